@@ -1,7 +1,6 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <float.h>
 
 #define TK_OBJFILE_IMPLEMENTATION
 #include "tk_objfile.h"
@@ -10,23 +9,12 @@
 // code to implement file loading, printing and allocation.
 
 // Compute the bounding box for an obj, to show how to use the simple "triangle soup" API.
+// The parser works out the bounds itself (computeBounds), so we only need the bounds
+// callback, the materials are just printed.
 struct BoundingBox {
-    float minPos[3];
-    float maxPos[3];
+    TK_ObjBounds fileBounds;
 };
 
-inline float minFloat( float a, float b)
-{
-    if (a < b) return a;
-    else return b;
-}
-
-inline float maxFloat( float a, float b)
-{
-    if (a >= b) return a;
-    else return b;
-}
-
 void bboxErrorMessage( size_t lineNum, const char *message, void *userData )
 {
     printf("ERROR on line %zu: %s\n", lineNum, message );
@@ -37,12 +25,16 @@ void bboxSwitchMaterial( const char *materialName, size_t numTriangles, void *us
     printf(">>> Current material: %s (%zu triangles)\n", materialName, numTriangles );
 }
 
-void bboxProcessTriangle( TK_TriangleVert a, TK_TriangleVert b, TK_TriangleVert c, void *userData )
+void bboxBounds( const TK_ObjBounds *fileBounds, const TK_ObjBounds *mtlBounds,
+                 size_t numMaterials, void *userData )
 {
     BoundingBox *bbox = (BoundingBox*)userData;
-    for (int i=0; i < 3; i++) {
-        bbox->minPos[i] = minFloat( a.pos[i], bbox->minPos[i] );
-        bbox->maxPos[i] = maxFloat( a.pos[i], bbox->maxPos[i] );
+    bbox->fileBounds = *fileBounds;
+    
+    for (size_t i=0; i < numMaterials; i++) {
+        printf("    material %zu: min [%3.2f %3.2f %3.2f] max [%3.2f %3.2f %3.2f]\n", i,
+               mtlBounds[i].bboxMin[0], mtlBounds[i].bboxMin[1], mtlBounds[i].bboxMin[2],
+               mtlBounds[i].bboxMax[0], mtlBounds[i].bboxMax[1], mtlBounds[i].bboxMax[2] );
     }
 }
 
@@ -82,13 +74,16 @@ void *readEntireFile( const char *filename, size_t *out_filesz )
 int main(int argc, const char * argv[])
 {
     // The bounding box that we will fill in
-    BoundingBox bbox = { { FLT_MAX, FLT_MAX, FLT_MAX },
-                         { FLT_MIN, FLT_MIN, FLT_MIN } };
+    BoundingBox bbox = {};
 
     // Callbacks for API
     TK_ObjDelegate objDelegate = {};
     objDelegate.userData = (void*)&bbox;
     objDelegate.error = bboxErrorMessage;
+    
+    // We only need positions, don't parse the STs or normals
+    objDelegate.skipAttribs = TK_ObjAttrib_St | TK_ObjAttrib_Nrm;
+    objDelegate.computeBounds = 1;
 
     // Read the obj file
     if (argc < 2) {
@@ -108,7 +103,7 @@ int main(int argc, const char * argv[])
     
     // Parse again with memory
     objDelegate.material = bboxSwitchMaterial;
-    objDelegate.triangle = bboxProcessTriangle;
+    objDelegate.bounds = bboxBounds;
     
     TK_ParseObj( objFileData, objFileSize, &objDelegate );
     
@@ -116,9 +111,13 @@ int main(int argc, const char * argv[])
     printf("Num Norms %zu\n", objDelegate.numNorms );
     printf("Num STs %zu\n", objDelegate.numSts );
     
+    const TK_ObjBounds &b = bbox.fileBounds;
     printf("Bounding Box: min [%3.2f %3.2f %3.2f] max [%3.2f %3.2f %3.2f]\n",
-           bbox.minPos[0], bbox.minPos[1], bbox.minPos[2],
-           bbox.maxPos[0], bbox.maxPos[1], bbox.maxPos[2] );
+           b.bboxMin[0], b.bboxMin[1], b.bboxMin[2],
+           b.bboxMax[0], b.bboxMax[1], b.bboxMax[2] );
+    printf("Bounding Sphere: center [%3.2f %3.2f %3.2f] radius %3.2f\n",
+           b.center[0], b.center[1], b.center[2], b.radius );
+    printf("Centroid: [%3.2f %3.2f %3.2f]\n", b.centroid[0], b.centroid[1], b.centroid[2] );
 
     
     return 0;
@@ -0,0 +1,1179 @@
+// tk_aobake -- Bakes ambient occlusion for an .OBJ, either per texel into a grayscale
+// PNG (using the model's texture coords) or per vertex into a text file. It's meant as
+// a stress test for the loader's throughput APIs: the parse, Morton sort, bounds and
+// triangle expansion all run on the thread pool, then a binned SAH BVH is built in
+// parallel and 4-wide packets of occlusion rays are traced on every core.
+//
+// Build it with something like:
+//
+//    c++ -O2 -pthread -I.. tk_aobake.cpp -o tk_aobake
+//
+// Usage:
+//
+//    tk_aobake model.obj [-o out.png] [-size 1024] [-rays 64] [-dist 0.5] [-threads 0]
+//    tk_aobake model.obj -vertex [-o out.txt] [-rays 64] [-dist 0.5] [-threads 0]
+//
+// -dist is the longest occluder distance as a fraction of the bounding sphere radius.
+// With -vertex, each line of the output is "x y z ao" for one triangle corner, in the
+// same order that TK_ParseObj's triangle() callback would give them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <chrono>
+
+#define TK_OBJFILE_IMPLEMENTATION
+#define TK_OBJFILE_THREADS
+#include "tk_objfile.h"
+
+// Note: like the other examples, this uses the stdlib for file loading, printing and
+// allocation. The thread pool comes from TK_OBJFILE_THREADS.
+
+// =========================================================
+//  4-wide floats (SSE2, or plain C if it's not there)
+// =========================================================
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+
+typedef __m128 V4;
+
+static inline V4 v4Splat( float f ) { return _mm_set1_ps( f ); }
+static inline V4 v4Load( const float *f ) { return _mm_loadu_ps( f ); }
+static inline V4 v4Add( V4 a, V4 b ) { return _mm_add_ps( a, b ); }
+static inline V4 v4Sub( V4 a, V4 b ) { return _mm_sub_ps( a, b ); }
+static inline V4 v4Mul( V4 a, V4 b ) { return _mm_mul_ps( a, b ); }
+static inline V4 v4Div( V4 a, V4 b ) { return _mm_div_ps( a, b ); }
+static inline V4 v4Min( V4 a, V4 b ) { return _mm_min_ps( a, b ); }
+static inline V4 v4Max( V4 a, V4 b ) { return _mm_max_ps( a, b ); }
+static inline V4 v4And( V4 a, V4 b ) { return _mm_and_ps( a, b ); }
+static inline V4 v4AndNot( V4 a, V4 b ) { return _mm_andnot_ps( a, b ); } // ~a & b
+static inline V4 v4Or( V4 a, V4 b ) { return _mm_or_ps( a, b ); }
+static inline V4 v4CmpLe( V4 a, V4 b ) { return _mm_cmple_ps( a, b ); }
+static inline V4 v4CmpLt( V4 a, V4 b ) { return _mm_cmplt_ps( a, b ); }
+static inline V4 v4CmpGt( V4 a, V4 b ) { return _mm_cmpgt_ps( a, b ); }
+static inline V4 v4CmpGe( V4 a, V4 b ) { return _mm_cmpge_ps( a, b ); }
+static inline V4 v4True() { return _mm_castsi128_ps( _mm_set1_epi32( -1 ) ); }
+static inline int v4Mask( V4 a ) { return _mm_movemask_ps( a ); }
+
+#else
+
+typedef struct { float f[4]; } V4;
+
+#define V4_OP(name, expr) \
+    static inline V4 name( V4 a, V4 b ) { V4 r; for (int i=0; i < 4; i++) { float x = a.f[i], y = b.f[i]; r.f[i] = (expr); } return r; }
+#define V4_BITOP(name, expr) \
+    static inline V4 name( V4 a, V4 b ) { V4 r; for (int i=0; i < 4; i++) { uint32_t x, y, z; \
+        memcpy( &x, a.f+i, 4 ); memcpy( &y, b.f+i, 4 ); z = (expr); memcpy( r.f+i, &z, 4 ); } return r; }
+#define V4_CMP(name, expr) \
+    static inline V4 name( V4 a, V4 b ) { V4 r; for (int i=0; i < 4; i++) { float x = a.f[i], y = b.f[i]; \
+        uint32_t z = (expr) ? 0xFFFFFFFFu : 0; memcpy( r.f+i, &z, 4 ); } return r; }
+
+static inline V4 v4Splat( float f ) { V4 r = { { f, f, f, f } }; return r; }
+static inline V4 v4Load( const float *f ) { V4 r; memcpy( r.f, f, sizeof(r.f) ); return r; }
+V4_OP( v4Add, x + y )
+V4_OP( v4Sub, x - y )
+V4_OP( v4Mul, x * y )
+V4_OP( v4Div, x / y )
+V4_OP( v4Min, (x < y) ? x : y )
+V4_OP( v4Max, (x > y) ? x : y )
+V4_BITOP( v4And, x & y )
+V4_BITOP( v4AndNot, ~x & y )
+V4_BITOP( v4Or, x | y )
+V4_CMP( v4CmpLe, x <= y )
+V4_CMP( v4CmpLt, x < y )
+V4_CMP( v4CmpGt, x > y )
+V4_CMP( v4CmpGe, x >= y )
+static inline V4 v4True() { return v4CmpLe( v4Splat( 0.0f ), v4Splat( 0.0f ) ); }
+static inline int v4Mask( V4 a )
+{
+    int mask = 0;
+    for (int i=0; i < 4; i++) {
+        uint32_t bits;
+        memcpy( &bits, a.f+i, 4 );
+        if (bits >> 31) mask |= (1 << i);
+    }
+    return mask;
+}
+
+#endif
+
+// =========================================================
+//  Little vector helpers
+// =========================================================
+static inline void vec3Sub( float *out, const float *a, const float *b )
+{
+    for (int i=0; i < 3; i++) out[i] = a[i] - b[i];
+}
+
+static inline void vec3Cross( float *out, const float *a, const float *b )
+{
+    out[0] = a[1]*b[2] - a[2]*b[1];
+    out[1] = a[2]*b[0] - a[0]*b[2];
+    out[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+static inline float vec3Dot( const float *a, const float *b )
+{
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+static inline int vec3Normalize( float *v )
+{
+    float len = sqrtf( vec3Dot( v, v ) );
+    if (len < 1e-20f) return 0;
+    for (int i=0; i < 3; i++) v[i] /= len;
+    return 1;
+}
+
+static inline float boxArea( const float *bmin, const float *bmax )
+{
+    float ex = bmax[0] - bmin[0], ey = bmax[1] - bmin[1], ez = bmax[2] - bmin[2];
+    return ex*ey + ey*ez + ez*ex;
+}
+
+static inline void boxEmpty( float *bmin, float *bmax )
+{
+    for (int i=0; i < 3; i++) {
+        bmin[i] = 1e30f;
+        bmax[i] = -1e30f;
+    }
+}
+
+static inline void boxGrow( float *bmin, float *bmax, const float *pmin, const float *pmax )
+{
+    for (int i=0; i < 3; i++) {
+        if (pmin[i] < bmin[i]) bmin[i] = pmin[i];
+        if (pmax[i] > bmax[i]) bmax[i] = pmax[i];
+    }
+}
+
+// =========================================================
+//  Binned SAH BVH
+// =========================================================
+#define BVH_NUM_BINS (16)
+#define BVH_MAX_LEAF (8)
+#define BVH_MAX_DEPTH (120)
+#define BVH_TRAVERSAL_COST (1.0f)
+
+// Triangles per job in the parallel passes over the whole mesh
+#define BVH_SLICE (16384)
+
+// Ranges bigger than this are binned on the job system at the top of the tree
+#define BVH_PARALLEL_BIN_MIN (65536)
+
+typedef struct {
+    float bmin[3];
+    uint32_t leftOrFirst;   // first child (the second is right after it), or first triangle
+    float bmax[3];
+    uint32_t count;         // triangles in a leaf, 0 for inner nodes
+} BVHNode;
+
+// Triangle ready for intersecting, in BVH order
+typedef struct {
+    float v0[3];
+    float e1[3];
+    float e2[3];
+} BVHTri;
+
+typedef struct {
+    float bmin[3], bmax[3];   // triangle bounds
+    float cmin[3], cmax[3];   // centroid bounds
+    uint32_t count;
+} BVHBin;
+
+typedef struct {
+    uint32_t node;
+    uint32_t first;
+    uint32_t count;
+    uint32_t depth;
+    float cmin[3], cmax[3];
+
+    // Where the subtree's nodes go, once the top of the tree is done
+    uint32_t nodeBase;
+} BVHTask;
+
+typedef struct {
+    const TK_Triangle *tris;
+    uint32_t numTris;
+
+    float *triMin, *triMax, *centroids;  // 3 floats per triangle
+    uint32_t *triIndex;
+
+    BVHNode *nodes;
+    uint32_t numNodes;
+    BVHTri *bvhTris;
+
+    const TK_ObjJobSystem *jobs;
+
+    // Scratch for the parallel passes, one entry per slice
+    BVHBin *sliceBins;
+
+    // The current parallel pass
+    BVHTask passTask;
+    float passScale[3];
+    BVHTask *tasks;
+    uint32_t numTasks;
+} BVH;
+
+static inline int bvhBinIndex( const float *centroid, const float *cmin, const float *scale, int axis )
+{
+    int bin = (int)((centroid[axis] - cmin[axis]) * scale[axis]);
+    if (bin < 0) bin = 0;
+    if (bin >= BVH_NUM_BINS) bin = BVH_NUM_BINS-1;
+    return bin;
+}
+
+static void bvhClearBins( BVHBin *bins, int numBins )
+{
+    for (int bi=0; bi < numBins; bi++) {
+        boxEmpty( bins[bi].bmin, bins[bi].bmax );
+        boxEmpty( bins[bi].cmin, bins[bi].cmax );
+        bins[bi].count = 0;
+    }
+}
+
+static void bvhMergeBin( BVHBin *dest, const BVHBin *src )
+{
+    boxGrow( dest->bmin, dest->bmax, src->bmin, src->bmax );
+    boxGrow( dest->cmin, dest->cmax, src->cmin, src->cmax );
+    dest->count += src->count;
+}
+
+// Bins [3][BVH_NUM_BINS] for a range of the task's triangles
+static void bvhBinRange( const BVH *bvh, const BVHTask *task, const float *scale,
+                         uint32_t first, uint32_t count, BVHBin *bins )
+{
+    bvhClearBins( bins, 3*BVH_NUM_BINS );
+    for (uint32_t i=first; i < first + count; i++) {
+        uint32_t ti = bvh->triIndex[i];
+        const float *c = bvh->centroids + ti*3;
+        for (int axis=0; axis < 3; axis++) {
+            if (scale[axis] == 0.0f) continue;
+            BVHBin *bin = bins + axis*BVH_NUM_BINS + bvhBinIndex( c, task->cmin, scale, axis );
+            boxGrow( bin->bmin, bin->bmax, bvh->triMin + ti*3, bvh->triMax + ti*3 );
+            boxGrow( bin->cmin, bin->cmax, c, c );
+            bin->count++;
+        }
+    }
+}
+
+static void bvhBinSliceJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    BVH *bvh = (BVH*)jobData;
+    const BVHTask *task = &bvh->passTask;
+    uint32_t first = task->first + (uint32_t)jobIndex * BVH_SLICE;
+    uint32_t count = task->first + task->count - first;
+    if (count > BVH_SLICE) count = BVH_SLICE;
+    bvhBinRange( bvh, task, bvh->passScale, first, count, bvh->sliceBins + jobIndex*3*BVH_NUM_BINS );
+}
+
+// Splits the task's node, filling in the two child tasks. Returns 0 if it should be a leaf.
+static int bvhSplit( BVH *bvh, const BVHTask *task, uint32_t childNode, BVHTask *out_left, BVHTask *out_right )
+{
+    BVHNode *node = bvh->nodes + task->node;
+    if ((task->count <= 2) || (task->depth >= BVH_MAX_DEPTH)) return 0;
+
+    float scale[3];
+    int canBin = 0;
+    for (int axis=0; axis < 3; axis++) {
+        float extent = task->cmax[axis] - task->cmin[axis];
+        scale[axis] = (extent > 1e-12f) ? (BVH_NUM_BINS / extent) * 0.9999f : 0.0f;
+        if (scale[axis] > 0.0f) canBin = 1;
+    }
+    if ((!canBin) && (task->count <= BVH_MAX_LEAF)) return 0;
+
+    uint32_t leftCount = 0;
+    int bestAxis = -1, bestBin = 0;
+    BVHBin bins[3*BVH_NUM_BINS];
+    if (canBin) {
+        // Big ranges at the top of the tree get binned across the workers
+        if ((task->count >= BVH_PARALLEL_BIN_MIN) && (bvh->jobs)) {
+            size_t numSlices = (task->count + BVH_SLICE-1) / BVH_SLICE;
+            bvh->passTask = *task;
+            for (int axis=0; axis < 3; axis++) bvh->passScale[axis] = scale[axis];
+            bvh->jobs->parallelFor( bvhBinSliceJob, bvh, numSlices, bvh->jobs->jobContext );
+
+            bvhClearBins( bins, 3*BVH_NUM_BINS );
+            for (size_t si=0; si < numSlices; si++) {
+                for (int bi=0; bi < 3*BVH_NUM_BINS; bi++) {
+                    bvhMergeBin( bins + bi, bvh->sliceBins + si*3*BVH_NUM_BINS + bi );
+                }
+            }
+        } else {
+            bvhBinRange( bvh, task, scale, task->first, task->count, bins );
+        }
+
+        // Sweep the bins for the cheapest split, cost is area * count on each side
+        float bestCost = 1e30f;
+        for (int axis=0; axis < 3; axis++) {
+            if (scale[axis] == 0.0f) continue;
+            const BVHBin *axisBins = bins + axis*BVH_NUM_BINS;
+
+            float rightArea[BVH_NUM_BINS];
+            uint32_t rightCount[BVH_NUM_BINS];
+            float bmin[3], bmax[3];
+            boxEmpty( bmin, bmax );
+            uint32_t count = 0;
+            for (int bi=BVH_NUM_BINS-1; bi > 0; bi--) {
+                if (axisBins[bi].count) boxGrow( bmin, bmax, axisBins[bi].bmin, axisBins[bi].bmax );
+                count += axisBins[bi].count;
+                rightArea[bi] = count ? boxArea( bmin, bmax ) : 0.0f;
+                rightCount[bi] = count;
+            }
+
+            boxEmpty( bmin, bmax );
+            count = 0;
+            for (int bi=0; bi < BVH_NUM_BINS-1; bi++) {
+                if (axisBins[bi].count) boxGrow( bmin, bmax, axisBins[bi].bmin, axisBins[bi].bmax );
+                count += axisBins[bi].count;
+                if ((!count) || (!rightCount[bi+1])) continue;
+
+                float cost = boxArea( bmin, bmax ) * count + rightArea[bi+1] * rightCount[bi+1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = bi;
+                    leftCount = count;
+                }
+            }
+        }
+
+        // Stay a leaf if that's cheaper than any split
+        float area = boxArea( node->bmin, node->bmax );
+        float leafCost = area * task->count;
+        float splitCost = BVH_TRAVERSAL_COST * area + bestCost;
+        if ((task->count <= BVH_MAX_LEAF) && (leafCost <= splitCost)) return 0;
+    }
+
+    BVHNode *left = bvh->nodes + childNode;
+    BVHNode *right = left + 1;
+    *out_left = *task;
+    *out_right = *task;
+    out_left->node = childNode;
+    out_right->node = childNode + 1;
+    out_left->depth = out_right->depth = task->depth + 1;
+
+    if (bestAxis >= 0) {
+        // Partition the range by bin, then the child bounds are just the bins' bounds
+        uint32_t i = task->first, j = task->first + task->count;
+        while (i < j) {
+            if (bvhBinIndex( bvh->centroids + bvh->triIndex[i]*3, task->cmin, scale, bestAxis ) <= bestBin) {
+                i++;
+            } else {
+                uint32_t tmp = bvh->triIndex[i];
+                bvh->triIndex[i] = bvh->triIndex[--j];
+                bvh->triIndex[j] = tmp;
+            }
+        }
+
+        boxEmpty( left->bmin, left->bmax );
+        boxEmpty( right->bmin, right->bmax );
+        boxEmpty( out_left->cmin, out_left->cmax );
+        boxEmpty( out_right->cmin, out_right->cmax );
+        for (int bi=0; bi < BVH_NUM_BINS; bi++) {
+            const BVHBin *bin = bins + bestAxis*BVH_NUM_BINS + bi;
+            if (!bin->count) continue;
+            BVHNode *child = (bi <= bestBin) ? left : right;
+            BVHTask *childTask = (bi <= bestBin) ? out_left : out_right;
+            boxGrow( child->bmin, child->bmax, bin->bmin, bin->bmax );
+            boxGrow( childTask->cmin, childTask->cmax, bin->cmin, bin->cmax );
+        }
+    } else {
+        // All the centroids are in the same spot, and there's too many for a leaf, so
+        // just cut the range in half
+        leftCount = task->count / 2;
+        for (int side=0; side < 2; side++) {
+            BVHNode *child = side ? right : left;
+            uint32_t first = side ? task->first + leftCount : task->first;
+            uint32_t count = side ? task->count - leftCount : leftCount;
+            boxEmpty( child->bmin, child->bmax );
+            for (uint32_t i=first; i < first + count; i++) {
+                uint32_t ti = bvh->triIndex[i];
+                boxGrow( child->bmin, child->bmax, bvh->triMin + ti*3, bvh->triMax + ti*3 );
+            }
+        }
+    }
+
+    out_left->count = leftCount;
+    out_right->first = task->first + leftCount;
+    out_right->count = task->count - leftCount;
+
+    node->leftOrFirst = childNode;
+    node->count = 0;
+    return 1;
+}
+
+static void bvhMakeLeaf( BVH *bvh, const BVHTask *task )
+{
+    bvh->nodes[task->node].leftOrFirst = task->first;
+    bvh->nodes[task->node].count = task->count;
+}
+
+// Builds a whole subtree on one worker. A subtree with n triangles never needs more
+// than 2n-2 nodes under its root, so each one gets its own block and they don't have
+// to coordinate.
+static void bvhSubtreeJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    BVH *bvh = (BVH*)jobData;
+    const BVHTask *root = bvh->tasks + jobIndex;
+    uint32_t nextNode = root->nodeBase;
+
+    BVHTask stack[2*BVH_MAX_DEPTH + 2];
+    int stackSize = 0;
+    stack[stackSize++] = *root;
+    while (stackSize) {
+        BVHTask task = stack[--stackSize];
+        BVHTask left, right;
+        if (bvhSplit( bvh, &task, nextNode, &left, &right )) {
+            nextNode += 2;
+            stack[stackSize++] = right;
+            stack[stackSize++] = left;
+        } else {
+            bvhMakeLeaf( bvh, &task );
+        }
+    }
+}
+
+static void bvhPrepSliceJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    BVH *bvh = (BVH*)jobData;
+    uint32_t first = (uint32_t)jobIndex * BVH_SLICE;
+    uint32_t end = first + BVH_SLICE;
+    if (end > bvh->numTris) end = bvh->numTris;
+
+    BVHBin *sliceBin = bvh->sliceBins + jobIndex*3*BVH_NUM_BINS;
+    bvhClearBins( sliceBin, 1 );
+    for (uint32_t ti=first; ti < end; ti++) {
+        const TK_Triangle *tri = bvh->tris + ti;
+        float *triMin = bvh->triMin + ti*3;
+        float *triMax = bvh->triMax + ti*3;
+        float *centroid = bvh->centroids + ti*3;
+        for (int i=0; i < 3; i++) {
+            triMin[i] = fminf( tri->vertA.pos[i], fminf( tri->vertB.pos[i], tri->vertC.pos[i] ) );
+            triMax[i] = fmaxf( tri->vertA.pos[i], fmaxf( tri->vertB.pos[i], tri->vertC.pos[i] ) );
+            centroid[i] = (triMin[i] + triMax[i]) * 0.5f;
+        }
+        bvh->triIndex[ti] = ti;
+        boxGrow( sliceBin->bmin, sliceBin->bmax, triMin, triMax );
+        boxGrow( sliceBin->cmin, sliceBin->cmax, centroid, centroid );
+    }
+}
+
+static void bvhReorderSliceJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    BVH *bvh = (BVH*)jobData;
+    uint32_t first = (uint32_t)jobIndex * BVH_SLICE;
+    uint32_t end = first + BVH_SLICE;
+    if (end > bvh->numTris) end = bvh->numTris;
+
+    for (uint32_t i=first; i < end; i++) {
+        const TK_Triangle *tri = bvh->tris + bvh->triIndex[i];
+        BVHTri *dest = bvh->bvhTris + i;
+        for (int k=0; k < 3; k++) dest->v0[k] = tri->vertA.pos[k];
+        vec3Sub( dest->e1, tri->vertB.pos, tri->vertA.pos );
+        vec3Sub( dest->e2, tri->vertC.pos, tri->vertA.pos );
+    }
+}
+
+static int compareTaskSize( const void *a, const void *b )
+{
+    uint32_t countA = ((const BVHTask*)a)->count, countB = ((const BVHTask*)b)->count;
+    return (countA < countB) ? 1 : ((countA > countB) ? -1 : 0);
+}
+
+static int bvhBuild( BVH *bvh, const TK_Triangle *tris, uint32_t numTris, const TK_ObjJobSystem *jobs )
+{
+    memset( bvh, 0, sizeof(BVH) );
+    bvh->tris = tris;
+    bvh->numTris = numTris;
+    bvh->jobs = jobs;
+    if (!numTris) return 0;
+
+    size_t numSlices = (numTris + BVH_SLICE-1) / BVH_SLICE;
+    size_t maxNodes = 2*(size_t)numTris;
+    bvh->triMin = (float*)malloc( sizeof(float)*3*numTris );
+    bvh->triMax = (float*)malloc( sizeof(float)*3*numTris );
+    bvh->centroids = (float*)malloc( sizeof(float)*3*numTris );
+    bvh->triIndex = (uint32_t*)malloc( sizeof(uint32_t)*numTris );
+    bvh->nodes = (BVHNode*)malloc( sizeof(BVHNode)*maxNodes );
+    bvh->bvhTris = (BVHTri*)malloc( sizeof(BVHTri)*numTris );
+    bvh->sliceBins = (BVHBin*)malloc( sizeof(BVHBin)*3*BVH_NUM_BINS*numSlices );
+    if ((!bvh->triMin) || (!bvh->triMax) || (!bvh->centroids) || (!bvh->triIndex) ||
+        (!bvh->nodes) || (!bvh->bvhTris) || (!bvh->sliceBins)) {
+        return 0;
+    }
+
+    // Triangle bounds and centroids, and the root's bounds
+    jobs->parallelFor( bvhPrepSliceJob, bvh, numSlices, jobs->jobContext );
+    BVHBin rootBin;
+    bvhClearBins( &rootBin, 1 );
+    for (size_t si=0; si < numSlices; si++) {
+        bvhMergeBin( &rootBin, bvh->sliceBins + si*3*BVH_NUM_BINS );
+    }
+
+    BVHTask root = {};
+    root.node = 0;
+    root.first = 0;
+    root.count = numTris;
+    for (int i=0; i < 3; i++) {
+        bvh->nodes[0].bmin[i] = rootBin.bmin[i];
+        bvh->nodes[0].bmax[i] = rootBin.bmax[i];
+        root.cmin[i] = rootBin.cmin[i];
+        root.cmax[i] = rootBin.cmax[i];
+    }
+    bvh->numNodes = 1;
+
+    // Split the top of the tree here (the binning itself is parallel), biggest first,
+    // until there are plenty of subtrees to keep the workers busy
+    size_t maxTasks = 8 * (jobs->numWorkers ? jobs->numWorkers : 1);
+    bvh->tasks = (BVHTask*)malloc( sizeof(BVHTask) * (maxTasks + 1) );
+    if (!bvh->tasks) return 0;
+    bvh->tasks[0] = root;
+    bvh->numTasks = 1;
+    while (bvh->numTasks < maxTasks) {
+        qsort( bvh->tasks, bvh->numTasks, sizeof(BVHTask), compareTaskSize );
+        BVHTask task = bvh->tasks[0];
+        if (task.count < 4096) break;
+
+        BVHTask left, right;
+        if (!bvhSplit( bvh, &task, bvh->numNodes, &left, &right )) break;
+        bvh->numNodes += 2;
+        bvh->tasks[0] = left;
+        bvh->tasks[bvh->numTasks++] = right;
+    }
+
+    // Hand out the node blocks, then build the subtrees
+    for (uint32_t i=0; i < bvh->numTasks; i++) {
+        bvh->tasks[i].nodeBase = bvh->numNodes;
+        bvh->numNodes += 2*bvh->tasks[i].count - 2;
+    }
+    qsort( bvh->tasks, bvh->numTasks, sizeof(BVHTask), compareTaskSize );
+    jobs->parallelFor( bvhSubtreeJob, bvh, bvh->numTasks, jobs->jobContext );
+
+    // Put the triangles in leaf order, ready for intersecting
+    jobs->parallelFor( bvhReorderSliceJob, bvh, numSlices, jobs->jobContext );
+    return 1;
+}
+
+static void bvhFree( BVH *bvh )
+{
+    free( bvh->triMin );
+    free( bvh->triMax );
+    free( bvh->centroids );
+    free( bvh->triIndex );
+    free( bvh->nodes );
+    free( bvh->bvhTris );
+    free( bvh->sliceBins );
+    free( bvh->tasks );
+}
+
+// =========================================================
+//  Ray packets
+// =========================================================
+
+// Four occlusion rays from the same origin. Returns a bitmask of the rays that hit
+// something closer than tmax.
+static int bvhOccluded4( const BVH *bvh, const float *origin, const V4 *dir, float tmax )
+{
+    V4 org[3], invDir[3];
+    for (int i=0; i < 3; i++) {
+        org[i] = v4Splat( origin[i] );
+        invDir[i] = v4Div( v4Splat( 1.0f ), dir[i] );
+    }
+    V4 zero = v4Splat( 0.0f );
+    V4 one = v4Splat( 1.0f );
+    V4 tfarMax = v4Splat( tmax );
+    V4 epsilon = v4Splat( 1e-9f );
+    V4 active = v4True();
+    int occluded = 0;
+
+    uint32_t stack[BVH_MAX_DEPTH + 8];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize) {
+        const BVHNode *node = bvh->nodes + stack[--stackSize];
+
+        // Slab test, against all four rays at once
+        V4 tnear = zero, tfar = tfarMax;
+        for (int i=0; i < 3; i++) {
+            V4 t0 = v4Mul( v4Sub( v4Splat( node->bmin[i] ), org[i] ), invDir[i] );
+            V4 t1 = v4Mul( v4Sub( v4Splat( node->bmax[i] ), org[i] ), invDir[i] );
+            tnear = v4Max( tnear, v4Min( t0, t1 ) );
+            tfar = v4Min( tfar, v4Max( t0, t1 ) );
+        }
+        if (!v4Mask( v4And( active, v4CmpLe( tnear, tfar ) ) )) continue;
+
+        if (!node->count) {
+            stack[stackSize++] = node->leftOrFirst + 1;
+            stack[stackSize++] = node->leftOrFirst;
+            continue;
+        }
+
+        // Moller-Trumbore, one triangle against the four rays
+        for (uint32_t ti=node->leftOrFirst; ti < node->leftOrFirst + node->count; ti++) {
+            const BVHTri *tri = bvh->bvhTris + ti;
+            V4 e1[3], e2[3], tvec[3];
+            for (int i=0; i < 3; i++) {
+                e1[i] = v4Splat( tri->e1[i] );
+                e2[i] = v4Splat( tri->e2[i] );
+                tvec[i] = v4Sub( org[i], v4Splat( tri->v0[i] ) );
+            }
+            V4 pvec[3] = {
+                v4Sub( v4Mul( dir[1], e2[2] ), v4Mul( dir[2], e2[1] ) ),
+                v4Sub( v4Mul( dir[2], e2[0] ), v4Mul( dir[0], e2[2] ) ),
+                v4Sub( v4Mul( dir[0], e2[1] ), v4Mul( dir[1], e2[0] ) )
+            };
+            V4 det = v4Add( v4Add( v4Mul( e1[0], pvec[0] ), v4Mul( e1[1], pvec[1] ) ), v4Mul( e1[2], pvec[2] ) );
+            V4 invDet = v4Div( one, det );
+            V4 u = v4Mul( v4Add( v4Add( v4Mul( tvec[0], pvec[0] ), v4Mul( tvec[1], pvec[1] ) ), v4Mul( tvec[2], pvec[2] ) ), invDet );
+
+            V4 qvec[3] = {
+                v4Sub( v4Mul( tvec[1], e1[2] ), v4Mul( tvec[2], e1[1] ) ),
+                v4Sub( v4Mul( tvec[2], e1[0] ), v4Mul( tvec[0], e1[2] ) ),
+                v4Sub( v4Mul( tvec[0], e1[1] ), v4Mul( tvec[1], e1[0] ) )
+            };
+            V4 v = v4Mul( v4Add( v4Add( v4Mul( dir[0], qvec[0] ), v4Mul( dir[1], qvec[1] ) ), v4Mul( dir[2], qvec[2] ) ), invDet );
+            V4 t = v4Mul( v4Add( v4Add( v4Mul( e2[0], qvec[0] ), v4Mul( e2[1], qvec[1] ) ), v4Mul( e2[2], qvec[2] ) ), invDet );
+
+            V4 hit = v4Or( v4CmpGt( det, epsilon ), v4CmpLt( det, v4Sub( zero, epsilon ) ) );
+            hit = v4And( hit, v4CmpGe( u, zero ) );
+            hit = v4And( hit, v4CmpGe( v, zero ) );
+            hit = v4And( hit, v4CmpLe( v4Add( u, v ), one ) );
+            hit = v4And( hit, v4CmpGt( t, zero ) );
+            hit = v4And( hit, v4CmpLt( t, tfarMax ) );
+            hit = v4And( hit, active );
+
+            int hitMask = v4Mask( hit );
+            if (hitMask) {
+                occluded |= hitMask;
+                active = v4AndNot( hit, active );
+                if (occluded == 0xF) return occluded;
+            }
+        }
+    }
+    return occluded;
+}
+
+// =========================================================
+//  Ambient occlusion
+// =========================================================
+typedef struct {
+    const BVH *bvh;
+
+    // Sample points, 3 floats each for the position and normal
+    const float *samplePos;
+    const float *sampleNrm;
+    const unsigned char *sampleValid; // NULL if they're all valid
+    size_t numSamples;
+
+    int numRays;        // a multiple of 4
+    float maxDist;
+    float offset;       // pushes the ray origins off the surface
+
+    float *ao;          // 1 is fully open
+} AOJob;
+
+#define AO_SAMPLES_PER_JOB (256)
+
+static inline uint32_t hashU32( uint32_t x )
+{
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline float randomFloat( uint32_t *state )
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+static float aoSample( const AOJob *aoJob, const float *pos, const float *nrm, uint32_t seed )
+{
+    // Tangent frame around the normal
+    float tangent[3], bitangent[3];
+    float up[3] = { 0.0f, 0.0f, 0.0f };
+    up[(fabsf( nrm[0] ) < 0.6f) ? 0 : 1] = 1.0f;
+    vec3Cross( tangent, up, nrm );
+    vec3Normalize( tangent );
+    vec3Cross( bitangent, nrm, tangent );
+
+    float origin[3];
+    for (int i=0; i < 3; i++) origin[i] = pos[i] + nrm[i] * aoJob->offset;
+
+    uint32_t rng = hashU32( seed ) | 1;
+    int numOccluded = 0;
+    for (int ri=0; ri < aoJob->numRays; ri += 4) {
+        // Cosine weighted directions, so the plain hit ratio is the AO
+        float dirs[3][4];
+        for (int k=0; k < 4; k++) {
+            float r1 = randomFloat( &rng ), r2 = randomFloat( &rng );
+            float phi = 6.2831853f * r1;
+            float r = sqrtf( r2 );
+            float x = r * cosf( phi ), y = r * sinf( phi ), z = sqrtf( 1.0f - r2 );
+            for (int i=0; i < 3; i++) {
+                float d = tangent[i]*x + bitangent[i]*y + nrm[i]*z;
+                dirs[i][k] = (fabsf( d ) < 1e-8f) ? 1e-8f : d;
+            }
+        }
+        V4 dir[3] = { v4Load( dirs[0] ), v4Load( dirs[1] ), v4Load( dirs[2] ) };
+        int mask = bvhOccluded4( aoJob->bvh, origin, dir, aoJob->maxDist );
+        numOccluded += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+    }
+    return 1.0f - (float)numOccluded / aoJob->numRays;
+}
+
+static void aoSampleJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    AOJob *aoJob = (AOJob*)jobData;
+    size_t first = jobIndex * AO_SAMPLES_PER_JOB;
+    size_t end = first + AO_SAMPLES_PER_JOB;
+    if (end > aoJob->numSamples) end = aoJob->numSamples;
+
+    for (size_t si=first; si < end; si++) {
+        if ((aoJob->sampleValid) && (!aoJob->sampleValid[si])) continue;
+        aoJob->ao[si] = aoSample( aoJob, aoJob->samplePos + si*3, aoJob->sampleNrm + si*3, (uint32_t)si );
+    }
+}
+
+// Shading normal of a corner, or the face normal if the obj doesn't have them
+static void cornerNormal( float *out, const TK_TriangleVert *vert, const TK_Triangle *tri )
+{
+    for (int i=0; i < 3; i++) out[i] = vert->nrm[i];
+    if (vec3Normalize( out )) return;
+
+    float e1[3], e2[3];
+    vec3Sub( e1, tri->vertB.pos, tri->vertA.pos );
+    vec3Sub( e2, tri->vertC.pos, tri->vertA.pos );
+    vec3Cross( out, e1, e2 );
+    if (!vec3Normalize( out )) {
+        out[0] = 0.0f; out[1] = 1.0f; out[2] = 0.0f;
+    }
+}
+
+// Fills in a position and normal for every texel covered by a triangle in uv space
+static size_t rasterizeTexels( const TK_Triangle *tris, size_t numTris, int size,
+                               float *texelPos, float *texelNrm, unsigned char *texelValid )
+{
+    size_t numCovered = 0;
+    for (size_t ti=0; ti < numTris; ti++) {
+        const TK_Triangle *tri = tris + ti;
+        const TK_TriangleVert *verts[3] = { &tri->vertA, &tri->vertB, &tri->vertC };
+
+        // Pixel space, with v=1 at the top row
+        float px[3], py[3], nrm[3][3];
+        for (int k=0; k < 3; k++) {
+            px[k] = verts[k]->st[0] * size;
+            py[k] = (1.0f - verts[k]->st[1]) * size;
+            cornerNormal( nrm[k], verts[k], tri );
+        }
+        float area = (px[1] - px[0])*(py[2] - py[0]) - (px[2] - px[0])*(py[1] - py[0]);
+        if (fabsf( area ) < 1e-12f) continue;
+
+        int x0 = (int)floorf( fminf( px[0], fminf( px[1], px[2] ) ) );
+        int x1 = (int)ceilf( fmaxf( px[0], fmaxf( px[1], px[2] ) ) );
+        int y0 = (int)floorf( fminf( py[0], fminf( py[1], py[2] ) ) );
+        int y1 = (int)ceilf( fmaxf( py[0], fmaxf( py[1], py[2] ) ) );
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 > size) x1 = size;
+        if (y1 > size) y1 = size;
+
+        for (int y=y0; y < y1; y++) {
+            for (int x=x0; x < x1; x++) {
+                float cx = x + 0.5f, cy = y + 0.5f;
+                float w0 = ((px[1] - cx)*(py[2] - cy) - (px[2] - cx)*(py[1] - cy)) / area;
+                float w1 = ((px[2] - cx)*(py[0] - cy) - (px[0] - cx)*(py[2] - cy)) / area;
+                float w2 = 1.0f - w0 - w1;
+                if ((w0 < 0.0f) || (w1 < 0.0f) || (w2 < 0.0f)) continue;
+
+                size_t texel = (size_t)y*size + x;
+                float *pos = texelPos + texel*3;
+                float *n = texelNrm + texel*3;
+                for (int i=0; i < 3; i++) {
+                    pos[i] = verts[0]->pos[i]*w0 + verts[1]->pos[i]*w1 + verts[2]->pos[i]*w2;
+                    n[i] = nrm[0][i]*w0 + nrm[1][i]*w1 + nrm[2][i]*w2;
+                }
+                if (!vec3Normalize( n )) {
+                    for (int i=0; i < 3; i++) n[i] = nrm[0][i];
+                }
+                if (!texelValid[texel]) numCovered++;
+                texelValid[texel] = 1;
+            }
+        }
+    }
+    return numCovered;
+}
+
+// Bleeds the baked texels out into the empty ones a few times, so filtering doesn't
+// pull in the background at the uv seams
+static void dilateTexels( float *ao, unsigned char *valid, int size, int numPasses )
+{
+    unsigned char *nextValid = (unsigned char*)malloc( (size_t)size*size );
+    if (!nextValid) return;
+    for (int pass=0; pass < numPasses; pass++) {
+        memcpy( nextValid, valid, (size_t)size*size );
+        for (int y=0; y < size; y++) {
+            for (int x=0; x < size; x++) {
+                size_t texel = (size_t)y*size + x;
+                if (valid[texel]) continue;
+
+                float sum = 0.0f;
+                int count = 0;
+                for (int dy=-1; dy <= 1; dy++) {
+                    for (int dx=-1; dx <= 1; dx++) {
+                        int nx = x + dx, ny = y + dy;
+                        if ((nx < 0) || (ny < 0) || (nx >= size) || (ny >= size)) continue;
+                        size_t neighbor = (size_t)ny*size + nx;
+                        if (!valid[neighbor]) continue;
+                        sum += ao[neighbor];
+                        count++;
+                    }
+                }
+                if (count) {
+                    ao[texel] = sum / count;
+                    nextValid[texel] = 1;
+                }
+            }
+        }
+        memcpy( valid, nextValid, (size_t)size*size );
+    }
+    free( nextValid );
+}
+
+// =========================================================
+//  PNG writer (uncompressed "stored" deflate blocks)
+// =========================================================
+static uint32_t g_crcTable[256];
+
+static void crcInit()
+{
+    for (uint32_t n=0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k=0; k < 8; k++) {
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+        g_crcTable[n] = c;
+    }
+}
+
+static uint32_t crcUpdate( uint32_t crc, const unsigned char *data, size_t size )
+{
+    for (size_t i=0; i < size; i++) {
+        crc = g_crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void putU32BE( unsigned char *dest, uint32_t value )
+{
+    dest[0] = (unsigned char)(value >> 24);
+    dest[1] = (unsigned char)(value >> 16);
+    dest[2] = (unsigned char)(value >> 8);
+    dest[3] = (unsigned char)value;
+}
+
+static void writeChunk( FILE *fp, const char *type, const unsigned char *data, size_t size )
+{
+    unsigned char header[8];
+    putU32BE( header, (uint32_t)size );
+    memcpy( header+4, type, 4 );
+    fwrite( header, 1, 8, fp );
+    if (size) fwrite( data, 1, size, fp );
+
+    uint32_t crc = crcUpdate( 0xFFFFFFFFu, (const unsigned char*)type, 4 );
+    crc = crcUpdate( crc, data, size ) ^ 0xFFFFFFFFu;
+    unsigned char crcBytes[4];
+    putU32BE( crcBytes, crc );
+    fwrite( crcBytes, 1, 4, fp );
+}
+
+static int writeGrayPNG( const char *filename, const unsigned char *pixels, int width, int height )
+{
+    FILE *fp = fopen( filename, "wb" );
+    if (!fp) return 0;
+    crcInit();
+
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    fwrite( signature, 1, 8, fp );
+
+    unsigned char ihdr[13];
+    putU32BE( ihdr, (uint32_t)width );
+    putU32BE( ihdr+4, (uint32_t)height );
+    ihdr[8] = 8;    // bits per channel
+    ihdr[9] = 0;    // grayscale
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    writeChunk( fp, "IHDR", ihdr, sizeof(ihdr) );
+
+    // Raw scanlines, each with a 0 (no filter) byte in front
+    size_t rowSize = (size_t)width + 1;
+    size_t rawSize = rowSize * height;
+    size_t numBlocks = (rawSize + 65534) / 65535;
+    size_t idatSize = 2 + rawSize + numBlocks*5 + 4;
+    unsigned char *idat = (unsigned char*)malloc( idatSize );
+    if (!idat) {
+        fclose( fp );
+        return 0;
+    }
+
+    unsigned char *out = idat;
+    *out++ = 0x78;  // zlib header, deflate with a 32k window
+    *out++ = 0x01;
+    uint32_t adlerA = 1, adlerB = 0;
+    size_t rawPos = 0;
+    for (size_t bi=0; bi < numBlocks; bi++) {
+        size_t blockSize = rawSize - rawPos;
+        if (blockSize > 65535) blockSize = 65535;
+        *out++ = (bi == numBlocks-1) ? 1 : 0;
+        *out++ = (unsigned char)(blockSize & 0xFF);
+        *out++ = (unsigned char)(blockSize >> 8);
+        *out++ = (unsigned char)(~blockSize & 0xFF);
+        *out++ = (unsigned char)((~blockSize >> 8) & 0xFF);
+        for (size_t i=0; i < blockSize; i++, rawPos++) {
+            size_t x = rawPos % rowSize;
+            unsigned char value = x ? pixels[(rawPos / rowSize)*width + (x-1)] : 0;
+            *out++ = value;
+            adlerA = (adlerA + value) % 65521;
+            adlerB = (adlerB + adlerA) % 65521;
+        }
+    }
+    putU32BE( out, (adlerB << 16) | adlerA );
+
+    writeChunk( fp, "IDAT", idat, idatSize );
+    writeChunk( fp, "IEND", NULL, 0 );
+    free( idat );
+
+    int ok = !ferror( fp );
+    fclose( fp );
+    return ok;
+}
+
+// =========================================================
+//  Loading
+// =========================================================
+void aobakeErrorMessage( size_t lineNum, const char *message, void *userData )
+{
+    (void)userData;
+    printf("ERROR on line %zu: %s\n", lineNum, message );
+}
+
+void *readEntireFile( const char *filename, size_t *out_filesz )
+{
+    FILE *fp = fopen( filename, "rb" );
+    if (!fp) return NULL;
+
+    fseek( fp, 0L, SEEK_END );
+    size_t filesz = ftell(fp);
+    fseek( fp, 0L, SEEK_SET );
+
+    void *fileData = malloc( filesz );
+    if ((fileData) && (fread( fileData, filesz, 1, fp ) != 1)) {
+        free( fileData );
+        fileData = NULL;
+    }
+    fclose( fp );
+
+    if (fileData) *out_filesz = filesz;
+    return fileData;
+}
+
+// The parser fills in a default normal when there aren't any, so look for 'vn' lines
+// to tell if the face normals should be used instead
+static int hasNormals( const char *data, size_t size )
+{
+    for (size_t i=0; i+2 < size; i++) {
+        if (((i == 0) || (data[i-1] == '\n')) && (data[i] == 'v') && (data[i+1] == 'n') &&
+            ((data[i+2] == ' ') || (data[i+2] == '\t'))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static double secondsSince( std::chrono::steady_clock::time_point start )
+{
+    return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+int main(int argc, const char * argv[])
+{
+    const char *objFilename = NULL;
+    const char *outFilename = NULL;
+    int size = 1024;
+    int numRays = 64;
+    float dist = 0.5f;
+    int numThreads = 0;
+    int vertexMode = 0;
+
+    for (int i=1; i < argc; i++) {
+        if ((!strcmp( argv[i], "-o" )) && (i+1 < argc)) outFilename = argv[++i];
+        else if ((!strcmp( argv[i], "-size" )) && (i+1 < argc)) size = atoi( argv[++i] );
+        else if ((!strcmp( argv[i], "-rays" )) && (i+1 < argc)) numRays = atoi( argv[++i] );
+        else if ((!strcmp( argv[i], "-dist" )) && (i+1 < argc)) dist = (float)atof( argv[++i] );
+        else if ((!strcmp( argv[i], "-threads" )) && (i+1 < argc)) numThreads = atoi( argv[++i] );
+        else if (!strcmp( argv[i], "-vertex" )) vertexMode = 1;
+        else if (argv[i][0] != '-') objFilename = argv[i];
+        else {
+            printf("Unknown option '%s'\n", argv[i] );
+            return 1;
+        }
+    }
+    if (!objFilename) {
+        printf("usage: tk_aobake model.obj [-o out.png] [-size 1024] [-rays 64] [-dist 0.5] [-threads 0] [-vertex]\n");
+        return 1;
+    }
+    if (!outFilename) outFilename = vertexMode ? "ao.txt" : "ao.png";
+    numRays = (numRays < 4) ? 4 : (numRays + 3) & ~3;
+    if (size < 1) size = 1;
+
+    size_t objFileSize = 0;
+    void *objFileData = readEntireFile( objFilename, &objFileSize );
+    if (!objFileData) {
+        printf("Could not open .OBJ file '%s'\n", objFilename );
+        return 1;
+    }
+
+    TK_ObjThreadPool *pool = TK_ObjThreadPoolCreate( numThreads );
+    TK_ObjJobSystem jobs;
+    TK_ObjThreadPoolJobSystem( pool, &jobs );
+    printf("Using %zu threads\n", jobs.numWorkers );
+
+    // Parse, with the triangles sorted so nearby ones are together in memory (which
+    // keeps neighbouring samples on the same parts of the tree), and the bounds to
+    // scale the ray lengths with
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    TK_ObjDelegate objDelegate = {};
+    objDelegate.error = aobakeErrorMessage;
+    objDelegate.jobs = &jobs;
+    objDelegate.mortonOrder = 1;
+    objDelegate.computeBounds = 1;
+    if (!hasNormals( (const char*)objFileData, objFileSize )) {
+        objDelegate.skipAttribs = TK_ObjAttrib_Nrm;
+    }
+
+    TK_ParseObjGeometry( objFileData, objFileSize, &objDelegate );
+    objDelegate.scratchMem = malloc( objDelegate.scratchMemSize );
+    TK_ObjGeometry *geom = TK_ParseObjGeometry( objFileData, objFileSize, &objDelegate );
+    TK_ObjBounds bounds;
+    if ((!geom) || (!TK_ObjGeometryBounds( geom, &bounds ))) {
+        printf("Could not parse '%s'\n", objFilename );
+        return 1;
+    }
+
+    // Expand every material into one big triangle array
+    size_t numMaterials = TK_ObjNumMaterials( geom );
+    size_t numTris = 0;
+    for (size_t mi=0; mi < numMaterials; mi++) {
+        numTris += TK_ObjMaterialNumTriangles( geom, mi );
+    }
+    if ((!numTris) || (numTris >= (1u << 30))) {
+        printf("Can't bake %zu triangles\n", numTris );
+        return 1;
+    }
+    TK_Triangle *tris = (TK_Triangle*)malloc( sizeof(TK_Triangle)*numTris );
+    void **mtlOutputs = (void**)malloc( sizeof(void*)*numMaterials );
+    size_t triOffset = 0;
+    for (size_t mi=0; mi < numMaterials; mi++) {
+        mtlOutputs[mi] = tris + triOffset;
+        triOffset += TK_ObjMaterialNumTriangles( geom, mi );
+    }
+    TK_ObjExpandParallel( geom, mtlOutputs, NULL, &jobs );
+    printf("Parsed %zu triangles in %.1fms\n", numTris, secondsSince( startTime )*1000.0 );
+
+    startTime = std::chrono::steady_clock::now();
+    BVH bvh;
+    if (!bvhBuild( &bvh, tris, (uint32_t)numTris, &jobs )) {
+        printf("Out of memory building the BVH\n");
+        return 1;
+    }
+    printf("Built BVH (%u nodes, %u subtrees) in %.1fms\n", bvh.numNodes, bvh.numTasks,
+           secondsSince( startTime )*1000.0 );
+
+    // Set up the sample points
+    AOJob aoJob = {};
+    aoJob.bvh = &bvh;
+    aoJob.numRays = numRays;
+    aoJob.maxDist = bounds.radius * dist;
+    aoJob.offset = bounds.radius * 1e-4f;
+
+    float *samplePos, *sampleNrm;
+    unsigned char *sampleValid = NULL;
+    if (vertexMode) {
+        aoJob.numSamples = numTris*3;
+        samplePos = (float*)malloc( sizeof(float)*3*aoJob.numSamples );
+        sampleNrm = (float*)malloc( sizeof(float)*3*aoJob.numSamples );
+        for (size_t ti=0; ti < numTris; ti++) {
+            const TK_TriangleVert *verts[3] = { &tris[ti].vertA, &tris[ti].vertB, &tris[ti].vertC };
+            for (int k=0; k < 3; k++) {
+                memcpy( samplePos + (ti*3+k)*3, verts[k]->pos, sizeof(float)*3 );
+                cornerNormal( sampleNrm + (ti*3+k)*3, verts[k], tris + ti );
+            }
+        }
+    } else {
+        aoJob.numSamples = (size_t)size*size;
+        samplePos = (float*)malloc( sizeof(float)*3*aoJob.numSamples );
+        sampleNrm = (float*)malloc( sizeof(float)*3*aoJob.numSamples );
+        sampleValid = (unsigned char*)calloc( aoJob.numSamples, 1 );
+        size_t numCovered = rasterizeTexels( tris, numTris, size, samplePos, sampleNrm, sampleValid );
+        if (!numCovered) {
+            printf("No texels covered, does '%s' have texture coords? (try -vertex)\n", objFilename );
+            return 1;
+        }
+        printf("Baking %zu of %zu texels\n", numCovered, aoJob.numSamples );
+    }
+    aoJob.samplePos = samplePos;
+    aoJob.sampleNrm = sampleNrm;
+    aoJob.sampleValid = sampleValid;
+    aoJob.ao = (float*)malloc( sizeof(float)*aoJob.numSamples );
+    for (size_t si=0; si < aoJob.numSamples; si++) aoJob.ao[si] = 1.0f;
+
+    startTime = std::chrono::steady_clock::now();
+    jobs.parallelFor( aoSampleJob, &aoJob, (aoJob.numSamples + AO_SAMPLES_PER_JOB-1) / AO_SAMPLES_PER_JOB,
+                      jobs.jobContext );
+    double traceTime = secondsSince( startTime );
+    size_t numTraced = 0;
+    for (size_t si=0; si < aoJob.numSamples; si++) {
+        if ((!sampleValid) || (sampleValid[si])) numTraced++;
+    }
+    printf("Traced %zu rays in %.1fms (%.2f Mrays/s)\n", numTraced * numRays, traceTime*1000.0,
+           (numTraced * numRays) / (traceTime * 1e6) );
+
+    int ok;
+    if (vertexMode) {
+        FILE *fp = fopen( outFilename, "w" );
+        ok = (fp != NULL);
+        if (fp) {
+            fprintf( fp, "# tk_aobake per-vertex AO: x y z ao, three lines per triangle\n" );
+            for (size_t si=0; si < aoJob.numSamples; si++) {
+                const float *pos = samplePos + si*3;
+                fprintf( fp, "%f %f %f %f\n", pos[0], pos[1], pos[2], aoJob.ao[si] );
+            }
+            ok = !ferror( fp );
+            fclose( fp );
+        }
+    } else {
+        dilateTexels( aoJob.ao, sampleValid, size, 4 );
+        unsigned char *pixels = (unsigned char*)malloc( aoJob.numSamples );
+        for (size_t si=0; si < aoJob.numSamples; si++) {
+            float value = sampleValid[si] ? aoJob.ao[si] : 1.0f;
+            pixels[si] = (unsigned char)(value * 255.0f + 0.5f);
+        }
+        ok = writeGrayPNG( outFilename, pixels, size, size );
+        free( pixels );
+    }
+    printf("%s '%s'\n", ok ? "Wrote" : "Could not write", outFilename );
+
+    bvhFree( &bvh );
+    TK_ObjThreadPoolDestroy( pool );
+    return ok ? 0 : 1;
+}
@@ -384,24 +384,20 @@ struct ObjMesh
     bool showInspector;
 };
 
-size_t ObjDrawBuffer_PushVert( ObjDrawBuffer *buff, TK_TriangleVert vert )
+void ObjDrawBuffer_FetchVerts( ObjDrawBuffer *buff, TK_ObjCursor *cursor )
 {
     // Can't add to a buffer anymore once you draw it
     assert( buff->vbo == 0);
-
-    // Make sure we have enough space for the new vert
     assert( buff->buffer );
-    assert( buff->vertUsed < buff->vertCapacity );
-    
-    // Now we have space, add the vert
-    size_t vertIndex = buff->vertUsed++;
-    TK_TriangleVert *destVert = buff->buffer + vertIndex;
-    memcpy( destVert, &vert, sizeof(TK_TriangleVert));
     
-    // Flip ST vertically
-    destVert->st[1] = 1.0-destVert->st[1];
+    // Write the verts straight into the buffer, flipping ST vertically
+    TK_VertexLayout layout;
+    TK_ObjVertexLayoutDefault( &layout );
+    layout.flipV = 1;
     
-    return vertIndex;
+    size_t numTris = TK_ObjCursorFetchVerts( cursor, &layout, buff->buffer + buff->vertUsed,
+                                             (buff->vertCapacity - buff->vertUsed) / 3 );
+    buff->vertUsed += numTris * 3;
 }
 
 void ObjMesh_addGroup( ObjMesh *mesh, ObjMeshGroup *group)
@@ -801,33 +797,39 @@ void objviewerMaterial( const char *materialName, size_t numTriangles, void *use
     mesh->totalNumTriangles += numTriangles;
 }
 
-void objviewerTriangle( TK_TriangleVert a, TK_TriangleVert b, TK_TriangleVert c, void *userData )
+void objviewerLoadGeometry( ObjMesh *mesh, TK_ObjGeometry *geom )
 {
-    ObjMesh *mesh = (ObjMesh*)userData;
-    ObjMeshGroup *group = mesh->currentGroup;
-    assert(group);
-    
-    // Add the triangle to the current material group
-    ObjDrawBuffer_PushVert( &group->drawbuffer, a );
-    ObjDrawBuffer_PushVert( &group->drawbuffer, b );
-    ObjDrawBuffer_PushVert( &group->drawbuffer, c );
+    for (size_t mi=0; mi < TK_ObjNumMaterials( geom ); mi++)
+    {
+        size_t numTriangles = TK_ObjMaterialNumTriangles( geom, mi );
+        if (!numTriangles) continue;
+        
+        char mtlName[256];
+        TK_ObjMaterialName( geom, mi, mtlName, sizeof(mtlName) );
+        objviewerMaterial( mtlName, numTriangles, mesh );
+        
+        // Add the triangles to the current material group
+        ObjMeshGroup *group = mesh->currentGroup;
+        TK_ObjCursor cursor;
+        TK_ObjCursorOpen( &cursor, geom, mi );
+        ObjDrawBuffer_FetchVerts( &group->drawbuffer, &cursor );
+    }
     
-    // Add to the centeroid
-    for (int i=0; i < 3; i++)
+    // The parser already found the centeroid (computeBounds). It's the same average of
+    // the triangle corners this used to add up itself, just summed in double, so on
+    // big meshes it can differ from the old one in the last few digits.
+    TK_ObjBounds bounds;
+    if (TK_ObjGeometryBounds( geom, &bounds ))
     {
-        mesh->objCenter[i] += a.pos[i];
-        mesh->objCenter[i] += b.pos[i];
-        mesh->objCenter[i] += c.pos[i];
+        for (int i=0; i < 3; i++)
+        {
+            mesh->objCenter[i] = bounds.centroid[i];
+        }
     }
 }
 
 void objviewerFinished( ObjMesh *mesh )
 {
-    double centeroidDivisor = mesh->totalNumTriangles * 3;
-    mesh->objCenter[0] /= centeroidDivisor;
-    mesh->objCenter[1] /= centeroidDivisor;
-    mesh->objCenter[2] /= centeroidDivisor;
-    
     printf("CENTEROID: %f %f %f\n",
            mesh->objCenter[0],
            mesh->objCenter[1],
@@ -875,8 +877,7 @@ int main(int argc, char *argv[])
     TK_ObjDelegate objDelegate = {};
     objDelegate.userData = (void*)&theMesh;
     objDelegate.error = objviewerErrorMessage;
-    objDelegate.material = objviewerMaterial;
-    objDelegate.triangle = objviewerTriangle;
+    objDelegate.computeBounds = 1;
     
     initMaterialColors();
     
@@ -895,12 +896,15 @@ int main(int argc, char *argv[])
     CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
 #endif
     // Prepass to determine memory reqs
-    TK_ParseObj( objFileData, objFileSize, &objDelegate );
+    TK_ParseObjGeometry( objFileData, objFileSize, &objDelegate );
     printf("Scratch Mem: %zu\n", objDelegate.scratchMemSize );
     objDelegate.scratchMem = malloc( objDelegate.scratchMemSize );
     
-    // Parse again with memory
-    TK_ParseObj( objFileData, objFileSize, &objDelegate );
+    // Parse again with memory, and pull the triangles into the draw buffers
+    TK_ObjGeometry *geom = TK_ParseObjGeometry( objFileData, objFileSize, &objDelegate );
+    if (geom) {
+        objviewerLoadGeometry( &theMesh, geom );
+    }
     
 #if __APPLE__
     CFAbsoluteTime endTime = CFAbsoluteTimeGetCurrent();
@@ -9,6 +9,23 @@
 #ifndef TK_OBJFILE_H_INCLUDED
 #define TK_OBJFILE_H_INCLUDED
 
+// The stdlib layer uses POSIX and BSD calls (pread, mkstemp, madvise, MAP_ANONYMOUS)
+// that glibc hides under -std=c99 and friends, so ask for them before the first system
+// header. Leaves alone anything the user already picked.
+#if defined(TK_OBJFILE_IMPLEMENTATION) && defined(__linux__) && \
+    (defined(TK_OBJFILE_STDLIB) || defined(TK_OBJFILE_THREADS) || defined(TK_OBJFILE_ZLIB) || defined(TK_OBJFILE_ZSTD))
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
+// Freestanding headers only, for size_t, offsetof and the fixed size ints
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -28,6 +45,89 @@ typedef struct {
     TK_TriangleVert vertC;
 } TK_Triangle;
     
+// TK_ObjBounds -- Bounding volumes, filled in if TK_ObjDelegate.computeBounds is set
+typedef struct {
+    float bboxMin[3];
+    float bboxMax[3];
+    
+    // Bounding sphere, centered on the box
+    float center[3];
+    float radius;
+    
+    // Average of the triangle corners (so it's weighted by how often a vert is used)
+    float centroid[3];
+} TK_ObjBounds;
+
+// TK_ObjAttrib -- Vertex attributes that can be skipped with TK_ObjDelegate.skipAttribs
+typedef enum {
+    TK_ObjAttrib_St  = (1<<0),
+    TK_ObjAttrib_Nrm = (1<<1),
+} TK_ObjAttrib;
+
+// TK_ObjArena -- Bump allocator for parse results. It can live across many parses,
+// TK_ObjArenaReset rewinds it without freeing anything, so a long running worker can
+// keep one warm arena and stop touching fresh memory on every load. It starts out in
+// an optional caller buffer, and if the alloc/free hooks are set it grows by adding
+// chunks of at least chunkSize. (TK_OBJFILE_STDLIB has malloc and huge page hooks)
+typedef struct TK_ObjArenaChunk {
+    struct TK_ObjArenaChunk *next;
+    size_t size; // usable bytes after the header
+} TK_ObjArenaChunk;
+
+typedef struct {
+    void *(*alloc)( size_t size, void *allocUserData );
+    void (*free)( void *ptr, size_t size, void *allocUserData );
+    void *allocUserData;
+    size_t chunkSize;
+    
+    // Internal state, use the TK_ObjArena functions
+    uint8_t *buffer;
+    size_t bufferSize;
+    TK_ObjArenaChunk *chunks;
+    TK_ObjArenaChunk *currChunk;
+    uint8_t *top;
+    size_t remaining;
+} TK_ObjArena;
+
+// TK_ObjArenaInit -- Sets up the arena on buffer (which can be NULL) with no growth
+// hooks. Set alloc/free/chunkSize afterwards to let it grow.
+void TK_ObjArenaInit( TK_ObjArena *arena, void *buffer, size_t bufferSize );
+
+// TK_ObjArenaPush -- Returns size bytes aligned to 16, or NULL if it's out of memory
+void *TK_ObjArenaPush( TK_ObjArena *arena, size_t size );
+
+// TK_ObjArenaReset -- Rewinds the arena, keeping all its chunks for reuse
+void TK_ObjArenaReset( TK_ObjArena *arena );
+
+// TK_ObjArenaRelease -- Frees the grown chunks through the hook and rewinds
+void TK_ObjArenaRelease( TK_ObjArena *arena );
+
+// TK_ObjArenaMark -- A saved position in an arena. Rewinding to it gives back
+// everything pushed since, so an arena can also be used for temporary memory.
+typedef struct {
+    TK_ObjArenaChunk *currChunk;
+    uint8_t *top;
+    size_t remaining;
+} TK_ObjArenaMark;
+
+TK_ObjArenaMark TK_ObjArenaGetMark( TK_ObjArena *arena );
+void TK_ObjArenaRewind( TK_ObjArena *arena, TK_ObjArenaMark mark );
+
+// TK_ObjJobFunc -- One unit of parallel work. workerIndex is in [0, numWorkers) and
+// is never used by two jobs at the same time, so it can index per-worker data.
+typedef void (*TK_ObjJobFunc)( void *jobData, size_t jobIndex, size_t workerIndex );
+
+// TK_ObjJobSystem -- Hook for running work on the caller's threads. The library never
+// creates threads itself (see TK_OBJFILE_THREADS below for a simple pool if you don't
+// have a job system handy). parallelFor must run job() for every index in [0, numJobs),
+// possibly concurrently, and return once they have all finished. Anything that takes
+// a TK_ObjJobSystem will run serially on the calling thread if it's NULL.
+typedef struct {
+    void (*parallelFor)( TK_ObjJobFunc job, void *jobData, size_t numJobs, void *jobContext );
+    void *jobContext;
+    size_t numWorkers;
+} TK_ObjJobSystem;
+
 // TKObjDelegate -- Callbacks for the OBJ format parser. All callbacks are optional.
 //
 // Scratch Memory -- The parser needs some scratch memory to do its work and to store the results.
@@ -43,15 +143,85 @@ typedef struct
     void (*material)( const char *mtlName, size_t numTriangles, void *userData );
     void (*triangle)( TK_TriangleVert a, TK_TriangleVert b, TK_TriangleVert c, void *userData );
     
+    // Parallel version of triangle(). If this and jobs are set, TK_ParseObj calls material()
+    // for every material first, then expands the triangles on the job system and passes
+    // them here in batches, from the worker threads, so it must be thread safe. Batches
+    // arrive in any order, but mtlIndex (the order material() was called in) and
+    // firstTriangle say exactly where each batch goes, so the results can be put back
+    // in the same order as the serial API.
+    void (*triangleBatch)( size_t mtlIndex, size_t firstTriangle, TK_Triangle *tris,
+                           size_t numTriangles, void *userData );
+    
+    // Job system for the parallel parts, NULL to run everything on the calling thread
+    const TK_ObjJobSystem *jobs;
+    
     // Scratch memory needed by parser.
     // If scratchMemSize is 0, results will not be returned but it will be
     // filled in with the required scratchMemSize
     void *scratchMem;
     size_t scratchMemSize;
     
+    // Alternatively, if arena is set the results are pushed onto it instead of
+    // scratchMem, growing it as needed, so there is no need for a prepass call.
+    // Results stay valid until the arena is reset.
+    TK_ObjArena *arena;
+    
     // arbitrary user data passed through to callbacks
     void *userData;
     
+    // Attributes (TK_ObjAttrib flags) to skip. Skipped vt/vn lines are still
+    // counted but not parsed or stored, and come out zeroed in the triangles.
+    unsigned int skipAttribs;
+    
+    // Immediate mode -- if set, triangles are emitted in file order as each face is
+    // parsed instead of being stored and grouped by material. material() is called
+    // each time the material changes, so it may be called more than once for the
+    // same material, numTriangles is always the material's total for the file.
+    // Scratch memory only holds the vertex lists. Vertices must be defined before
+    // the faces that use them.
+    int immediateMode;
+    
+    // Morton order -- if set, each material's triangles are sorted by the Morton code of
+    // their centroids (a parallel radix sort, on jobs) before they're emitted, so nearby
+    // triangles end up near each other. remap() is called right after each material()
+    // with the original, file order, index of each triangle (TK_ObjMaterialRemap has the
+    // same table for TK_ParseObjGeometry). Ignored in immediate mode.
+    int mortonOrder;
+    void (*remap)( const size_t *remap, size_t numTriangles, void *userData );
+    
+    // Bounds -- if set, the bounding box, sphere and centroid of the whole file and of each
+    // material are computed right after the parse (with SIMD, on jobs). bounds() is called
+    // once before the first material(), mtlBounds[i] goes with the i-th material() call.
+    // TK_ObjGeometryBounds and TK_ObjMaterialBounds have them for TK_ParseObjGeometry.
+    // The box and sphere for the file cover every position in it, used or not, the
+    // materials only cover their triangles. Ignored in immediate mode.
+    int computeBounds;
+    void (*bounds)( const TK_ObjBounds *fileBounds, const TK_ObjBounds *mtlBounds,
+                    size_t numMaterials, void *userData );
+    
+    // Weld -- if weldTolerance is more than 0, positions that close together are merged
+    // right after the parse (before the sort and bounds, on jobs), so the duplicate v lines
+    // a lot of exporters write for the same point don't leave cracks. The triangles are
+    // pointed at the lowest numbered position of each group, and the others are dropped
+    // from the geometry's position list, which otherwise keeps its order. Groups can chain,
+    // so positions a bit further apart than the tolerance may end up merged. numVerts
+    // below stays the file's count. Ignored in immediate mode.
+    float weldTolerance;
+    
+    // In situ -- if set, the vertex lists and triangles are stored in objFileData itself,
+    // over text that's already been read, so scratch memory only holds the materials
+    // (plus the sort and bounds temporaries, if they don't fit in what's left of the
+    // text). The text is gone afterwards, and the geometry is only good as long as
+    // objFileData is. The count pass works out if the lists fit behind the parse, if
+    // they don't (mostly files with short lines) it parses into scratch as usual, and
+    // so does anything that needs more than 4 billion of something. Ignored in
+    // immediate mode, and it always does the count pass, "# tk_counts" or not.
+    int inSitu;
+    
+    // LODs -- TK_ObjEmitLods calls lod() before the material() and triangle() calls for
+    // each level of detail, with its index in the ratios and its number of triangles.
+    void (*lod)( size_t lodIndex, size_t numTriangles, void *userData );
+    
     // stats used during parsing.
     size_t currentLineNumber;
     size_t numVerts;
@@ -66,40 +236,36 @@ typedef struct
 // TK_ParseObj -- Parse an obj file into triangle soup.
 //
 // Parse the obj formatted data and call delegate methods for each triangle.
+//
+// Normally the file is read twice, once to count everything and once to store it. If the
+// comments at the top of the file have a "# tk_counts" line (TK_WriteObj puts one there)
+// the counts come from it instead and the file is only read once. If the file doesn't
+// match it, that's caught during the parse and it starts over with a count pass, so a
+// stale header only costs time. The sizing call (scratchMem NULL) always counts, so the
+// size it fills in is right either way. Immediate mode, the stream and out-of-core parses
+// always count.
 // TODO:(jbd) Add a SimpleParse that just packs the triangles into a list for convienance
 void TK_ParseObj( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate );
-    
-    
-#ifdef __cplusplus
-} // extern "C"
-#endif
-
-// =========================================================
-//  IMPLEMENTATION
-// =========================================================
-#ifdef TK_OBJFILE_IMPLEMENTATION
 
-// NOTE: This uses a custom version of strtof (which is probably not as good). A few
-// people have told me that this is silly, there's no reason to avoid strtof or atof
-// from the cstdlib. They're probably right, there's no real compelling reason to avoid
-// the C stdlib, but since I'm doing this mostly for my own exercise I want to keep to
-// the "zero dependancies, from scratch" philosophy.
+// TK_ProbeObj -- Just count what's in the file, without parsing it.
 //
-// However, if you prefer to use the stdlib strtof, you can simply add:
-//    #define TK_STRTOF strtof
-// before you include tk_objfile and it will happily use that instead (or define
-// it to be your own implementation).
-#ifndef TK_STRTOF
-#define TK_STRTOF TKimpl_stringToFloat
-#endif
+// Fills in numVerts, numSts, numNorms, numFaces and numTriangles in objDelegate, the same
+// as TK_ParseObj would, and returns the number of materials (the same as
+// TK_ObjNumMaterials, counting the default one for faces before any usemtl). Nothing else
+// in objDelegate is used, and no scratch memory is needed. Lines are sorted out by their
+// first bytes and face corners are counted with SIMD instead of being tokenized, so this
+// is about as fast as the file can be read. It's also what the count pass uses.
+size_t TK_ProbeObj( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate );
 
 // Implementation types (TKimpl_*) are internal, and may 
-// change without warning between versions. 
+// change without warning between versions. They are declared
+// here only so the cursor API and the C++ front-end below can
+// use them from any translation unit.
 
 typedef struct {
-    ssize_t posIndex;
-    ssize_t stIndex;
-    ssize_t normIndex;
+    ptrdiff_t posIndex;
+    ptrdiff_t stIndex;
+    ptrdiff_t normIndex;
 } TKimpl_IndexedVert;
 
 typedef struct {
@@ -108,11 +274,34 @@ typedef struct {
     TKimpl_IndexedVert vertC;
 } TKimpl_IndexedTriangle;
 
+// Stored triangles use 32-bit indices whenever the counts from the
+// prepass fit, which is half the size of the full TKimpl_IndexedTriangle
+typedef struct {
+    uint32_t posIndex;
+    uint32_t stIndex;
+    uint32_t normIndex;
+} TKimpl_CompactVert;
+
+typedef struct {
+    TKimpl_CompactVert vertA;
+    TKimpl_CompactVert vertB;
+    TKimpl_CompactVert vertC;
+} TKimpl_CompactTriangle;
+
 // TKimpl_Material
 typedef struct {
     char  *mtlName; // not 0-delimited, be careful
     size_t numTriangles;
+    
+    // Only one of these is used, depending on geom->compactIndices
     TKimpl_IndexedTriangle *triangles;
+    TKimpl_CompactTriangle *compactTriangles;
+    
+    // File order index of each triangle, if they were sorted (mortonOrder)
+    size_t *remap;
+    
+    // Only filled in with computeBounds
+    TK_ObjBounds bounds;
 } TKimpl_Material;
 
 // Maximum number of unique materials in an obj file
@@ -135,127 +324,878 @@ typedef struct {
     TKimpl_Material *materials;
     size_t numMaterials;
     
+    // TK_ObjAttrib flags that weren't parsed
+    unsigned int skipAttribs;
+    
+    // Materials store TKimpl_CompactTriangle instead of TKimpl_IndexedTriangle
+    int compactIndices;
+    
+    // If set, the full pass hands each triangle to this instead of storing
+    // it in the material (the out-of-core parser spills them to disk)
+    void (*triangleSink)( void *sinkData, size_t mtlIndex, TKimpl_IndexedTriangle *ndxTri );
+    void *sinkData;
+    
+    // Whole file bounds, and if they (and the materials' bounds) were computed
+    int hasBounds;
+    TK_ObjBounds bounds;
+    
+    // Added to indices that were relative (negative) in the file, TK_ParseObjShard
+    // uses it to tell them apart. 0 everywhere else.
+    ptrdiff_t relativeBias;
+    
+    // The lists are being stored over the file text (inSitu in the delegate), so the
+    // rest of a v, vt or vn line is skipped once it's stored
+    int inSitu;
+    
 } TKimpl_Geometry;
 
-// TKImpl_ParseType
+// TK_ObjGeometry -- The parsed obj, stored in the scratch memory
+typedef TKimpl_Geometry TK_ObjGeometry;
+
+// TK_ObjCursor -- Walks a range of triangles in one material. It's a plain struct
+// so it's cheap to copy, and since fetching only reads the geometry, several cursors
+// can fetch from the same geometry on different threads at once.
+typedef struct {
+    TK_ObjGeometry *geom;
+    size_t mtlIndex;
+    size_t triIndex; // next triangle to fetch
+    size_t endIndex; // one past the last triangle in range
+} TK_ObjCursor;
+
+// TK_ParseObjGeometry -- Pull-style alternative to TK_ParseObj.
+//
+// Parses the obj into scratch memory like TK_ParseObj, but doesn't call the material
+// or triangle callbacks. Instead, the triangles are read back with a TK_ObjCursor.
+// Returns NULL if there was no scratch memory (scratchMemSize is filled in, just like
+// TK_ParseObj) or if it was too small. The geometry stays valid as long as the scratch
+// memory does. Don't set immediateMode, nothing gets stored in that case (the triangles
+// are emitted through the callbacks during the parse instead).
+TK_ObjGeometry *TK_ParseObjGeometry( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate );
+
+// Material info. Materials that aren't used by any faces have 0 triangles.
+size_t TK_ObjNumMaterials( TK_ObjGeometry *geom );
+size_t TK_ObjMaterialNumTriangles( TK_ObjGeometry *geom, size_t mtlIndex );
+char *TK_ObjMaterialName( TK_ObjGeometry *geom, size_t mtlIndex, char *dest, size_t destSize );
+
+// TK_ObjMaterialRemap -- With mortonOrder, the file order index of each of the material's
+// triangles, NULL if they weren't sorted.
+const size_t *TK_ObjMaterialRemap( TK_ObjGeometry *geom, size_t mtlIndex );
+
+// TK_ObjGeometryBounds, TK_ObjMaterialBounds -- With computeBounds, copies out the
+// bounds and returns 1, otherwise returns 0.
+int TK_ObjGeometryBounds( TK_ObjGeometry *geom, TK_ObjBounds *bounds );
+int TK_ObjMaterialBounds( TK_ObjGeometry *geom, size_t mtlIndex, TK_ObjBounds *bounds );
+
+// TK_ObjCursorOpen -- Set up a cursor over all the triangles in a material, or
+// over [firstTriangle, firstTriangle+numTriangles) of it, so that workers can
+// pull disjoint ranges of the same material.
+void TK_ObjCursorOpen( TK_ObjCursor *cursor, TK_ObjGeometry *geom, size_t mtlIndex );
+void TK_ObjCursorOpenRange( TK_ObjCursor *cursor, TK_ObjGeometry *geom, size_t mtlIndex,
+                            size_t firstTriangle, size_t numTriangles );
+
+// TK_ObjCursorSeek -- Move to a triangle index within the material (clamped to the range)
+void TK_ObjCursorSeek( TK_ObjCursor *cursor, size_t triIndex );
+
+// TK_ObjCursorFetch -- Copies up to maxTriangles triangles into dest and advances
+// the cursor. Returns the number fetched, 0 when the cursor is done.
+size_t TK_ObjCursorFetch( TK_ObjCursor *cursor, TK_Triangle *dest, size_t maxTriangles );
+
+// TK_VertFormat -- Storage formats for TK_VertexLayout attributes
 typedef enum {
-    TKimpl_ParseTypeCountOnly,
-    TKimpl_ParseTypeFull,
-} TKimpl_ParseType;
+    TK_VertFormat_None = 0,  // attribute isn't written
+    TK_VertFormat_Float32,
+    TK_VertFormat_Float16,
+    TK_VertFormat_Snorm16,   // [-1,1] mapped to int16, good for normals
+    TK_VertFormat_Unorm16,   // [0,1] mapped to uint16, good for STs in 0..1
+} TK_VertFormat;
 
-// TKImpl_MemArena
+// TK_VertexLayout -- Describes the caller's vertex format, so that vertices can be
+// written straight into e.g. a mapped GPU buffer without going through TK_TriangleVert.
+// Offsets are in bytes from the start of each vertex, and should be aligned to the
+// size of the format's components.
 typedef struct {
-    void *base;
-    uint8_t *top;
-    size_t remaining;
-} TKImpl_MemArena;
+    size_t stride;
+    
+    size_t posOffset;
+    size_t stOffset;
+    size_t nrmOffset;
+    
+    TK_VertFormat posFormat;
+    TK_VertFormat stFormat;
+    TK_VertFormat nrmFormat;
+    
+    // If set, writes 1-t instead of t, for OpenGL style textures
+    int flipV;
+} TK_VertexLayout;
 
-void *TKImpl_PushSize( TKImpl_MemArena *arena, size_t structSize )
-{
-    if (structSize > arena->remaining) {
-        return NULL;
-    }
+// TK_ObjVertexLayoutDefault -- Fills in a layout matching TK_TriangleVert
+void TK_ObjVertexLayoutDefault( TK_VertexLayout *layout );
+
+// TK_ObjCursorFetchVerts -- Like TK_ObjCursorFetch, but writes the three vertices of
+// each triangle into dest using the layout. Vertex i of the fetch lands at
+// dest + i*layout->stride. Returns the number of triangles written.
+size_t TK_ObjCursorFetchVerts( TK_ObjCursor *cursor, const TK_VertexLayout *layout,
+                               void *dest, size_t maxTriangles );
+
+// TK_ObjExpandParallel -- Expands all of the triangles on the job system, straight
+// into caller-provided memory for each material. mtlOutputs[mi] must have room for
+// TK_ObjMaterialNumTriangles(geom,mi) TK_Triangles, or three vertices per triangle in
+// the given layout if it isn't NULL. NULL outputs are skipped. Big materials are split
+// into slices so they spread across the workers too. Every triangle lands at its own
+// index, so the output is identical to the serial cursor no matter how it's scheduled.
+void TK_ObjExpandParallel( TK_ObjGeometry *geom, void **mtlOutputs, const TK_VertexLayout *layout,
+                           const TK_ObjJobSystem *jobs );
+
+// TK_ObjTile -- One grid cell's worth of a material's triangles, from TK_ObjTileGeometry.
+// The bbox is the bounds of the triangles themselves, which can poke out of the cell.
+typedef struct {
+    size_t mtlIndex;
+    unsigned int cell[3];
+    size_t firstTriangle;
+    size_t numTriangles;
+    float bboxMin[3];
+    float bboxMax[3];
+} TK_ObjTile;
+
+typedef void (*TK_ObjTileFunc)( TK_ObjGeometry *geom, const TK_ObjTile *tile, void *userData );
+
+// TK_ObjTileGeometry -- Splits the geometry into a uniform grid of gridSize cells over the
+// bounds of its positions. Each material's triangles are reordered in place (a counting
+// sort on the cell of each triangle's centroid) so that every cell is one contiguous
+// range, then tileFunc is called for each non-empty cell, by material and then by cell
+// (x fastest). Open a cursor with TK_ObjCursorOpenRange on the tile to get its triangles.
+//
+// The cells are found on the job system, then the materials are sorted one at a time so
+// they can share the per-cell buffers, each just before its tiles are handed out (a later
+// material isn't sorted yet during an earlier one's tileFunc calls). Temporary memory
+// comes from scratch and is rewound before it returns.
+// Returns the number of tiles, or 0 if scratch ran out (the geometry isn't changed then).
+size_t TK_ObjTileGeometry( TK_ObjGeometry *geom, const unsigned int gridSize[3],
+                           TK_ObjArena *scratch, TK_ObjTileFunc tileFunc, void *userData,
+                           const TK_ObjJobSystem *jobs );
+
+// TK_WriteObj -- Writes the geometry back out as obj text: a "# tk_counts" comment, the
+// v, vt and vn lists, then each material's triangles as "f" lines after its usemtl, in
+// the order they're stored. The comment lets TK_ParseObj skip its count pass when the
+// file is read back.
+// Floats get the fewest digits that read back as exactly the same float, so parsing the
+// output gives the same geometry, bit for bit. Slices of lines are formatted on the job
+// system, each into a worst case sized spot in dest, and then slid together.
+//
+// Like scratchMemSize, if dest is NULL or *destSize is too small it only fills in
+// *destSize with the size it needs and returns 0. Otherwise it returns the number of
+// bytes written, which is usually well under *destSize. Groups, polygons and anything
+// else the parser doesn't keep aren't written. Lists that are empty (or were skipped
+// with skipAttribs) are left out of the faces.
+size_t TK_WriteObj( TK_ObjGeometry *geom, void *dest, size_t *destSize, const TK_ObjJobSystem *jobs );
+
+// TK_ObjShard -- Part of a file, parsed by TK_ParseObjShard. It's a single block of
+// memory (size bytes, this header included) with offsets instead of pointers, so it can
+// be copied, saved or sent to another machine to be merged. The indices in it are
+// ptrdiff_t, so it has to stay on machines with the same word size and byte order.
+#define TK_OBJ_SHARD_MAGIC (0x3164726168536b74ULL) // "tkShard1"
+typedef struct {
+    uint64_t magic;
+    uint64_t size;
     
-    void *result = (void*)arena->top;
-    arena->top += structSize;
-    arena->remaining -= structSize;
+    // The TK_ObjDelegate stats for the shard's lines
+    uint64_t numVerts, numSts, numNorms, numFaces, numTriangles;
     
+    // What was stored (skipped vt and vn lines aren't, and an error stops the parse)
+    uint64_t numVertPos, numVertSt, numVertNrm;
     
-    return result;
-}
+    // Material 0 is whichever one was in use where the shard starts, the rest are the
+    // shard's usemtls, one each in file order even if a name repeats (at most 99).
+    // lastMaterial is the one in use at the end.
+    uint64_t numMaterials;
+    uint64_t lastMaterial;
+    
+    // Relative indices that point back before the start of the shard
+    uint64_t numUnresolved;
+    
+    // Offsets from the start of the shard
+    uint64_t mtlOffset, posOffset, stOffset, nrmOffset;
+} TK_ObjShard;
 
-#define TKImpl_PushStruct(arena,T) (T*)TKImpl_PushSize(arena,sizeof(T))
-#define TKImpl_PushStructArray(arena,T,num) (T*)TKImpl_PushSize(arena,sizeof(T)*num)
+// TK_ParseObjShard -- Parses the lines that start in [begin, end) of the file, so a big
+// file can be split into byte ranges anywhere, and each parsed separately (on different
+// machines even) with no coordination. Every line ends up in exactly one shard.
+// objFileData is the whole file, usually mapped, only the range and the rest of its last
+// line are read. Relative (negative) indices are kept relative to the shard, and the ones
+// that reach back into earlier shards are left for the merge.
+//
+// The shard goes in scratchMem or on the arena, just like TK_ParseObjGeometry, and
+// returns NULL (with scratchMemSize filled in) the same way. Line numbers in errors are
+// counted from the start of the range. immediateMode, mortonOrder, computeBounds and
+// weldTolerance are ignored, the merge does those.
+TK_ObjShard *TK_ParseObjShard( void *objFileData, size_t objFileSize, size_t begin, size_t end,
+                               TK_ObjDelegate *objDelegate );
 
+// TK_MergeObjShards -- Puts the shards of a file (in file order, covering all of it)
+// back together into one geometry, the same one TK_ParseObjGeometry would get from the
+// whole file, sorted and with bounds if objDelegate asks for them. Each shard is copied
+// in on the job system. Memory works like TK_ParseObjGeometry, and the material names
+// point into the shards, so keep them around as long as the geometry. Shards are checked
+// before they're read, one with anything pointing outside it is an error and returns NULL.
+TK_ObjGeometry *TK_MergeObjShards( TK_ObjShard **shards, size_t numShards, TK_ObjDelegate *objDelegate );
 
-int TKimpl_isIdentifier( char ch ) {
-    if (ch=='\0'||ch==' '||ch=='\n'||ch=='\t'||ch=='\r') return 0;
-    return 1;
+// TK_OBJ_RESTART_INDEX -- Primitive restart index between strips (the 32-bit one GL and
+// D3D/Vulkan use for strips)
+#define TK_OBJ_RESTART_INDEX (0xFFFFFFFFu)
+
+// TK_ObjIndexedMesh -- One material as an indexed mesh, from TK_ObjIndexMaterial.
+typedef struct {
+    // Each distinct pos/st/nrm combination in the material, numbered in the order the
+    // indices first use them. Verts on a UV or normal seam are separate, but share
+    // their posIndex (into geom->vertPos).
+    size_t numVerts;
+    TK_TriangleVert *verts;
+    size_t *posIndices;
+
+    // A triangle list, or strips with TK_OBJ_RESTART_INDEX between them. As a list the
+    // triangles would take 3*numTriangles indices, numIndices is what they take here.
+    size_t numIndices;
+    uint32_t *indices;
+    size_t numStrips; // 0 for a list
+    size_t numTriangles;
+} TK_ObjIndexedMesh;
+
+// TK_ObjIndexMaterial -- Builds an indexed mesh for one material, merging corners that
+// use the same pos, st and nrm. If strips is set, the triangles are joined into strips
+// across shared edges (keeping their winding), each new strip starting next to the
+// verts a 16 entry vertex cache would still have from the last one. Otherwise it's a
+// list in the stored order. On the test meshes strips took 1.4 to 2.5 indices per
+// triangle (48% to 85% of the list), more where UV seams split the verts, and a
+// scattered mesh can take up to four.
+//
+// The mesh is pushed on arena. Temporary memory (up to 80 bytes per triangle for a
+// list, 150 for strips) comes from scratch and is rewound before it returns, unless
+// it's the same arena. Returns 0 if either ran out, if the material has 1.4 billion
+// triangles or more, or if the geometry was parsed in immediate mode. It only reads
+// the geometry, so the materials can be indexed on different threads at once, each
+// with their own arenas.
+int TK_ObjIndexMaterial( TK_ObjGeometry *geom, size_t mtlIndex, int strips,
+                         TK_ObjArena *arena, TK_ObjArena *scratch, TK_ObjIndexedMesh *mesh );
+
+// TK_ObjEmitLods -- Simplifies the geometry down to each fraction of its triangles in ratios
+// (1.0, 0.5, 0.25 say) and emits every level of detail through objDelegate: lod(), then
+// material() and triangle() for its materials, the same as TK_ParseObj. Each level goes on
+// from the one before, so the ratios should be decreasing.
+//
+// Edges are collapsed in order of quadric error, each one moving a vert onto one of its
+// neighbours, so no new positions or UVs are made up. Verts on an open border, a UV or
+// normal seam, or between materials never move (other verts can collapse onto them), so
+// the seams and the material boundaries stay where they were, and collapses that would
+// flip or fold over a triangle or pinch the surface are skipped. A level can end up with more
+// triangles than asked for if the rest are all stuck like that. Degenerate triangles are
+// dropped from every level.
+//
+// Works on a copy in scratch (about 120 bytes per position plus 110 per triangle), which
+// is rewound before it returns. Returns 0 if scratch ran out, or the geometry was parsed
+// in immediate mode, has more than 4 billion of something, or has a face with an index
+// past the end of its list.
+int TK_ObjEmitLods( TK_ObjGeometry *geom, const float *ratios, size_t numLods,
+                    TK_ObjDelegate *objDelegate, TK_ObjArena *scratch );
+
+// TK_OBJ_NO_HALF_EDGE -- The twin of a half-edge that doesn't have exactly one
+#define TK_OBJ_NO_HALF_EDGE (0xFFFFFFFFu)
+
+// TK_ObjHalfEdges -- Adjacency for all of a geometry's triangles, from TK_ObjBuildHalfEdges.
+// The triangles are numbered material by material in stored order, the ones in material
+// mi starting at mtlStart[mi]. Triangle t has half-edges 3t, 3t+1 and 3t+2, in winding
+// order, each one going from vertex[h] (a posIndex) to the vertex of the next one.
+typedef struct {
+    size_t numTriangles;
+    size_t numHalfEdges;
+    size_t numMaterials;
+    size_t *mtlStart; // numMaterials+1 entries
+    
+    uint32_t *vertex;
+    uint32_t *twin; // the one going the other way along the same edge, or TK_OBJ_NO_HALF_EDGE
+    
+    // Every half-edge leaving position v is in vertEdges[vertStart[v]] up to
+    // vertEdges[vertStart[v+1]], lowest numbered first
+    size_t numVerts;
+    uint32_t *vertStart; // numVerts+1 entries
+    uint32_t *vertEdges;
+} TK_ObjHalfEdges;
+
+// TK_ObjBuildHalfEdges -- Builds the half-edges on arena (usually the one the geometry is
+// on, so they go together). The edges are matched up with a parallel radix sort of their
+// keys on jobs. An edge gets twins only if it has exactly two half-edges going opposite
+// ways, so borders, non-manifold edges and ones between triangles wound differently
+// don't have any. Edges only match where the triangles share a posIndex, so weld the
+// positions first (weldTolerance) if the file repeats them. Temporary memory (about
+// 24 bytes per half-edge) comes from scratch and is rewound before it returns, unless
+// it's the same arena. Returns NULL if either ran out, if the geometry was parsed in
+// immediate mode, or if it has 4 billion or more half-edges or positions.
+TK_ObjHalfEdges *TK_ObjBuildHalfEdges( TK_ObjGeometry *geom, TK_ObjArena *arena, TK_ObjArena *scratch,
+                                       const TK_ObjJobSystem *jobs );
+
+// TK_ObjHalfEdgeNext, TK_ObjHalfEdgePrev, TK_ObjHalfEdgeTwin -- Walking the half-edges.
+// Next and prev stay in the triangle. Going around a position v, from a half-edge h
+// leaving it, TK_ObjHalfEdgeTwin( he, TK_ObjHalfEdgePrev( h ) ) is the next one leaving
+// it the other way round, until it hits a border.
+size_t TK_ObjHalfEdgeNext( size_t halfEdge );
+size_t TK_ObjHalfEdgePrev( size_t halfEdge );
+size_t TK_ObjHalfEdgeTwin( const TK_ObjHalfEdges *halfEdges, size_t halfEdge );
+
+// TK_ObjVertexStar -- The half-edges leaving a position (all of them, even across borders
+// and non-manifold edges). Returns how many there are, and points *out_halfEdges at them.
+size_t TK_ObjVertexStar( const TK_ObjHalfEdges *halfEdges, size_t posIndex, const uint32_t **out_halfEdges );
+
+// TKimpl_stringDelimMtlName -- Copies a material name into dest as a 0-terminated string.
+char *TKimpl_stringDelimMtlName( char *dest, char *mtlName, size_t maxLen );
+
+// TKimpl_ExpandTriangles -- Looks up the vertex data for a run of a material's triangles.
+void TKimpl_ExpandTriangles( TKimpl_Geometry *geom, TKimpl_Material *mtl, size_t firstTriangle,
+                             size_t numTriangles, TK_Triangle *dest );
+
+// TKimpl_LoadIndexedTriangle, TKimpl_StoreIndexedTriangle -- Read or write a stored
+// triangle's indices, whichever index width the geometry was built with.
+void TKimpl_LoadIndexedTriangle( TKimpl_Geometry *geom, TKimpl_Material *mtl, size_t triIndex,
+                                 TKimpl_IndexedTriangle *ndxTri );
+void TKimpl_StoreIndexedTriangle( TKimpl_Geometry *geom, TKimpl_Material *mtl, size_t triIndex,
+                                  TKimpl_IndexedTriangle *ndxTri );
+
+// TKimpl_SortMorton -- Sorts the materials that have a remap table into Morton order,
+// using temporary memory from the arena (TKimpl_MortonScratchSize bytes at most).
+int TKimpl_SortMorton( TKimpl_Geometry *geom, TK_ObjArena *arena, const TK_ObjJobSystem *jobs );
+size_t TKimpl_MortonScratchSize( size_t numVerts, size_t maxTriangles, size_t triangleSize );
+
+// TKimpl_ComputeBounds -- Fills in geom->bounds and each material's bounds, using
+// temporary memory from the arena (TKimpl_BoundsScratchSize bytes at most).
+int TKimpl_ComputeBounds( TKimpl_Geometry *geom, TK_ObjArena *arena, const TK_ObjJobSystem *jobs );
+size_t TKimpl_BoundsScratchSize( size_t numVerts, TKimpl_Material *materials, size_t numMaterials );
+
+// TKimpl_WeldPositions -- Merges positions within tolerance and remaps the stored triangles,
+// using temporary memory from the arena (TKimpl_WeldScratchSize bytes at most).
+int TKimpl_WeldPositions( TKimpl_Geometry *geom, float tolerance, TK_ObjArena *arena, const TK_ObjJobSystem *jobs );
+size_t TKimpl_WeldScratchSize( size_t numVerts );
+
+// =========================================================
+//  OPTIONAL STDLIB LAYER
+// =========================================================
+// Define TK_OBJFILE_STDLIB to get helpers that use the C stdlib for file
+// loading and allocation, and TK_OBJFILE_THREADS (which implies STDLIB)
+// for a small pthreads pool. TK_OBJFILE_ZLIB and TK_OBJFILE_ZSTD (which
+// imply THREADS) let TK_ParseObjCompressed read .obj.gz and .obj.zst files,
+// and need zlib or libzstd to link. The core above doesn't use any of them.
+#if (defined(TK_OBJFILE_ZLIB) || defined(TK_OBJFILE_ZSTD)) && !defined(TK_OBJFILE_THREADS)
+#define TK_OBJFILE_THREADS
+#endif
+
+#if defined(TK_OBJFILE_THREADS) && !defined(TK_OBJFILE_STDLIB)
+#define TK_OBJFILE_STDLIB
+#endif
+
+#ifdef TK_OBJFILE_STDLIB
+
+// TK_ObjArenaInitMalloc -- Sets up an arena that grows with malloc, in chunks of at
+// least chunkSize. Call TK_ObjArenaRelease to free it.
+void TK_ObjArenaInitMalloc( TK_ObjArena *arena, size_t chunkSize );
+
+// TK_ObjArenaInitHugePages -- Same, but the chunks are mmapped and rounded up to 2MB,
+// and use huge pages where the OS supports them (Linux MAP_HUGETLB, falling back to
+// transparent huge pages). Saves a lot of TLB misses and page faults on big meshes.
+void TK_ObjArenaInitHugePages( TK_ObjArena *arena, size_t chunkSize );
+
+// TK_ObjBatchItem -- One file for TK_ParseObjBatch, either a path to load or a
+// buffer that's already in memory (if path is NULL).
+typedef struct {
+    const char *path;
+    void *objFileData;
+    size_t objFileSize;
+} TK_ObjBatchItem;
+
+// TK_ObjBatchDoneFunc -- Called on a worker thread as each file finishes, so it must
+// be thread safe. geom is NULL if the file couldn't be read or parsed. The geometry
+// (and the file data, for paths) are only valid until the callback returns, since
+// the worker reuses its memory for the next file. objDelegate has the stats for the file.
+typedef void (*TK_ObjBatchDoneFunc)( size_t itemIndex, TK_ObjGeometry *geom,
+                                     TK_ObjDelegate *objDelegate, void *userData );
+
+// TK_ParseObjBatch -- Parses a list of files across the workers of a job system.
+//
+// objDelegate is a template for each file's delegate: its options (e.g. skipAttribs),
+// userData and error callback are used, error() is called from the worker threads
+// with the line number of the file that's being parsed. Its scratchMem and arena are
+// ignored, each worker keeps its own malloc arena and file buffer and reuses them,
+// so after the first few files each one is just a single parse with no allocation.
+// Returns the number of files that parsed successfully.
+size_t TK_ParseObjBatch( TK_ObjBatchItem *items, size_t numItems, TK_ObjDelegate *objDelegate,
+                         TK_ObjBatchDoneFunc fileDone, const TK_ObjJobSystem *jobs );
+
+// TK_ParseObjOutOfCore -- Parses a file that's too big to fit in memory, and emits it
+// through the delegate like TK_ParseObj (material(), then triangle() or triangleBatch()).
+//
+// The file is mapped instead of read, the vertex lists live in a memory mapped temp
+// file, and each material's triangles are gathered in a buffer and spilled to a temp
+// file of their own when it fills up, then streamed back a buffer at a time when it's
+// emitted. The buffers all come out of ramBudget bytes, so that (plus whatever pages
+// of the mappings the OS keeps resident) is the working set. Materials that fit in
+// their buffer never touch the disk. Temp files go in tempDir ($TMPDIR or /tmp if
+// NULL) and are unlinked right after they're made, so nothing is left behind.
+// scratchMem, arena, jobs, mortonOrder, computeBounds and weldTolerance in the delegate
+// are ignored. Returns 1 on success.
+// Needs mmap, on other platforms it calls error() and returns 0.
+int TK_ParseObjOutOfCore( const char *path, TK_ObjDelegate *objDelegate,
+                          const char *tempDir, size_t ramBudget );
+
+// TK_ParseObjShardFile -- TK_ParseObjShard for one byte range of a file, reading just
+// that range (plus the byte before it, and the rest of its last line) so each machine
+// only touches its own part of a shared file. Needs pread, like TK_ParseObjOutOfCore.
+TK_ObjShard *TK_ParseObjShardFile( const char *path, size_t begin, size_t end, TK_ObjDelegate *objDelegate );
+
+// TK_WriteObjFile -- TK_WriteObj into a malloc'd buffer, then out to path. Returns 1 on success.
+int TK_WriteObjFile( const char *path, TK_ObjGeometry *geom, const TK_ObjJobSystem *jobs );
+
+// TK_ObjStream -- Incremental parse, for when the file arrives a piece at a time (off
+// the network, or out of a decompressor) and the whole text is never in memory at once.
+// Feed the bytes in order, in pieces of any size, then TK_ObjStreamEnd finishes the
+// parse and emits the results through the delegate like TK_ParseObj (weldTolerance,
+// mortonOrder, computeBounds, triangleBatch and jobs all work). There's no prepass, so the vertex
+// lists and each material's triangles grow with realloc as they come in. Material
+// names are copied, so a piece can be reused as soon as TK_ObjStreamFeed returns.
+// In immediateMode the triangles are emitted from inside TK_ObjStreamFeed, and
+// material() is only told how many triangles the material had in what's been fed
+// so far. scratchMem and arena in the delegate are ignored.
+typedef struct TK_ObjStream TK_ObjStream;
+
+TK_ObjStream *TK_ObjStreamBegin( TK_ObjDelegate *objDelegate );
+
+// Returns 0 after a parse error or running out of memory, the rest is then ignored
+int TK_ObjStreamFeed( TK_ObjStream *stream, const void *data, size_t size );
+
+// Parses the last line, emits everything and frees the stream. Returns 1 on success.
+int TK_ObjStreamEnd( TK_ObjStream *stream );
+
+#endif // TK_OBJFILE_STDLIB
+
+#ifdef TK_OBJFILE_THREADS
+
+// TK_ObjThreadPool -- Simple persistent thread pool. Workers pull job indices from a
+// shared counter, so uneven jobs balance out. The thread calling parallelFor works
+// too, as worker 0. Only one parallelFor can run on a pool at a time, don't call it
+// from inside one of its own jobs.
+typedef struct TK_ObjThreadPool TK_ObjThreadPool;
+
+// numThreads includes the calling thread, 0 means one per core.
+TK_ObjThreadPool *TK_ObjThreadPoolCreate( size_t numThreads );
+void TK_ObjThreadPoolDestroy( TK_ObjThreadPool *pool );
+
+// Fills in a TK_ObjJobSystem that runs on the pool
+void TK_ObjThreadPoolJobSystem( TK_ObjThreadPool *pool, TK_ObjJobSystem *jobs );
+
+// TK_ParseObjCompressed -- Parses a file that's gzip or zstd compressed (or plain text,
+// it goes by the first few bytes) without ever inflating the whole thing. A thread
+// decompresses into a ring of ringSize bytes (0 for 4MB), split in four slots, and the
+// calling thread feeds each slot to a TK_ObjStream as it fills, so the parse overlaps
+// the decompression. Emits through the delegate like TK_ObjStreamEnd, the callbacks
+// all happen on the calling thread. gzip needs TK_OBJFILE_ZLIB and zstd needs
+// TK_OBJFILE_ZSTD, otherwise those files get an error(). Returns 1 on success.
+int TK_ParseObjCompressed( const char *path, TK_ObjDelegate *objDelegate, size_t ringSize );
+
+#endif // TK_OBJFILE_THREADS
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+// =========================================================
+//  C++ FRONT-END
+// =========================================================
+// tk::parseObj -- Same as TK_ParseObj, but calls methods on a visitor object
+// instead of going through function pointers, so the compiler can inline the
+// per-triangle work into the emit loop. The visitor can implement any of:
+//
+//    void material( const char *mtlName, size_t numTriangles );
+//    void triangle( const TK_TriangleVert &a, const TK_TriangleVert &b, const TK_TriangleVert &c );
+//    void error( size_t lineNumber, const char *message );
+//
+// Methods that are missing are compiled out entirely (e.g. a visitor without triangle()
+// never expands the indexed triangles). Memory works the same as the C API, call it once
+// without scratchMem to get the size back, then again with the memory:
+//
+//    BBoxVisitor bbox;
+//    size_t scratchMemSize = tk::parseObj( objFileData, objFileSize, bbox );
+//    void *scratchMem = malloc( scratchMemSize );
+//    tk::parseObj( objFileData, objFileSize, bbox, scratchMem, scratchMemSize );
+//
+// The overload that takes a TK_ObjDelegate uses it for memory, options and stats,
+// its callbacks are ignored. (In immediateMode the visitor is called through the
+// delegate's function pointers, since it emits from inside the parser)
+#ifdef __cplusplus
+
+namespace tk {
+    
+namespace detail {
+
+template<bool B> struct Bool {};
+
+// Member detection, sizeof(char) if the visitor has the method
+template<class V> struct HasMaterial {
+    template<class U> static char test( int (*)[sizeof(((U*)0)->material( (const char*)0, (size_t)0 ), 1)] );
+    template<class U> static long test( ... );
+    enum { value = (sizeof(test<V>(0)) == sizeof(char)) };
+};
+
+template<class V> struct HasTriangle {
+    template<class U> static char test( int (*)[sizeof(((U*)0)->triangle( *(const TK_TriangleVert*)0,
+                                                                         *(const TK_TriangleVert*)0,
+                                                                         *(const TK_TriangleVert*)0 ), 1)] );
+    template<class U> static long test( ... );
+    enum { value = (sizeof(test<V>(0)) == sizeof(char)) };
+};
+
+template<class V> struct HasError {
+    template<class U> static char test( int (*)[sizeof(((U*)0)->error( (size_t)0, (const char*)0 ), 1)] );
+    template<class U> static long test( ... );
+    enum { value = (sizeof(test<V>(0)) == sizeof(char)) };
+};
+
+template<class V> void errorTrampoline( size_t lineNumber, const char *message, void *userData )
+{
+    ((V*)userData)->error( lineNumber, message );
 }
 
-// FIXME:(jbd) Remove this debug crap
-char *TKimpl_printMtl( char *mtlName )
+template<class V> void materialTrampoline( const char *mtlName, size_t numTriangles, void *userData )
 {
-    static char buff[256];
-    char *ch2 = buff;
-    for (char *ch=mtlName; TKimpl_isIdentifier( *ch ); ch++) {
-        *ch2++ = *ch;
-    }
-    *ch2 = '\0';
-    return buff;
+    ((V*)userData)->material( mtlName, numTriangles );
 }
 
-char *TKimpl_printToken( char *token, char *endtoken)
+template<class V> void triangleTrampoline( TK_TriangleVert a, TK_TriangleVert b, TK_TriangleVert c, void *userData )
 {
-    static char buff[256];
-    char *ch2 = buff;
-    for (char *ch=token; ch < endtoken; ch++) {
-        *ch2++ = *ch;
-    }
-    *ch2 = '\0';
-    return buff;
-    
+    ((V*)userData)->triangle( a, b, c );
 }
 
-char *TKimpl_stringDelimMtlName( char *dest, char *mtlName, size_t maxLen )
+template<class V> inline void setupError( TK_ObjDelegate &objDelegate, Bool<true> ) {
+    objDelegate.error = errorTrampoline<V>;
+}
+template<class V> inline void setupError( TK_ObjDelegate &objDelegate, Bool<false> ) {
+    objDelegate.error = 0;
+}
+
+// Immediate mode emits from inside the parser, so it has to go through the delegate
+template<class V> inline void setupImmediate( TK_ObjDelegate &objDelegate, Bool<true>, Bool<true> ) {
+    objDelegate.material = materialTrampoline<V>;
+    objDelegate.triangle = triangleTrampoline<V>;
+}
+template<class V> inline void setupImmediate( TK_ObjDelegate &objDelegate, Bool<true>, Bool<false> ) {
+    objDelegate.material = materialTrampoline<V>;
+}
+template<class V> inline void setupImmediate( TK_ObjDelegate &objDelegate, Bool<false>, Bool<true> ) {
+    objDelegate.triangle = triangleTrampoline<V>;
+}
+template<class V> inline void setupImmediate( TK_ObjDelegate &, Bool<false>, Bool<false> ) {}
+
+template<class V> inline void emitMaterial( V &visitor, TKimpl_Material *mtl, Bool<true> )
 {
-    char *ch2 = dest;
-    for (char *ch=mtlName; TKimpl_isIdentifier( *ch ); ch++) {
-        *ch2++ = *ch;
-        if (ch2-dest >= (maxLen-1)) break;
-    }
-    *ch2 = '\0';
-    return dest;
+    char mtlName[TKIMPL_MAX_MATERIAL_NAME];
+    TKimpl_stringDelimMtlName( mtlName, mtl->mtlName, TKIMPL_MAX_MATERIAL_NAME );
+    visitor.material( mtlName, mtl->numTriangles );
 }
+template<class V> inline void emitMaterial( V &, TKimpl_Material *, Bool<false> ) {}
 
-void TKimpl_nextToken( char **out_token, char **out_endtoken, char *endline )
+template<class V> inline void emitTriangles( V &visitor, TKimpl_Geometry *geom, TKimpl_Material *mtl, Bool<true> )
 {
-    char *token = *out_token;
-    char *endtoken = *out_endtoken;
-    
-    while (((*endtoken=='\n')||(*endtoken == ' ')) && (endtoken < endline)) {
-        endtoken++;
-    }
-    token = endtoken;
-    if (token >= endline) {
-        *out_token = NULL;
-        *out_endtoken = NULL;
-        return;
-    }
+    // Fetch in small batches so the visitor call sits in a tight loop
+    TK_ObjCursor cursor;
+    TK_ObjCursorOpen( &cursor, geom, mtl - geom->materials );
     
-    while ((endtoken < endline) && (*endtoken != ' ')) {
-        endtoken++;
+    TK_Triangle batch[64];
+    size_t count;
+    while ((count = TK_ObjCursorFetch( &cursor, batch, 64 )) > 0) {
+        for (size_t bi=0; bi < count; bi++) {
+            visitor.triangle( batch[bi].vertA, batch[bi].vertB, batch[bi].vertC );
+        }
     }
-    
-    *out_token = token;
-    *out_endtoken = endtoken;
 }
+template<class V> inline void emitTriangles( V &, TKimpl_Geometry *, TKimpl_Material *, Bool<false> ) {}
 
-long TKimpl_parseIndex( char *token, char *endtoken )
+} // namespace detail
+
+template<class Visitor>
+void parseObj( void *objFileData, size_t objFileSize, Visitor &visitor, TK_ObjDelegate &objDelegate )
 {
-    long result = 0;
-    long sign = 1;
-    for (char *ch = token; ch < endtoken; ch++) {
-        if (*ch=='-') {
-            sign = -1;
-        } else if ((*ch>='0')&&(*ch<='9')) {
-            int val = *ch - '0';
-            result = (result * 10) + val;
+    const bool hasMaterial = detail::HasMaterial<Visitor>::value;
+    const bool hasTriangle = detail::HasTriangle<Visitor>::value;
+    
+    objDelegate.material = 0;
+    objDelegate.triangle = 0;
+    objDelegate.userData = (void*)&visitor;
+    detail::setupError<Visitor>( objDelegate, detail::Bool<detail::HasError<Visitor>::value>() );
+    if (objDelegate.immediateMode) {
+        detail::setupImmediate<Visitor>( objDelegate, detail::Bool<hasMaterial>(), detail::Bool<hasTriangle>() );
+    }
+    
+    TK_ObjGeometry *geom = TK_ParseObjGeometry( objFileData, objFileSize, &objDelegate );
+    if ((!geom) || (objDelegate.immediateMode) || (!hasMaterial && !hasTriangle)) return;
+    
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        TKimpl_Material *mtl = geom->materials + mi;
+        if (mtl->numTriangles > 0) {
+            detail::emitMaterial( visitor, mtl, detail::Bool<hasMaterial>() );
+            detail::emitTriangles( visitor, geom, mtl, detail::Bool<hasTriangle>() );
         }
     }
-    return sign * result;
 }
 
-void TKimpl_parseFaceIndices( char *token, char *endtoken,
-                             ssize_t *pndx, ssize_t *stndx, ssize_t *nndx)
+// Returns scratchMemSize, so calling it without scratchMem returns the size needed
+template<class Visitor>
+size_t parseObj( void *objFileData, size_t objFileSize, Visitor &visitor,
+                 void *scratchMem = 0, size_t scratchMemSize = 0 )
 {
-    // count slashes and find numeric tokens
-    int numSlash = 0;
-    char *numberDelim[4];
-    long number[3];
-    numberDelim[0] = token;
-    for (char *ch = token; ch < endtoken; ch++) {
-        if (*ch=='/') {
+    TK_ObjDelegate objDelegate = {};
+    objDelegate.scratchMem = scratchMem;
+    objDelegate.scratchMemSize = scratchMemSize;
+    parseObj( objFileData, objFileSize, visitor, objDelegate );
+    return objDelegate.scratchMemSize;
+}
+
+} // namespace tk
+
+#endif // __cplusplus
+
+// =========================================================
+//  IMPLEMENTATION
+// =========================================================
+#ifdef TK_OBJFILE_IMPLEMENTATION
+
+// NOTE: This uses a custom version of strtof (it's correctly rounded, so TK_WriteObj
+// output reads back exactly, and about as good as the stdlib one now). A few
+// people have told me that this is silly, there's no reason to avoid strtof or atof
+// from the cstdlib. They're probably right, there's no real compelling reason to avoid
+// the C stdlib, but since I'm doing this mostly for my own exercise I want to keep to
+// the "zero dependancies, from scratch" philosophy.
+//
+// However, if you prefer to use the stdlib strtof, you can simply add:
+//    #define TK_STRTOF strtof
+// before you include tk_objfile and it will happily use that instead (or define
+// it to be your own implementation).
+#ifndef TK_STRTOF
+#define TK_STRTOF TKimpl_stringToFloat
+#endif
+
+// The triangle expansion uses SSE2 (and AVX for the stores, if it's enabled) on x86.
+// Define TK_OBJFILE_NO_SIMD to always use the plain C version.
+#if !defined(TK_OBJFILE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)))
+#define TKIMPL_SIMD_SSE2 (1)
+#include <emmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+#endif
+
+// Extra floats on the end of the pos and nrm lists, so the SIMD
+// expansion can load a whole 4-wide vector for the last vertex.
+#define TKIMPL_VERT_PADDING (1)
+
+// TKImpl_ParseType
+typedef enum {
+    TKimpl_ParseTypeCountOnly,
+    TKimpl_ParseTypeFull,
+} TKimpl_ParseType;
+
+// TKimpl_ParseState -- Where a pass left off, so the next piece of the file can pick
+// up from there (for TK_ObjStream). Each pass over the whole file starts fresh.
+#define TKIMPL_NO_MATERIAL ((size_t)-1)
+typedef struct {
+    size_t currMtl;     // index of the usemtl material
+    size_t emitMtl;     // last material reported in immediateMode, or TKIMPL_NO_MATERIAL
+    size_t lineNumber;
+    size_t shardMtl;    // for shards, the slot the next usemtl takes (0 to look names up)
+} TKimpl_ParseState;
+
+// TKimpl_CountHint -- Counts from a "# tk_counts" header (TK_WriteObj writes one), so
+// the full pass can be sized without the count pass. The full pass checks everything
+// against the file as it goes, and sets failed if the header turns out to be wrong.
+typedef struct {
+    size_t numVerts, numSts, numNorms, numFaces, numTriangles;
+    size_t numMtls;
+    size_t mtlTriangles[TKIMPL_MAX_UNIQUE_MTLS];
+    
+    // What the full pass actually saw, skipped lines included
+    size_t seenSts, seenNorms, seenFaces;
+    int failed;
+} TKimpl_CountHint;
+
+#define TKIMPL_DEFAULT_MTL_NAME "mtl.default " // trailing space is intentional
+
+// TKimpl_InSitu -- What the count pass finds out about storing the lists over the text.
+// Each slack is the smallest (end of the text the item came from) - (end of the item
+// if the list started at 0) over the list, so a list can start anywhere up to its slack
+// without catching up to text that hasn't been read yet.
+#define TKIMPL_MAX_SLACK ((ptrdiff_t)(~(size_t)0 >> 1))
+typedef struct {
+    ptrdiff_t posSlack, stSlack, nrmSlack;
+    ptrdiff_t mtlSlack[TKIMPL_MAX_UNIQUE_MTLS];
+} TKimpl_InSitu;
+
+// All arena allocations are aligned to this
+#define TKIMPL_ARENA_ALIGN (16)
+
+// Arena space for an allocation, including the alignment padding
+#define TKimpl_ArenaSize(size) (((size) + (TKIMPL_ARENA_ALIGN-1)) & ~(size_t)(TKIMPL_ARENA_ALIGN-1))
+
+void TK_ObjArenaInit( TK_ObjArena *arena, void *buffer, size_t bufferSize )
+{
+    arena->alloc = NULL;
+    arena->free = NULL;
+    arena->allocUserData = NULL;
+    arena->chunkSize = 0;
+    
+    arena->buffer = (uint8_t*)buffer;
+    arena->bufferSize = buffer ? bufferSize : 0;
+    arena->chunks = NULL;
+    TK_ObjArenaReset( arena );
+}
+
+void TK_ObjArenaReset( TK_ObjArena *arena )
+{
+    arena->currChunk = NULL;
+    arena->top = arena->buffer;
+    arena->remaining = arena->bufferSize;
+}
+
+void TK_ObjArenaRelease( TK_ObjArena *arena )
+{
+    TK_ObjArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        TK_ObjArenaChunk *next = chunk->next;
+        arena->free( chunk, sizeof(TK_ObjArenaChunk) + chunk->size, arena->allocUserData );
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    TK_ObjArenaReset( arena );
+}
+
+void *TK_ObjArenaPush( TK_ObjArena *arena, size_t size )
+{
+    size_t padding = (TKIMPL_ARENA_ALIGN - ((uintptr_t)arena->top & (TKIMPL_ARENA_ALIGN-1))) & (TKIMPL_ARENA_ALIGN-1);
+    if ((!arena->top) || (padding + size > arena->remaining)) {
+        
+        // Doesn't fit, move on to the next chunk that's big enough
+        size_t needed = size + TKIMPL_ARENA_ALIGN;
+        TK_ObjArenaChunk *chunk = arena->currChunk ? arena->currChunk->next : arena->chunks;
+        while ((chunk) && (chunk->size < needed)) {
+            chunk = chunk->next;
+        }
+        
+        // or grow a new one on the end
+        if (!chunk) {
+            if (!arena->alloc) return NULL;
+            
+            size_t chunkSize = (needed > arena->chunkSize) ? needed : arena->chunkSize;
+            chunk = (TK_ObjArenaChunk*)arena->alloc( sizeof(TK_ObjArenaChunk) + chunkSize,
+                                                     arena->allocUserData );
+            if (!chunk) return NULL;
+            chunk->next = NULL;
+            chunk->size = chunkSize;
+            
+            TK_ObjArenaChunk **link = &(arena->chunks);
+            while (*link) link = &((*link)->next);
+            *link = chunk;
+        }
+        
+        arena->currChunk = chunk;
+        arena->top = (uint8_t*)(chunk+1);
+        arena->remaining = chunk->size;
+        padding = (TKIMPL_ARENA_ALIGN - ((uintptr_t)arena->top & (TKIMPL_ARENA_ALIGN-1))) & (TKIMPL_ARENA_ALIGN-1);
+    }
+    
+    void *result = (void*)(arena->top + padding);
+    arena->top += padding + size;
+    arena->remaining -= padding + size;
+    
+    return result;
+}
+
+TK_ObjArenaMark TK_ObjArenaGetMark( TK_ObjArena *arena )
+{
+    TK_ObjArenaMark mark;
+    mark.currChunk = arena->currChunk;
+    mark.top = arena->top;
+    mark.remaining = arena->remaining;
+    return mark;
+}
+
+void TK_ObjArenaRewind( TK_ObjArena *arena, TK_ObjArenaMark mark )
+{
+    arena->currChunk = mark.currChunk;
+    arena->top = mark.top;
+    arena->remaining = mark.remaining;
+}
+
+#define TKImpl_PushStruct(arena,T) (T*)TK_ObjArenaPush(arena,sizeof(T))
+#define TKImpl_PushStructArray(arena,T,num) (T*)TK_ObjArenaPush(arena,sizeof(T)*(num))
+
+
+int TKimpl_isIdentifier( char ch ) {
+    if (ch=='\0'||ch==' '||ch=='\n'||ch=='\t'||ch=='\r') return 0;
+    return 1;
+}
+
+char *TKimpl_stringDelimMtlName( char *dest, char *mtlName, size_t maxLen )
+{
+    char *ch2 = dest;
+    for (char *ch=mtlName; TKimpl_isIdentifier( *ch ); ch++) {
+        *ch2++ = *ch;
+        if ((size_t)(ch2-dest) >= (maxLen-1)) break;
+    }
+    *ch2 = '\0';
+    return dest;
+}
+
+void TKimpl_nextToken( char **out_token, char **out_endtoken, char *endline )
+{
+    char *token = *out_token;
+    char *endtoken = *out_endtoken;
+    
+    while (((*endtoken=='\n')||(*endtoken == ' ')) && (endtoken < endline)) {
+        endtoken++;
+    }
+    token = endtoken;
+    if (token >= endline) {
+        *out_token = NULL;
+        *out_endtoken = NULL;
+        return;
+    }
+    
+    while ((endtoken < endline) && (*endtoken != ' ')) {
+        endtoken++;
+    }
+    
+    *out_token = token;
+    *out_endtoken = endtoken;
+}
+
+long TKimpl_parseIndex( char *token, char *endtoken )
+{
+    long result = 0;
+    long sign = 1;
+    for (char *ch = token; ch < endtoken; ch++) {
+        if (*ch=='-') {
+            sign = -1;
+        } else if ((*ch>='0')&&(*ch<='9')) {
+            int val = *ch - '0';
+            result = (result * 10) + val;
+        }
+    }
+    return sign * result;
+}
+
+// Returns the TK_ObjAttrib flags of the indices the corner gives (the rest are 0)
+int TKimpl_parseFaceIndices( char *token, char *endtoken,
+                             ptrdiff_t *pndx, ptrdiff_t *stndx, ptrdiff_t *nndx)
+{
+    // count slashes and find numeric tokens
+    int numSlash = 0;
+    char *numberDelim[4];
+    long number[3];
+    numberDelim[0] = token;
+    for (char *ch = token; ch < endtoken; ch++) {
+        if (*ch=='/') {
             numSlash++;
             numberDelim[numSlash] = ch+1;
         }
@@ -288,6 +1228,11 @@ void TKimpl_parseFaceIndices( char *token, char *endtoken,
         if (stndx) *stndx = number[1];
         if (nndx) *nndx = number[2];
     }
+    
+    int given = 0;
+    if ((stndx) && (numSlash >= 1) && (numberDelim[2]-1 > numberDelim[1])) given |= TK_ObjAttrib_St;
+    if ((nndx) && (numSlash == 2) && (endtoken > numberDelim[2])) given |= TK_ObjAttrib_Nrm;
+    return given;
 }
 
 int TKimpl_compareToken( const char *target, char *token, char *endtoken )
@@ -330,38 +1275,271 @@ void TKimpl_memoryError( TK_ObjDelegate *objDelegate )
 }
 
 
-int TKimpl_isFloatChar( char ch )
+// Exact powers of ten in a double, for the fast path of TKimpl_stringToFloat
+static const double TKimpl_pow10[23] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline uint32_t TKimpl_floatBits( float f )
+{
+    union { float f; uint32_t u; } bits;
+    bits.f = f;
+    return bits.u;
+}
+
+static inline float TKimpl_bitsFloat( uint32_t u )
+{
+    union { float f; uint32_t u; } bits;
+    bits.u = u;
+    return bits.f;
+}
+
+// TKimpl_BigInt -- Just enough of a big integer to compare a long decimal against
+// a float midpoint exactly. Little endian 32-bit words.
+#define TKIMPL_BIGINT_WORDS (48)
+typedef struct {
+    uint32_t word[TKIMPL_BIGINT_WORDS];
+    size_t size;
+} TKimpl_BigInt;
+
+void TKimpl_bigIntMulAdd( TKimpl_BigInt *big, uint32_t mul, uint32_t add )
+{
+    uint64_t carry = add;
+    for (size_t i=0; i < big->size; i++) {
+        uint64_t value = (uint64_t)big->word[i] * mul + carry;
+        big->word[i] = (uint32_t)value;
+        carry = value >> 32;
+    }
+    if ((carry) && (big->size < TKIMPL_BIGINT_WORDS)) {
+        big->word[big->size++] = (uint32_t)carry;
+    }
+}
+
+void TKimpl_bigIntMulPow5( TKimpl_BigInt *big, int power )
+{
+    // 5^13 is the biggest that fits in 32 bits
+    for (; power >= 13; power -= 13) TKimpl_bigIntMulAdd( big, 1220703125u, 0 );
+    uint32_t mul = 1;
+    for (; power > 0; power--) mul *= 5;
+    TKimpl_bigIntMulAdd( big, mul, 0 );
+}
+
+void TKimpl_bigIntShiftLeft( TKimpl_BigInt *big, int bits )
+{
+    size_t words = bits / 32;
+    bits %= 32;
+    if (big->size + words + 1 > TKIMPL_BIGINT_WORDS) return;
+    
+    big->word[big->size] = 0;
+    for (size_t i=big->size + 1; i-- > 0; ) {
+        uint32_t value = big->word[i] << bits;
+        if ((bits) && (i > 0)) value |= big->word[i-1] >> (32 - bits);
+        big->word[i + words] = value;
+    }
+    for (size_t i=0; i < words; i++) big->word[i] = 0;
+    big->size += words + 1;
+    while ((big->size) && (!big->word[big->size-1])) big->size--;
+}
+
+int TKimpl_bigIntCompare( TKimpl_BigInt *a, TKimpl_BigInt *b )
+{
+    if (a->size != b->size) return (a->size < b->size) ? -1 : 1;
+    for (size_t i=a->size; i-- > 0; ) {
+        if (a->word[i] != b->word[i]) return (a->word[i] < b->word[i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Compares digits*10^exp10 (plus a little more, if sticky) with the midpoint between
+// the positive float with the given bits and the next float up
+int TKimpl_compareFloatMidpoint( TKimpl_BigInt *digits, int exp10, int sticky, uint32_t bits )
+{
+    uint32_t biasedExp = bits >> 23;
+    uint32_t mantissa = bits & 0x7fffff;
+    int exp2 = biasedExp ? (int)biasedExp - 150 : -149;
+    if (biasedExp) mantissa |= 0x800000;
+    
+    // digits * 5^exp10 * 2^exp10  vs  (2*mantissa+1) * 2^(exp2-1)
+    TKimpl_BigInt left = *digits;
+    TKimpl_BigInt right;
+    right.word[0] = 2*mantissa + 1;
+    right.size = 1;
+    if (exp10 >= 0) {
+        TKimpl_bigIntMulPow5( &left, exp10 );
+    } else {
+        TKimpl_bigIntMulPow5( &right, -exp10 );
+    }
+    int shift = exp10 - (exp2 - 1);
+    if (shift >= 0) {
+        TKimpl_bigIntShiftLeft( &left, shift );
+    } else {
+        TKimpl_bigIntShiftLeft( &right, -shift );
+    }
+    
+    int result = TKimpl_bigIntCompare( &left, &right );
+    return ((result == 0) && (sticky)) ? 1 : result;
+}
+
+// The slow path, for long or extreme numbers and ones that land right on a float
+// midpoint in double precision. Starts from a guess that's at most a float or two
+// off and walks to the correctly rounded float with exact comparisons. exp10 is
+// just the exponent after the 'e', the digits are read again here.
+float TKimpl_stringToFloatExact( const char *digitsStart, const char *digitsEnd, int exp10, float guess )
 {
-    if ( ((ch>='0')&&(ch<='9')) || (ch=='-') || (ch=='.')) return 1;
-    else return 0;
+    // Up to 120 significant digits, the midpoints between floats have fewer than that
+    TKimpl_BigInt digits;
+    digits.size = 0;
+    int numDigits = 0, sticky = 0, inDecimal = 0;
+    for (const char *ch=digitsStart; ch < digitsEnd; ch++) {
+        if (*ch == '.') {
+            inDecimal = 1;
+            continue;
+        }
+        int digit = *ch - '0';
+        if ((!numDigits) && (!digit)) {
+            if (inDecimal) exp10--;
+        } else if (numDigits < 120) {
+            TKimpl_bigIntMulAdd( &digits, 10, digit );
+            numDigits++;
+            if (inDecimal) exp10--;
+        } else {
+            if (digit) sticky = 1;
+            if (!inDecimal) exp10++;
+        }
+    }
+    
+    uint32_t bits = TKimpl_floatBits( guess ) & 0x7fffffff;
+    for (;;) {
+        if (bits < 0x7f800000) {
+            int cmp = TKimpl_compareFloatMidpoint( &digits, exp10, sticky, bits );
+            if ((cmp > 0) || ((cmp == 0) && (bits & 1))) {
+                bits++;
+                continue;
+            }
+        }
+        if (bits > 0) {
+            int cmp = TKimpl_compareFloatMidpoint( &digits, exp10, sticky, bits - 1 );
+            if ((cmp < 0) || ((cmp == 0) && (bits & 1))) {
+                bits--;
+                continue;
+            }
+        }
+        break;
+    }
+    return TKimpl_bitsFloat( bits );
 }
 
+// Correctly rounded, so it reads back exactly what TK_WriteObj writes. Takes the
+// usual [+-]digits[.digits][e[+-]digits], and inf and nan.
 float TKimpl_stringToFloat( char *str, char **str_end )
 {
     char *ch = str;
-    float value = 0.0;
-    float mag= 0.1;
-    float sign = 1.0;
-    int inDecimal = 0;
-    while (TKimpl_isFloatChar(*ch)) {
-        
-        if (*ch=='-') {
-            sign = -1.0;
-        } else if (*ch=='.') {
+    int negative = 0;
+    if ((*ch == '-') || (*ch == '+')) {
+        negative = (*ch == '-');
+        ch++;
+    }
+    
+    if ((ch[0] == 'i') && (ch[1] == 'n') && (ch[2] == 'f')) {
+        if (str_end) *str_end = ch + 3;
+        return TKimpl_bitsFloat( negative ? 0xff800000 : 0x7f800000 );
+    } else if ((ch[0] == 'n') && (ch[1] == 'a') && (ch[2] == 'n')) {
+        if (str_end) *str_end = ch + 3;
+        return TKimpl_bitsFloat( negative ? 0xffc00000 : 0x7fc00000 );
+    }
+    
+    // The first 19 significant digits go in the mantissa, past that they're only
+    // needed by the slow path
+    char *digitsStart = ch;
+    uint64_t mantissa = 0;
+    int numDigits = 0, exp10 = 0, truncated = 0, anyDigits = 0, inDecimal = 0;
+    for (;; ch++) {
+        if ((*ch == '.') && (!inDecimal)) {
             inDecimal = 1;
-        } else if ((*ch>='0') && (*ch<='9')) {
-            float digitValue = (float)((*ch)-'0');
-            if (inDecimal) {
-                value = (value + digitValue*mag);
-                mag /= 10.0;
-            } else {
-                value = (value*10.0) + digitValue;
+            continue;
+        }
+        if ((*ch < '0') || (*ch > '9')) break;
+        
+        int digit = *ch - '0';
+        anyDigits = 1;
+        if ((!numDigits) && (!digit)) {
+            if (inDecimal) exp10--;
+        } else if (numDigits < 19) {
+            mantissa = mantissa * 10 + digit;
+            numDigits++;
+            if (inDecimal) exp10--;
+        } else {
+            if (digit) truncated = 1;
+            if (!inDecimal) exp10++;
+        }
+    }
+    if (!anyDigits) {
+        if (str_end) *str_end = str;
+        return 0.0f;
+    }
+    char *digitsEnd = ch;
+    
+    int explicitExp = 0;
+    if ((*ch == 'e') || (*ch == 'E')) {
+        char *expStart = ch + 1;
+        int expNegative = 0;
+        if ((*expStart == '-') || (*expStart == '+')) {
+            expNegative = (*expStart == '-');
+            expStart++;
+        }
+        if ((*expStart >= '0') && (*expStart <= '9')) {
+            int exponent = 0;
+            for (ch = expStart; (*ch >= '0') && (*ch <= '9'); ch++) {
+                if (exponent < 100000) exponent = exponent * 10 + (*ch - '0');
             }
+            explicitExp = expNegative ? -exponent : exponent;
         }
-        ch++;
     }
     if (str_end) *str_end = ch;
-    return sign * value;
+    exp10 += explicitExp;
+    
+    float result;
+    if ((!mantissa) || (numDigits + exp10 < -46)) {
+        // Below half the smallest denormal
+        result = 0.0f;
+    } else if (numDigits + exp10 > 39) {
+        result = TKimpl_bitsFloat( 0x7f800000 );
+    } else if ((!truncated) && (mantissa <= ((uint64_t)1 << 24)) && (exp10 >= -10) && (exp10 <= 10)) {
+        // The common case, both exact in a float so one float op rounds correctly
+        result = (exp10 >= 0) ? (float)mantissa * (float)TKimpl_pow10[exp10] :
+                                (float)mantissa / (float)TKimpl_pow10[-exp10];
+    } else {
+        // Fast path, one correctly rounded double op. Rounding that again to a float is
+        // only off when the double lands exactly halfway between two floats.
+        int exact = 0;
+        double value;
+        if ((!truncated) && (mantissa <= ((uint64_t)1 << 53)) && (exp10 >= -22) && (exp10 <= 22)) {
+            exact = 1;
+            value = (exp10 >= 0) ? (double)mantissa * TKimpl_pow10[exp10] :
+                                   (double)mantissa / TKimpl_pow10[-exp10];
+        } else {
+            // Only needs to be close enough for a starting guess
+            value = (double)mantissa;
+            for (int e=exp10; e > 0; e -= 22) value *= TKimpl_pow10[(e < 22) ? e : 22];
+            for (int e=-exp10; e > 0; e -= 22) value /= TKimpl_pow10[(e < 22) ? e : 22];
+        }
+        result = (float)value;
+        
+        if (exact) {
+            uint32_t bits = TKimpl_floatBits( result );
+            if (bits >= 0x7f800000) {
+                exact = 0;
+            } else if ((double)result != value) {
+                float neighbor = TKimpl_bitsFloat( ((double)result < value) ? bits + 1 : bits - 1 );
+                if (value - (double)result == (double)neighbor - value) exact = 0;
+            }
+        }
+        if (!exact) {
+            result = TKimpl_stringToFloatExact( digitsStart, digitsEnd, explicitExp, result );
+        }
+    }
+    return negative ? -result : result;
 }
 
 // Return 1 on success, 0 on failure
@@ -394,16 +1572,96 @@ int TKimpl_parseFloat( TK_ObjDelegate *objDelegate, char *token, char *endtoken,
 }
 
 
-void TKimpl_ParseObjPass( void *objFileData, size_t objFileSize,
+void TKimpl_GetIndexedTriangle( TK_Triangle *tri, TKimpl_Geometry *geom, TKimpl_IndexedTriangle ndxTri )
+{
+    tri->vertA.pos[0] = geom->vertPos[ndxTri.vertA.posIndex*3 + 0];
+    tri->vertA.pos[1] = geom->vertPos[ndxTri.vertA.posIndex*3 + 1];
+    tri->vertA.pos[2] = geom->vertPos[ndxTri.vertA.posIndex*3 + 2];
+    tri->vertA.nrm[0] = geom->vertNrm[ndxTri.vertA.normIndex*3 + 0];
+    tri->vertA.nrm[1] = geom->vertNrm[ndxTri.vertA.normIndex*3 + 1];
+    tri->vertA.nrm[2] = geom->vertNrm[ndxTri.vertA.normIndex*3 + 2];
+    tri->vertA.st[0] = geom->vertSt[ndxTri.vertA.stIndex*2 + 0];
+    tri->vertA.st[1] = geom->vertSt[ndxTri.vertA.stIndex*2 + 1];
+
+    tri->vertB.pos[0] = geom->vertPos[ndxTri.vertB.posIndex*3 + 0];
+    tri->vertB.pos[1] = geom->vertPos[ndxTri.vertB.posIndex*3 + 1];
+    tri->vertB.pos[2] = geom->vertPos[ndxTri.vertB.posIndex*3 + 2];
+    tri->vertB.nrm[0] = geom->vertNrm[ndxTri.vertB.normIndex*3 + 0];
+    tri->vertB.nrm[1] = geom->vertNrm[ndxTri.vertB.normIndex*3 + 1];
+    tri->vertB.nrm[2] = geom->vertNrm[ndxTri.vertB.normIndex*3 + 2];
+    tri->vertB.st[0] = geom->vertSt[ndxTri.vertB.stIndex*2 + 0];
+    tri->vertB.st[1] = geom->vertSt[ndxTri.vertB.stIndex*2 + 1];
+
+    tri->vertC.pos[0] = geom->vertPos[ndxTri.vertC.posIndex*3 + 0];
+    tri->vertC.pos[1] = geom->vertPos[ndxTri.vertC.posIndex*3 + 1];
+    tri->vertC.pos[2] = geom->vertPos[ndxTri.vertC.posIndex*3 + 2];
+    tri->vertC.nrm[0] = geom->vertNrm[ndxTri.vertC.normIndex*3 + 0];
+    tri->vertC.nrm[1] = geom->vertNrm[ndxTri.vertC.normIndex*3 + 1];
+    tri->vertC.nrm[2] = geom->vertNrm[ndxTri.vertC.normIndex*3 + 2];
+    tri->vertC.st[0] = geom->vertSt[ndxTri.vertC.stIndex*2 + 0];
+    tri->vertC.st[1] = geom->vertSt[ndxTri.vertC.stIndex*2 + 1];
+}
+
+// Emits one triangle straight from the full pass, for immediateMode. given has the
+// TK_ObjAttrib flags of the indices each corner had in the file.
+void TKimpl_EmitImmediate( TKimpl_Geometry *geom, TKimpl_Material *mtl, TKimpl_Material **emitMtl,
+                           TKimpl_IndexedTriangle *ndxTri, const int *given, TK_ObjDelegate *objDelegate )
+{
+    // Everything has to be defined before the face that uses it, since we
+    // haven't seen the rest of the file yet. Missing st and nrm indices use
+    // the default entry, which is always there.
+    TKimpl_IndexedVert *ndxVerts = &(ndxTri->vertA);
+    for (int vi=0; vi < 3; vi++) {
+        if ( ((size_t)ndxVerts[vi].posIndex >= geom->numVertPos) ||
+             ((given[vi] & TK_ObjAttrib_St) && ((size_t)ndxVerts[vi].stIndex >= geom->numVertSt)) ||
+             ((given[vi] & TK_ObjAttrib_Nrm) && ((size_t)ndxVerts[vi].normIndex >= geom->numVertNrm)) ) {
+            if (objDelegate->error) {
+                objDelegate->error( objDelegate->currentLineNumber,
+                                   "Face uses a vertex that isn't defined yet.",
+                                   objDelegate->userData );
+            }
+            return;
+        }
+    }
+    
+    // Report material switches as they happen
+    if (mtl != *emitMtl) {
+        *emitMtl = mtl;
+        if (objDelegate->material) {
+            char mtlName[TKIMPL_MAX_MATERIAL_NAME];
+            TKimpl_stringDelimMtlName( mtlName, mtl->mtlName, TKIMPL_MAX_MATERIAL_NAME );
+            objDelegate->material( mtlName, mtl->numTriangles, objDelegate->userData );
+        }
+    }
+    
+    if (objDelegate->triangle) {
+        TK_Triangle tri;
+        TKimpl_GetIndexedTriangle( &tri, geom, *ndxTri );
+        objDelegate->triangle( tri.vertA, tri.vertB, tri.vertC, objDelegate->userData );
+    }
+}
+
+static inline void TKimpl_inSituSlack( ptrdiff_t *slack, ptrdiff_t textEnd, size_t listEnd )
+{
+    ptrdiff_t itemSlack = textEnd - (ptrdiff_t)listEnd;
+    if (itemSlack < *slack) *slack = itemSlack;
+}
+
+// Returns 0 if it stopped on an error. state is NULL to parse a whole file, or picks
+// up where the last piece left off and is updated to continue with the next. With a
+// hint, the full pass finds the materials itself and stops if the hint is wrong.
+int TKimpl_ParseObjPass( void *objFileData, size_t objFileSize,
                          TKimpl_Geometry *geom,
                          TKimpl_Material *uniqueMtls, size_t *numUniqueMtls,
-                         TK_ObjDelegate *objDelegate, TKimpl_ParseType parseType )
+                         TK_ObjDelegate *objDelegate, TKimpl_ParseType parseType,
+                         TKimpl_ParseState *state, TKimpl_CountHint *hint, TKimpl_InSitu *inSitu )
 {
     // Make default material
     TKimpl_Material *currMtl = NULL;
-    if (parseType == TKimpl_ParseTypeCountOnly)
+    TKimpl_Material *emitMtl = NULL;
+    if ((parseType == TKimpl_ParseTypeCountOnly) && (*numUniqueMtls == 0))
     {
-        uniqueMtls[0].mtlName = (char *)"mtl.default "; // trailing space is intentional
+        uniqueMtls[0].mtlName = (char *)TKIMPL_DEFAULT_MTL_NAME;
         uniqueMtls[0].numTriangles = 0;
         (*numUniqueMtls)++;
     }
@@ -412,17 +1670,23 @@ void TKimpl_ParseObjPass( void *objFileData, size_t objFileSize,
     // Reset the delegate state
     objDelegate->currentLineNumber = 1;
     
+    if (state) {
+        currMtl = &uniqueMtls[state->currMtl];
+        emitMtl = (state->emitMtl == TKIMPL_NO_MATERIAL) ? NULL : &uniqueMtls[state->emitMtl];
+        objDelegate->currentLineNumber = state->lineNumber;
+    }
+    
     // Split file into lines
     char *start = (char*)objFileData;
     char *line = start;
     char *endline = line;
     
-    while (line - start < objFileSize)
+    while ((size_t)(line - start) < objFileSize)
     {
         // Advance to the next endline
         do {
             endline++;
-        } while ((*endline) && (*endline!='\n') && (endline - start < objFileSize));
+        } while (((size_t)(endline - start) < objFileSize) && (*endline) && (*endline!='\n'));
         
         // skip leading whitespace
         while ( ((*line==' ') || (*line=='\t')) && (line != endline)) {
@@ -447,28 +1711,41 @@ void TKimpl_ParseObjPass( void *objFileData, size_t objFileSize,
                     {
                         // Just count the vert
                         objDelegate->numVerts++;
+                        if (inSitu) {
+                            TKimpl_inSituSlack( &(inSitu->posSlack), endline - start, sizeof(float)*3*objDelegate->numVerts );
+                        }
                     }
                     else
                     {
                         // v X Y Z -- vertex position
-                        float *vertPos = geom->vertPos + (geom->numVertPos*3);
+                        if ((hint) && (geom->numVertPos >= hint->numVerts)) {
+                            hint->failed = 1;
+                            return 0;
+                        }
+                        // Parsed before it's stored, in situ it can land on the line itself
+                        float vertPos[3];
                         
                         TKimpl_nextToken( &token, &endtoken, endline);
                         if (!TKimpl_parseFloat( objDelegate, token, endtoken, &(vertPos[0]) )) {
-                            return;
+                            return 0;
                         }
 
                         TKimpl_nextToken( &token, &endtoken, endline);
                         if (!TKimpl_parseFloat( objDelegate, token, endtoken, &(vertPos[1]) )) {
-                            return;
+                            return 0;
                         }
                         
                         TKimpl_nextToken( &token, &endtoken, endline);
                         if (!TKimpl_parseFloat( objDelegate, token, endtoken, &(vertPos[2]) )) {
-                            return;
+                            return 0;
                         }
                         
+                        float *dest = geom->vertPos + (geom->numVertPos*3);
+                        dest[0] = vertPos[0];
+                        dest[1] = vertPos[1];
+                        dest[2] = vertPos[2];
                         geom->numVertPos++;
+                        if (geom->inSitu) break;
                     }
                     
                 } else if (TKimpl_compareToken("vn", token, endtoken)) {
@@ -476,62 +1753,114 @@ void TKimpl_ParseObjPass( void *objFileData, size_t objFileSize,
                     if (parseType==TKimpl_ParseTypeCountOnly)
                     {
                         objDelegate->numNorms++;
+                        if ((inSitu) && (!(objDelegate->skipAttribs & TK_ObjAttrib_Nrm))) {
+                            TKimpl_inSituSlack( &(inSitu->nrmSlack), endline - start, sizeof(float)*3*objDelegate->numNorms );
+                        }
+                    }
+                    else if ((hint) && (hint->seenNorms++ >= hint->numNorms))
+                    {
+                        hint->failed = 1;
+                        return 0;
+                    }
+                    else if (objDelegate->skipAttribs & TK_ObjAttrib_Nrm)
+                    {
+                        // not wanted, skip the rest of the line
+                        break;
                     }
                     else
                     {
                         // vn X Y Z -- vertex normal
-                        float *vertNrm = geom->vertNrm + (geom->numVertNrm*3);
+                        float vertNrm[3];
                         
                         TKimpl_nextToken( &token, &endtoken, endline);
                         if (!TKimpl_parseFloat( objDelegate, token, endtoken, &(vertNrm[0]) )) {
-                            return;
+                            return 0;
                         }
                         
                         TKimpl_nextToken( &token, &endtoken, endline);
                         if (!TKimpl_parseFloat( objDelegate, token, endtoken, &(vertNrm[1]) )) {
-                            return;
+                            return 0;
                         }
                         
                         TKimpl_nextToken( &token, &endtoken, endline);
                         if (!TKimpl_parseFloat( objDelegate, token, endtoken, &(vertNrm[2]) )) {
-                            return;
+                            return 0;
                         }
                         
+                        float *dest = geom->vertNrm + (geom->numVertNrm*3);
+                        dest[0] = vertNrm[0];
+                        dest[1] = vertNrm[1];
+                        dest[2] = vertNrm[2];
                         geom->numVertNrm++;
+                        if (geom->inSitu) break;
                     }
                 } else if (TKimpl_compareToken("vt", token, endtoken)) {
                     
                     if (parseType==TKimpl_ParseTypeCountOnly)
                     {
                         objDelegate->numSts++;
+                        if ((inSitu) && (!(objDelegate->skipAttribs & TK_ObjAttrib_St))) {
+                            TKimpl_inSituSlack( &(inSitu->stSlack), endline - start, sizeof(float)*2*objDelegate->numSts );
+                        }
                     }
-                    else
+                    else if ((hint) && (hint->seenSts++ >= hint->numSts))
                     {
-                        // vn S T -- vertex texture coord
-                        float *vertSt = geom->vertSt + (geom->numVertSt*2);
+                        hint->failed = 1;
+                        return 0;
+                    }
+                    else if (objDelegate->skipAttribs & TK_ObjAttrib_St)
+                    {
+                        break;
+                    }
+                    else
+                    {
+                        // vt S T -- vertex texture coord
+                        float vertSt[2];
 
                         TKimpl_nextToken( &token, &endtoken, endline);
                         if (!TKimpl_parseFloat( objDelegate, token, endtoken, &(vertSt[0]) )) {
-                            return;
+                            return 0;
                         }
                         
                         TKimpl_nextToken( &token, &endtoken, endline);
                         if (!TKimpl_parseFloat( objDelegate, token, endtoken, &(vertSt[1]) )) {
-                            return;
+                            return 0;
                         }
 
+                        float *dest = geom->vertSt + (geom->numVertSt*2);
+                        dest[0] = vertSt[0];
+                        dest[1] = vertSt[1];
                         geom->numVertSt++;
+                        if (geom->inSitu) break;
                     }
                 } else if (TKimpl_compareToken("usemtl", token, endtoken)) {
                     
-                    // usemtl, is this an existing mtl group or a new one?
+                    // usemtl, is this an existing mtl group or a new one? (a missing
+                    // name is an empty one)
                     TKimpl_nextToken( &token, &endtoken, endline);
+                    if (!token) token = endtoken = endline;
                     
                     TKimpl_Material *useMtl = NULL;
-                    for (int i=1; i < *numUniqueMtls; i++) {
+                    if ((state) && (state->shardMtl)) {
+                        // A shard can't know which names the shards before it used, so
+                        // every usemtl gets its own slot and the merge matches them up
+                        if (state->shardMtl >= TKIMPL_MAX_UNIQUE_MTLS) {
+                            if (objDelegate->error) {
+                                objDelegate->error( objDelegate->currentLineNumber, "Too many materials.",
+                                                    objDelegate->userData );
+                            }
+                            return 0;
+                        }
+                        useMtl = &uniqueMtls[state->shardMtl++];
+                        if (parseType==TKimpl_ParseTypeCountOnly) {
+                            (*numUniqueMtls)++;
+                            useMtl->numTriangles = 0;
+                            useMtl->mtlName = token;
+                        }
+                    }
+                    for (size_t i=1; (!useMtl) && (i < *numUniqueMtls); i++) {
                         if (TKimpl_compareMtlName( uniqueMtls[i].mtlName, token )) {
                             useMtl = &uniqueMtls[i];
-                            break;
                         }
                     }
                     if ((!useMtl) && (parseType==TKimpl_ParseTypeCountOnly)) {
@@ -539,53 +1868,90 @@ void TKimpl_ParseObjPass( void *objFileData, size_t objFileSize,
                         useMtl = &uniqueMtls[(*numUniqueMtls)++];
                         useMtl->numTriangles = 0;
                         useMtl->mtlName = token;
+                    } else if ((!useMtl) && (hint)) {
+                        // New materials take the header's slots in order
+                        if (*numUniqueMtls >= hint->numMtls) {
+                            hint->failed = 1;
+                            return 0;
+                        }
+                        useMtl = &uniqueMtls[(*numUniqueMtls)++];
+                        useMtl->mtlName = token;
                     }
                     currMtl = useMtl;
 
                 } else if (TKimpl_compareToken("f", token, endtoken)) {
                     TKimpl_IndexedTriangle tri;
                     TKimpl_IndexedVert vert;
+                    int triGiven[3];
                     int count = 0;
+                    
+                    // Skipped attributes all point at the zeroed default entry
+                    int skipSt = (objDelegate->skipAttribs & TK_ObjAttrib_St);
+                    int skipNrm = (objDelegate->skipAttribs & TK_ObjAttrib_Nrm);
+                    vert.stIndex = 0;
+                    vert.normIndex = 0;
                     do {
                         TKimpl_nextToken( &token, &endtoken, endline );
                         if (token) {
                             if (parseType==TKimpl_ParseTypeFull)
                             {
-                                TKimpl_parseFaceIndices(token, endtoken,
-                                                        &(vert.posIndex),
-                                                        &(vert.stIndex),
-                                                        &(vert.normIndex) );
+                                int given = TKimpl_parseFaceIndices(token, endtoken,
+                                                                    &(vert.posIndex),
+                                                                    skipSt ? NULL : &(vert.stIndex),
+                                                                    skipNrm ? NULL : &(vert.normIndex) );
 
                                 if (vert.posIndex < 0) {
-                                   vert.posIndex = geom->numVertPos + vert.posIndex;
+                                   vert.posIndex = geom->numVertPos + vert.posIndex + geom->relativeBias;
                                 }
 
                                 if (vert.stIndex < 0) {
-                                   vert.stIndex = geom->numVertSt + vert.stIndex;
+                                   vert.stIndex = geom->numVertSt + vert.stIndex + geom->relativeBias;
                                 }
 
                                 if (vert.normIndex < 0) {
-                                   vert.normIndex = geom->numVertNrm + vert.normIndex;
+                                   vert.normIndex = geom->numVertNrm + vert.normIndex + geom->relativeBias;
                                 }
 
                                 if (count==0) {
                                     tri.vertA = vert;
+                                    triGiven[0] = given;
                                 } else if (count==1) {
                                     tri.vertB = vert;
+                                    triGiven[1] = given;
                                 } else if (count >= 3) {
                                     tri.vertB = tri.vertC;
+                                    triGiven[1] = triGiven[2];
                                 }
                                 
                                 if (count >= 2) {
                                     tri.vertC = vert;
-                                    currMtl->triangles[ currMtl->numTriangles++ ] = tri;
+                                    triGiven[2] = given;
+                                    if (objDelegate->immediateMode) {
+                                        TKimpl_EmitImmediate( geom, currMtl, &emitMtl, &tri, triGiven, objDelegate );
+                                    } else if (geom->triangleSink) {
+                                        geom->triangleSink( geom->sinkData, currMtl - uniqueMtls, &tri );
+                                        currMtl->numTriangles++;
+                                    } else if ((hint) && (currMtl->numTriangles >= hint->mtlTriangles[currMtl - uniqueMtls])) {
+                                        hint->failed = 1;
+                                        return 0;
+                                    } else {
+                                        TKimpl_StoreIndexedTriangle( geom, currMtl, currMtl->numTriangles++, &tri );
+                                    }
                                 }
+                            } else if ((inSitu) && (count >= 2)) {
+                                // The triangle's stored once its last corner has been read
+                                size_t triIndex = currMtl->numTriangles + (count - 2);
+                                TKimpl_inSituSlack( inSitu->mtlSlack + (currMtl - uniqueMtls), endtoken - start,
+                                                    sizeof(TKimpl_CompactTriangle)*(triIndex + 1) );
                             }
                             
                             count++;
                         }
                     } while (token);
                     
+                    if ((count > 2) && (hint)) {
+                        hint->seenFaces++;
+                    }
                     if ((count > 2) &&  (parseType==TKimpl_ParseTypeCountOnly)) {
                         int triCount = count-2;
                         currMtl->numTriangles += triCount;
@@ -600,164 +1966,5869 @@ void TKimpl_ParseObjPass( void *objFileData, size_t objFileSize,
         do {
             line = ++endline;
             objDelegate->currentLineNumber++;
-        } while (*endline=='\n');
+        } while (((size_t)(endline - start) < objFileSize) && (*endline=='\n'));
+    }
+    
+    if (state) {
+        state->currMtl = currMtl - uniqueMtls;
+        state->emitMtl = emitMtl ? (size_t)(emitMtl - uniqueMtls) : TKIMPL_NO_MATERIAL;
+        state->lineNumber = objDelegate->currentLineNumber;
     }
+    return 1;
 }
 
-void TKimpl_GetIndexedTriangle( TK_Triangle *tri, TKimpl_Geometry *geom, TKimpl_IndexedTriangle ndxTri )
+#ifdef TKIMPL_SIMD_SSE2
+
+// Builds one 32 byte TK_TriangleVert from the three lists with two 4-wide loads
+// and an 8 byte load, and writes it out with a single 256 bit store (or two 128s)
+static inline void TKimpl_expandVertSSE( float *dest, const float *pos, const float *st, const float *nrm )
 {
-    tri->vertA.pos[0] = geom->vertPos[ndxTri.vertA.posIndex*3 + 0];
-    tri->vertA.pos[1] = geom->vertPos[ndxTri.vertA.posIndex*3 + 1];
-    tri->vertA.pos[2] = geom->vertPos[ndxTri.vertA.posIndex*3 + 2];
-    tri->vertA.nrm[0] = geom->vertNrm[ndxTri.vertA.normIndex*3 + 0];
-    tri->vertA.nrm[1] = geom->vertNrm[ndxTri.vertA.normIndex*3 + 1];
-    tri->vertA.nrm[2] = geom->vertNrm[ndxTri.vertA.normIndex*3 + 2];
-    tri->vertA.st[0] = geom->vertSt[ndxTri.vertA.stIndex*2 + 0];
-    tri->vertA.st[1] = geom->vertSt[ndxTri.vertA.stIndex*2 + 1];
+    __m128 p = _mm_loadu_ps( pos );                          // p0 p1 p2 --
+    __m128 t = _mm_castpd_ps( _mm_load_sd( (const double*)st ) ); // s0 s1 0 0
+    __m128 n = _mm_loadu_ps( nrm );                          // n0 n1 n2 --
+    
+    __m128 pt = _mm_shuffle_ps( p, t, _MM_SHUFFLE(0,0,2,2) );  // p2 p2 s0 s0
+    __m128 lo = _mm_shuffle_ps( p, pt, _MM_SHUFFLE(2,0,1,0) ); // p0 p1 p2 s0
+    __m128 tn = _mm_shuffle_ps( t, n, _MM_SHUFFLE(0,0,1,1) );  // s1 s1 n0 n0
+    __m128 hi = _mm_shuffle_ps( tn, n, _MM_SHUFFLE(2,1,2,0) ); // s1 n0 n1 n2
+    
+#ifdef __AVX__
+    _mm256_storeu_ps( dest, _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 ) );
+#else
+    _mm_storeu_ps( dest, lo );
+    _mm_storeu_ps( dest + 4, hi );
+#endif
+}
 
-    tri->vertB.pos[0] = geom->vertPos[ndxTri.vertB.posIndex*3 + 0];
-    tri->vertB.pos[1] = geom->vertPos[ndxTri.vertB.posIndex*3 + 1];
-    tri->vertB.pos[2] = geom->vertPos[ndxTri.vertB.posIndex*3 + 2];
-    tri->vertB.nrm[0] = geom->vertNrm[ndxTri.vertB.normIndex*3 + 0];
-    tri->vertB.nrm[1] = geom->vertNrm[ndxTri.vertB.normIndex*3 + 1];
-    tri->vertB.nrm[2] = geom->vertNrm[ndxTri.vertB.normIndex*3 + 2];
-    tri->vertB.st[0] = geom->vertSt[ndxTri.vertB.stIndex*2 + 0];
-    tri->vertB.st[1] = geom->vertSt[ndxTri.vertB.stIndex*2 + 1];
+// Position only version, st and nrm are zeroed
+static inline void TKimpl_expandPosSSE( float *dest, const float *pos )
+{
+    __m128 zero = _mm_setzero_ps();
+    __m128 p = _mm_loadu_ps( pos );
+    __m128 pz = _mm_shuffle_ps( p, zero, _MM_SHUFFLE(0,0,2,2) ); // p2 p2 0 0
+    __m128 lo = _mm_shuffle_ps( p, pz, _MM_SHUFFLE(2,0,1,0) );   // p0 p1 p2 0
+    
+#ifdef __AVX__
+    _mm256_storeu_ps( dest, _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), zero, 1 ) );
+#else
+    _mm_storeu_ps( dest, lo );
+    _mm_storeu_ps( dest + 4, zero );
+#endif
+}
 
-    tri->vertC.pos[0] = geom->vertPos[ndxTri.vertC.posIndex*3 + 0];
-    tri->vertC.pos[1] = geom->vertPos[ndxTri.vertC.posIndex*3 + 1];
-    tri->vertC.pos[2] = geom->vertPos[ndxTri.vertC.posIndex*3 + 2];
-    tri->vertC.nrm[0] = geom->vertNrm[ndxTri.vertC.normIndex*3 + 0];
-    tri->vertC.nrm[1] = geom->vertNrm[ndxTri.vertC.normIndex*3 + 1];
-    tri->vertC.nrm[2] = geom->vertNrm[ndxTri.vertC.normIndex*3 + 2];
-    tri->vertC.st[0] = geom->vertSt[ndxTri.vertC.stIndex*2 + 0];
-    tri->vertC.st[1] = geom->vertSt[ndxTri.vertC.stIndex*2 + 1];
+#define TKIMPL_EXPAND_VERT TKimpl_expandVertSSE
+#define TKIMPL_EXPAND_POS TKimpl_expandPosSSE
+#define TKIMPL_PREFETCH(addr) _mm_prefetch( (const char*)(addr), _MM_HINT_T0 )
+
+#else
+
+static inline void TKimpl_expandVertScalar( float *dest, const float *pos, const float *st, const float *nrm )
+{
+    dest[0] = pos[0]; dest[1] = pos[1]; dest[2] = pos[2];
+    dest[3] = st[0];  dest[4] = st[1];
+    dest[5] = nrm[0]; dest[6] = nrm[1]; dest[7] = nrm[2];
 }
 
-void TK_ParseObj( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate )
+static inline void TKimpl_expandPosScalar( float *dest, const float *pos )
+{
+    dest[0] = pos[0]; dest[1] = pos[1]; dest[2] = pos[2];
+    dest[3] = 0.0f; dest[4] = 0.0f;
+    dest[5] = 0.0f; dest[6] = 0.0f; dest[7] = 0.0f;
+}
+
+#define TKIMPL_EXPAND_VERT TKimpl_expandVertScalar
+#define TKIMPL_EXPAND_POS TKimpl_expandPosScalar
+#if defined(__GNUC__) || defined(__clang__)
+#define TKIMPL_PREFETCH(addr) __builtin_prefetch( (addr) )
+#else
+#define TKIMPL_PREFETCH(addr)
+#endif
+
+#endif // TKIMPL_SIMD_SSE2
+
+// How many triangles ahead to prefetch the vertex data for
+#define TKIMPL_PREFETCH_DISTANCE (8)
+
+// Expansion kernel for one stored triangle type. The compact and full width
+// triangles have the same field names, so the same body works for both.
+#define TKIMPL_DEFINE_EXPAND_KERNEL( name, TriType ) \
+static void name( TKimpl_Geometry *geom, const TriType *ndxTris, size_t numTriangles, TK_Triangle *dest ) \
+{ \
+    int posOnly = (geom->skipAttribs == (TK_ObjAttrib_St|TK_ObjAttrib_Nrm)); \
+    for (size_t ti=0; ti < numTriangles; ti++) { \
+        if (ti + TKIMPL_PREFETCH_DISTANCE < numTriangles) { \
+            const TriType *ahead = ndxTris + ti + TKIMPL_PREFETCH_DISTANCE; \
+            TKIMPL_PREFETCH( geom->vertPos + ahead->vertA.posIndex*3 ); \
+            TKIMPL_PREFETCH( geom->vertPos + ahead->vertB.posIndex*3 ); \
+            TKIMPL_PREFETCH( geom->vertPos + ahead->vertC.posIndex*3 ); \
+            if (!posOnly) { \
+                TKIMPL_PREFETCH( geom->vertSt + ahead->vertA.stIndex*2 ); \
+                TKIMPL_PREFETCH( geom->vertSt + ahead->vertB.stIndex*2 ); \
+                TKIMPL_PREFETCH( geom->vertSt + ahead->vertC.stIndex*2 ); \
+                TKIMPL_PREFETCH( geom->vertNrm + ahead->vertA.normIndex*3 ); \
+                TKIMPL_PREFETCH( geom->vertNrm + ahead->vertB.normIndex*3 ); \
+                TKIMPL_PREFETCH( geom->vertNrm + ahead->vertC.normIndex*3 ); \
+            } \
+        } \
+        const TriType *ndxTri = ndxTris + ti; \
+        float *destVert = (float*)(dest + ti); \
+        if (posOnly) { \
+            TKIMPL_EXPAND_POS( destVert,      geom->vertPos + ndxTri->vertA.posIndex*3 ); \
+            TKIMPL_EXPAND_POS( destVert + 8,  geom->vertPos + ndxTri->vertB.posIndex*3 ); \
+            TKIMPL_EXPAND_POS( destVert + 16, geom->vertPos + ndxTri->vertC.posIndex*3 ); \
+        } else { \
+            TKIMPL_EXPAND_VERT( destVert, geom->vertPos + ndxTri->vertA.posIndex*3, \
+                                geom->vertSt + ndxTri->vertA.stIndex*2, geom->vertNrm + ndxTri->vertA.normIndex*3 ); \
+            TKIMPL_EXPAND_VERT( destVert + 8, geom->vertPos + ndxTri->vertB.posIndex*3, \
+                                geom->vertSt + ndxTri->vertB.stIndex*2, geom->vertNrm + ndxTri->vertB.normIndex*3 ); \
+            TKIMPL_EXPAND_VERT( destVert + 16, geom->vertPos + ndxTri->vertC.posIndex*3, \
+                                geom->vertSt + ndxTri->vertC.stIndex*2, geom->vertNrm + ndxTri->vertC.normIndex*3 ); \
+        } \
+    } \
+}
+
+TKIMPL_DEFINE_EXPAND_KERNEL( TKimpl_expandTrianglesCompact, TKimpl_CompactTriangle )
+TKIMPL_DEFINE_EXPAND_KERNEL( TKimpl_expandTrianglesWide, TKimpl_IndexedTriangle )
+
+void TKimpl_ExpandTriangles( TKimpl_Geometry *geom, TKimpl_Material *mtl, size_t firstTriangle,
+                             size_t numTriangles, TK_Triangle *dest )
+{
+    if (geom->compactIndices) {
+        TKimpl_expandTrianglesCompact( geom, mtl->compactTriangles + firstTriangle, numTriangles, dest );
+    } else {
+        TKimpl_expandTrianglesWide( geom, mtl->triangles + firstTriangle, numTriangles, dest );
+    }
+}
+
+void TKimpl_LoadIndexedTriangle( TKimpl_Geometry *geom, TKimpl_Material *mtl, size_t triIndex,
+                                 TKimpl_IndexedTriangle *ndxTri )
+{
+    if (geom->compactIndices) {
+        TKimpl_CompactVert *src = &(mtl->compactTriangles[triIndex].vertA);
+        TKimpl_IndexedVert *dst = &(ndxTri->vertA);
+        for (int vi=0; vi < 3; vi++) {
+            dst[vi].posIndex = src[vi].posIndex;
+            dst[vi].stIndex = src[vi].stIndex;
+            dst[vi].normIndex = src[vi].normIndex;
+        }
+    } else {
+        *ndxTri = mtl->triangles[triIndex];
+    }
+}
+
+void TKimpl_StoreIndexedTriangle( TKimpl_Geometry *geom, TKimpl_Material *mtl, size_t triIndex,
+                                  TKimpl_IndexedTriangle *ndxTri )
+{
+    if (geom->compactIndices) {
+        TKimpl_IndexedVert *src = &(ndxTri->vertA);
+        TKimpl_CompactVert *dst = &(mtl->compactTriangles[triIndex].vertA);
+        for (int vi=0; vi < 3; vi++) {
+            dst[vi].posIndex = (uint32_t)src[vi].posIndex;
+            dst[vi].stIndex = (uint32_t)src[vi].stIndex;
+            dst[vi].normIndex = (uint32_t)src[vi].normIndex;
+        }
+    } else {
+        mtl->triangles[triIndex] = *ndxTri;
+    }
+}
+
+// Number of set bits, for the probe's byte masks
+static inline size_t TKimpl_bitCount( unsigned int bits )
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount( bits );
+#else
+    bits = bits - ((bits >> 1) & 0x55555555u);
+    bits = (bits & 0x33333333u) + ((bits >> 2) & 0x33333333u);
+    return (((bits + (bits >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+#endif
+}
+
+// Scans from ch to the end of the line, and returns it. Counts where tokens start (a byte
+// that's not a space right after one that is, ch is after a space if afterSpace), and
+// sets keyword if there's a v, f or u anywhere, since every keyword starts with one.
+char *TKimpl_probeScan( char *ch, char *end, int afterSpace, size_t *out_tokens, int *out_keyword )
+{
+    size_t tokens = 0;
+    unsigned int prevSpace = afterSpace ? 1 : 0;
+    unsigned int keyword = 0;
+#ifdef TKIMPL_SIMD_SSE2
+    const __m128i newline = _mm_set1_epi8( '\n' );
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i space = _mm_set1_epi8( ' ' );
+    const __m128i keyV = _mm_set1_epi8( 'v' );
+    const __m128i keyF = _mm_set1_epi8( 'f' );
+    const __m128i keyU = _mm_set1_epi8( 'u' );
+    while (end - ch >= 16) {
+        __m128i bytes = _mm_loadu_si128( (const __m128i*)ch );
+        unsigned int stop = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( bytes, newline ),
+                                                             _mm_cmpeq_epi8( bytes, zero ) ) );
+        unsigned int spaces = _mm_movemask_epi8( _mm_cmpeq_epi8( bytes, space ) );
+        unsigned int keys = _mm_movemask_epi8( _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( bytes, keyV ),
+                                                                           _mm_cmpeq_epi8( bytes, keyF ) ),
+                                                             _mm_cmpeq_epi8( bytes, keyU ) ) );
+
+        // Only the bytes before the first newline count
+        unsigned int valid = stop ? ((stop & (0u - stop)) - 1) : 0xFFFF;
+        tokens += TKimpl_bitCount( ~spaces & ((spaces << 1) | prevSpace) & valid );
+        keyword |= keys & valid;
+        if (stop) {
+            *out_tokens = tokens;
+            *out_keyword = (keyword != 0);
+            return ch + TKimpl_bitCount( valid );
+        }
+        prevSpace = (spaces >> 15) & 1;
+        ch += 16;
+    }
+#endif
+    while ((ch < end) && (*ch) && (*ch != '\n')) {
+        if (*ch == ' ') {
+            prevSpace = 1;
+        } else {
+            tokens += prevSpace;
+            prevSpace = 0;
+            keyword |= (*ch == 'v') || (*ch == 'f') || (*ch == 'u');
+        }
+        ch++;
+    }
+    *out_tokens = tokens;
+    *out_keyword = (keyword != 0);
+    return ch;
+}
+
+// Same counts as a TKimpl_ParseTypeCountOnly pass, but without tokenizing. Comments,
+// faces and v, vt and vn lines are counted straight from the bytes. Anything that
+// could have a keyword somewhere else on the line (usemtl, or a v line that goes on
+// about faces) is rare enough to just hand that line to the real pass.
+void TKimpl_ProbeObjPass( void *objFileData, size_t objFileSize,
+                          TKimpl_Material *uniqueMtls, size_t *numUniqueMtls,
+                          TK_ObjDelegate *objDelegate )
+{
+    if (*numUniqueMtls == 0) {
+        uniqueMtls[0].mtlName = (char *)TKIMPL_DEFAULT_MTL_NAME;
+        uniqueMtls[0].numTriangles = 0;
+        (*numUniqueMtls)++;
+    }
+
+    TKimpl_ParseState state;
+    state.currMtl = 0;
+    state.emitMtl = TKIMPL_NO_MATERIAL;
+    state.shardMtl = 0;
+    size_t lineNumber = 1;
+
+    char *start = (char*)objFileData;
+    char *end = start + objFileSize;
+    char *line = start;
+    char *endline;
+
+    while (line < end)
+    {
+        // The pass never checks a line's first byte for the end of the line
+        int slowLine = (*line == '\0') || (*line == '\n');
+
+        char *ch = line;
+        while ((ch < end) && ((*ch == ' ') || (*ch == '\t'))) {
+            ch++;
+        }
+
+        size_t tokens = 0;
+        int keyword = 0;
+        if ((ch == end) || (*ch == '\0') || (*ch == '\n')) {
+            endline = ch;
+        } else if (*ch == '#') {
+            endline = TKimpl_probeScan( ch, end, 0, &tokens, &keyword );
+            keyword = 0;
+        } else {
+            char *endtoken = ch;
+            while ((endtoken < end) && (*endtoken != ' ') && (*endtoken) && (*endtoken != '\n')) {
+                endtoken++;
+            }
+
+            size_t *counter = NULL;
+            int isFace = 0;
+            if ((endtoken - ch == 1) && (ch[0] == 'f')) {
+                isFace = 1;
+            } else if ((endtoken - ch == 1) && (ch[0] == 'v')) {
+                counter = &(objDelegate->numVerts);
+            } else if ((endtoken - ch == 2) && (ch[0] == 'v') && (ch[1] == 't')) {
+                counter = &(objDelegate->numSts);
+            } else if ((endtoken - ch == 2) && (ch[0] == 'v') && (ch[1] == 'n')) {
+                counter = &(objDelegate->numNorms);
+            }
+
+            if (isFace) {
+                // Every token after the f is a corner
+                endline = TKimpl_probeScan( endtoken, end, 0, &tokens, &keyword );
+                keyword = 0;
+                if (tokens > 2) {
+                    uniqueMtls[state.currMtl].numTriangles += tokens - 2;
+                    objDelegate->numFaces += 1;
+                    objDelegate->numTriangles += tokens - 2;
+                }
+            } else if (counter) {
+                endline = TKimpl_probeScan( endtoken, end, 0, &tokens, &keyword );
+                if (!keyword) (*counter)++;
+            } else {
+                endline = TKimpl_probeScan( ch, end, 1, &tokens, &keyword );
+            }
+        }
+
+        if ((slowLine) || (keyword)) {
+            // The pass finds the same end of line, starting from the same place
+            if (slowLine) {
+                endline = line + 1;
+                while ((endline < end) && (*endline) && (*endline != '\n')) endline++;
+            }
+            state.lineNumber = lineNumber;
+            TKimpl_ParseObjPass( line, endline - line, NULL, uniqueMtls, numUniqueMtls,
+                                 objDelegate, TKimpl_ParseTypeCountOnly, &state, NULL, NULL );
+        }
+
+        // next nonblank line
+        do {
+            line = ++endline;
+            lineNumber++;
+        } while ((endline < end) && (*endline == '\n'));
+    }
+
+    objDelegate->currentLineNumber = lineNumber;
+}
+
+// Pre-pass, count how many verts, nrms, sts and unique materials there are
+void TKimpl_CountObjPass( void *objFileData, size_t objFileSize,
+                          TKimpl_Material *uniqueMtls, size_t *numUniqueMtls,
+                          TK_ObjDelegate *objDelegate, TKimpl_InSitu *inSitu )
 {
-    TKimpl_Material uniqueMtls[TKIMPL_MAX_UNIQUE_MTLS];
-    size_t numUniqueMtls = 0;
-    
-    // pre-pass, count how many verts, nrms and sts there are
     objDelegate->numVerts=0;
     objDelegate->numSts=0;
     objDelegate->numNorms=0;
     objDelegate->numFaces=0;
     objDelegate->numTriangles=0;
     
-    // First pass, just count verts and unique materials...
-    TKimpl_ParseObjPass( objFileData, objFileSize,  NULL,
-                        uniqueMtls, &numUniqueMtls,
-                        objDelegate, TKimpl_ParseTypeCountOnly );
+    if (inSitu) {
+        inSitu->posSlack = TKIMPL_MAX_SLACK;
+        inSitu->stSlack = TKIMPL_MAX_SLACK;
+        inSitu->nrmSlack = TKIMPL_MAX_SLACK;
+        for (size_t mi=0; mi < TKIMPL_MAX_UNIQUE_MTLS; mi++) inSitu->mtlSlack[mi] = TKIMPL_MAX_SLACK;
+    }
+    
+    // Only in situ needs the real pass, for the slack on every line
+    *numUniqueMtls = 0;
+    if (inSitu) {
+        TKimpl_ParseObjPass( objFileData, objFileSize,  NULL,
+                            uniqueMtls, numUniqueMtls,
+                            objDelegate, TKimpl_ParseTypeCountOnly, NULL, NULL, inSitu );
+    } else {
+        TKimpl_ProbeObjPass( objFileData, objFileSize, uniqueMtls, numUniqueMtls, objDelegate );
+    }
     
     // Make sure we reserve space for at least a single
     // st and normal, if they are not present in the obj
     if (!objDelegate->numSts) objDelegate->numSts = 1;
     if (!objDelegate->numNorms) objDelegate->numNorms = 1;
+}
+
+// Use 32-bit indices unless one of the lists is too big for them
+int TKimpl_useCompactIndices( TK_ObjDelegate *objDelegate )
+{
+    return (objDelegate->numVerts <= UINT32_MAX) &&
+           (objDelegate->numSts <= UINT32_MAX) &&
+           (objDelegate->numNorms <= UINT32_MAX);
+}
+
+// Fill in the default ST and Norm, these get overwritten if the
+// obj has any. (Set before the parse since immediate mode emits during it,
+// in situ it's after, for whichever lists came up empty)
+void TKimpl_setDefaultAttribs( TKimpl_Geometry *geom, TK_ObjDelegate *objDelegate )
+{
+    if (!geom->numVertSt) {
+        geom->vertSt[0] = 0.0;
+        geom->vertSt[1] = 0.0;
+    }
+    
+    if (!geom->numVertNrm) {
+        geom->vertNrm[0] = 0.0;
+        geom->vertNrm[1] = (objDelegate->skipAttribs & TK_ObjAttrib_Nrm) ? 0.0 : 1.0;
+        geom->vertNrm[2] = 0.0;
+    }
+}
+
+// Reads a number at *ch, returns 0 if there isn't one, or it's more than maxValue
+int TKimpl_readHintNumber( char **ch, char *end, size_t maxValue, size_t *out_value )
+{
+    size_t value = 0;
+    char *start = *ch;
+    while ((*ch < end) && (**ch >= '0') && (**ch <= '9')) {
+        size_t digit = (size_t)(**ch - '0');
+        if (value > (maxValue - digit) / 10) return 0;
+        value = value*10 + digit;
+        (*ch)++;
+    }
+    *out_value = value;
+    return *ch > start;
+}
+
+// Looks through the comments at the top of the file for a header like
+//   # tk_counts v=8 vt=14 vn=6 f=6 tris=12 mtls=3 mtltris=8,2,2
+// with the counts the count pass would find (mtltris in order of first use, starting
+// with the default material). Returns 1 if there's one and it adds up. It's only a
+// comment, so none of the counts are trusted to be more than the file could hold
+// (every line takes at least two bytes, and so does every corner past the second).
+int TKimpl_readCountHint( void *objFileData, size_t objFileSize, TKimpl_CountHint *hint )
+{
+    size_t maxCount = objFileSize / 2;
+    char *ch = (char*)objFileData;
+    char *end = ch + objFileSize;
+    const char *tag = "# tk_counts ";
+    
+    for (;;) {
+        while ((ch < end) && ((*ch == ' ') || (*ch == '\t') || (*ch == '\r') || (*ch == '\n'))) ch++;
+        if ((ch == end) || (*ch != '#')) return 0;
+        
+        char *endline = ch;
+        while ((endline < end) && (*endline != '\n')) endline++;
+        
+        size_t tagLen = 0;
+        while ((tag[tagLen]) && (ch + tagLen < endline) && (ch[tagLen] == tag[tagLen])) tagLen++;
+        if (!tag[tagLen]) {
+            ch += tagLen;
+            break;
+        }
+        ch = endline;
+    }
+    
+    // key=value pairs, unknown keys are skipped
+    unsigned int found = 0;
+    size_t numMtls = 0, mtlTriangleSum = 0;
+    hint->numMtls = 0;
+    while (ch < end) {
+        while ((ch < end) && ((*ch == ' ') || (*ch == '\t') || (*ch == '\r'))) ch++;
+        if ((ch == end) || (*ch == '\n')) break;
+        
+        char *key = ch;
+        while ((ch < end) && (*ch != '=') && (TKimpl_isIdentifier( *ch ))) ch++;
+        if ((ch == end) || (*ch != '=')) return 0;
+        char *endkey = ch++;
+        
+        if (TKimpl_compareToken( "mtltris", key, endkey ) && (endkey - key == 7)) {
+            found |= (1<<6);
+            for (;;) {
+                if (hint->numMtls >= TKIMPL_MAX_UNIQUE_MTLS) return 0;
+                if (!TKimpl_readHintNumber( &ch, end, maxCount - mtlTriangleSum, hint->mtlTriangles + hint->numMtls )) {
+                    return 0;
+                }
+                mtlTriangleSum += hint->mtlTriangles[hint->numMtls++];
+                if ((ch == end) || (*ch != ',')) break;
+                ch++;
+            }
+            continue;
+        }
+        
+        size_t value;
+        if (!TKimpl_readHintNumber( &ch, end, maxCount, &value )) return 0;
+        if ((endkey - key == 1) && (*key == 'v')) {
+            hint->numVerts = value;
+            found |= (1<<0);
+        } else if ((endkey - key == 2) && (TKimpl_compareToken( "vt", key, endkey ))) {
+            hint->numSts = value;
+            found |= (1<<1);
+        } else if ((endkey - key == 2) && (TKimpl_compareToken( "vn", key, endkey ))) {
+            hint->numNorms = value;
+            found |= (1<<2);
+        } else if ((endkey - key == 1) && (*key == 'f')) {
+            hint->numFaces = value;
+            found |= (1<<3);
+        } else if ((endkey - key == 4) && (TKimpl_compareToken( "tris", key, endkey ))) {
+            hint->numTriangles = value;
+            found |= (1<<4);
+        } else if ((endkey - key == 4) && (TKimpl_compareToken( "mtls", key, endkey ))) {
+            numMtls = value;
+            found |= (1<<5);
+        }
+    }
     
-    size_t totalTriangleCount = 0;
-    for (int i=0; i < numUniqueMtls; i++) {
-        totalTriangleCount += uniqueMtls[i].numTriangles;
+    hint->seenSts = 0;
+    hint->seenNorms = 0;
+    hint->seenFaces = 0;
+    hint->failed = 0;
+    return (found == 0x7f) && (hint->numMtls >= 1) && (numMtls == hint->numMtls) &&
+           (mtlTriangleSum == hint->numTriangles) && (hint->numFaces <= hint->numTriangles);
+}
+
+// Checks a hinted parse found exactly what the header said
+int TKimpl_checkCountHint( TKimpl_Geometry *geom, TKimpl_CountHint *hint )
+{
+    if ((hint->failed) || (geom->numVertPos != hint->numVerts) || (hint->seenSts != hint->numSts) ||
+        (hint->seenNorms != hint->numNorms) || (hint->seenFaces != hint->numFaces) ||
+        (geom->numMaterials != hint->numMtls)) {
+        return 0;
+    }
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        if (geom->materials[mi].numTriangles != hint->mtlTriangles[mi]) return 0;
     }
+    return 1;
+}
+
+// Overflow checked size arithmetic, for sizes that come from counts in the file. Once
+// anything overflows the result sticks at TKIMPL_SIZE_OVERFLOW.
+#define TKIMPL_SIZE_OVERFLOW (~(size_t)0)
+
+static inline size_t TKimpl_sizeAdd( size_t a, size_t b )
+{
+    return (a > TKIMPL_SIZE_OVERFLOW - b) ? TKIMPL_SIZE_OVERFLOW : a + b;
+}
+
+static inline size_t TKimpl_sizeMul( size_t a, size_t b )
+{
+    return ((b) && (a > TKIMPL_SIZE_OVERFLOW / b)) ? TKIMPL_SIZE_OVERFLOW : a * b;
+}
+
+// TKimpl_ArenaSize, but it can't wrap around
+static inline size_t TKimpl_sizeArena( size_t size )
+{
+    return (size > TKIMPL_SIZE_OVERFLOW - TKIMPL_ARENA_ALIGN) ? TKIMPL_SIZE_OVERFLOW : TKimpl_ArenaSize( size );
+}
+
+// The scratchMemSize TKimpl_AllocGeometry needs for the counts in objDelegate and
+// uniqueMtls, or TKIMPL_SIZE_OVERFLOW if that doesn't fit in a size_t
+size_t TKimpl_GeometryScratchSize( TK_ObjDelegate *objDelegate, TKimpl_Material *uniqueMtls, size_t numUniqueMtls,
+                                   size_t extraTempMem )
+{
+    // Skipped attributes only get the single default entry
+    size_t numStsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_St) ? 1 : objDelegate->numSts;
+    size_t numNormsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_Nrm) ? 1 : objDelegate->numNorms;
     
-    // Calculate scratchMemSize
+    // Every push is padded out to the arena alignment
     size_t requiredScratchMem =
-        sizeof(TKImpl_MemArena) +
-        sizeof(TKimpl_Geometry) +
-        sizeof(float)*3*objDelegate->numVerts +
-        sizeof(float)*3*objDelegate->numNorms +
-        sizeof(float)*2*objDelegate->numSts +
-        sizeof(TKimpl_Material) * numUniqueMtls +
-        sizeof(TKimpl_IndexedTriangle) * totalTriangleCount;
-    
-    // If no scratchMem, just stop now after the prepass
-    if (!objDelegate->scratchMem) {
-        objDelegate->scratchMemSize = requiredScratchMem;
-        return;
+        TKIMPL_ARENA_ALIGN + // in case scratchMem itself isn't aligned
+        TKimpl_ArenaSize( sizeof(TKimpl_Geometry) ) +
+        TKimpl_ArenaSize( sizeof(TKimpl_Material) * numUniqueMtls );
+    size_t posFloats = TKimpl_sizeAdd( TKimpl_sizeMul( 3, objDelegate->numVerts ), TKIMPL_VERT_PADDING );
+    size_t nrmFloats = TKimpl_sizeAdd( TKimpl_sizeMul( 3, numNormsAlloc ), TKIMPL_VERT_PADDING );
+    requiredScratchMem = TKimpl_sizeAdd( requiredScratchMem, TKimpl_sizeArena( TKimpl_sizeMul( sizeof(float), posFloats ) ) );
+    requiredScratchMem = TKimpl_sizeAdd( requiredScratchMem, TKimpl_sizeArena( TKimpl_sizeMul( sizeof(float), nrmFloats ) ) );
+    requiredScratchMem = TKimpl_sizeAdd( requiredScratchMem, TKimpl_sizeArena( TKimpl_sizeMul( sizeof(float)*2, numStsAlloc ) ) );
+    
+    size_t triangleSize = TKimpl_useCompactIndices( objDelegate ) ? sizeof(TKimpl_CompactTriangle) : sizeof(TKimpl_IndexedTriangle);
+    
+    if (!objDelegate->immediateMode) {
+        for (size_t i=0; i < numUniqueMtls; i++) {
+            size_t triangleMem = TKimpl_sizeArena( TKimpl_sizeMul( triangleSize, uniqueMtls[i].numTriangles ) );
+            requiredScratchMem = TKimpl_sizeAdd( requiredScratchMem, triangleMem );
+        }
+    }
+    
+    // The remap tables, and the temporary space for the sort after the parse. Those are
+    // a few times the triangles at most, and the counts are capped by the file size
+    // (or were really counted), so once the lists fit they can't get near overflowing.
+    if (requiredScratchMem == TKIMPL_SIZE_OVERFLOW) return TKIMPL_SIZE_OVERFLOW;
+    int mortonOrder = (objDelegate->mortonOrder) && (!objDelegate->immediateMode);
+    size_t tempScratchMem = 0;
+    if (mortonOrder) {
+        size_t maxTriangles = 0;
+        for (size_t i=0; i < numUniqueMtls; i++) {
+            size_t remapMem = TKimpl_sizeArena( TKimpl_sizeMul( sizeof(size_t), uniqueMtls[i].numTriangles ) );
+            requiredScratchMem = TKimpl_sizeAdd( requiredScratchMem, remapMem );
+            if (uniqueMtls[i].numTriangles > maxTriangles) maxTriangles = uniqueMtls[i].numTriangles;
+        }
+        tempScratchMem = TKimpl_MortonScratchSize( objDelegate->numVerts, maxTriangles, triangleSize );
+    }
+    
+    // The bounds and the weld reuse the sort's temporary space, none of them overlap
+    int computeBounds = (objDelegate->computeBounds) && (!objDelegate->immediateMode);
+    if (computeBounds) {
+        size_t boundsScratchMem = TKimpl_BoundsScratchSize( objDelegate->numVerts, uniqueMtls, numUniqueMtls );
+        if (boundsScratchMem > tempScratchMem) tempScratchMem = boundsScratchMem;
+    }
+    if ((objDelegate->weldTolerance > 0.0f) && (!objDelegate->immediateMode)) {
+        size_t weldScratchMem = TKimpl_WeldScratchSize( objDelegate->numVerts );
+        if (weldScratchMem > tempScratchMem) tempScratchMem = weldScratchMem;
     }
-    else if (objDelegate->scratchMemSize < requiredScratchMem) {
+    if (extraTempMem > tempScratchMem) tempScratchMem = extraTempMem;
+    return TKimpl_sizeAdd( requiredScratchMem, tempScratchMem );
+}
+
+// Sizes and allocates a geometry for the counts in objDelegate and uniqueMtls, with
+// room for the remap tables and the temporary space TKimpl_FinishGeometry needs (or
+// extraTempMem, if the caller needs more than that before it's finished). It
+// goes on the caller's arena, or on scratchMem (set up in scratchArena). Returns NULL
+// if there's no scratchMem yet (scratchMemSize is filled in), or not enough.
+TKimpl_Geometry *TKimpl_AllocGeometry( TK_ObjDelegate *objDelegate, TKimpl_Material *uniqueMtls, size_t numUniqueMtls,
+                                       size_t extraTempMem, TK_ObjArena *scratchArena, TK_ObjArena **out_arena )
+{
+    size_t numStsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_St) ? 1 : objDelegate->numSts;
+    size_t numNormsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_Nrm) ? 1 : objDelegate->numNorms;
+    int compactIndices = TKimpl_useCompactIndices( objDelegate );
+    size_t triangleSize = compactIndices ? sizeof(TKimpl_CompactTriangle) : sizeof(TKimpl_IndexedTriangle);
+    int mortonOrder = (objDelegate->mortonOrder) && (!objDelegate->immediateMode);
+    
+    size_t requiredScratchMem = TKimpl_GeometryScratchSize( objDelegate, uniqueMtls, numUniqueMtls, extraTempMem );
+    if (requiredScratchMem == TKIMPL_SIZE_OVERFLOW) {
         TKimpl_memoryError( objDelegate );
-        return;
+        return NULL;
     }
     
-    // Initialize our mem arena
-    TKImpl_MemArena *arena = (TKImpl_MemArena *)objDelegate->scratchMem;
-    arena->base = arena+1;
-    arena->top = (uint8_t*)arena->base;
-    arena->remaining = objDelegate->scratchMemSize - sizeof(TKImpl_MemArena);
+    // Use the caller's arena, or set one up on scratchMem
+    TK_ObjArena *arena = objDelegate->arena;
+    if (!arena) {
+        // If no scratchMem, just stop now after the prepass
+        if (!objDelegate->scratchMem) {
+            objDelegate->scratchMemSize = requiredScratchMem;
+            return NULL;
+        }
+        else if (objDelegate->scratchMemSize < requiredScratchMem) {
+            TKimpl_memoryError( objDelegate );
+            return NULL;
+        }
+        
+        TK_ObjArenaInit( scratchArena, objDelegate->scratchMem, objDelegate->scratchMemSize );
+        arena = scratchArena;
+    }
     
     // Allocate our geom
     TKimpl_Geometry *geom = TKImpl_PushStruct(arena, TKimpl_Geometry);
+    if (!geom) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
+    }
     
     // Allocate vertex data lists
     geom->numVertPos = 0;
-    geom->vertPos = (float*)TKImpl_PushSize(arena, sizeof(float)*3*objDelegate->numVerts);
+    geom->vertPos = (float*)TK_ObjArenaPush(arena, sizeof(float)*(3*objDelegate->numVerts + TKIMPL_VERT_PADDING));
     
     geom->numVertNrm = 0;
-    geom->vertNrm = (float*)TKImpl_PushSize(arena, sizeof(float)*3*objDelegate->numNorms);
+    geom->vertNrm = (float*)TK_ObjArenaPush(arena, sizeof(float)*(3*numNormsAlloc + TKIMPL_VERT_PADDING));
     
     geom->numVertSt = 0;
-    geom->vertSt = (float*)TKImpl_PushSize(arena, sizeof(float)*2*objDelegate->numSts);
+    geom->vertSt = (float*)TK_ObjArenaPush(arena, sizeof(float)*2*numStsAlloc);
     
     geom->materials = TKImpl_PushStructArray(arena, TKimpl_Material, numUniqueMtls );
     geom->numMaterials = numUniqueMtls;
     
-    for (int i = 0; i < numUniqueMtls; i++) {
+    geom->skipAttribs = objDelegate->skipAttribs;
+    geom->compactIndices = compactIndices;
+    geom->triangleSink = NULL;
+    geom->sinkData = NULL;
+    geom->hasBounds = 0;
+    geom->relativeBias = 0;
+    geom->inSitu = 0;
+    
+    if ((!geom->vertPos) || (!geom->vertNrm) || (!geom->vertSt) || (!geom->materials)) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
+    }
+    
+    int outOfMemory = 0;
+    for (size_t i = 0; i < numUniqueMtls; i++) {
         geom->materials[i].mtlName = uniqueMtls[i].mtlName;
-        geom->materials[i].triangles = TKImpl_PushStructArray( arena, TKimpl_IndexedTriangle,
-                                                              uniqueMtls[i].numTriangles );
-        geom->materials[i].numTriangles = 0;
+        if (objDelegate->immediateMode) {
+            // Nothing is stored, keep the count from the prepass to report to material()
+            geom->materials[i].triangles = NULL;
+            geom->materials[i].compactTriangles = NULL;
+            geom->materials[i].remap = NULL;
+            geom->materials[i].numTriangles = uniqueMtls[i].numTriangles;
+        } else {
+            void *triangles = TK_ObjArenaPush( arena, triangleSize * uniqueMtls[i].numTriangles );
+            geom->materials[i].triangles = compactIndices ? NULL : (TKimpl_IndexedTriangle*)triangles;
+            geom->materials[i].compactTriangles = compactIndices ? (TKimpl_CompactTriangle*)triangles : NULL;
+            geom->materials[i].remap = NULL;
+            geom->materials[i].numTriangles = 0;
+            if (!triangles) outOfMemory = 1;
+            
+            if (mortonOrder) {
+                geom->materials[i].remap = TKImpl_PushStructArray( arena, size_t, uniqueMtls[i].numTriangles );
+                if (!geom->materials[i].remap) outOfMemory = 1;
+            }
+        }
     }
     
-    // Now space is allocated for all the data, parse again and store
-    TKimpl_ParseObjPass( objFileData, objFileSize,  geom,
-                        geom->materials, &(geom->numMaterials),
-                        objDelegate, TKimpl_ParseTypeFull );
+    if (outOfMemory) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
+    }
     
-    // If we have no STs or Norms, push a default one
-    if (geom->numVertSt==0) {
-        geom->vertSt[0] = 0.0;
-        geom->vertSt[1] = 0.0;
+    TKimpl_setDefaultAttribs( geom, objDelegate );
+    
+    *out_arena = arena;
+    return geom;
+}
+
+// Welds and sorts the filled in geometry and computes its bounds, if objDelegate asks for them
+TK_ObjGeometry *TKimpl_FinishGeometry( TKimpl_Geometry *geom, TK_ObjArena *arena, TK_ObjDelegate *objDelegate )
+{
+    if ((!objDelegate->immediateMode) &&
+        (!TKimpl_WeldPositions( geom, objDelegate->weldTolerance, arena, objDelegate->jobs ))) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
     }
     
-    if (geom->numVertNrm==0) {
-        geom->vertNrm[0] = 0.0;
-        geom->vertNrm[1] = 1.0;
-        geom->vertNrm[2] = 0.0;
+    int mortonOrder = (objDelegate->mortonOrder) && (!objDelegate->immediateMode);
+    if ((mortonOrder) && (!TKimpl_SortMorton( geom, arena, objDelegate->jobs ))) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
     }
-
     
-    // Now go through the results with the "triangle soup" API
-    if ((objDelegate->triangle) || (objDelegate->material)) {
-        for (int mi=0; mi < geom->numMaterials; mi++) {
-            if (geom->materials[mi].numTriangles > 0) {
-                if (objDelegate->material) {
-                    // Copy the mtlName into a nice 0-terminated string
-                    char mtlName[TKIMPL_MAX_MATERIAL_NAME];
-                    TKimpl_stringDelimMtlName(mtlName, geom->materials[mi].mtlName,
-                                              TKIMPL_MAX_MATERIAL_NAME );
-                    
-                    // emit the material name
-                    objDelegate->material( mtlName,
-                                          geom->materials[mi].numTriangles,
-                                          objDelegate->userData );
-                }
-                // Now emit all the triangles for the material
-                if (objDelegate->triangle)
-                {
-                    for (size_t ti=0; ti < geom->materials[mi].numTriangles; ti++) {
-                        TK_Triangle tri = {};
-
-                        TKimpl_GetIndexedTriangle( &tri, geom, geom->materials[mi].triangles[ti] );
-                        objDelegate->triangle( tri.vertA, tri.vertB, tri.vertC, objDelegate->userData );
-                    }
-                }
-            }
-        }
+    int computeBounds = (objDelegate->computeBounds) && (!objDelegate->immediateMode);
+    if ((computeBounds) && (!TKimpl_ComputeBounds( geom, arena, objDelegate->jobs ))) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
     }
+    
+    return geom;
+}
+
+// Does the parse for TK_ParseObjGeometry in situ, with the lists laid out over the text
+// the same way TKimpl_AllocGeometry lays them out in scratch. Sets fits to 0 (and does
+// nothing else) if they'd get ahead of the parse somewhere, or need 64-bit indices.
+TK_ObjGeometry *TKimpl_ParseObjInSitu( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate,
+                                       TKimpl_Material *uniqueMtls, size_t numUniqueMtls,
+                                       TKimpl_InSitu *inSitu, int *out_fits )
+{
+    char *data = (char*)objFileData;
+    *out_fits = 0;
+    if (!TKimpl_useCompactIndices( objDelegate )) return NULL;
+    
+    size_t numStsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_St) ? 1 : objDelegate->numSts;
+    size_t numNormsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_Nrm) ? 1 : objDelegate->numNorms;
+    
+    size_t posOffset = TKimpl_ArenaSize( (uintptr_t)data ) - (uintptr_t)data;
+    size_t stOffset = posOffset + TKimpl_ArenaSize( sizeof(float)*(3*objDelegate->numVerts + TKIMPL_VERT_PADDING) );
+    size_t nrmOffset = stOffset + TKimpl_ArenaSize( sizeof(float)*2*numStsAlloc );
+    size_t offset = nrmOffset + TKimpl_ArenaSize( sizeof(float)*(3*numNormsAlloc + TKIMPL_VERT_PADDING) );
+    int fits = ((ptrdiff_t)posOffset <= inSitu->posSlack) && ((ptrdiff_t)stOffset <= inSitu->stSlack) &&
+               ((ptrdiff_t)nrmOffset <= inSitu->nrmSlack);
+    
+    size_t mtlOffsets[TKIMPL_MAX_UNIQUE_MTLS];
+    size_t nameBytes = 0, remapMem = 0, maxTriangles = 0;
+    for (size_t mi=0; mi < numUniqueMtls; mi++) {
+        mtlOffsets[mi] = offset;
+        if ((ptrdiff_t)offset > inSitu->mtlSlack[mi]) fits = 0;
+        offset += TKimpl_ArenaSize( sizeof(TKimpl_CompactTriangle) * uniqueMtls[mi].numTriangles );
+        
+        for (char *ch = uniqueMtls[mi].mtlName; (mi > 0) && (TKimpl_isIdentifier( *ch )); ch++) nameBytes++;
+        nameBytes++;
+        
+        remapMem += TKimpl_ArenaSize( sizeof(size_t) * uniqueMtls[mi].numTriangles );
+        if (uniqueMtls[mi].numTriangles > maxTriangles) maxTriangles = uniqueMtls[mi].numTriangles;
+    }
+    if ((!fits) || (offset > objFileSize)) return NULL;
+    *out_fits = 1;
+    
+    // After the parse, the rest of the text can hold the remap tables and the
+    // temporaries, if they fit. Otherwise they go in scratch like usual.
+    size_t tempMem = 0;
+    if (!objDelegate->mortonOrder) {
+        remapMem = 0;
+    } else {
+        tempMem = TKimpl_MortonScratchSize( objDelegate->numVerts, maxTriangles, sizeof(TKimpl_CompactTriangle) );
+    }
+    if (objDelegate->computeBounds) {
+        size_t boundsScratchMem = TKimpl_BoundsScratchSize( objDelegate->numVerts, uniqueMtls, numUniqueMtls );
+        if (boundsScratchMem > tempMem) tempMem = boundsScratchMem;
+    }
+    if (objDelegate->weldTolerance > 0.0f) {
+        size_t weldScratchMem = TKimpl_WeldScratchSize( objDelegate->numVerts );
+        if (weldScratchMem > tempMem) tempMem = weldScratchMem;
+    }
+    int tempInText = (offset + TKIMPL_ARENA_ALIGN + remapMem + tempMem <= objFileSize);
+    
+    // Scratch only has the geometry and the materials, and their names since the text
+    // they point to gets overwritten
+    size_t requiredScratchMem =
+        TKIMPL_ARENA_ALIGN +
+        TKimpl_ArenaSize( sizeof(TKimpl_Geometry) ) +
+        TKimpl_ArenaSize( sizeof(TKimpl_Material) * numUniqueMtls ) +
+        TKimpl_ArenaSize( nameBytes );
+    if (!tempInText) requiredScratchMem += remapMem + tempMem;
+    
+    TK_ObjArena scratchArena;
+    TK_ObjArena *arena = objDelegate->arena;
+    if (!arena) {
+        if (!objDelegate->scratchMem) {
+            objDelegate->scratchMemSize = requiredScratchMem;
+            return NULL;
+        }
+        else if (objDelegate->scratchMemSize < requiredScratchMem) {
+            TKimpl_memoryError( objDelegate );
+            return NULL;
+        }
+        
+        TK_ObjArenaInit( &scratchArena, objDelegate->scratchMem, objDelegate->scratchMemSize );
+        arena = &scratchArena;
+    }
+    
+    TKimpl_Geometry *geom = TKImpl_PushStruct( arena, TKimpl_Geometry );
+    TKimpl_Material *materials = TKImpl_PushStructArray( arena, TKimpl_Material, numUniqueMtls );
+    char *names = (char*)TK_ObjArenaPush( arena, nameBytes );
+    if ((!geom) || (!materials) || (!names)) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
+    }
+    
+    geom->numVertPos = 0;
+    geom->numVertSt = 0;
+    geom->numVertNrm = 0;
+    geom->vertPos = (float*)(data + posOffset);
+    geom->vertSt = (float*)(data + stOffset);
+    geom->vertNrm = (float*)(data + nrmOffset);
+    geom->materials = materials;
+    geom->numMaterials = numUniqueMtls;
+    geom->skipAttribs = objDelegate->skipAttribs;
+    geom->compactIndices = 1;
+    geom->triangleSink = NULL;
+    geom->sinkData = NULL;
+    geom->hasBounds = 0;
+    geom->relativeBias = 0;
+    geom->inSitu = 1;
+    
+    for (size_t mi=0; mi < numUniqueMtls; mi++) {
+        materials[mi].mtlName = uniqueMtls[mi].mtlName;
+        if (mi > 0) {
+            materials[mi].mtlName = names;
+            for (char *ch = uniqueMtls[mi].mtlName; TKimpl_isIdentifier( *ch ); ch++) *names++ = *ch;
+            *names++ = '\0';
+        }
+        materials[mi].numTriangles = 0;
+        materials[mi].triangles = NULL;
+        materials[mi].compactTriangles = (TKimpl_CompactTriangle*)(data + mtlOffsets[mi]);
+        materials[mi].remap = NULL;
+    }
+    
+    TKimpl_ParseObjPass( objFileData, objFileSize, geom, geom->materials, &(geom->numMaterials),
+                         objDelegate, TKimpl_ParseTypeFull, NULL, NULL, NULL );
+    TKimpl_setDefaultAttribs( geom, objDelegate );
+    
+    TK_ObjArena textArena;
+    TK_ObjArena *tempArena = arena;
+    if (tempInText) {
+        TK_ObjArenaInit( &textArena, data + offset, objFileSize - offset );
+        tempArena = &textArena;
+    }
+    for (size_t mi=0; (objDelegate->mortonOrder) && (mi < numUniqueMtls); mi++) {
+        materials[mi].remap = TKImpl_PushStructArray( tempArena, size_t, uniqueMtls[mi].numTriangles );
+        if (!materials[mi].remap) {
+            TKimpl_memoryError( objDelegate );
+            return NULL;
+        }
+    }
+    
+    return TKimpl_FinishGeometry( geom, tempArena, objDelegate );
+}
+
+// Does the parse for TK_ParseObjGeometry, sized by the count pass, or by the hint if
+// it's not NULL. Sets hint->failed and returns NULL if the hint was wrong.
+TK_ObjGeometry *TKimpl_ParseObjGeometry( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate,
+                                         TKimpl_CountHint *hint )
+{
+    TKimpl_Material uniqueMtls[TKIMPL_MAX_UNIQUE_MTLS];
+    size_t numUniqueMtls = 0;
+    
+    if (hint) {
+        // The header has the counts, the names turn up in the full pass
+        objDelegate->numVerts = hint->numVerts;
+        objDelegate->numSts = hint->numSts ? hint->numSts : 1;
+        objDelegate->numNorms = hint->numNorms ? hint->numNorms : 1;
+        objDelegate->numFaces = hint->numFaces;
+        objDelegate->numTriangles = hint->numTriangles;
+        
+        numUniqueMtls = hint->numMtls;
+        for (size_t i=0; i < numUniqueMtls; i++) {
+            uniqueMtls[i].mtlName = (i == 0) ? (char *)TKIMPL_DEFAULT_MTL_NAME : NULL;
+            uniqueMtls[i].numTriangles = hint->mtlTriangles[i];
+        }
+        
+        // Counts that couldn't be allocated can't be right either
+        if (TKimpl_GeometryScratchSize( objDelegate, uniqueMtls, numUniqueMtls, 0 ) == TKIMPL_SIZE_OVERFLOW) {
+            hint->failed = 1;
+            return NULL;
+        }
+    } else {
+        // First pass, just count verts and unique materials...
+        TKimpl_InSitu inSitu;
+        int wantInSitu = (objDelegate->inSitu) && (!objDelegate->immediateMode);
+        TKimpl_CountObjPass( objFileData, objFileSize, uniqueMtls, &numUniqueMtls, objDelegate,
+                             wantInSitu ? &inSitu : NULL );
+        
+        int fits = 0;
+        TK_ObjGeometry *geom = NULL;
+        if (wantInSitu) {
+            geom = TKimpl_ParseObjInSitu( objFileData, objFileSize, objDelegate, uniqueMtls, numUniqueMtls,
+                                          &inSitu, &fits );
+        }
+        if (fits) return geom;
+    }
+    
+    TK_ObjArena scratchArena, *arena;
+    TKimpl_Geometry *geom = TKimpl_AllocGeometry( objDelegate, uniqueMtls, numUniqueMtls, 0, &scratchArena, &arena );
+    if (!geom) return NULL;
+    geom->numMaterials = hint ? 1 : numUniqueMtls;
+    
+    // Now space is allocated for all the data, parse again and store
+    TKimpl_ParseObjPass( objFileData, objFileSize,  geom,
+                        geom->materials, &(geom->numMaterials),
+                        objDelegate, TKimpl_ParseTypeFull, NULL, hint, NULL );
+    
+    if ((hint) && (!TKimpl_checkCountHint( geom, hint ))) {
+        hint->failed = 1;
+        return NULL;
+    }
+    
+    return TKimpl_FinishGeometry( geom, arena, objDelegate );
+}
+
+// Stands in for the caller's error callback during a hinted pass, so anything that
+// goes wrong there is reported once by the count pass that replaces it
+typedef struct {
+    void (*error)( size_t lineNumber, const char *message, void *userData );
+    void *userData;
+    int failed;
+} TKimpl_HintErrors;
+
+void TKimpl_hintError( size_t lineNumber, const char *message, void *userData )
+{
+    (void)lineNumber;
+    (void)message;
+    ((TKimpl_HintErrors *)userData)->failed = 1;
+}
+
+TK_ObjGeometry *TK_ParseObjGeometry( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate )
+{
+    // Immediate mode emits during the full pass, so there'd be no going back if the
+    // header turned out to be wrong. In situ needs the count pass to see if it fits.
+    // The sizing call (no scratchMem) always counts, so the size it hands back is right
+    // even when the header isn't.
+    TKimpl_CountHint hint;
+    if ((objDelegate->immediateMode) || (objDelegate->inSitu) ||
+        ((!objDelegate->arena) && (!objDelegate->scratchMem)) ||
+        (!TKimpl_readCountHint( objFileData, objFileSize, &hint ))) {
+        return TKimpl_ParseObjGeometry( objFileData, objFileSize, objDelegate, NULL );
+    }
+    
+    TK_ObjArenaMark mark;
+    if (objDelegate->arena) mark = TK_ObjArenaGetMark( objDelegate->arena );
+    
+    TKimpl_HintErrors hintErrors;
+    hintErrors.error = objDelegate->error;
+    hintErrors.userData = objDelegate->userData;
+    hintErrors.failed = 0;
+    objDelegate->error = TKimpl_hintError;
+    objDelegate->userData = &hintErrors;
+    
+    TK_ObjGeometry *geom = TKimpl_ParseObjGeometry( objFileData, objFileSize, objDelegate, &hint );
+    
+    objDelegate->error = hintErrors.error;
+    objDelegate->userData = hintErrors.userData;
+    if ((!hint.failed) && (!hintErrors.failed)) return geom;
+    
+    // The header doesn't match the file (or the scratch memory was sized for the real
+    // counts, or the file has errors), so start over with a count pass
+    if (objDelegate->arena) TK_ObjArenaRewind( objDelegate->arena, mark );
+    return TKimpl_ParseObjGeometry( objFileData, objFileSize, objDelegate, NULL );
+}
+
+void TKimpl_ParallelFor( const TK_ObjJobSystem *jobs, TK_ObjJobFunc job, void *jobData, size_t numJobs )
+{
+    if ((jobs) && (jobs->parallelFor) && (numJobs > 1)) {
+        jobs->parallelFor( job, jobData, numJobs, jobs->jobContext );
+    } else {
+        for (size_t i=0; i < numJobs; i++) {
+            job( jobData, i, 0 );
+        }
+    }
+}
+
+size_t TK_ObjNumMaterials( TK_ObjGeometry *geom )
+{
+    return geom->numMaterials;
+}
+
+size_t TK_ObjMaterialNumTriangles( TK_ObjGeometry *geom, size_t mtlIndex )
+{
+    return geom->materials[mtlIndex].numTriangles;
+}
+
+char *TK_ObjMaterialName( TK_ObjGeometry *geom, size_t mtlIndex, char *dest, size_t destSize )
+{
+    return TKimpl_stringDelimMtlName( dest, geom->materials[mtlIndex].mtlName, destSize );
+}
+
+const size_t *TK_ObjMaterialRemap( TK_ObjGeometry *geom, size_t mtlIndex )
+{
+    return geom->materials[mtlIndex].remap;
+}
+
+int TK_ObjGeometryBounds( TK_ObjGeometry *geom, TK_ObjBounds *bounds )
+{
+    if (!geom->hasBounds) return 0;
+    *bounds = geom->bounds;
+    return 1;
+}
+
+int TK_ObjMaterialBounds( TK_ObjGeometry *geom, size_t mtlIndex, TK_ObjBounds *bounds )
+{
+    if (!geom->hasBounds) return 0;
+    *bounds = geom->materials[mtlIndex].bounds;
+    return 1;
+}
+
+void TK_ObjCursorOpen( TK_ObjCursor *cursor, TK_ObjGeometry *geom, size_t mtlIndex )
+{
+    TK_ObjCursorOpenRange( cursor, geom, mtlIndex, 0, geom->materials[mtlIndex].numTriangles );
+}
+
+void TK_ObjCursorOpenRange( TK_ObjCursor *cursor, TK_ObjGeometry *geom, size_t mtlIndex,
+                            size_t firstTriangle, size_t numTriangles )
+{
+    size_t mtlTriangles = geom->materials[mtlIndex].numTriangles;
+    if (firstTriangle > mtlTriangles) firstTriangle = mtlTriangles;
+    if (numTriangles > mtlTriangles - firstTriangle) numTriangles = mtlTriangles - firstTriangle;
+    
+    cursor->geom = geom;
+    cursor->mtlIndex = mtlIndex;
+    cursor->triIndex = firstTriangle;
+    cursor->endIndex = firstTriangle + numTriangles;
+    
+    // immediate mode doesn't store any triangles
+    if ((!geom->materials[mtlIndex].triangles) && (!geom->materials[mtlIndex].compactTriangles)) {
+        cursor->endIndex = cursor->triIndex;
+    }
+}
+
+void TK_ObjCursorSeek( TK_ObjCursor *cursor, size_t triIndex )
+{
+    if (triIndex > cursor->endIndex) triIndex = cursor->endIndex;
+    cursor->triIndex = triIndex;
+}
+
+size_t TK_ObjCursorFetch( TK_ObjCursor *cursor, TK_Triangle *dest, size_t maxTriangles )
+{
+    size_t count = cursor->endIndex - cursor->triIndex;
+    if (count > maxTriangles) count = maxTriangles;
+    if (count) {
+        TKimpl_Material *mtl = cursor->geom->materials + cursor->mtlIndex;
+        TKimpl_ExpandTriangles( cursor->geom, mtl, cursor->triIndex, count, dest );
+        cursor->triIndex += count;
+    }
+    return count;
+}
+
+void TK_ObjVertexLayoutDefault( TK_VertexLayout *layout )
+{
+    layout->stride = sizeof(TK_TriangleVert);
+    layout->posOffset = offsetof( TK_TriangleVert, pos );
+    layout->stOffset = offsetof( TK_TriangleVert, st );
+    layout->nrmOffset = offsetof( TK_TriangleVert, nrm );
+    layout->posFormat = TK_VertFormat_Float32;
+    layout->stFormat = TK_VertFormat_Float32;
+    layout->nrmFormat = TK_VertFormat_Float32;
+    layout->flipV = 0;
+}
+
+uint16_t TKimpl_floatToHalf( float value )
+{
+    union { float f; uint32_t u; } bits;
+    bits.f = value;
+    
+    uint32_t sign = (bits.u >> 16) & 0x8000;
+    int32_t exponent = (int32_t)((bits.u >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits.u & 0x7fffff;
+    
+    if (((bits.u >> 23) & 0xff) == 0xff) {
+        // Inf or NaN
+        return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    } else if (exponent >= 31) {
+        // Too big, clamp to inf
+        return (uint16_t)(sign | 0x7c00);
+    } else if (exponent <= 0) {
+        // Denormal or zero
+        if (exponent < -10) return (uint16_t)sign;
+        mantissa |= 0x800000;
+        uint32_t shift = (uint32_t)(14 - exponent);
+        uint32_t half = mantissa >> shift;
+        uint32_t rem = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if ((rem > halfway) || ((rem == halfway) && (half & 1))) half++;
+        return (uint16_t)(sign | half);
+    }
+    
+    // Normal, round to nearest even (a carry rolls into the exponent, which is what we want)
+    uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rem = mantissa & 0x1fff;
+    if ((rem > 0x1000) || ((rem == 0x1000) && (half & 1))) half++;
+    return (uint16_t)half;
+}
+
+void TKimpl_writeVertAttrib( uint8_t *dest, TK_VertFormat format, const float *src, int numComponents )
+{
+    switch (format) {
+        case TK_VertFormat_Float32:
+            for (int i=0; i < numComponents; i++) {
+                ((float*)dest)[i] = src[i];
+            }
+            break;
+        case TK_VertFormat_Float16:
+            for (int i=0; i < numComponents; i++) {
+                ((uint16_t*)dest)[i] = TKimpl_floatToHalf( src[i] );
+            }
+            break;
+        case TK_VertFormat_Snorm16:
+            for (int i=0; i < numComponents; i++) {
+                float v = src[i];
+                if (v < -1.0f) v = -1.0f;
+                if (v > 1.0f) v = 1.0f;
+                ((int16_t*)dest)[i] = (int16_t)(v * 32767.0f + ((v < 0.0f) ? -0.5f : 0.5f));
+            }
+            break;
+        case TK_VertFormat_Unorm16:
+            for (int i=0; i < numComponents; i++) {
+                float v = src[i];
+                if (v < 0.0f) v = 0.0f;
+                if (v > 1.0f) v = 1.0f;
+                ((uint16_t*)dest)[i] = (uint16_t)(v * 65535.0f + 0.5f);
+            }
+            break;
+        case TK_VertFormat_None:
+            break;
+    }
+}
+
+size_t TK_ObjCursorFetchVerts( TK_ObjCursor *cursor, const TK_VertexLayout *layout,
+                               void *dest, size_t maxTriangles )
+{
+    size_t count = cursor->endIndex - cursor->triIndex;
+    if (count > maxTriangles) count = maxTriangles;
+    if (!count) return 0;
+    
+    TK_ObjGeometry *geom = cursor->geom;
+    TKimpl_Material *mtl = geom->materials + cursor->mtlIndex;
+    uint8_t *destVert = (uint8_t*)dest;
+    
+    // Gather each vert right into the destination
+    TKimpl_IndexedTriangle ndxTri;
+    for (size_t vi=0; vi < count*3; vi++) {
+        if (vi % 3 == 0) {
+            TKimpl_LoadIndexedTriangle( geom, mtl, cursor->triIndex + vi/3, &ndxTri );
+        }
+        TKimpl_IndexedVert ndx = (&(ndxTri.vertA))[vi % 3];
+        
+        if (layout->posFormat == TK_VertFormat_Float32) {
+            float *pos = (float*)(destVert + layout->posOffset);
+            pos[0] = geom->vertPos[ndx.posIndex*3 + 0];
+            pos[1] = geom->vertPos[ndx.posIndex*3 + 1];
+            pos[2] = geom->vertPos[ndx.posIndex*3 + 2];
+        } else {
+            TKimpl_writeVertAttrib( destVert + layout->posOffset, layout->posFormat,
+                                    geom->vertPos + ndx.posIndex*3, 3 );
+        }
+        
+        if (layout->stFormat != TK_VertFormat_None) {
+            float st[2];
+            st[0] = geom->vertSt[ndx.stIndex*2 + 0];
+            st[1] = geom->vertSt[ndx.stIndex*2 + 1];
+            if (layout->flipV) st[1] = 1.0f - st[1];
+            TKimpl_writeVertAttrib( destVert + layout->stOffset, layout->stFormat, st, 2 );
+        }
+        
+        if (layout->nrmFormat == TK_VertFormat_Float32) {
+            float *nrm = (float*)(destVert + layout->nrmOffset);
+            nrm[0] = geom->vertNrm[ndx.normIndex*3 + 0];
+            nrm[1] = geom->vertNrm[ndx.normIndex*3 + 1];
+            nrm[2] = geom->vertNrm[ndx.normIndex*3 + 2];
+        } else {
+            TKimpl_writeVertAttrib( destVert + layout->nrmOffset, layout->nrmFormat,
+                                    geom->vertNrm + ndx.normIndex*3, 3 );
+        }
+        
+        destVert += layout->stride;
+    }
+    
+    cursor->triIndex += count;
+    return count;
+}
+
+// Triangles per slice when expanding in parallel, and per batch within a slice
+#define TKIMPL_EXPAND_SLICE (8192)
+#define TKIMPL_EXPAND_BATCH (256)
+
+typedef struct {
+    TK_ObjGeometry *geom;
+    size_t sliceStart[TKIMPL_MAX_UNIQUE_MTLS+1]; // first slice of each material
+    
+    // Either write into the outputs...
+    void **mtlOutputs;
+    const TK_VertexLayout *layout;
+    
+    // ...or hand batches to the delegate
+    TK_ObjDelegate *objDelegate;
+    size_t emitIndex[TKIMPL_MAX_UNIQUE_MTLS];
+} TKimpl_ExpandJob;
+
+void TKimpl_expandSliceJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_ExpandJob *expand = (TKimpl_ExpandJob*)jobData;
+    TK_ObjGeometry *geom = expand->geom;
+    
+    // Find which material this slice is in
+    size_t mi = 0;
+    while (expand->sliceStart[mi+1] <= jobIndex) mi++;
+    size_t firstTriangle = (jobIndex - expand->sliceStart[mi]) * TKIMPL_EXPAND_SLICE;
+    
+    TK_ObjCursor cursor;
+    TK_ObjCursorOpenRange( &cursor, geom, mi, firstTriangle, TKIMPL_EXPAND_SLICE );
+    
+    if (expand->mtlOutputs) {
+        uint8_t *dest = (uint8_t*)expand->mtlOutputs[mi];
+        if (expand->layout) {
+            dest += firstTriangle * 3 * expand->layout->stride;
+            TK_ObjCursorFetchVerts( &cursor, expand->layout, dest, TKIMPL_EXPAND_SLICE );
+        } else {
+            dest += firstTriangle * sizeof(TK_Triangle);
+            TK_ObjCursorFetch( &cursor, (TK_Triangle*)dest, TKIMPL_EXPAND_SLICE );
+        }
+    } else {
+        TK_ObjDelegate *objDelegate = expand->objDelegate;
+        TK_Triangle batch[TKIMPL_EXPAND_BATCH];
+        size_t count;
+        while ((count = TK_ObjCursorFetch( &cursor, batch, TKIMPL_EXPAND_BATCH )) > 0) {
+            objDelegate->triangleBatch( expand->emitIndex[mi], cursor.triIndex - count, batch, count,
+                                        objDelegate->userData );
+        }
+    }
+}
+
+// Sets up the slices, skipping materials with no output
+size_t TKimpl_setupExpandSlices( TKimpl_ExpandJob *expand, TK_ObjGeometry *geom )
+{
+    size_t numSlices = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        expand->sliceStart[mi] = numSlices;
+        if ((expand->mtlOutputs) && (!expand->mtlOutputs[mi])) continue;
+        numSlices += (geom->materials[mi].numTriangles + TKIMPL_EXPAND_SLICE-1) / TKIMPL_EXPAND_SLICE;
+    }
+    expand->sliceStart[geom->numMaterials] = numSlices;
+    return numSlices;
+}
+
+void TK_ObjExpandParallel( TK_ObjGeometry *geom, void **mtlOutputs, const TK_VertexLayout *layout,
+                           const TK_ObjJobSystem *jobs )
+{
+    TKimpl_ExpandJob expand;
+    expand.geom = geom;
+    expand.mtlOutputs = mtlOutputs;
+    expand.layout = layout;
+    expand.objDelegate = NULL;
+    
+    size_t numSlices = TKimpl_setupExpandSlices( &expand, geom );
+    TKimpl_ParallelFor( jobs, TKimpl_expandSliceJob, &expand, numSlices );
+}
+
+// Calls bounds() with the non-empty materials' bounds, in the order they're emitted
+void TKimpl_emitBounds( TK_ObjGeometry *geom, TK_ObjDelegate *objDelegate )
+{
+    if ((!objDelegate->bounds) || (!geom->hasBounds)) return;
+    
+    TK_ObjBounds mtlBounds[TKIMPL_MAX_UNIQUE_MTLS];
+    size_t numBounds = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        if (geom->materials[mi].numTriangles == 0) continue;
+        mtlBounds[numBounds++] = geom->materials[mi].bounds;
+    }
+    objDelegate->bounds( &(geom->bounds), mtlBounds, numBounds, objDelegate->userData );
+}
+
+// Parallel version of the emit loop for triangleBatch
+void TKimpl_EmitParallel( TK_ObjGeometry *geom, TK_ObjDelegate *objDelegate )
+{
+    TKimpl_ExpandJob expand;
+    expand.geom = geom;
+    expand.mtlOutputs = NULL;
+    expand.layout = NULL;
+    expand.objDelegate = objDelegate;
+    
+    TKimpl_emitBounds( geom, objDelegate );
+    
+    // Report the materials up front, on this thread
+    size_t emitIndex = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        if (geom->materials[mi].numTriangles == 0) continue;
+        expand.emitIndex[mi] = emitIndex++;
+        if (objDelegate->material) {
+            char mtlName[TKIMPL_MAX_MATERIAL_NAME];
+            TKimpl_stringDelimMtlName( mtlName, geom->materials[mi].mtlName, TKIMPL_MAX_MATERIAL_NAME );
+            objDelegate->material( mtlName, geom->materials[mi].numTriangles, objDelegate->userData );
+        }
+        if ((objDelegate->remap) && (geom->materials[mi].remap)) {
+            objDelegate->remap( geom->materials[mi].remap, geom->materials[mi].numTriangles, objDelegate->userData );
+        }
+    }
+    
+    size_t numSlices = TKimpl_setupExpandSlices( &expand, geom );
+    TKimpl_ParallelFor( objDelegate->jobs, TKimpl_expandSliceJob, &expand, numSlices );
+}
+
+// Emits parsed geometry through the delegate's callbacks
+void TKimpl_EmitGeometry( TK_ObjGeometry *geom, TK_ObjDelegate *objDelegate )
+{
+    if ((objDelegate->triangleBatch) && (objDelegate->jobs)) {
+        TKimpl_EmitParallel( geom, objDelegate );
+        return;
+    }
+    
+    TKimpl_emitBounds( geom, objDelegate );
+    
+    // Now go through the results with the "triangle soup" API
+    if ((objDelegate->triangle) || (objDelegate->material) || (objDelegate->remap)) {
+        for (size_t mi=0; mi < geom->numMaterials; mi++) {
+            if (geom->materials[mi].numTriangles > 0) {
+                if (objDelegate->material) {
+                    // Copy the mtlName into a nice 0-terminated string
+                    char mtlName[TKIMPL_MAX_MATERIAL_NAME];
+                    TKimpl_stringDelimMtlName(mtlName, geom->materials[mi].mtlName,
+                                              TKIMPL_MAX_MATERIAL_NAME );
+                    
+                    // emit the material name
+                    objDelegate->material( mtlName,
+                                          geom->materials[mi].numTriangles,
+                                          objDelegate->userData );
+                }
+                if ((objDelegate->remap) && (geom->materials[mi].remap)) {
+                    objDelegate->remap( geom->materials[mi].remap, geom->materials[mi].numTriangles,
+                                        objDelegate->userData );
+                }
+                // Now emit all the triangles for the material
+                if (objDelegate->triangle)
+                {
+                    TK_ObjCursor cursor;
+                    TK_ObjCursorOpen( &cursor, geom, mi );
+                    
+                    TK_Triangle batch[64];
+                    size_t count;
+                    while ((count = TK_ObjCursorFetch( &cursor, batch, 64 )) > 0) {
+                        for (size_t bi=0; bi < count; bi++) {
+                            objDelegate->triangle( batch[bi].vertA, batch[bi].vertB, batch[bi].vertC,
+                                                   objDelegate->userData );
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void TK_ParseObj( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate )
+{
+    TK_ObjGeometry *geom = TK_ParseObjGeometry( objFileData, objFileSize, objDelegate );
+    
+    // Immediate mode already emitted everything during the parse
+    if ((!geom) || (objDelegate->immediateMode)) return;
+    
+    TKimpl_EmitGeometry( geom, objDelegate );
+}
+
+size_t TK_ProbeObj( void *objFileData, size_t objFileSize, TK_ObjDelegate *objDelegate )
+{
+    TKimpl_Material uniqueMtls[TKIMPL_MAX_UNIQUE_MTLS];
+    size_t numUniqueMtls = 0;
+    TKimpl_CountObjPass( objFileData, objFileSize, uniqueMtls, &numUniqueMtls, objDelegate, NULL );
+    return numUniqueMtls;
+}
+
+// Which material a slice is in, and its range of triangles
+void TKimpl_sliceRange( const size_t *sliceStart, TK_ObjGeometry *geom, size_t sliceSize, size_t sliceIndex,
+                        size_t *out_mtlIndex, size_t *out_firstTriangle, size_t *out_numTriangles )
+{
+    size_t mi = 0;
+    while (sliceStart[mi+1] <= sliceIndex) mi++;
+    size_t firstTriangle = (sliceIndex - sliceStart[mi]) * sliceSize;
+    size_t numTriangles = geom->materials[mi].numTriangles - firstTriangle;
+    if (numTriangles > sliceSize) numTriangles = sliceSize;
+    
+    *out_mtlIndex = mi;
+    *out_firstTriangle = firstTriangle;
+    *out_numTriangles = numTriangles;
+}
+
+// Positions per job when finding the bounds
+#define TKIMPL_BOUNDS_SLICE (65536)
+
+typedef struct {
+    TK_ObjGeometry *geom;
+    float *sliceBounds; // min xyz, max xyz for each slice
+} TKimpl_BoundsJob;
+
+void TKimpl_boundsSliceJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_BoundsJob *boundsJob = (TKimpl_BoundsJob*)jobData;
+    TK_ObjGeometry *geom = boundsJob->geom;
+    
+    size_t first = jobIndex * TKIMPL_BOUNDS_SLICE;
+    size_t end = first + TKIMPL_BOUNDS_SLICE;
+    if (end > geom->numVertPos) end = geom->numVertPos;
+    
+    float *bounds = boundsJob->sliceBounds + jobIndex*6;
+    const float *pos = geom->vertPos + first*3;
+    for (int i=0; i < 3; i++) {
+        bounds[i] = pos[i];
+        bounds[i+3] = pos[i];
+    }
+    
+    size_t vi = first;
+#ifdef TKIMPL_SIMD_SSE2
+    // Four positions are three vectors, with the lanes going xyzx yzxy zxyz, so
+    // just keep a min and max for each of the three and sort out the lanes after
+    __m128 first0 = _mm_setr_ps( pos[0], pos[1], pos[2], pos[0] );
+    __m128 first1 = _mm_setr_ps( pos[1], pos[2], pos[0], pos[1] );
+    __m128 first2 = _mm_setr_ps( pos[2], pos[0], pos[1], pos[2] );
+    __m128 min0 = first0, min1 = first1, min2 = first2;
+    __m128 max0 = first0, max1 = first1, max2 = first2;
+    for (; vi + 4 <= end; vi += 4, pos += 12) {
+        __m128 p0 = _mm_loadu_ps( pos );
+        __m128 p1 = _mm_loadu_ps( pos + 4 );
+        __m128 p2 = _mm_loadu_ps( pos + 8 );
+        min0 = _mm_min_ps( min0, p0 ); max0 = _mm_max_ps( max0, p0 );
+        min1 = _mm_min_ps( min1, p1 ); max1 = _mm_max_ps( max1, p1 );
+        min2 = _mm_min_ps( min2, p2 ); max2 = _mm_max_ps( max2, p2 );
+    }
+    float lanesMin[12], lanesMax[12];
+    _mm_storeu_ps( lanesMin, min0 ); _mm_storeu_ps( lanesMin + 4, min1 ); _mm_storeu_ps( lanesMin + 8, min2 );
+    _mm_storeu_ps( lanesMax, max0 ); _mm_storeu_ps( lanesMax + 4, max1 ); _mm_storeu_ps( lanesMax + 8, max2 );
+    for (int li=0; li < 12; li++) {
+        if (lanesMin[li] < bounds[li%3]) bounds[li%3] = lanesMin[li];
+        if (lanesMax[li] > bounds[li%3+3]) bounds[li%3+3] = lanesMax[li];
+    }
+#endif
+    for (; vi < end; vi++, pos += 3) {
+        for (int i=0; i < 3; i++) {
+            if (pos[i] < bounds[i]) bounds[i] = pos[i];
+            if (pos[i] > bounds[i+3]) bounds[i+3] = pos[i];
+        }
+    }
+}
+
+// Bounds of all the positions in the geometry, returns 0 if there aren't any
+// (or if scratch is out of memory)
+int TKimpl_PositionBounds( TK_ObjGeometry *geom, TK_ObjArena *scratch, const TK_ObjJobSystem *jobs,
+                           float *out_min, float *out_max )
+{
+    size_t numSlices = (geom->numVertPos + TKIMPL_BOUNDS_SLICE-1) / TKIMPL_BOUNDS_SLICE;
+    if (!numSlices) return 0;
+    
+    TKimpl_BoundsJob boundsJob;
+    boundsJob.geom = geom;
+    boundsJob.sliceBounds = TKImpl_PushStructArray( scratch, float, numSlices*6 );
+    if (!boundsJob.sliceBounds) return 0;
+    
+    TKimpl_ParallelFor( jobs, TKimpl_boundsSliceJob, &boundsJob, numSlices );
+    
+    for (int i=0; i < 3; i++) {
+        out_min[i] = boundsJob.sliceBounds[i];
+        out_max[i] = boundsJob.sliceBounds[i+3];
+    }
+    for (size_t si=1; si < numSlices; si++) {
+        float *bounds = boundsJob.sliceBounds + si*6;
+        for (int i=0; i < 3; i++) {
+            if (bounds[i] < out_min[i]) out_min[i] = bounds[i];
+            if (bounds[i+3] > out_max[i]) out_max[i] = bounds[i+3];
+        }
+    }
+    return 1;
+}
+
+#define TKIMPL_FLT_MAX (3.402823466e+38F)
+
+// Triangles per job when finding the cell of each triangle
+#define TKIMPL_TILE_SLICE (16384)
+
+typedef struct {
+    TK_ObjGeometry *geom;
+    unsigned int gridSize[3];
+    size_t numCells;
+    float gridMin[3];
+    float cellScale[3];
+    size_t triangleSize;
+    size_t sliceStart[TKIMPL_MAX_UNIQUE_MTLS+1];
+    
+    // per material
+    uint32_t *cellIds[TKIMPL_MAX_UNIQUE_MTLS];
+    
+    // Shared by the materials, which are sorted one at a time
+    size_t *cellEnds;   // end of each cell's range once sorted
+    float *cellBounds;  // min xyz, max xyz for each cell
+    uint8_t *sortedTris;
+    size_t *sortedRemap;
+} TKimpl_TileJob;
+
+static inline uint8_t *TKimpl_materialTriangleData( TK_ObjGeometry *geom, TKimpl_Material *mtl )
+{
+    return geom->compactIndices ? (uint8_t*)mtl->compactTriangles : (uint8_t*)mtl->triangles;
+}
+
+// Copies a stored triangle between two arrays of the geometry's triangle type
+static inline void TKimpl_copyTriangle( TK_ObjGeometry *geom, uint8_t *dest, size_t destIndex,
+                                        const uint8_t *src, size_t srcIndex )
+{
+    if (geom->compactIndices) {
+        ((TKimpl_CompactTriangle*)dest)[destIndex] = ((const TKimpl_CompactTriangle*)src)[srcIndex];
+    } else {
+        ((TKimpl_IndexedTriangle*)dest)[destIndex] = ((const TKimpl_IndexedTriangle*)src)[srcIndex];
+    }
+}
+
+void TKimpl_tileCellJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_TileJob *tile = (TKimpl_TileJob*)jobData;
+    TK_ObjGeometry *geom = tile->geom;
+    
+    size_t mi, firstTriangle, numTriangles;
+    TKimpl_sliceRange( tile->sliceStart, geom, TKIMPL_TILE_SLICE, jobIndex, &mi, &firstTriangle, &numTriangles );
+    TKimpl_Material *mtl = geom->materials + mi;
+    
+    for (size_t ti=firstTriangle; ti < firstTriangle + numTriangles; ti++) {
+        TKimpl_IndexedTriangle ndxTri;
+        TKimpl_LoadIndexedTriangle( geom, mtl, ti, &ndxTri );
+        const float *a = geom->vertPos + ndxTri.vertA.posIndex*3;
+        const float *b = geom->vertPos + ndxTri.vertB.posIndex*3;
+        const float *c = geom->vertPos + ndxTri.vertC.posIndex*3;
+        
+        unsigned int cell[3];
+        for (int i=0; i < 3; i++) {
+            float centroid = (a[i] + b[i] + c[i]) * (1.0f/3.0f);
+            float coord = (centroid - tile->gridMin[i]) * tile->cellScale[i];
+            cell[i] = (coord > 0.0f) ? (unsigned int)coord : 0;
+            if (cell[i] >= tile->gridSize[i]) cell[i] = tile->gridSize[i]-1;
+        }
+        tile->cellIds[mi][ti] = (uint32_t)((cell[2]*tile->gridSize[1] + cell[1])*tile->gridSize[0] + cell[0]);
+    }
+}
+
+// Counting sort of one material's triangles by cell, into the shared cell buffers
+void TKimpl_tileSortMaterial( TKimpl_TileJob *tile, size_t mtlIndex )
+{
+    TK_ObjGeometry *geom = tile->geom;
+    TKimpl_Material *mtl = geom->materials + mtlIndex;
+    
+    uint32_t *cellIds = tile->cellIds[mtlIndex];
+    size_t *cellEnds = tile->cellEnds;
+    float *cellBounds = tile->cellBounds;
+    
+    // Count, then turn the counts into start offsets
+    for (size_t ci=0; ci < tile->numCells; ci++) {
+        cellEnds[ci] = 0;
+    }
+    for (size_t ti=0; ti < mtl->numTriangles; ti++) {
+        cellEnds[cellIds[ti]]++;
+    }
+    size_t offset = 0;
+    for (size_t ci=0; ci < tile->numCells; ci++) {
+        size_t count = cellEnds[ci];
+        cellEnds[ci] = offset;
+        offset += count;
+        
+        float *bounds = cellBounds + ci*6;
+        for (int i=0; i < 3; i++) {
+            bounds[i] = TKIMPL_FLT_MAX;
+            bounds[i+3] = -TKIMPL_FLT_MAX;
+        }
+    }
+    
+    // Scatter into the sorted copy, growing the cell bounds as we go. Each
+    // cell's offset is bumped along until it ends up at the end of its range.
+    uint8_t *triData = TKimpl_materialTriangleData( geom, mtl );
+    for (size_t ti=0; ti < mtl->numTriangles; ti++) {
+        uint32_t ci = cellIds[ti];
+        if (mtl->remap) {
+            tile->sortedRemap[cellEnds[ci]] = mtl->remap[ti];
+        }
+        TKimpl_copyTriangle( geom, tile->sortedTris, cellEnds[ci]++, triData, ti );
+        
+        TKimpl_IndexedTriangle ndxTri;
+        TKimpl_LoadIndexedTriangle( geom, mtl, ti, &ndxTri );
+        TKimpl_IndexedVert *ndxVerts = &(ndxTri.vertA);
+        float *bounds = cellBounds + ci*6;
+        for (int vi=0; vi < 3; vi++) {
+            const float *pos = geom->vertPos + ndxVerts[vi].posIndex*3;
+            for (int i=0; i < 3; i++) {
+                if (pos[i] < bounds[i]) bounds[i] = pos[i];
+                if (pos[i] > bounds[i+3]) bounds[i+3] = pos[i];
+            }
+        }
+    }
+    
+    for (size_t ti=0; ti < mtl->numTriangles; ti++) {
+        TKimpl_copyTriangle( geom, triData, ti, tile->sortedTris, ti );
+    }
+    if (mtl->remap) {
+        for (size_t ti=0; ti < mtl->numTriangles; ti++) {
+            mtl->remap[ti] = tile->sortedRemap[ti];
+        }
+    }
+}
+
+size_t TK_ObjTileGeometry( TK_ObjGeometry *geom, const unsigned int gridSize[3],
+                           TK_ObjArena *scratch, TK_ObjTileFunc tileFunc, void *userData,
+                           const TK_ObjJobSystem *jobs )
+{
+    TK_ObjArenaMark mark = TK_ObjArenaGetMark( scratch );
+    
+    TKimpl_TileJob *tile = TKImpl_PushStruct( scratch, TKimpl_TileJob );
+    float boundsMin[3], boundsMax[3];
+    if ((!tile) || (!TKimpl_PositionBounds( geom, scratch, jobs, boundsMin, boundsMax ))) {
+        TK_ObjArenaRewind( scratch, mark );
+        return 0;
+    }
+    
+    tile->geom = geom;
+    tile->numCells = 1;
+    for (int i=0; i < 3; i++) {
+        tile->gridSize[i] = (gridSize[i] > 0) ? gridSize[i] : 1;
+        tile->numCells *= tile->gridSize[i];
+        
+        float extent = boundsMax[i] - boundsMin[i];
+        tile->gridMin[i] = boundsMin[i];
+        tile->cellScale[i] = (extent > 0.0f) ? ((float)tile->gridSize[i] / extent) : 0.0f;
+    }
+    tile->triangleSize = geom->compactIndices ? sizeof(TKimpl_CompactTriangle) : sizeof(TKimpl_IndexedTriangle);
+    
+    // Cell ids have to fit in 32 bits
+    if (tile->numCells > UINT32_MAX) {
+        TK_ObjArenaRewind( scratch, mark );
+        return 0;
+    }
+    
+    // Everything's allocated up front, so running out doesn't leave some materials sorted
+    int outOfMemory = 0;
+    size_t maxTriangles = 0;
+    int anyRemap = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        TKimpl_Material *mtl = geom->materials + mi;
+        if (!TKimpl_materialTriangleData( geom, mtl )) {
+            // immediate mode geometry doesn't have any triangles to sort
+            tile->sliceStart[mi] = 0;
+            continue;
+        }
+        tile->cellIds[mi] = TKImpl_PushStructArray( scratch, uint32_t, mtl->numTriangles );
+        if (!tile->cellIds[mi]) outOfMemory = 1;
+        if (mtl->numTriangles > maxTriangles) maxTriangles = mtl->numTriangles;
+        if (mtl->remap) anyRemap = 1;
+    }
+    tile->cellEnds = TKImpl_PushStructArray( scratch, size_t, tile->numCells );
+    tile->cellBounds = TKImpl_PushStructArray( scratch, float, tile->numCells*6 );
+    tile->sortedTris = (uint8_t*)TK_ObjArenaPush( scratch, maxTriangles * tile->triangleSize );
+    tile->sortedRemap = anyRemap ? TKImpl_PushStructArray( scratch, size_t, maxTriangles ) : NULL;
+    if ((!tile->cellEnds) || (!tile->cellBounds) || (!tile->sortedTris) || ((anyRemap) && (!tile->sortedRemap))) {
+        outOfMemory = 1;
+    }
+    if (outOfMemory) {
+        TK_ObjArenaRewind( scratch, mark );
+        return 0;
+    }
+    
+    size_t numSlices = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        tile->sliceStart[mi] = numSlices;
+        if (TKimpl_materialTriangleData( geom, geom->materials + mi )) {
+            numSlices += (geom->materials[mi].numTriangles + TKIMPL_TILE_SLICE-1) / TKIMPL_TILE_SLICE;
+        }
+    }
+    tile->sliceStart[geom->numMaterials] = numSlices;
+    
+    TKimpl_ParallelFor( jobs, TKimpl_tileCellJob, tile, numSlices );
+    
+    // Sort each material and hand out its non-empty cells before the next one reuses the buffers
+    size_t numTiles = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        if ((!geom->materials[mi].numTriangles) || (!TKimpl_materialTriangleData( geom, geom->materials + mi ))) {
+            continue;
+        }
+        TKimpl_tileSortMaterial( tile, mi );
+        
+        size_t cellStart = 0;
+        for (size_t ci=0; ci < tile->numCells; ci++) {
+            size_t cellEnd = tile->cellEnds[ci];
+            if (cellEnd > cellStart) {
+                TK_ObjTile objTile;
+                objTile.mtlIndex = mi;
+                objTile.cell[0] = (unsigned int)(ci % tile->gridSize[0]);
+                objTile.cell[1] = (unsigned int)((ci / tile->gridSize[0]) % tile->gridSize[1]);
+                objTile.cell[2] = (unsigned int)(ci / ((size_t)tile->gridSize[0] * tile->gridSize[1]));
+                objTile.firstTriangle = cellStart;
+                objTile.numTriangles = cellEnd - cellStart;
+                for (int i=0; i < 3; i++) {
+                    objTile.bboxMin[i] = tile->cellBounds[ci*6 + i];
+                    objTile.bboxMax[i] = tile->cellBounds[ci*6 + i + 3];
+                }
+                if (tileFunc) {
+                    tileFunc( geom, &objTile, userData );
+                }
+                numTiles++;
+            }
+            cellStart = cellEnd;
+        }
+    }
+    
+    TK_ObjArenaRewind( scratch, mark );
+    return numTiles;
+}
+
+// Triangles per job for the Morton sort, each slice keeps a 256 entry histogram
+#define TKIMPL_MORTON_SLICE (65536)
+
+// Bits per axis in the Morton codes, 3*10 fits in 32 bits
+#define TKIMPL_MORTON_BITS (10)
+
+typedef struct {
+    TK_ObjGeometry *geom;
+    TKimpl_Material *mtl;
+    float boundsMin[3];
+    float scale[3];
+    size_t numSlices;
+    
+    // Keys and triangle indices, ping-ponged between each radix pass
+    uint32_t *keys[2];
+    size_t *vals[2];
+    int src;
+    int shift;
+    
+    size_t *histograms; // 256 per slice
+    uint8_t *sortedTris;
+} TKimpl_MortonJob;
+
+// Spreads the low 10 bits out to every third bit
+static inline uint32_t TKimpl_mortonSpread( uint32_t x )
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8))  & 0x0300f00f;
+    x = (x | (x << 4))  & 0x030c30c3;
+    x = (x | (x << 2))  & 0x09249249;
+    return x;
+}
+
+static inline void TKimpl_mortonSliceRange( TKimpl_MortonJob *morton, size_t sliceIndex,
+                                            size_t *out_first, size_t *out_end )
+{
+    *out_first = sliceIndex * TKIMPL_MORTON_SLICE;
+    *out_end = *out_first + TKIMPL_MORTON_SLICE;
+    if (*out_end > morton->mtl->numTriangles) *out_end = morton->mtl->numTriangles;
+}
+
+void TKimpl_mortonKeyJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_MortonJob *morton = (TKimpl_MortonJob*)jobData;
+    TK_ObjGeometry *geom = morton->geom;
+    size_t first, end;
+    TKimpl_mortonSliceRange( morton, jobIndex, &first, &end );
+    
+    const float maxCoord = (float)((1 << TKIMPL_MORTON_BITS) - 1);
+    for (size_t ti=first; ti < end; ti++) {
+        TKimpl_IndexedTriangle ndxTri;
+        TKimpl_LoadIndexedTriangle( geom, morton->mtl, ti, &ndxTri );
+        const float *a = geom->vertPos + ndxTri.vertA.posIndex*3;
+        const float *b = geom->vertPos + ndxTri.vertB.posIndex*3;
+        const float *c = geom->vertPos + ndxTri.vertC.posIndex*3;
+        
+        uint32_t key = 0;
+        for (int i=0; i < 3; i++) {
+            float centroid = (a[i] + b[i] + c[i]) * (1.0f/3.0f);
+            float coord = (centroid - morton->boundsMin[i]) * morton->scale[i];
+            if (coord < 0.0f) coord = 0.0f;
+            if (coord > maxCoord) coord = maxCoord;
+            key |= TKimpl_mortonSpread( (uint32_t)coord ) << i;
+        }
+        morton->keys[0][ti] = key;
+        morton->vals[0][ti] = ti;
+    }
+}
+
+void TKimpl_mortonHistogramJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_MortonJob *morton = (TKimpl_MortonJob*)jobData;
+    size_t first, end;
+    TKimpl_mortonSliceRange( morton, jobIndex, &first, &end );
+    
+    size_t *histogram = morton->histograms + jobIndex*256;
+    for (int d=0; d < 256; d++) {
+        histogram[d] = 0;
+    }
+    const uint32_t *keys = morton->keys[morton->src];
+    for (size_t ti=first; ti < end; ti++) {
+        histogram[(keys[ti] >> morton->shift) & 0xff]++;
+    }
+}
+
+void TKimpl_mortonScatterJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_MortonJob *morton = (TKimpl_MortonJob*)jobData;
+    size_t first, end;
+    TKimpl_mortonSliceRange( morton, jobIndex, &first, &end );
+    
+    // The histogram holds this slice's starting offset for each digit by now
+    size_t *offsets = morton->histograms + jobIndex*256;
+    const uint32_t *srcKeys = morton->keys[morton->src];
+    const size_t *srcVals = morton->vals[morton->src];
+    uint32_t *destKeys = morton->keys[!morton->src];
+    size_t *destVals = morton->vals[!morton->src];
+    for (size_t ti=first; ti < end; ti++) {
+        size_t dest = offsets[(srcKeys[ti] >> morton->shift) & 0xff]++;
+        destKeys[dest] = srcKeys[ti];
+        destVals[dest] = srcVals[ti];
+    }
+}
+
+void TKimpl_mortonPermuteJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_MortonJob *morton = (TKimpl_MortonJob*)jobData;
+    size_t first, end;
+    TKimpl_mortonSliceRange( morton, jobIndex, &first, &end );
+    
+    const size_t *order = morton->vals[morton->src];
+    uint8_t *triData = TKimpl_materialTriangleData( morton->geom, morton->mtl );
+    for (size_t ti=first; ti < end; ti++) {
+        TKimpl_copyTriangle( morton->geom, morton->sortedTris, ti, triData, order[ti] );
+    }
+}
+
+void TKimpl_mortonCopyBackJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_MortonJob *morton = (TKimpl_MortonJob*)jobData;
+    size_t first, end;
+    TKimpl_mortonSliceRange( morton, jobIndex, &first, &end );
+    
+    uint8_t *triData = TKimpl_materialTriangleData( morton->geom, morton->mtl );
+    for (size_t ti=first; ti < end; ti++) {
+        TKimpl_copyTriangle( morton->geom, triData, ti, morton->sortedTris, ti );
+    }
+    
+    // The remap is vals[0], so it only needs a copy if the last pass left it in vals[1]
+    if (morton->src) {
+        for (size_t ti=first; ti < end; ti++) {
+            morton->vals[0][ti] = morton->vals[1][ti];
+        }
+    }
+}
+
+// Largest material that's going to be sorted
+size_t TKimpl_mortonMaxTriangles( TKimpl_Material *materials, size_t numMaterials )
+{
+    size_t maxTriangles = 0;
+    for (size_t mi=0; mi < numMaterials; mi++) {
+        if (materials[mi].numTriangles > maxTriangles) maxTriangles = materials[mi].numTriangles;
+    }
+    return maxTriangles;
+}
+
+size_t TKimpl_MortonScratchSize( size_t numVerts, size_t maxTriangles, size_t triangleSize )
+{
+    size_t numSlices = (maxTriangles + TKIMPL_MORTON_SLICE-1) / TKIMPL_MORTON_SLICE;
+    size_t numBoundsSlices = (numVerts + TKIMPL_BOUNDS_SLICE-1) / TKIMPL_BOUNDS_SLICE;
+    return TKimpl_ArenaSize( sizeof(TKimpl_MortonJob) ) +
+           TKimpl_ArenaSize( sizeof(float) * numBoundsSlices * 6 ) +
+           TKimpl_ArenaSize( sizeof(uint32_t) * maxTriangles ) * 2 +
+           TKimpl_ArenaSize( sizeof(size_t) * maxTriangles ) +
+           TKimpl_ArenaSize( sizeof(size_t) * numSlices * 256 ) +
+           TKimpl_ArenaSize( triangleSize * maxTriangles );
+}
+
+int TKimpl_SortMorton( TK_ObjGeometry *geom, TK_ObjArena *arena, const TK_ObjJobSystem *jobs )
+{
+    // Nothing to sort by, leave everything in file order
+    if (!geom->numVertPos) {
+        for (size_t mi=0; mi < geom->numMaterials; mi++) {
+            TKimpl_Material *mtl = geom->materials + mi;
+            for (size_t ti=0; (mtl->remap) && (ti < mtl->numTriangles); ti++) {
+                mtl->remap[ti] = ti;
+            }
+        }
+        return 1;
+    }
+    
+    TK_ObjArenaMark mark = TK_ObjArenaGetMark( arena );
+    
+    // Same order as TKimpl_MortonScratchSize
+    TKimpl_MortonJob *morton = TKImpl_PushStruct( arena, TKimpl_MortonJob );
+    float boundsMax[3];
+    if ((!morton) || (!TKimpl_PositionBounds( geom, arena, jobs, morton->boundsMin, boundsMax ))) {
+        TK_ObjArenaRewind( arena, mark );
+        return 0;
+    }
+    
+    size_t maxTriangles = TKimpl_mortonMaxTriangles( geom->materials, geom->numMaterials );
+    size_t triangleSize = geom->compactIndices ? sizeof(TKimpl_CompactTriangle) : sizeof(TKimpl_IndexedTriangle);
+    morton->geom = geom;
+    morton->keys[0] = TKImpl_PushStructArray( arena, uint32_t, maxTriangles );
+    morton->keys[1] = TKImpl_PushStructArray( arena, uint32_t, maxTriangles );
+    morton->vals[1] = TKImpl_PushStructArray( arena, size_t, maxTriangles );
+    morton->histograms = TKImpl_PushStructArray( arena, size_t, ((maxTriangles + TKIMPL_MORTON_SLICE-1) / TKIMPL_MORTON_SLICE) * 256 );
+    morton->sortedTris = (uint8_t*)TK_ObjArenaPush( arena, triangleSize * maxTriangles );
+    if ((!morton->keys[0]) || (!morton->keys[1]) || (!morton->vals[1]) ||
+        (!morton->histograms) || (!morton->sortedTris)) {
+        TK_ObjArenaRewind( arena, mark );
+        return 0;
+    }
+    
+    const float gridSize = (float)(1 << TKIMPL_MORTON_BITS);
+    for (int i=0; i < 3; i++) {
+        float extent = boundsMax[i] - morton->boundsMin[i];
+        morton->scale[i] = (extent > 0.0f) ? (gridSize / extent) : 0.0f;
+    }
+    
+    // One material at a time, each spread over the job system
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        TKimpl_Material *mtl = geom->materials + mi;
+        if ((!mtl->numTriangles) || (!mtl->remap)) continue;
+        
+        morton->mtl = mtl;
+        morton->vals[0] = mtl->remap;
+        morton->src = 0;
+        morton->numSlices = (mtl->numTriangles + TKIMPL_MORTON_SLICE-1) / TKIMPL_MORTON_SLICE;
+        TKimpl_ParallelFor( jobs, TKimpl_mortonKeyJob, morton, morton->numSlices );
+        
+        // LSD radix sort, a byte at a time
+        for (morton->shift = 0; morton->shift < 3*TKIMPL_MORTON_BITS; morton->shift += 8) {
+            TKimpl_ParallelFor( jobs, TKimpl_mortonHistogramJob, morton, morton->numSlices );
+            
+            // Turn the histograms into each slice's offsets, digit major so the sort is stable.
+            // If every key has the same digit, the pass wouldn't move anything.
+            size_t offset = 0;
+            int skipPass = 0;
+            for (int d=0; d < 256; d++) {
+                size_t digitStart = offset;
+                for (size_t si=0; si < morton->numSlices; si++) {
+                    size_t count = morton->histograms[si*256 + d];
+                    morton->histograms[si*256 + d] = offset;
+                    offset += count;
+                }
+                if (offset - digitStart == mtl->numTriangles) skipPass = 1;
+            }
+            if (skipPass) continue;
+            
+            TKimpl_ParallelFor( jobs, TKimpl_mortonScatterJob, morton, morton->numSlices );
+            morton->src = !morton->src;
+        }
+        
+        TKimpl_ParallelFor( jobs, TKimpl_mortonPermuteJob, morton, morton->numSlices );
+        TKimpl_ParallelFor( jobs, TKimpl_mortonCopyBackJob, morton, morton->numSlices );
+    }
+    
+    TK_ObjArenaRewind( arena, mark );
+    return 1;
+}
+
+// Triangles per job when finding the material bounds
+#define TKIMPL_BOUNDS_TRI_SLICE (16384)
+
+typedef struct {
+    float bboxMin[3];
+    float bboxMax[3];
+    double sum[3];
+    float maxDistSq;
+} TKimpl_BoundsPartial;
+
+typedef struct {
+    TK_ObjGeometry *geom;
+    size_t numVertSlices;
+    size_t sliceStart[TKIMPL_MAX_UNIQUE_MTLS+1]; // first triangle slice of each material
+    
+    // The vertex slices, then the triangle slices
+    TKimpl_BoundsPartial *partials;
+} TKimpl_MtlBoundsJob;
+
+static inline double TKimpl_sqrtd( double x )
+{
+#ifdef TKIMPL_SIMD_SSE2
+    return _mm_cvtsd_f64( _mm_sqrt_sd( _mm_setzero_pd(), _mm_set_sd( x ) ) );
+#else
+    // No libm in the core, so Newton's method from a guess with half the exponent
+    if (x <= 0.0) return 0.0;
+    double r = 1.0;
+    while (r*r*4.0 < x) r *= 2.0;
+    while (r*r > x*4.0) r *= 0.5;
+    for (int i=0; i < 6; i++) {
+        r = 0.5 * (r + x/r);
+    }
+    return r;
+#endif
+}
+
+static inline float TKimpl_sqrt( float x )
+{
+#ifdef TKIMPL_SIMD_SSE2
+    return _mm_cvtss_f32( _mm_sqrt_ss( _mm_set_ss( x ) ) );
+#else
+    return (float)TKimpl_sqrtd( x );
+#endif
+}
+
+static inline float TKimpl_distSq( const float *p, const float *center )
+{
+    float dx = p[0] - center[0];
+    float dy = p[1] - center[1];
+    float dz = p[2] - center[2];
+    return dx*dx + dy*dy + dz*dz;
+}
+
+// Vertex slices find the file radius, triangle slices find the box and the corner
+// sums of their piece of a material
+void TKimpl_mtlBoundsJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_MtlBoundsJob *boundsJob = (TKimpl_MtlBoundsJob*)jobData;
+    TK_ObjGeometry *geom = boundsJob->geom;
+    TKimpl_BoundsPartial *partial = boundsJob->partials + jobIndex;
+    
+    if (jobIndex < boundsJob->numVertSlices) {
+        size_t first = jobIndex * TKIMPL_BOUNDS_SLICE;
+        size_t end = first + TKIMPL_BOUNDS_SLICE;
+        if (end > geom->numVertPos) end = geom->numVertPos;
+        
+        float maxDistSq = 0.0f;
+        for (size_t vi=first; vi < end; vi++) {
+            float distSq = TKimpl_distSq( geom->vertPos + vi*3, geom->bounds.center );
+            if (distSq > maxDistSq) maxDistSq = distSq;
+        }
+        partial->maxDistSq = maxDistSq;
+        return;
+    }
+    
+    size_t mi, firstTriangle, numTriangles;
+    TKimpl_sliceRange( boundsJob->sliceStart, geom, TKIMPL_BOUNDS_TRI_SLICE, jobIndex - boundsJob->numVertSlices,
+                       &mi, &firstTriangle, &numTriangles );
+    TKimpl_Material *mtl = geom->materials + mi;
+    
+    double sum[3] = { 0.0, 0.0, 0.0 };
+    TKimpl_IndexedTriangle ndxTri;
+    TKimpl_LoadIndexedTriangle( geom, mtl, firstTriangle, &ndxTri );
+#ifdef TKIMPL_SIMD_SSE2
+    // One position per vector, the 4th lane is junk (or the vert padding)
+    __m128 bboxMin = _mm_loadu_ps( geom->vertPos + ndxTri.vertA.posIndex*3 );
+    __m128 bboxMax = bboxMin;
+#else
+    float *bboxMin = partial->bboxMin;
+    float *bboxMax = partial->bboxMax;
+    for (int i=0; i < 3; i++) {
+        bboxMin[i] = bboxMax[i] = geom->vertPos[ndxTri.vertA.posIndex*3 + i];
+    }
+#endif
+    for (size_t ti=firstTriangle; ti < firstTriangle + numTriangles; ti++) {
+        TKimpl_LoadIndexedTriangle( geom, mtl, ti, &ndxTri );
+        const float *corner[3] = {
+            geom->vertPos + ndxTri.vertA.posIndex*3,
+            geom->vertPos + ndxTri.vertB.posIndex*3,
+            geom->vertPos + ndxTri.vertC.posIndex*3
+        };
+        for (int ci=0; ci < 3; ci++) {
+#ifdef TKIMPL_SIMD_SSE2
+            __m128 p = _mm_loadu_ps( corner[ci] );
+            bboxMin = _mm_min_ps( bboxMin, p );
+            bboxMax = _mm_max_ps( bboxMax, p );
+#endif
+            for (int i=0; i < 3; i++) {
+#ifndef TKIMPL_SIMD_SSE2
+                if (corner[ci][i] < bboxMin[i]) bboxMin[i] = corner[ci][i];
+                if (corner[ci][i] > bboxMax[i]) bboxMax[i] = corner[ci][i];
+#endif
+                sum[i] += corner[ci][i];
+            }
+        }
+    }
+#ifdef TKIMPL_SIMD_SSE2
+    float lanesMin[4], lanesMax[4];
+    _mm_storeu_ps( lanesMin, bboxMin );
+    _mm_storeu_ps( lanesMax, bboxMax );
+    for (int i=0; i < 3; i++) {
+        partial->bboxMin[i] = lanesMin[i];
+        partial->bboxMax[i] = lanesMax[i];
+    }
+#endif
+    for (int i=0; i < 3; i++) {
+        partial->sum[i] = sum[i];
+    }
+}
+
+// Second pass over the triangle slices, once each material's center is known
+void TKimpl_mtlRadiusJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_MtlBoundsJob *boundsJob = (TKimpl_MtlBoundsJob*)jobData;
+    TK_ObjGeometry *geom = boundsJob->geom;
+    TKimpl_BoundsPartial *partial = boundsJob->partials + boundsJob->numVertSlices + jobIndex;
+    
+    size_t mi, firstTriangle, numTriangles;
+    TKimpl_sliceRange( boundsJob->sliceStart, geom, TKIMPL_BOUNDS_TRI_SLICE, jobIndex,
+                       &mi, &firstTriangle, &numTriangles );
+    TKimpl_Material *mtl = geom->materials + mi;
+    
+    float maxDistSq = 0.0f;
+    for (size_t ti=firstTriangle; ti < firstTriangle + numTriangles; ti++) {
+        TKimpl_IndexedTriangle ndxTri;
+        TKimpl_LoadIndexedTriangle( geom, mtl, ti, &ndxTri );
+        float distA = TKimpl_distSq( geom->vertPos + ndxTri.vertA.posIndex*3, mtl->bounds.center );
+        float distB = TKimpl_distSq( geom->vertPos + ndxTri.vertB.posIndex*3, mtl->bounds.center );
+        float distC = TKimpl_distSq( geom->vertPos + ndxTri.vertC.posIndex*3, mtl->bounds.center );
+        if (distA > maxDistSq) maxDistSq = distA;
+        if (distB > maxDistSq) maxDistSq = distB;
+        if (distC > maxDistSq) maxDistSq = distC;
+    }
+    partial->maxDistSq = maxDistSq;
+}
+
+size_t TKimpl_BoundsScratchSize( size_t numVerts, TKimpl_Material *materials, size_t numMaterials )
+{
+    size_t numVertSlices = (numVerts + TKIMPL_BOUNDS_SLICE-1) / TKIMPL_BOUNDS_SLICE;
+    size_t numTriSlices = 0;
+    for (size_t mi=0; mi < numMaterials; mi++) {
+        numTriSlices += (materials[mi].numTriangles + TKIMPL_BOUNDS_TRI_SLICE-1) / TKIMPL_BOUNDS_TRI_SLICE;
+    }
+    return TKimpl_ArenaSize( sizeof(TKimpl_MtlBoundsJob) ) +
+           TKimpl_ArenaSize( sizeof(float) * numVertSlices * 6 ) +
+           TKimpl_ArenaSize( sizeof(TKimpl_BoundsPartial) * (numVertSlices + numTriSlices) );
+}
+
+int TKimpl_ComputeBounds( TK_ObjGeometry *geom, TK_ObjArena *arena, const TK_ObjJobSystem *jobs )
+{
+    TK_ObjBounds zeroBounds = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, 0.0f, { 0.0f, 0.0f, 0.0f } };
+    geom->bounds = zeroBounds;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        geom->materials[mi].bounds = zeroBounds;
+    }
+    
+    // No positions, so there's nothing to bound
+    if (!geom->numVertPos) {
+        geom->hasBounds = 1;
+        return 1;
+    }
+    
+    TK_ObjArenaMark mark = TK_ObjArenaGetMark( arena );
+    
+    // Same order as TKimpl_BoundsScratchSize
+    TKimpl_MtlBoundsJob *boundsJob = TKImpl_PushStruct( arena, TKimpl_MtlBoundsJob );
+    if ((!boundsJob) || (!TKimpl_PositionBounds( geom, arena, jobs, geom->bounds.bboxMin, geom->bounds.bboxMax ))) {
+        TK_ObjArenaRewind( arena, mark );
+        return 0;
+    }
+    for (int i=0; i < 3; i++) {
+        geom->bounds.center[i] = (geom->bounds.bboxMin[i] + geom->bounds.bboxMax[i]) * 0.5f;
+    }
+    
+    size_t numTriSlices = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        boundsJob->sliceStart[mi] = numTriSlices;
+        numTriSlices += (geom->materials[mi].numTriangles + TKIMPL_BOUNDS_TRI_SLICE-1) / TKIMPL_BOUNDS_TRI_SLICE;
+    }
+    boundsJob->sliceStart[geom->numMaterials] = numTriSlices;
+    
+    boundsJob->geom = geom;
+    boundsJob->numVertSlices = (geom->numVertPos + TKIMPL_BOUNDS_SLICE-1) / TKIMPL_BOUNDS_SLICE;
+    boundsJob->partials = TKImpl_PushStructArray( arena, TKimpl_BoundsPartial, boundsJob->numVertSlices + numTriSlices );
+    if (!boundsJob->partials) {
+        TK_ObjArenaRewind( arena, mark );
+        return 0;
+    }
+    
+    // File radius and the material boxes in one go
+    TKimpl_ParallelFor( jobs, TKimpl_mtlBoundsJob, boundsJob, boundsJob->numVertSlices + numTriSlices );
+    
+    float maxDistSq = 0.0f;
+    for (size_t si=0; si < boundsJob->numVertSlices; si++) {
+        if (boundsJob->partials[si].maxDistSq > maxDistSq) maxDistSq = boundsJob->partials[si].maxDistSq;
+    }
+    geom->bounds.radius = TKimpl_sqrt( maxDistSq );
+    
+    double fileSum[3] = { 0.0, 0.0, 0.0 };
+    size_t fileTriangles = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        TKimpl_Material *mtl = geom->materials + mi;
+        if (!mtl->numTriangles) continue;
+        
+        TKimpl_BoundsPartial *partials = boundsJob->partials + boundsJob->numVertSlices;
+        double sum[3] = { 0.0, 0.0, 0.0 };
+        for (int i=0; i < 3; i++) {
+            mtl->bounds.bboxMin[i] = partials[boundsJob->sliceStart[mi]].bboxMin[i];
+            mtl->bounds.bboxMax[i] = partials[boundsJob->sliceStart[mi]].bboxMax[i];
+        }
+        for (size_t si=boundsJob->sliceStart[mi]; si < boundsJob->sliceStart[mi+1]; si++) {
+            for (int i=0; i < 3; i++) {
+                if (partials[si].bboxMin[i] < mtl->bounds.bboxMin[i]) mtl->bounds.bboxMin[i] = partials[si].bboxMin[i];
+                if (partials[si].bboxMax[i] > mtl->bounds.bboxMax[i]) mtl->bounds.bboxMax[i] = partials[si].bboxMax[i];
+                sum[i] += partials[si].sum[i];
+            }
+        }
+        for (int i=0; i < 3; i++) {
+            mtl->bounds.center[i] = (mtl->bounds.bboxMin[i] + mtl->bounds.bboxMax[i]) * 0.5f;
+            mtl->bounds.centroid[i] = (float)(sum[i] / (3.0 * (double)mtl->numTriangles));
+            fileSum[i] += sum[i];
+        }
+        fileTriangles += mtl->numTriangles;
+    }
+    
+    for (int i=0; i < 3; i++) {
+        geom->bounds.centroid[i] = fileTriangles ? (float)(fileSum[i] / (3.0 * (double)fileTriangles)) : geom->bounds.center[i];
+    }
+    
+    // The material spheres need their centers first
+    if (numTriSlices) {
+        TKimpl_ParallelFor( jobs, TKimpl_mtlRadiusJob, boundsJob, numTriSlices );
+        
+        for (size_t mi=0; mi < geom->numMaterials; mi++) {
+            TKimpl_BoundsPartial *partials = boundsJob->partials + boundsJob->numVertSlices;
+            maxDistSq = 0.0f;
+            for (size_t si=boundsJob->sliceStart[mi]; si < boundsJob->sliceStart[mi+1]; si++) {
+                if (partials[si].maxDistSq > maxDistSq) maxDistSq = partials[si].maxDistSq;
+            }
+            geom->materials[mi].bounds.radius = TKimpl_sqrt( maxDistSq );
+        }
+    }
+    
+    geom->hasBounds = 1;
+    TK_ObjArenaRewind( arena, mark );
+    return 1;
+}
+
+// Positions per job when welding, for finding cells and roots. The neighbour search
+// goes TKIMPL_WELD_BUCKET_SLICE hash buckets per job instead, and the remap
+// TKIMPL_WELD_TRI_SLICE triangles of a material.
+#define TKIMPL_WELD_SLICE (65536)
+#define TKIMPL_WELD_BUCKET_SLICE (16384)
+#define TKIMPL_WELD_TRI_SLICE (16384)
+
+// Cell coordinates are clamped to this, so huge positions or a tiny tolerance can't overflow
+#define TKIMPL_WELD_MAX_CELL (4.0e18)
+
+typedef struct {
+    TK_ObjGeometry *geom;
+    float tolerance;
+    double invCellSize;
+    size_t tableMask;
+    size_t numVerts; // before the weld
+    
+    size_t *bucketStart; // tableMask+2 entries, the positions in each bucket
+    size_t *bucketVerts;
+    size_t *vertBucket;  // then the root of each position, then its new index
+    size_t *rep;         // lowest numbered position within tolerance
+    
+    size_t sliceStart[TKIMPL_MAX_UNIQUE_MTLS+1]; // first triangle slice of each material
+} TKimpl_WeldJob;
+
+// The cell a position is in, and which way along each axis (-1, 1, or 0 if it doesn't)
+// its tolerance reaches into the next cell
+static inline void TKimpl_weldCell( TKimpl_WeldJob *weld, const float *pos, int64_t *cell, int *side )
+{
+    for (int i=0; i < 3; i++) {
+        double coord = pos[i] * weld->invCellSize;
+        // The negated compares catch NaN too
+        if (!(coord >= -TKIMPL_WELD_MAX_CELL)) coord = -TKIMPL_WELD_MAX_CELL;
+        if (!(coord <= TKIMPL_WELD_MAX_CELL)) coord = TKIMPL_WELD_MAX_CELL;
+        int64_t floorCoord = (int64_t)coord;
+        if ((double)floorCoord > coord) floorCoord--;
+        cell[i] = floorCoord;
+        double frac = coord - (double)floorCoord;
+        side[i] = (frac < 0.25) ? -1 : ((frac >= 0.75) ? 1 : 0);
+    }
+}
+
+static inline size_t TKimpl_weldBucket( TKimpl_WeldJob *weld, int64_t x, int64_t y, int64_t z )
+{
+    uint64_t h = (uint64_t)x * 0x9E3779B97F4A7C15ull;
+    h ^= (uint64_t)y * 0xC2B2AE3D27D4EB4Full;
+    h ^= (uint64_t)z * 0x165667B19E3779F9ull;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return (size_t)h & weld->tableMask;
+}
+
+void TKimpl_weldBucketJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_WeldJob *weld = (TKimpl_WeldJob*)jobData;
+    size_t first = jobIndex * TKIMPL_WELD_SLICE;
+    size_t end = first + TKIMPL_WELD_SLICE;
+    if (end > weld->numVerts) end = weld->numVerts;
+    
+    for (size_t vi=first; vi < end; vi++) {
+        int64_t cell[3];
+        int side[3];
+        TKimpl_weldCell( weld, weld->geom->vertPos + vi*3, cell, side );
+        weld->vertBucket[vi] = TKimpl_weldBucket( weld, cell[0], cell[1], cell[2] );
+    }
+}
+
+// Finds the lowest numbered position within tolerance of each one in the slice's buckets.
+// The cells are four times the tolerance, so that's in its own cell or a neighbour its
+// tolerance reaches into: up to 8 cells to look in near a corner, only its own in the
+// middle eighth of the cell. Each job only writes rep for its own buckets.
+void TKimpl_weldSearchJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_WeldJob *weld = (TKimpl_WeldJob*)jobData;
+    const float *vertPos = weld->geom->vertPos;
+    float tolSq = weld->tolerance * weld->tolerance;
+    size_t firstBucket = jobIndex * TKIMPL_WELD_BUCKET_SLICE;
+    size_t endBucket = firstBucket + TKIMPL_WELD_BUCKET_SLICE;
+    if (endBucket > weld->tableMask + 1) endBucket = weld->tableMask + 1;
+    
+    for (size_t bi = weld->bucketStart[firstBucket]; bi < weld->bucketStart[endBucket]; bi++) {
+        size_t vi = weld->bucketVerts[bi];
+        const float *pos = vertPos + vi*3;
+        int64_t cell[3];
+        int side[3];
+        TKimpl_weldCell( weld, pos, cell, side );
+        
+        size_t best = vi;
+        for (int ni=0; ni < 8; ni++) {
+            if (((ni & 1) && (!side[0])) || ((ni & 2) && (!side[1])) || ((ni & 4) && (!side[2]))) continue;
+            size_t bucket = TKimpl_weldBucket( weld, cell[0] + ((ni & 1) ? side[0] : 0),
+                                               cell[1] + ((ni & 2) ? side[1] : 0),
+                                               cell[2] + ((ni & 4) ? side[2] : 0) );
+            
+            // Buckets are in position order, so the first one that's close enough is the lowest
+            for (size_t oi = weld->bucketStart[bucket]; oi < weld->bucketStart[bucket+1]; oi++) {
+                size_t other = weld->bucketVerts[oi];
+                if (other >= best) break;
+                const float *otherPos = vertPos + other*3;
+                float d[3] = { otherPos[0] - pos[0], otherPos[1] - pos[1], otherPos[2] - pos[2] };
+                if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] <= tolSq) {
+                    best = other;
+                    break;
+                }
+            }
+        }
+        weld->rep[vi] = best;
+    }
+}
+
+// Follows each position's rep down to one that's its own, reps only ever go down
+void TKimpl_weldRootJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_WeldJob *weld = (TKimpl_WeldJob*)jobData;
+    size_t first = jobIndex * TKIMPL_WELD_SLICE;
+    size_t end = first + TKIMPL_WELD_SLICE;
+    if (end > weld->numVerts) end = weld->numVerts;
+    
+    for (size_t vi=first; vi < end; vi++) {
+        size_t root = weld->rep[vi];
+        while (weld->rep[root] != root) root = weld->rep[root];
+        weld->vertBucket[vi] = root;
+    }
+}
+
+void TKimpl_weldRemapJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_WeldJob *weld = (TKimpl_WeldJob*)jobData;
+    TK_ObjGeometry *geom = weld->geom;
+    size_t mi = 0;
+    while (weld->sliceStart[mi+1] <= jobIndex) mi++;
+    TKimpl_Material *mtl = geom->materials + mi;
+    
+    size_t first = (jobIndex - weld->sliceStart[mi]) * TKIMPL_WELD_TRI_SLICE;
+    size_t end = first + TKIMPL_WELD_TRI_SLICE;
+    if (end > mtl->numTriangles) end = mtl->numTriangles;
+    
+    // vertBucket has the new indices by now. Indices past the old end stay out of range.
+    for (size_t ti=first; ti < end; ti++) {
+        TKimpl_IndexedTriangle ndxTri;
+        TKimpl_LoadIndexedTriangle( geom, mtl, ti, &ndxTri );
+        TKimpl_IndexedVert *verts = &(ndxTri.vertA);
+        for (int ci=0; ci < 3; ci++) {
+            if ((verts[ci].posIndex >= 0) && ((size_t)verts[ci].posIndex < weld->numVerts)) {
+                verts[ci].posIndex = (ptrdiff_t)weld->vertBucket[verts[ci].posIndex];
+            }
+        }
+        TKimpl_StoreIndexedTriangle( geom, mtl, ti, &ndxTri );
+    }
+}
+
+static inline size_t TKimpl_weldTableSize( size_t numVerts )
+{
+    size_t tableSize = 16;
+    while (tableSize < numVerts) tableSize <<= 1;
+    return tableSize;
+}
+
+size_t TKimpl_WeldScratchSize( size_t numVerts )
+{
+    return TKimpl_ArenaSize( sizeof(TKimpl_WeldJob) ) +
+           TKimpl_ArenaSize( sizeof(size_t) * (TKimpl_weldTableSize( numVerts ) + 1) ) +
+           TKimpl_ArenaSize( sizeof(size_t) * numVerts ) * 3;
+}
+
+int TKimpl_WeldPositions( TK_ObjGeometry *geom, float tolerance, TK_ObjArena *arena, const TK_ObjJobSystem *jobs )
+{
+    size_t numVerts = geom->numVertPos;
+    if ((!(tolerance > 0.0f)) || (numVerts < 2)) return 1;
+    
+    TK_ObjArenaMark mark = TK_ObjArenaGetMark( arena );
+    
+    // Same order as TKimpl_WeldScratchSize
+    size_t tableSize = TKimpl_weldTableSize( numVerts );
+    TKimpl_WeldJob *weld = TKImpl_PushStruct( arena, TKimpl_WeldJob );
+    size_t *bucketStart = TKImpl_PushStructArray( arena, size_t, tableSize + 1 );
+    size_t *bucketVerts = TKImpl_PushStructArray( arena, size_t, numVerts );
+    size_t *vertBucket = TKImpl_PushStructArray( arena, size_t, numVerts );
+    size_t *rep = TKImpl_PushStructArray( arena, size_t, numVerts );
+    if ((!weld) || (!bucketStart) || (!bucketVerts) || (!vertBucket) || (!rep)) {
+        TK_ObjArenaRewind( arena, mark );
+        return 0;
+    }
+    weld->geom = geom;
+    weld->tolerance = tolerance;
+    weld->invCellSize = 0.25 / (double)tolerance;
+    weld->tableMask = tableSize - 1;
+    weld->numVerts = numVerts;
+    weld->bucketStart = bucketStart;
+    weld->bucketVerts = bucketVerts;
+    weld->vertBucket = vertBucket;
+    weld->rep = rep;
+    
+    // Counting sort the positions into their buckets, in order within each one
+    size_t numSlices = (numVerts + TKIMPL_WELD_SLICE-1) / TKIMPL_WELD_SLICE;
+    TKimpl_ParallelFor( jobs, TKimpl_weldBucketJob, weld, numSlices );
+    for (size_t bi=0; bi <= tableSize; bi++) bucketStart[bi] = 0;
+    for (size_t vi=0; vi < numVerts; vi++) bucketStart[vertBucket[vi] + 1]++;
+    for (size_t bi=0; bi < tableSize; bi++) bucketStart[bi+1] += bucketStart[bi];
+    for (size_t vi=0; vi < numVerts; vi++) bucketVerts[bucketStart[vertBucket[vi]]++] = vi;
+    for (size_t bi=tableSize; bi > 0; bi--) bucketStart[bi] = bucketStart[bi-1];
+    bucketStart[0] = 0;
+    
+    TKimpl_ParallelFor( jobs, TKimpl_weldSearchJob, weld, (tableSize + TKIMPL_WELD_BUCKET_SLICE-1) / TKIMPL_WELD_BUCKET_SLICE );
+    TKimpl_ParallelFor( jobs, TKimpl_weldRootJob, weld, numSlices );
+    
+    // Roots keep their order, and move down over the ones that were welded to them.
+    // Everything else takes its root's new index, which always comes first.
+    size_t numWelded = 0;
+    for (size_t vi=0; vi < numVerts; vi++) {
+        size_t root = vertBucket[vi];
+        if (root == vi) {
+            for (int i=0; i < 3; i++) geom->vertPos[numWelded*3 + i] = geom->vertPos[vi*3 + i];
+            vertBucket[vi] = numWelded++;
+        } else {
+            vertBucket[vi] = vertBucket[root];
+        }
+    }
+    
+    if (numWelded < numVerts) {
+        size_t numTriSlices = 0;
+        for (size_t mi=0; mi < geom->numMaterials; mi++) {
+            weld->sliceStart[mi] = numTriSlices;
+            if (TKimpl_materialTriangleData( geom, geom->materials + mi )) {
+                numTriSlices += (geom->materials[mi].numTriangles + TKIMPL_WELD_TRI_SLICE-1) / TKIMPL_WELD_TRI_SLICE;
+            }
+        }
+        weld->sliceStart[geom->numMaterials] = numTriSlices;
+        TKimpl_ParallelFor( jobs, TKimpl_weldRemapJob, weld, numTriSlices );
+        geom->numVertPos = numWelded;
+    }
+    
+    TK_ObjArenaRewind( arena, mark );
+    return 1;
+}
+
+// =========================================================
+//  Writing
+// =========================================================
+
+// Shortest round trip float formatting, after Ryu (Ulf Adams, "Ryu: Fast Float-to-String
+// Conversion", PLDI 2018). The tables are 5^i and 2^k/5^i scaled to 59-61 bits.
+#define TKIMPL_FLOAT_POW5_INV_BITCOUNT (59)
+#define TKIMPL_FLOAT_POW5_BITCOUNT (61)
+
+static const uint64_t TKimpl_floatPow5InvSplit[31] = {
+    576460752303423489ull, 461168601842738791ull, 368934881474191033ull,
+    295147905179352826ull, 472236648286964522ull, 377789318629571618ull,
+    302231454903657294ull, 483570327845851670ull, 386856262276681336ull,
+    309485009821345069ull, 495176015714152110ull, 396140812571321688ull,
+    316912650057057351ull, 507060240091291761ull, 405648192073033409ull,
+    324518553658426727ull, 519229685853482763ull, 415383748682786211ull,
+    332306998946228969ull, 531691198313966350ull, 425352958651173080ull,
+    340282366920938464ull, 544451787073501542ull, 435561429658801234ull,
+    348449143727040987ull, 557518629963265579ull, 446014903970612463ull,
+    356811923176489971ull, 570899077082383953ull, 456719261665907162ull,
+    365375409332725730ull
+};
+
+static const uint64_t TKimpl_floatPow5Split[47] = {
+    1152921504606846976ull, 1441151880758558720ull, 1801439850948198400ull,
+    2251799813685248000ull, 1407374883553280000ull, 1759218604441600000ull,
+    2199023255552000000ull, 1374389534720000000ull, 1717986918400000000ull,
+    2147483648000000000ull, 1342177280000000000ull, 1677721600000000000ull,
+    2097152000000000000ull, 1310720000000000000ull, 1638400000000000000ull,
+    2048000000000000000ull, 1280000000000000000ull, 1600000000000000000ull,
+    2000000000000000000ull, 1250000000000000000ull, 1562500000000000000ull,
+    1953125000000000000ull, 1220703125000000000ull, 1525878906250000000ull,
+    1907348632812500000ull, 1192092895507812500ull, 1490116119384765625ull,
+    1862645149230957031ull, 1164153218269348144ull, 1455191522836685180ull,
+    1818989403545856475ull, 2273736754432320594ull, 1421085471520200371ull,
+    1776356839400250464ull, 2220446049250313080ull, 1387778780781445675ull,
+    1734723475976807094ull, 2168404344971008868ull, 1355252715606880542ull,
+    1694065894508600678ull, 2117582368135750847ull, 1323488980084844279ull,
+    1654361225106055349ull, 2067951531382569187ull, 1292469707114105741ull,
+    1615587133892632177ull, 2019483917365790221ull
+};
+
+// ceil(log2(5^e)), floor(log10(2^e)) and floor(log10(5^e)), for small e >= 0
+static inline int32_t TKimpl_pow5Bits( int32_t e ) { return (int32_t)(((uint32_t)e * 1217359) >> 19) + 1; }
+static inline int32_t TKimpl_log10Pow2( int32_t e ) { return (int32_t)(((uint32_t)e * 78913) >> 18); }
+static inline int32_t TKimpl_log10Pow5( int32_t e ) { return (int32_t)(((uint32_t)e * 732923) >> 20); }
+
+static inline int TKimpl_multipleOfPow5( uint32_t value, int32_t p )
+{
+    int32_t count = 0;
+    while ((value) && (value % 5 == 0)) {
+        value /= 5;
+        count++;
+    }
+    return count >= p;
+}
+
+static inline uint32_t TKimpl_mulShift32( uint32_t m, uint64_t factor, int32_t shift )
+{
+    uint64_t bits0 = (uint64_t)m * (uint32_t)factor;
+    uint64_t bits1 = (uint64_t)m * (uint32_t)(factor >> 32);
+    return (uint32_t)(((bits0 >> 32) + bits1) >> (shift - 32));
+}
+
+// TKimpl_floatToShortest -- The fewest decimal digits, digits * 10^exp10, that read back
+// as exactly the positive, finite float with these bits.
+void TKimpl_floatToShortest( uint32_t bits, uint32_t *out_digits, int32_t *out_exp10 )
+{
+    uint32_t ieeeMantissa = bits & 0x7fffff;
+    uint32_t ieeeExponent = (bits >> 23) & 0xff;
+    
+    int32_t e2;
+    uint32_t m2;
+    if (!ieeeExponent) {
+        e2 = 1 - 127 - 23 - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = (int32_t)ieeeExponent - 127 - 23 - 2;
+        m2 = (1u << 23) | ieeeMantissa;
+    }
+    int acceptBounds = !(m2 & 1);
+    
+    // The float and the halfway points to its neighbors, times 4
+    uint32_t mv = 4*m2;
+    uint32_t mp = 4*m2 + 2;
+    uint32_t mmShift = (ieeeMantissa != 0) || (ieeeExponent <= 1);
+    uint32_t mm = 4*m2 - 1 - mmShift;
+    
+    // Scale them all to a power of ten
+    uint32_t vr, vp, vm;
+    int32_t exp10;
+    int vmIsTrailingZeros = 0, vrIsTrailingZeros = 0;
+    uint32_t lastRemovedDigit = 0;
+    if (e2 >= 0) {
+        int32_t q = TKimpl_log10Pow2( e2 );
+        exp10 = q;
+        int32_t k = TKIMPL_FLOAT_POW5_INV_BITCOUNT + TKimpl_pow5Bits( q ) - 1;
+        int32_t i = -e2 + q + k;
+        vr = TKimpl_mulShift32( mv, TKimpl_floatPow5InvSplit[q], i );
+        vp = TKimpl_mulShift32( mp, TKimpl_floatPow5InvSplit[q], i );
+        vm = TKimpl_mulShift32( mm, TKimpl_floatPow5InvSplit[q], i );
+        if ((q != 0) && ((vp - 1) / 10 <= vm / 10)) {
+            // Need the digit that the scaling removed, for the rounding below
+            int32_t l = TKIMPL_FLOAT_POW5_INV_BITCOUNT + TKimpl_pow5Bits( q - 1 ) - 1;
+            lastRemovedDigit = TKimpl_mulShift32( mv, TKimpl_floatPow5InvSplit[q-1], -e2 + q - 1 + l ) % 10;
+        }
+        if (q <= 9) {
+            // Only one of mp, mv and mm can be a multiple of 5, if any
+            if (mv % 5 == 0) {
+                vrIsTrailingZeros = TKimpl_multipleOfPow5( mv, q );
+            } else if (acceptBounds) {
+                vmIsTrailingZeros = TKimpl_multipleOfPow5( mm, q );
+            } else {
+                vp -= TKimpl_multipleOfPow5( mp, q );
+            }
+        }
+    } else {
+        int32_t q = TKimpl_log10Pow5( -e2 );
+        exp10 = q + e2;
+        int32_t i = -e2 - q;
+        int32_t k = TKimpl_pow5Bits( i ) - TKIMPL_FLOAT_POW5_BITCOUNT;
+        int32_t j = q - k;
+        vr = TKimpl_mulShift32( mv, TKimpl_floatPow5Split[i], j );
+        vp = TKimpl_mulShift32( mp, TKimpl_floatPow5Split[i], j );
+        vm = TKimpl_mulShift32( mm, TKimpl_floatPow5Split[i], j );
+        if ((q != 0) && ((vp - 1) / 10 <= vm / 10)) {
+            j = q - 1 - (TKimpl_pow5Bits( i + 1 ) - TKIMPL_FLOAT_POW5_BITCOUNT);
+            lastRemovedDigit = TKimpl_mulShift32( mv, TKimpl_floatPow5Split[i+1], j ) % 10;
+        }
+        if (q <= 1) {
+            // mv = 4*m2 always has two trailing zero bits, mp has one
+            vrIsTrailingZeros = 1;
+            if (acceptBounds) {
+                vmIsTrailingZeros = (mmShift == 1);
+            } else {
+                vp--;
+            }
+        } else if (q < 31) {
+            vrIsTrailingZeros = ((mv & ((1u << (q - 1)) - 1)) == 0);
+        }
+    }
+    
+    // Drop digits while the interval still holds a shorter number
+    int32_t removed = 0;
+    uint32_t output;
+    if ((vmIsTrailingZeros) || (vrIsTrailingZeros)) {
+        // Rare, the exact value might end in ...5000
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= (vm % 10 == 0);
+            vrIsTrailingZeros &= (lastRemovedDigit == 0);
+            lastRemovedDigit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vmIsTrailingZeros) {
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= (lastRemovedDigit == 0);
+                lastRemovedDigit = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if ((vrIsTrailingZeros) && (lastRemovedDigit == 5) && (vr % 2 == 0)) {
+            // Exactly halfway, round to even
+            lastRemovedDigit = 4;
+        }
+        output = vr + (((vr == vm) && ((!acceptBounds) || (!vmIsTrailingZeros))) || (lastRemovedDigit >= 5));
+    } else {
+        while (vp / 10 > vm / 10) {
+            lastRemovedDigit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + ((vr == vm) || (lastRemovedDigit >= 5));
+    }
+    
+    *out_digits = output;
+    *out_exp10 = exp10 + removed;
+}
+
+// Longest TKimpl_formatFloat output, e.g. -1.17549435e-38 or -0.000123456789
+#define TKIMPL_WRITE_MAX_FLOAT (15)
+
+// TKimpl_formatFloat -- Writes the shortest text that TKimpl_stringToFloat reads back as
+// exactly value. Plain decimals unless the exponent is far out. Returns the length.
+size_t TKimpl_formatFloat( char *dest, float value )
+{
+    char *ch = dest;
+    uint32_t bits = TKimpl_floatBits( value );
+    if (bits >> 31) *ch++ = '-';
+    bits &= 0x7fffffff;
+    
+    if (bits >= 0x7f800000) {
+        const char *special = (bits == 0x7f800000) ? "inf" : "nan";
+        for (int i=0; i < 3; i++) *ch++ = special[i];
+        return ch - dest;
+    } else if (!bits) {
+        *ch++ = '0';
+        return ch - dest;
+    }
+    
+    uint32_t digits;
+    int32_t exp10;
+    TKimpl_floatToShortest( bits, &digits, &exp10 );
+    
+    char digitChars[10] = { 0 };
+    int32_t numDigits = 0;
+    for (uint32_t d=digits; d; d /= 10) numDigits++;
+    for (int32_t i=numDigits; i-- > 0; digits /= 10) digitChars[i] = '0' + (digits % 10);
+    
+    // Where the decimal point goes, counting from the first digit
+    int32_t point = numDigits + exp10;
+    if ((exp10 >= 0) && (point <= 9)) {
+        for (int32_t i=0; i < numDigits; i++) *ch++ = digitChars[i];
+        for (int32_t i=0; i < exp10; i++) *ch++ = '0';
+    } else if ((exp10 < 0) && (point > 0)) {
+        for (int32_t i=0; i < numDigits; i++) {
+            if (i == point) *ch++ = '.';
+            *ch++ = digitChars[i];
+        }
+    } else if ((point <= 0) && (point > -4)) {
+        *ch++ = '0';
+        *ch++ = '.';
+        for (int32_t i=point; i < 0; i++) *ch++ = '0';
+        for (int32_t i=0; i < numDigits; i++) *ch++ = digitChars[i];
+    } else {
+        *ch++ = digitChars[0];
+        if (numDigits > 1) {
+            *ch++ = '.';
+            for (int32_t i=1; i < numDigits; i++) *ch++ = digitChars[i];
+        }
+        int32_t sciExp = point - 1;
+        *ch++ = 'e';
+        if (sciExp < 0) {
+            *ch++ = '-';
+            sciExp = -sciExp;
+        }
+        if (sciExp >= 10) *ch++ = '0' + (sciExp / 10);
+        *ch++ = '0' + (sciExp % 10);
+    }
+    return ch - dest;
+}
+
+size_t TKimpl_numDigits( size_t value )
+{
+    size_t numDigits = 1;
+    for (; value >= 10; value /= 10) numDigits++;
+    return numDigits;
+}
+
+size_t TKimpl_formatIndex( char *dest, size_t value )
+{
+    size_t numDigits = TKimpl_numDigits( value );
+    for (size_t i=numDigits; i-- > 0; value /= 10) dest[i] = '0' + (value % 10);
+    return numDigits;
+}
+
+// Lines are formatted a slice at a time on the job system, each slice into its
+// own worst case sized spot in dest, then they're all slid down together.
+#define TKIMPL_WRITE_SLICE (4096)
+
+typedef struct {
+    size_t numLines;
+    size_t lineBytes;   // longest a line can be
+    size_t headerBytes; // room for the usemtl (or tk_counts) line
+    size_t firstSlice;
+    size_t numSlices;
+    size_t offset;      // of the first slice in dest
+} TKimpl_WriteSection;
+
+// Sections are the v, vt and vn lists, then the faces of each material
+#define TKIMPL_WRITE_FACES (3)
+
+typedef struct {
+    TKimpl_Geometry *geom;
+    char *dest;
+    int writeSt, writeNrm;
+    TKimpl_WriteSection sections[TKIMPL_WRITE_FACES + TKIMPL_MAX_UNIQUE_MTLS];
+    size_t numSections;
+    size_t numSlices;
+    size_t maxSize;
+} TKimpl_WriteJob;
+
+// Writes the "# tk_counts" line TK_ParseObj uses to skip its count pass. The writer
+// puts out one f line per triangle and a usemtl for every material, so the counts come
+// straight from the geometry. dest can be NULL to just get the length.
+size_t TKimpl_writeCountHeader( char *dest, TKimpl_Geometry *geom )
+{
+    const char *keys[6] = { "# tk_counts v=", " vt=", " vn=", " f=", " tris=", " mtls=" };
+    size_t numTriangles = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) numTriangles += geom->materials[mi].numTriangles;
+    size_t values[6] = { geom->numVertPos, geom->numVertSt, geom->numVertNrm,
+                         numTriangles, numTriangles, geom->numMaterials };
+    
+    size_t len = 0;
+    for (int i=0; i < 6; i++) {
+        for (const char *key=keys[i]; *key; key++, len++) {
+            if (dest) dest[len] = *key;
+        }
+        len += dest ? TKimpl_formatIndex( dest + len, values[i] ) : TKimpl_numDigits( values[i] );
+    }
+    for (const char *key=" mtltris="; *key; key++, len++) {
+        if (dest) dest[len] = *key;
+    }
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        if (mi > 0) {
+            if (dest) dest[len] = ',';
+            len++;
+        }
+        size_t value = geom->materials[mi].numTriangles;
+        len += dest ? TKimpl_formatIndex( dest + len, value ) : TKimpl_numDigits( value );
+    }
+    if (dest) dest[len] = '\n';
+    return len + 1;
+}
+
+void TKimpl_writeSetup( TKimpl_WriteJob *writeJob, TKimpl_Geometry *geom )
+{
+    writeJob->geom = geom;
+    writeJob->writeSt = (geom->numVertSt > 0);
+    writeJob->writeNrm = (geom->numVertNrm > 0);
+    writeJob->numSections = TKIMPL_WRITE_FACES + geom->numMaterials;
+    
+    // " 12/34/56" for each corner
+    size_t cornerBytes = 1 + TKimpl_numDigits( geom->numVertPos );
+    if ((writeJob->writeSt) || (writeJob->writeNrm)) cornerBytes++;
+    if (writeJob->writeSt) cornerBytes += TKimpl_numDigits( geom->numVertSt );
+    if (writeJob->writeNrm) cornerBytes += 1 + TKimpl_numDigits( geom->numVertNrm );
+    
+    size_t offset = 0;
+    writeJob->numSlices = 0;
+    for (size_t si=0; si < writeJob->numSections; si++) {
+        TKimpl_WriteSection *section = writeJob->sections + si;
+        section->headerBytes = 0;
+        if (si == 0) {
+            section->numLines = geom->numVertPos;
+            section->lineBytes = 1 + 3*(1 + TKIMPL_WRITE_MAX_FLOAT) + 1;
+            section->headerBytes = TKimpl_writeCountHeader( NULL, geom );
+        } else if (si == 1) {
+            section->numLines = geom->numVertSt;
+            section->lineBytes = 2 + 2*(1 + TKIMPL_WRITE_MAX_FLOAT) + 1;
+        } else if (si == 2) {
+            section->numLines = geom->numVertNrm;
+            section->lineBytes = 2 + 3*(1 + TKIMPL_WRITE_MAX_FLOAT) + 1;
+        } else {
+            // The default material's faces come first, before any usemtl
+            size_t mi = si - TKIMPL_WRITE_FACES;
+            section->numLines = geom->materials[mi].numTriangles;
+            section->lineBytes = 1 + 3*cornerBytes + 1;
+            if (mi > 0) {
+                size_t nameLen = 0;
+                while (TKimpl_isIdentifier( geom->materials[mi].mtlName[nameLen] )) nameLen++;
+                section->headerBytes = 7 + nameLen + 1;
+            }
+        }
+        
+        // Each slice ends with a 0, so the slide knows where it stops
+        section->firstSlice = writeJob->numSlices;
+        section->numSlices = (section->numLines + TKIMPL_WRITE_SLICE-1) / TKIMPL_WRITE_SLICE;
+        offset += section->headerBytes;
+        section->offset = offset;
+        offset += section->numLines * section->lineBytes + section->numSlices;
+        writeJob->numSlices += section->numSlices;
+    }
+    writeJob->maxSize = offset;
+}
+
+char *TKimpl_writeFloats( char *ch, const char *prefix, const float *values, int numValues )
+{
+    while (*prefix) *ch++ = *prefix++;
+    for (int i=0; i < numValues; i++) {
+        *ch++ = ' ';
+        ch += TKimpl_formatFloat( ch, values[i] );
+    }
+    *ch++ = '\n';
+    return ch;
+}
+
+void TKimpl_writeSliceJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_WriteJob *writeJob = (TKimpl_WriteJob*)jobData;
+    TKimpl_Geometry *geom = writeJob->geom;
+    
+    size_t si = 0;
+    while (writeJob->sections[si].firstSlice + writeJob->sections[si].numSlices <= jobIndex) si++;
+    TKimpl_WriteSection *section = writeJob->sections + si;
+    size_t slice = jobIndex - section->firstSlice;
+    size_t firstLine = slice * TKIMPL_WRITE_SLICE;
+    size_t endLine = firstLine + TKIMPL_WRITE_SLICE;
+    if (endLine > section->numLines) endLine = section->numLines;
+    
+    char *ch = writeJob->dest + section->offset + slice * (TKIMPL_WRITE_SLICE * section->lineBytes + 1);
+    for (size_t li=firstLine; li < endLine; li++) {
+        if (si == 0) {
+            ch = TKimpl_writeFloats( ch, "v", geom->vertPos + li*3, 3 );
+        } else if (si == 1) {
+            ch = TKimpl_writeFloats( ch, "vt", geom->vertSt + li*2, 2 );
+        } else if (si == 2) {
+            ch = TKimpl_writeFloats( ch, "vn", geom->vertNrm + li*3, 3 );
+        } else {
+            TKimpl_IndexedTriangle ndxTri;
+            TKimpl_LoadIndexedTriangle( geom, geom->materials + (si - TKIMPL_WRITE_FACES), li, &ndxTri );
+            TKimpl_IndexedVert *ndxVerts = &(ndxTri.vertA);
+            
+            // The parser doesn't range check indices, anything out of range is written as
+            // 1 so it can't run past the line's space
+            *ch++ = 'f';
+            for (int vi=0; vi < 3; vi++) {
+                size_t posIndex = (size_t)ndxVerts[vi].posIndex;
+                size_t stIndex = (size_t)ndxVerts[vi].stIndex;
+                size_t normIndex = (size_t)ndxVerts[vi].normIndex;
+                *ch++ = ' ';
+                ch += TKimpl_formatIndex( ch, (posIndex < geom->numVertPos) ? posIndex + 1 : 1 );
+                if ((writeJob->writeSt) || (writeJob->writeNrm)) *ch++ = '/';
+                if (writeJob->writeSt) {
+                    ch += TKimpl_formatIndex( ch, (stIndex < geom->numVertSt) ? stIndex + 1 : 1 );
+                }
+                if (writeJob->writeNrm) {
+                    *ch++ = '/';
+                    ch += TKimpl_formatIndex( ch, (normIndex < geom->numVertNrm) ? normIndex + 1 : 1 );
+                }
+            }
+            *ch++ = '\n';
+        }
+    }
+    *ch = '\0';
+}
+
+size_t TK_WriteObj( TK_ObjGeometry *geom, void *dest, size_t *destSize, const TK_ObjJobSystem *jobs )
+{
+    TKimpl_WriteJob writeJob;
+    TKimpl_writeSetup( &writeJob, geom );
+    if ((!dest) || (*destSize < writeJob.maxSize)) {
+        *destSize = writeJob.maxSize;
+        return 0;
+    }
+    
+    writeJob.dest = (char*)dest;
+    TKimpl_ParallelFor( jobs, TKimpl_writeSliceJob, &writeJob, writeJob.numSlices );
+    
+    // Slide the slices down, in order. Nothing is ever written past the spot it was
+    // reserved at, so the copy never gets ahead of what it's reading.
+    char *out = writeJob.dest;
+    for (size_t si=0; si < writeJob.numSections; si++) {
+        TKimpl_WriteSection *section = writeJob.sections + si;
+        if (si == 0) {
+            out += TKimpl_writeCountHeader( out, geom );
+        } else if (section->headerBytes) {
+            const char *usemtl = "usemtl ";
+            while (*usemtl) *out++ = *usemtl++;
+            for (char *name=geom->materials[si - TKIMPL_WRITE_FACES].mtlName; TKimpl_isIdentifier( *name ); name++) {
+                *out++ = *name;
+            }
+            *out++ = '\n';
+        }
+        for (size_t slice=0; slice < section->numSlices; slice++) {
+            const char *src = writeJob.dest + section->offset + slice * (TKIMPL_WRITE_SLICE * section->lineBytes + 1);
+            while (*src) *out++ = *src++;
+        }
+    }
+    return out - writeJob.dest;
+}
+
+
+// =========================================================
+//  Sharded parsing
+// =========================================================
+
+// Relative indices in a shard are stored as their index within the shard plus this, so
+// the merge can tell them from absolute ones (which are already global). It's big enough
+// that neither kind gets anywhere near the other.
+#define TKIMPL_SHARD_RELATIVE ((ptrdiff_t)1 << (sizeof(ptrdiff_t)*8 - 2))
+
+typedef struct {
+    uint64_t nameOffset; // 0-terminated, empty for material 0
+    uint64_t numTriangles;
+    uint64_t trianglesOffset;
+} TKimpl_ShardMaterial;
+
+// Moves pos forward to the start of a line (the one it's in the middle of ends first)
+size_t TKimpl_shardLineStart( char *data, size_t size, size_t pos )
+{
+    while ((pos > 0) && (pos < size) && (data[pos-1] != '\n')) pos++;
+    return pos;
+}
+
+TK_ObjShard *TK_ParseObjShard( void *objFileData, size_t objFileSize, size_t begin, size_t end,
+                               TK_ObjDelegate *objDelegate )
+{
+    // The shard gets the lines that start in the range, so both ends move forward to the
+    // next line start, and the neighboring shard does the same with the other side
+    char *data = (char*)objFileData;
+    if (end > objFileSize) end = objFileSize;
+    if (begin > end) begin = end;
+    begin = TKimpl_shardLineStart( data, objFileSize, begin );
+    end = TKimpl_shardLineStart( data, objFileSize, end );
+    if (begin > end) begin = end;
+    
+    // Count the range, keeping the real st and nrm counts for the stats. Every usemtl
+    // gets its own material, in file order, for the merge to look up.
+    TKimpl_Material uniqueMtls[TKIMPL_MAX_UNIQUE_MTLS];
+    size_t numUniqueMtls = 0;
+    objDelegate->numVerts = 0;
+    objDelegate->numSts = 0;
+    objDelegate->numNorms = 0;
+    objDelegate->numFaces = 0;
+    objDelegate->numTriangles = 0;
+    TKimpl_ParseState state;
+    state.currMtl = 0;
+    state.emitMtl = TKIMPL_NO_MATERIAL;
+    state.lineNumber = 1;
+    state.shardMtl = 1;
+    if (!TKimpl_ParseObjPass( data + begin, end - begin, NULL, uniqueMtls, &numUniqueMtls,
+                              objDelegate, TKimpl_ParseTypeCountOnly, &state, NULL, NULL )) {
+        return NULL;
+    }
+    
+    size_t numStsAlloc = ((objDelegate->skipAttribs & TK_ObjAttrib_St) || (!objDelegate->numSts)) ? 1 : objDelegate->numSts;
+    size_t numNormsAlloc = ((objDelegate->skipAttribs & TK_ObjAttrib_Nrm) || (!objDelegate->numNorms)) ? 1 : objDelegate->numNorms;
+    
+    // Lay out the shard
+    size_t shardSize = TKimpl_ArenaSize( sizeof(TK_ObjShard) );
+    size_t mtlOffset = shardSize;
+    shardSize += TKimpl_ArenaSize( sizeof(TKimpl_ShardMaterial) * numUniqueMtls );
+    size_t nameOffset = shardSize;
+    for (size_t mi=0; mi < numUniqueMtls; mi++) {
+        size_t nameLen = 0;
+        while ((mi > 0) && (TKimpl_isIdentifier( uniqueMtls[mi].mtlName[nameLen] ))) nameLen++;
+        shardSize += nameLen + 1;
+    }
+    shardSize = TKimpl_ArenaSize( shardSize );
+    size_t posOffset = shardSize;
+    shardSize += TKimpl_ArenaSize( sizeof(float)*3*objDelegate->numVerts );
+    size_t stOffset = shardSize;
+    shardSize += TKimpl_ArenaSize( sizeof(float)*2*numStsAlloc );
+    size_t nrmOffset = shardSize;
+    shardSize += TKimpl_ArenaSize( sizeof(float)*3*numNormsAlloc );
+    size_t trianglesOffset = shardSize;
+    for (size_t mi=0; mi < numUniqueMtls; mi++) {
+        shardSize += TKimpl_ArenaSize( sizeof(TKimpl_IndexedTriangle) * uniqueMtls[mi].numTriangles );
+    }
+    
+    // Use the caller's arena, or scratchMem
+    TK_ObjArena scratchArena;
+    TK_ObjArena *arena = objDelegate->arena;
+    if (!arena) {
+        if (!objDelegate->scratchMem) {
+            objDelegate->scratchMemSize = TKIMPL_ARENA_ALIGN + shardSize;
+            return NULL;
+        }
+        TK_ObjArenaInit( &scratchArena, objDelegate->scratchMem, objDelegate->scratchMemSize );
+        arena = &scratchArena;
+    }
+    
+    char *blob = (char*)TK_ObjArenaPush( arena, shardSize );
+    if (!blob) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
+    }
+    
+    TK_ObjShard *shard = (TK_ObjShard*)blob;
+    shard->magic = TK_OBJ_SHARD_MAGIC;
+    shard->size = shardSize;
+    shard->numVerts = objDelegate->numVerts;
+    shard->numSts = objDelegate->numSts;
+    shard->numNorms = objDelegate->numNorms;
+    shard->numFaces = objDelegate->numFaces;
+    shard->numTriangles = objDelegate->numTriangles;
+    shard->numMaterials = numUniqueMtls;
+    shard->mtlOffset = mtlOffset;
+    shard->posOffset = posOffset;
+    shard->stOffset = stOffset;
+    shard->nrmOffset = nrmOffset;
+    
+    // The parse stores straight into the shard
+    TKimpl_Geometry geom;
+    TKimpl_Material materials[TKIMPL_MAX_UNIQUE_MTLS];
+    geom.numVertPos = 0;
+    geom.numVertSt = 0;
+    geom.numVertNrm = 0;
+    geom.vertPos = (float*)(blob + posOffset);
+    geom.vertSt = (float*)(blob + stOffset);
+    geom.vertNrm = (float*)(blob + nrmOffset);
+    geom.materials = materials;
+    geom.numMaterials = numUniqueMtls;
+    geom.skipAttribs = objDelegate->skipAttribs;
+    geom.compactIndices = 0;
+    geom.triangleSink = NULL;
+    geom.sinkData = NULL;
+    geom.hasBounds = 0;
+    geom.relativeBias = TKIMPL_SHARD_RELATIVE;
+    geom.inSitu = 0;
+    TKimpl_setDefaultAttribs( &geom, objDelegate );
+    
+    TKimpl_ShardMaterial *shardMtls = (TKimpl_ShardMaterial*)(blob + mtlOffset);
+    for (size_t mi=0; mi < numUniqueMtls; mi++) {
+        // Names are copied in, so lookups in the full pass find the copies
+        char *name = blob + nameOffset;
+        for (char *ch = uniqueMtls[mi].mtlName; (mi > 0) && (TKimpl_isIdentifier( *ch )); ch++) {
+            blob[nameOffset++] = *ch;
+        }
+        blob[nameOffset++] = '\0';
+        
+        shardMtls[mi].nameOffset = name - blob;
+        shardMtls[mi].numTriangles = uniqueMtls[mi].numTriangles;
+        shardMtls[mi].trianglesOffset = trianglesOffset;
+        
+        materials[mi].mtlName = name;
+        materials[mi].numTriangles = 0;
+        materials[mi].triangles = (TKimpl_IndexedTriangle*)(blob + trianglesOffset);
+        materials[mi].compactTriangles = NULL;
+        materials[mi].remap = NULL;
+        trianglesOffset += TKimpl_ArenaSize( sizeof(TKimpl_IndexedTriangle) * uniqueMtls[mi].numTriangles );
+    }
+    
+    state.currMtl = 0;
+    state.emitMtl = TKIMPL_NO_MATERIAL;
+    state.lineNumber = 1;
+    state.shardMtl = 1;
+    int immediateMode = objDelegate->immediateMode;
+    objDelegate->immediateMode = 0;
+    TKimpl_ParseObjPass( data + begin, end - begin, &geom, materials, &(geom.numMaterials),
+                         objDelegate, TKimpl_ParseTypeFull, &state, NULL, NULL );
+    objDelegate->immediateMode = immediateMode;
+    
+    shard->numVertPos = geom.numVertPos;
+    shard->numVertSt = geom.numVertSt;
+    shard->numVertNrm = geom.numVertNrm;
+    shard->lastMaterial = state.currMtl;
+    shard->numUnresolved = 0;
+    for (size_t mi=0; mi < numUniqueMtls; mi++) {
+        shardMtls[mi].numTriangles = materials[mi].numTriangles;
+        ptrdiff_t *indices = (ptrdiff_t*)materials[mi].triangles;
+        for (size_t i=0; i < materials[mi].numTriangles * 9; i++) {
+            if ((indices[i] >= TKIMPL_SHARD_RELATIVE/2) && (indices[i] < TKIMPL_SHARD_RELATIVE)) {
+                shard->numUnresolved++;
+            }
+        }
+    }
+    
+    return shard;
+}
+
+// Where each shard's lists and triangles go in the merged geometry
+typedef struct {
+    size_t posBase, stBase, nrmBase;
+    size_t mtlMap[TKIMPL_MAX_UNIQUE_MTLS];       // shard material -> merged material
+    size_t triangleBase[TKIMPL_MAX_UNIQUE_MTLS]; // shard material -> first merged triangle
+    int badIndex;                                // set by the job if an index is out of range
+} TKimpl_MergeShard;
+
+typedef struct {
+    TK_ObjShard **shards;
+    TKimpl_MergeShard *mergeShards;
+    TKimpl_Geometry *geom;
+} TKimpl_MergeJob;
+
+// Whether count things of elemSize at offset are inside the shard, and aligned the way
+// TK_ParseObjShard lays them out
+int TKimpl_shardFits( const TK_ObjShard *shard, uint64_t offset, uint64_t count, size_t elemSize )
+{
+    return (offset <= shard->size) && (!(offset & (TKIMPL_ARENA_ALIGN-1))) &&
+           (count <= (shard->size - offset) / elemSize);
+}
+
+// Checks everything the merge reads from a shard is inside it, since it might have come
+// from a file or another machine. Doesn't look at the indices, the merge job does that.
+int TKimpl_validShard( const TK_ObjShard *shard, TK_ObjDelegate *objDelegate )
+{
+    if ((shard->magic != TK_OBJ_SHARD_MAGIC) || (shard->size < sizeof(TK_ObjShard)) ||
+        (shard->numMaterials < 1) || (shard->numMaterials > TKIMPL_MAX_UNIQUE_MTLS) ||
+        (shard->lastMaterial >= shard->numMaterials) ||
+        (!TKimpl_shardFits( shard, shard->mtlOffset, shard->numMaterials, sizeof(TKimpl_ShardMaterial) )) ||
+        (!TKimpl_shardFits( shard, shard->posOffset, shard->numVerts, sizeof(float)*3 )) ||
+        (!TKimpl_shardFits( shard, shard->stOffset, shard->numVertSt, sizeof(float)*2 )) ||
+        (!TKimpl_shardFits( shard, shard->nrmOffset, shard->numVertNrm, sizeof(float)*3 ))) {
+        return 0;
+    }
+    
+    // The geometry is sized from the stats, and skipped lists only get the default entry.
+    // Every position line has room in the shard, vt and vn don't when they're skipped.
+    if ((shard->numVertPos > shard->numVerts) || (shard->numVertSt > shard->numSts) ||
+        (shard->numVertNrm > shard->numNorms) ||
+        ((objDelegate->skipAttribs & TK_ObjAttrib_St) && (shard->numVertSt)) ||
+        ((objDelegate->skipAttribs & TK_ObjAttrib_Nrm) && (shard->numVertNrm))) {
+        return 0;
+    }
+    
+    const char *blob = (const char*)shard;
+    const TKimpl_ShardMaterial *shardMtls = (const TKimpl_ShardMaterial*)(blob + shard->mtlOffset);
+    for (size_t mi=0; mi < shard->numMaterials; mi++) {
+        if (!TKimpl_shardFits( shard, shardMtls[mi].trianglesOffset, shardMtls[mi].numTriangles,
+                               sizeof(TKimpl_IndexedTriangle) )) {
+            return 0;
+        }
+        // The name has to end before the shard does
+        uint64_t nameEnd = shardMtls[mi].nameOffset;
+        while ((nameEnd < shard->size) && (blob[nameEnd])) nameEnd++;
+        if (nameEnd >= shard->size) return 0;
+    }
+    return 1;
+}
+
+// Finds the merged materials, in the order the whole file would have them, by looking up
+// each shard's usemtls in file order. Each shard's material 0 is the last one in use in
+// the shard before it. Returns 0 if there are too
+// many, or one of the shards isn't.
+int TKimpl_mergeMaterials( TK_ObjShard **shards, size_t numShards, TKimpl_Material *uniqueMtls,
+                           size_t *numUniqueMtls, TKimpl_MergeShard *mergeShard, TK_ObjDelegate *objDelegate )
+{
+    uniqueMtls[0].mtlName = (char *)TKIMPL_DEFAULT_MTL_NAME;
+    uniqueMtls[0].numTriangles = 0;
+    *numUniqueMtls = 1;
+    
+    size_t currMtl = 0;
+    for (size_t si=0; si < numShards; si++) {
+        TK_ObjShard *shard = shards[si];
+        if (!TKimpl_validShard( shard, objDelegate )) {
+            if (objDelegate->error) objDelegate->error( 0, "Not a valid shard.", objDelegate->userData );
+            return 0;
+        }
+        
+        TKimpl_ShardMaterial *shardMtls = (TKimpl_ShardMaterial*)((char*)shard + shard->mtlOffset);
+        size_t mtlMap[TKIMPL_MAX_UNIQUE_MTLS];
+        mtlMap[0] = currMtl;
+        for (size_t mi=1; mi < shard->numMaterials; mi++) {
+            char *name = (char*)shard + shardMtls[mi].nameOffset;
+            size_t found = 0;
+            for (size_t i=1; (i < *numUniqueMtls) && (!found); i++) {
+                if (TKimpl_compareMtlName( uniqueMtls[i].mtlName, name )) found = i;
+            }
+            if (!found) {
+                if (*numUniqueMtls >= TKIMPL_MAX_UNIQUE_MTLS) {
+                    if (objDelegate->error) objDelegate->error( 0, "Too many materials.", objDelegate->userData );
+                    return 0;
+                }
+                found = (*numUniqueMtls)++;
+                uniqueMtls[found].mtlName = name;
+                uniqueMtls[found].numTriangles = 0;
+            }
+            mtlMap[mi] = found;
+        }
+        for (size_t mi=0; mi < shard->numMaterials; mi++) {
+            uniqueMtls[mtlMap[mi]].numTriangles = TKimpl_sizeAdd( uniqueMtls[mtlMap[mi]].numTriangles,
+                                                                  (size_t)shardMtls[mi].numTriangles );
+            if (mergeShard) mergeShard[si].mtlMap[mi] = mtlMap[mi];
+        }
+        currMtl = mtlMap[shard->lastMaterial];
+    }
+    return 1;
+}
+
+static inline ptrdiff_t TKimpl_mergeIndex( ptrdiff_t index, size_t base )
+{
+    return (index >= TKIMPL_SHARD_RELATIVE/2) ? (ptrdiff_t)base + (index - TKIMPL_SHARD_RELATIVE) : index;
+}
+
+void TKimpl_mergeShardJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_MergeJob *merge = (TKimpl_MergeJob*)jobData;
+    TK_ObjShard *shard = merge->shards[jobIndex];
+    TKimpl_MergeShard *mergeShard = merge->mergeShards + jobIndex;
+    TKimpl_Geometry *geom = merge->geom;
+    char *blob = (char*)shard;
+    
+    const float *vertPos = (const float*)(blob + shard->posOffset);
+    for (size_t i=0; i < 3*shard->numVertPos; i++) geom->vertPos[3*mergeShard->posBase + i] = vertPos[i];
+    const float *vertSt = (const float*)(blob + shard->stOffset);
+    for (size_t i=0; i < 2*shard->numVertSt; i++) geom->vertSt[2*mergeShard->stBase + i] = vertSt[i];
+    const float *vertNrm = (const float*)(blob + shard->nrmOffset);
+    for (size_t i=0; i < 3*shard->numVertNrm; i++) geom->vertNrm[3*mergeShard->nrmBase + i] = vertNrm[i];
+    
+    // Empty lists still have their default entry
+    ptrdiff_t numVertPos = (ptrdiff_t)geom->numVertPos;
+    ptrdiff_t numVertSt = geom->numVertSt ? (ptrdiff_t)geom->numVertSt : 1;
+    ptrdiff_t numVertNrm = geom->numVertNrm ? (ptrdiff_t)geom->numVertNrm : 1;
+    
+    TKimpl_ShardMaterial *shardMtls = (TKimpl_ShardMaterial*)(blob + shard->mtlOffset);
+    for (size_t mi=0; mi < shard->numMaterials; mi++) {
+        size_t mergedMtl = mergeShard->mtlMap[mi];
+        size_t triangleBase = mergeShard->triangleBase[mi];
+        TKimpl_IndexedTriangle *triangles = (TKimpl_IndexedTriangle*)(blob + shardMtls[mi].trianglesOffset);
+        for (size_t ti=0; ti < shardMtls[mi].numTriangles; ti++) {
+            TKimpl_IndexedTriangle tri = triangles[ti];
+            TKimpl_IndexedVert *verts = &(tri.vertA);
+            for (int vi=0; vi < 3; vi++) {
+                verts[vi].posIndex = TKimpl_mergeIndex( verts[vi].posIndex, mergeShard->posBase );
+                verts[vi].stIndex = TKimpl_mergeIndex( verts[vi].stIndex, mergeShard->stBase );
+                verts[vi].normIndex = TKimpl_mergeIndex( verts[vi].normIndex, mergeShard->nrmBase );
+                if ((verts[vi].posIndex < 0) || (verts[vi].posIndex >= numVertPos) ||
+                    (verts[vi].stIndex < 0) || (verts[vi].stIndex >= numVertSt) ||
+                    (verts[vi].normIndex < 0) || (verts[vi].normIndex >= numVertNrm)) {
+                    mergeShard->badIndex = 1;
+                    return;
+                }
+            }
+            TKimpl_StoreIndexedTriangle( geom, geom->materials + mergedMtl, triangleBase + ti, &tri );
+        }
+    }
+}
+
+TK_ObjGeometry *TK_MergeObjShards( TK_ObjShard **shards, size_t numShards, TK_ObjDelegate *objDelegate )
+{
+    TKimpl_Material uniqueMtls[TKIMPL_MAX_UNIQUE_MTLS];
+    size_t numUniqueMtls = 0;
+    if (!TKimpl_mergeMaterials( shards, numShards, uniqueMtls, &numUniqueMtls, NULL, objDelegate )) {
+        return NULL;
+    }
+    
+    size_t numVertSt = 0, numVertNrm = 0;
+    objDelegate->numVerts = 0;
+    objDelegate->numSts = 0;
+    objDelegate->numNorms = 0;
+    objDelegate->numFaces = 0;
+    objDelegate->numTriangles = 0;
+    // Saturating, so stats that don't fit come out as too big to allocate
+    for (size_t si=0; si < numShards; si++) {
+        objDelegate->numVerts = TKimpl_sizeAdd( objDelegate->numVerts, (size_t)shards[si]->numVerts );
+        objDelegate->numSts = TKimpl_sizeAdd( objDelegate->numSts, (size_t)shards[si]->numSts );
+        objDelegate->numNorms = TKimpl_sizeAdd( objDelegate->numNorms, (size_t)shards[si]->numNorms );
+        objDelegate->numFaces = TKimpl_sizeAdd( objDelegate->numFaces, (size_t)shards[si]->numFaces );
+        objDelegate->numTriangles = TKimpl_sizeAdd( objDelegate->numTriangles, (size_t)shards[si]->numTriangles );
+        numVertSt += shards[si]->numVertSt;
+        numVertNrm += shards[si]->numVertNrm;
+    }
+    if (!objDelegate->numSts) objDelegate->numSts = 1;
+    if (!objDelegate->numNorms) objDelegate->numNorms = 1;
+    
+    // The tables of where everything goes are only needed until the copy's done
+    size_t tableSize = TKimpl_ArenaSize( sizeof(TKimpl_MergeShard) * numShards );
+    
+    int immediateMode = objDelegate->immediateMode;
+    objDelegate->immediateMode = 0;
+    TK_ObjArena scratchArena, *arena;
+    TKimpl_Geometry *geom = TKimpl_AllocGeometry( objDelegate, uniqueMtls, numUniqueMtls, tableSize,
+                                                  &scratchArena, &arena );
+    objDelegate->immediateMode = immediateMode;
+    if (!geom) return NULL;
+    
+    TK_ObjArenaMark mark = TK_ObjArenaGetMark( arena );
+    TKimpl_MergeJob merge;
+    merge.shards = shards;
+    merge.geom = geom;
+    merge.mergeShards = TKImpl_PushStructArray( arena, TKimpl_MergeShard, numShards );
+    if (!merge.mergeShards) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
+    }
+    TKimpl_mergeMaterials( shards, numShards, uniqueMtls, &numUniqueMtls, merge.mergeShards, objDelegate );
+    
+    for (size_t si=0; si < numShards; si++) {
+        TK_ObjShard *shard = shards[si];
+        TKimpl_MergeShard *mergeShard = merge.mergeShards + si;
+        mergeShard->posBase = geom->numVertPos;
+        mergeShard->stBase = geom->numVertSt;
+        mergeShard->nrmBase = geom->numVertNrm;
+        mergeShard->badIndex = 0;
+        geom->numVertPos += shard->numVertPos;
+        geom->numVertSt += shard->numVertSt;
+        geom->numVertNrm += shard->numVertNrm;
+        
+        // A merged material can show up more than once in a shard, so each of the
+        // shard's materials goes after the ones before it in the file
+        TKimpl_ShardMaterial *shardMtls = (TKimpl_ShardMaterial*)((char*)shard + shard->mtlOffset);
+        for (size_t mi=0; mi < shard->numMaterials; mi++) {
+            TKimpl_Material *mtl = geom->materials + mergeShard->mtlMap[mi];
+            mergeShard->triangleBase[mi] = mtl->numTriangles;
+            mtl->numTriangles += shardMtls[mi].numTriangles;
+        }
+    }
+    
+    TKimpl_ParallelFor( objDelegate->jobs, TKimpl_mergeShardJob, &merge, numShards );
+    for (size_t si=0; si < numShards; si++) {
+        if (merge.mergeShards[si].badIndex) {
+            if (objDelegate->error) objDelegate->error( 0, "Not a valid shard.", objDelegate->userData );
+            return NULL;
+        }
+    }
+    TK_ObjArenaRewind( arena, mark );
+    
+    return TKimpl_FinishGeometry( geom, arena, objDelegate );
+}
+
+// =========================================================
+//  Indexed output
+// =========================================================
+
+#define TKIMPL_NO_INDEX (0xFFFFFFFFu)
+#define TKIMPL_STRIP_DONE (0xFFFFFFFFu)
+#define TKIMPL_STRIP_CACHE (16)
+
+// Hash of up to three indices, for the open addressed tables below
+static inline uint64_t TKimpl_hashIndices( uint64_t a, uint64_t b, uint64_t c )
+{
+    uint64_t h = (a * 0x9E3779B97F4A7C15ULL) ^ (b * 0xC2B2AE3D27D4EB4FULL) ^ (c * 0x165667B19E3779F9ULL);
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 32);
+}
+
+// One corner (3 per triangle) of a material's stored triangles
+static inline void TKimpl_loadCorner( TK_ObjGeometry *geom, TKimpl_Material *mtl, size_t corner,
+                                      TKimpl_IndexedVert *vert )
+{
+    if (geom->compactIndices) {
+        const TKimpl_CompactVert *src = &(mtl->compactTriangles[corner/3].vertA) + (corner%3);
+        vert->posIndex = src->posIndex;
+        vert->stIndex = src->stIndex;
+        vert->normIndex = src->normIndex;
+    } else {
+        *vert = (&(mtl->triangles[corner/3].vertA))[corner%3];
+    }
+}
+
+// Half-edge h goes from corner h to the next corner of the same triangle
+static inline uint32_t TKimpl_nextCorner( uint32_t h )
+{
+    return (h % 3 == 2) ? h - 2 : h + 1;
+}
+
+typedef struct {
+    const uint32_t *corners; // vert of each corner
+    uint32_t *twins;         // half-edge going the other way over the same edge, or TKIMPL_NO_INDEX
+    uint32_t *marks;         // TKIMPL_STRIP_DONE once a triangle's in a strip, or the last walk to visit it
+    uint32_t *vertTriStart;  // triangles that use each vert, vertTris[vertTriStart[v]..vertTriStart[v+1])
+    uint32_t *vertTris;
+    uint32_t numTriangles;
+} TKimpl_Stripper;
+
+// Walks a strip starting at tri, with its corners rotated by rot, and marks the
+// triangles it takes with stamp. Writes the strip's indices to dest if it isn't
+// NULL. Returns the number of triangles in the strip.
+size_t TKimpl_walkStrip( TKimpl_Stripper *strip, uint32_t tri, uint32_t rot, uint32_t stamp, uint32_t *dest )
+{
+    const uint32_t *corners = strip->corners;
+    if (dest) {
+        dest[0] = corners[3*tri + rot];
+        dest[1] = corners[3*tri + (rot+1)%3];
+        dest[2] = corners[3*tri + (rot+2)%3];
+    }
+    strip->marks[tri] = stamp;
+
+    // The even triangles of a strip leave through the edge after the one they came in
+    // on, and the odd ones through the edge before, which keeps the winding the same
+    size_t numTriangles = 1;
+    uint32_t exit = 3*tri + (rot+1)%3;
+    for (;;) {
+        uint32_t entry = strip->twins[exit];
+        if (entry == TKIMPL_NO_INDEX) break;
+
+        uint32_t next = entry / 3;
+        if ((strip->marks[next] == TKIMPL_STRIP_DONE) || (strip->marks[next] == stamp)) break;
+        strip->marks[next] = stamp;
+
+        uint32_t edge = entry % 3;
+        if (dest) {
+            dest[numTriangles + 2] = corners[3*next + (edge+2)%3];
+        }
+        exit = 3*next + (edge + ((numTriangles & 1) ? 2 : 1)) % 3;
+        numTriangles++;
+    }
+    return numTriangles;
+}
+
+// Neighbours of a triangle that aren't in a strip yet
+static inline int TKimpl_freeNeighbours( TKimpl_Stripper *strip, uint32_t tri )
+{
+    int numFree = 0;
+    for (uint32_t hi=3*tri; hi < 3*tri + 3; hi++) {
+        uint32_t twin = strip->twins[hi];
+        if ((twin != TKIMPL_NO_INDEX) && (strip->marks[twin/3] != TKIMPL_STRIP_DONE)) numFree++;
+    }
+    return numFree;
+}
+
+// Finds the half-edge a->b in the edge table, or TKIMPL_NO_INDEX
+static inline uint32_t TKimpl_findEdge( const uint32_t *table, size_t tableMask, const uint32_t *corners,
+                                        uint32_t a, uint32_t b )
+{
+    for (size_t slot = TKimpl_hashIndices( a, b, 0 ) & tableMask; ; slot = (slot + 1) & tableMask) {
+        uint32_t h = table[slot];
+        if ((h == TKIMPL_NO_INDEX) ||
+            ((corners[h] == a) && (corners[TKimpl_nextCorner( h )] == b))) {
+            return h;
+        }
+    }
+}
+
+// Joins the triangles into strips, writing them with restarts in between to dest
+// (room for 4 indices per triangle). The table is scratch space for the edges.
+size_t TKimpl_buildStrips( TKimpl_Stripper *strip, uint32_t *table, size_t tableSize,
+                           uint32_t *dest, size_t *out_numStrips )
+{
+    const uint32_t *corners = strip->corners;
+    uint32_t numCorners = 3 * strip->numTriangles;
+
+    // Match up the half-edges. Degenerate triangles are left out, so they end up as
+    // strips of their own, and where more than two triangles share an edge only the
+    // first one going each way is used.
+    for (size_t si=0; si < tableSize; si++) table[si] = TKIMPL_NO_INDEX;
+    for (uint32_t h=0; h < numCorners; h++) {
+        strip->twins[h] = TKIMPL_NO_INDEX;
+        uint32_t a = corners[h], b = corners[TKimpl_nextCorner( h )];
+        uint32_t c = corners[TKimpl_nextCorner( TKimpl_nextCorner( h ) )];
+        if ((a == b) || (b == c) || (a == c)) continue;
+
+        size_t slot = TKimpl_hashIndices( a, b, 0 ) & (tableSize - 1);
+        while ((table[slot] != TKIMPL_NO_INDEX) &&
+               ((corners[table[slot]] != a) || (corners[TKimpl_nextCorner( table[slot] )] != b))) {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (table[slot] == TKIMPL_NO_INDEX) table[slot] = h;
+    }
+    for (uint32_t h=0; h < numCorners; h++) {
+        uint32_t a = corners[h], b = corners[TKimpl_nextCorner( h )];
+        if (a != b) {
+            strip->twins[h] = TKimpl_findEdge( table, tableSize - 1, corners, b, a );
+        }
+    }
+    for (uint32_t ti=0; ti < strip->numTriangles; ti++) {
+        strip->marks[ti] = 0;
+    }
+
+    uint32_t cache[TKIMPL_STRIP_CACHE];
+    uint32_t cachePos = 0;
+    for (int ci=0; ci < TKIMPL_STRIP_CACHE; ci++) cache[ci] = TKIMPL_NO_INDEX;
+
+    size_t numIndices = 0, numStrips = 0;
+    uint32_t nextInOrder = 0, stamp = 0;
+    for (;;) {
+        // Start next to something still in the cache, at the triangle with the fewest
+        // free neighbours so that strips don't leave single triangles stranded. If
+        // there's nothing there, take the next triangle in order.
+        uint32_t start = TKIMPL_NO_INDEX;
+        int fewestFree = 4;
+        for (int ci=0; (ci < TKIMPL_STRIP_CACHE) && (fewestFree > 0); ci++) {
+            uint32_t vert = cache[ci];
+            if (vert == TKIMPL_NO_INDEX) continue;
+            for (uint32_t vi = strip->vertTriStart[vert]; vi < strip->vertTriStart[vert+1]; vi++) {
+                uint32_t tri = strip->vertTris[vi];
+                if (strip->marks[tri] == TKIMPL_STRIP_DONE) continue;
+                int numFree = TKimpl_freeNeighbours( strip, tri );
+                if (numFree < fewestFree) {
+                    fewestFree = numFree;
+                    start = tri;
+                }
+            }
+        }
+        if (start == TKIMPL_NO_INDEX) {
+            while ((nextInOrder < strip->numTriangles) && (strip->marks[nextInOrder] == TKIMPL_STRIP_DONE)) {
+                nextInOrder++;
+            }
+            if (nextInOrder == strip->numTriangles) break;
+            start = nextInOrder;
+        }
+
+        // Try leaving the first triangle through each of its edges, keep the longest
+        uint32_t bestRot = 0;
+        size_t bestLength = 0;
+        for (uint32_t rot=0; rot < 3; rot++) {
+            size_t length = TKimpl_walkStrip( strip, start, rot, ++stamp, NULL );
+            if (length > bestLength) {
+                bestLength = length;
+                bestRot = rot;
+            }
+        }
+
+        if (numStrips) dest[numIndices++] = TK_OBJ_RESTART_INDEX;
+        size_t length = TKimpl_walkStrip( strip, start, bestRot, TKIMPL_STRIP_DONE, dest + numIndices );
+        for (size_t ii = numIndices; ii < numIndices + length + 2; ii++) {
+            int cached = 0;
+            for (int ci=0; (ci < TKIMPL_STRIP_CACHE) && (!cached); ci++) cached = (cache[ci] == dest[ii]);
+            if (!cached) {
+                cache[cachePos] = dest[ii];
+                cachePos = (cachePos + 1) % TKIMPL_STRIP_CACHE;
+            }
+        }
+        numIndices += length + 2;
+        numStrips++;
+    }
+
+    *out_numStrips = numStrips;
+    return numIndices;
+}
+
+int TK_ObjIndexMaterial( TK_ObjGeometry *geom, size_t mtlIndex, int strips,
+                         TK_ObjArena *arena, TK_ObjArena *scratch, TK_ObjIndexedMesh *mesh )
+{
+    TKimpl_Material *mtl = geom->materials + mtlIndex;
+    mesh->numVerts = 0;
+    mesh->verts = NULL;
+    mesh->posIndices = NULL;
+    mesh->numIndices = 0;
+    mesh->indices = NULL;
+    mesh->numStrips = 0;
+    mesh->numTriangles = mtl->numTriangles;
+    if (!mtl->numTriangles) return 1;
+
+    // Every corner could be its own vert, and those have to stay below the restart index
+    if ((!TKimpl_materialTriangleData( geom, mtl )) || (mtl->numTriangles >= TKIMPL_NO_INDEX / 3)) {
+        return 0;
+    }
+    uint32_t numTriangles = (uint32_t)mtl->numTriangles;
+    uint32_t numCorners = 3 * numTriangles;
+    size_t tableSize = 16;
+    while (tableSize < 2 * (size_t)numCorners) tableSize <<= 1;
+
+    TK_ObjArenaMark arenaMark = TK_ObjArenaGetMark( arena );
+    TK_ObjArenaMark mark = TK_ObjArenaGetMark( scratch );
+    uint32_t *table = TKImpl_PushStructArray( scratch, uint32_t, tableSize );
+    uint32_t *corners = TKImpl_PushStructArray( scratch, uint32_t, numCorners );
+    uint32_t *firstCorners = TKImpl_PushStructArray( scratch, uint32_t, numCorners );
+    if ((!table) || (!corners) || (!firstCorners)) {
+        TK_ObjArenaRewind( scratch, mark );
+        return 0;
+    }
+
+    // Give each distinct corner a vert, numbered in the order they come up
+    for (size_t si=0; si < tableSize; si++) table[si] = TKIMPL_NO_INDEX;
+    uint32_t numVerts = 0;
+    for (uint32_t ci=0; ci < numCorners; ci++) {
+        TKimpl_IndexedVert vert, other;
+        TKimpl_loadCorner( geom, mtl, ci, &vert );
+
+        size_t slot = TKimpl_hashIndices( vert.posIndex, vert.stIndex, vert.normIndex ) & (tableSize - 1);
+        for (;; slot = (slot + 1) & (tableSize - 1)) {
+            if (table[slot] == TKIMPL_NO_INDEX) {
+                table[slot] = numVerts;
+                firstCorners[numVerts++] = ci;
+                break;
+            }
+            TKimpl_loadCorner( geom, mtl, firstCorners[table[slot]], &other );
+            if ((other.posIndex == vert.posIndex) && (other.stIndex == vert.stIndex) &&
+                (other.normIndex == vert.normIndex)) {
+                break;
+            }
+        }
+        corners[ci] = table[slot];
+    }
+
+    uint32_t *indices = corners;
+    size_t numIndices = numCorners;
+    size_t numStrips = 0;
+    if (strips) {
+        TKimpl_Stripper strip;
+        strip.corners = corners;
+        strip.numTriangles = numTriangles;
+        strip.twins = TKImpl_PushStructArray( scratch, uint32_t, numCorners );
+        strip.marks = TKImpl_PushStructArray( scratch, uint32_t, numTriangles );
+        strip.vertTriStart = TKImpl_PushStructArray( scratch, uint32_t, (size_t)numVerts + 1 );
+        strip.vertTris = TKImpl_PushStructArray( scratch, uint32_t, numCorners );
+        indices = TKImpl_PushStructArray( scratch, uint32_t, (size_t)numTriangles * 4 );
+        if ((!strip.twins) || (!strip.marks) || (!strip.vertTriStart) || (!strip.vertTris) || (!indices)) {
+            TK_ObjArenaRewind( scratch, mark );
+            return 0;
+        }
+
+        // Triangles around each vert, for picking where the next strip starts
+        for (uint32_t vi=0; vi <= numVerts; vi++) strip.vertTriStart[vi] = 0;
+        for (uint32_t ci=0; ci < numCorners; ci++) strip.vertTriStart[corners[ci] + 1]++;
+        for (uint32_t vi=0; vi < numVerts; vi++) strip.vertTriStart[vi+1] += strip.vertTriStart[vi];
+        for (uint32_t ci=0; ci < numCorners; ci++) strip.vertTris[strip.vertTriStart[corners[ci]]++] = ci / 3;
+        for (uint32_t vi=numVerts; vi > 0; vi--) strip.vertTriStart[vi] = strip.vertTriStart[vi-1];
+        strip.vertTriStart[0] = 0;
+
+        numIndices = TKimpl_buildStrips( &strip, table, tableSize, indices, &numStrips );
+    }
+
+    mesh->verts = TKImpl_PushStructArray( arena, TK_TriangleVert, numVerts );
+    mesh->posIndices = TKImpl_PushStructArray( arena, size_t, numVerts );
+    mesh->indices = TKImpl_PushStructArray( arena, uint32_t, numIndices );
+    if ((!mesh->verts) || (!mesh->posIndices) || (!mesh->indices)) {
+        TK_ObjArenaRewind( arena, arenaMark );
+        if (arena != scratch) TK_ObjArenaRewind( scratch, mark );
+        mesh->verts = NULL;
+        mesh->posIndices = NULL;
+        mesh->indices = NULL;
+        return 0;
+    }
+
+    // Renumber the verts in the order the indices use them (strips change the order),
+    // the edge table isn't needed anymore so it holds the new numbers
+    uint32_t *newIndex = table;
+    for (uint32_t vi=0; vi < numVerts; vi++) newIndex[vi] = TKIMPL_NO_INDEX;
+    uint32_t numUsed = 0;
+    for (size_t ii=0; ii < numIndices; ii++) {
+        uint32_t index = indices[ii];
+        if (index == TK_OBJ_RESTART_INDEX) {
+            mesh->indices[ii] = index;
+            continue;
+        }
+        if (newIndex[index] == TKIMPL_NO_INDEX) newIndex[index] = numUsed++;
+        mesh->indices[ii] = newIndex[index];
+    }
+
+    for (uint32_t vi=0; vi < numVerts; vi++) {
+        TKimpl_IndexedVert vert;
+        TKimpl_loadCorner( geom, mtl, firstCorners[vi], &vert );
+
+        TK_TriangleVert *dest = mesh->verts + newIndex[vi];
+        const float *pos = geom->vertPos + vert.posIndex*3;
+        const float *st = geom->vertSt + vert.stIndex*2;
+        const float *nrm = geom->vertNrm + vert.normIndex*3;
+        dest->pos[0] = pos[0]; dest->pos[1] = pos[1]; dest->pos[2] = pos[2];
+        dest->st[0] = st[0];   dest->st[1] = st[1];
+        dest->nrm[0] = nrm[0]; dest->nrm[1] = nrm[1]; dest->nrm[2] = nrm[2];
+        mesh->posIndices[newIndex[vi]] = vert.posIndex;
+    }
+
+    mesh->numVerts = numVerts;
+    mesh->numIndices = numIndices;
+    mesh->numStrips = numStrips;
+    if (arena != scratch) TK_ObjArenaRewind( scratch, mark );
+    return 1;
+}
+
+
+// =========================================================
+//  Simplification
+// =========================================================
+
+// Collapses around a vert with more triangles than this are skipped
+#define TKIMPL_LOD_MAX_FAN (64)
+
+typedef struct {
+    TKimpl_CompactVert verts[3];
+    uint32_t mtlIndex; // TKIMPL_NO_INDEX once it's been collapsed away
+} TKimpl_LodTriangle;
+
+// Symmetric 4x4 error quadric, aa ab ac ad bb bc bd cc cd dd
+typedef struct {
+    double q[10];
+} TKimpl_Quadric;
+
+typedef struct {
+    TK_ObjGeometry *geom;
+    TKimpl_LodTriangle *tris;
+    uint32_t numTriangles;
+    uint32_t numAlive;
+    
+    // Per position. Collapsed positions are spliced into the circular list of the one
+    // they went to, so walking it finds all the triangles that use the survivor.
+    TKimpl_Quadric *quadrics;
+    uint8_t *locked;
+    uint32_t *chainNext;
+    uint32_t *vertTriStart; // triangles each position started out in
+    uint32_t *vertTris;
+    uint32_t *touched;      // last pass that changed something around the position
+    uint32_t pass;
+} TKimpl_Lod;
+
+void TKimpl_quadricAddPlane( TKimpl_Quadric *quadric, const float *a, const float *b, const float *c )
+{
+    double e1[3], e2[3], n[3];
+    for (int i=0; i < 3; i++) {
+        e1[i] = (double)b[i] - a[i];
+        e2[i] = (double)c[i] - a[i];
+    }
+    n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+    n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+    n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+    
+    // Weighted by area, so the length of the cross product is twice the weight
+    double len = TKimpl_sqrtd( n[0]*n[0] + n[1]*n[1] + n[2]*n[2] );
+    if (len <= 0.0) return;
+    for (int i=0; i < 3; i++) n[i] /= len;
+    double d = -(n[0]*a[0] + n[1]*a[1] + n[2]*a[2]);
+    double weight = 0.5 * len;
+    
+    double *q = quadric->q;
+    q[0] += weight*n[0]*n[0]; q[1] += weight*n[0]*n[1]; q[2] += weight*n[0]*n[2]; q[3] += weight*n[0]*d;
+    q[4] += weight*n[1]*n[1]; q[5] += weight*n[1]*n[2]; q[6] += weight*n[1]*d;
+    q[7] += weight*n[2]*n[2]; q[8] += weight*n[2]*d;
+    q[9] += weight*d*d;
+}
+
+static inline double TKimpl_quadricError( const TKimpl_Quadric *quadric, const float *p )
+{
+    const double *q = quadric->q;
+    double x = p[0], y = p[1], z = p[2];
+    return q[0]*x*x + 2.0*q[1]*x*y + 2.0*q[2]*x*z + 2.0*q[3]*x +
+           q[4]*y*y + 2.0*q[5]*y*z + 2.0*q[6]*y +
+           q[7]*z*z + 2.0*q[8]*z +
+           q[9];
+}
+
+static inline void TKimpl_lodNormal( const float *a, const float *b, const float *c, float *n )
+{
+    float e1[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+    float e2[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+    n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+    n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+    n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+}
+
+// The live triangles around a position, returns TKIMPL_LOD_MAX_FAN+1 if there are too many
+size_t TKimpl_lodFan( TKimpl_Lod *lod, uint32_t vert, uint32_t *fan )
+{
+    size_t numFan = 0;
+    uint32_t member = vert;
+    do {
+        for (uint32_t vi = lod->vertTriStart[member]; vi < lod->vertTriStart[member+1]; vi++) {
+            uint32_t tri = lod->vertTris[vi];
+            if (lod->tris[tri].mtlIndex == TKIMPL_NO_INDEX) continue;
+            if (numFan == TKIMPL_LOD_MAX_FAN) return TKIMPL_LOD_MAX_FAN + 1;
+            fan[numFan++] = tri;
+        }
+        member = lod->chainNext[member];
+    } while (member != vert);
+    return numFan;
+}
+
+// Which corner of the triangle is at the position, or 3
+static inline int TKimpl_lodCorner( TKimpl_LodTriangle *tri, uint32_t vert )
+{
+    int corner = 0;
+    while ((corner < 3) && (tri->verts[corner].posIndex != vert)) corner++;
+    return corner;
+}
+
+// Collapses vert onto target, if that doesn't pinch the surface or flip anything.
+// Returns 0 (and doesn't change anything) if it can't.
+int TKimpl_lodCollapse( TKimpl_Lod *lod, uint32_t vert, uint32_t target )
+{
+    const float *vertPos = lod->geom->vertPos;
+    uint32_t fan[TKIMPL_LOD_MAX_FAN], targetFan[TKIMPL_LOD_MAX_FAN];
+    size_t numFan = TKimpl_lodFan( lod, vert, fan );
+    if (numFan > TKIMPL_LOD_MAX_FAN) return 0;
+    
+    // The triangles on the edge go away, and the target's uv and normal on them are the
+    // ones the rest of the fan picks up. If those don't agree the edge is on a seam.
+    TKimpl_CompactVert targetAttribs;
+    uint32_t across[2];
+    size_t numShared = 0;
+    uint32_t neighbours[2*TKIMPL_LOD_MAX_FAN];
+    size_t numNeighbours = 0;
+    for (size_t fi=0; fi < numFan; fi++) {
+        TKimpl_LodTriangle *tri = lod->tris + fan[fi];
+        int targetCorner = TKimpl_lodCorner( tri, target );
+        for (int ci=0; ci < 3; ci++) {
+            if (tri->verts[ci].posIndex != vert) neighbours[numNeighbours++] = tri->verts[ci].posIndex;
+        }
+        if (targetCorner == 3) continue;
+        
+        if (numShared == 2) return 0;
+        TKimpl_CompactVert *attribs = tri->verts + targetCorner;
+        if ((numShared) && ((attribs->stIndex != targetAttribs.stIndex) ||
+                            (attribs->normIndex != targetAttribs.normIndex))) {
+            return 0;
+        }
+        targetAttribs = *attribs;
+        int vertCorner = TKimpl_lodCorner( tri, vert );
+        across[numShared++] = tri->verts[3 - vertCorner - targetCorner].posIndex;
+    }
+    if (!numShared) return 0;
+    
+    // Anything else next to both would end up with two edges to the target
+    size_t numTargetFan = TKimpl_lodFan( lod, target, targetFan );
+    if (numTargetFan > TKIMPL_LOD_MAX_FAN) return 0;
+    for (size_t fi=0; fi < numTargetFan; fi++) {
+        TKimpl_LodTriangle *tri = lod->tris + targetFan[fi];
+        for (int ci=0; ci < 3; ci++) {
+            uint32_t other = tri->verts[ci].posIndex;
+            if ((other == target) || (other == vert)) continue;
+            if ((other == across[0]) || ((numShared > 1) && (other == across[1]))) continue;
+            for (size_t ni=0; ni < numNeighbours; ni++) {
+                if (neighbours[ni] == other) return 0;
+            }
+        }
+    }
+    
+    // The rest of the fan can't turn over
+    const float *targetPos = vertPos + (size_t)target*3;
+    for (size_t fi=0; fi < numFan; fi++) {
+        TKimpl_LodTriangle *tri = lod->tris + fan[fi];
+        if (TKimpl_lodCorner( tri, target ) != 3) continue;
+        
+        const float *corners[3];
+        for (int ci=0; ci < 3; ci++) corners[ci] = vertPos + (size_t)tri->verts[ci].posIndex*3;
+        float before[3], after[3];
+        TKimpl_lodNormal( corners[0], corners[1], corners[2], before );
+        corners[TKimpl_lodCorner( tri, vert )] = targetPos;
+        TKimpl_lodNormal( corners[0], corners[1], corners[2], after );
+        float dot = before[0]*after[0] + before[1]*after[1] + before[2]*after[2];
+        float lenSq = (before[0]*before[0] + before[1]*before[1] + before[2]*before[2]) *
+                      (after[0]*after[0] + after[1]*after[1] + after[2]*after[2]);
+        if ((dot <= 0.0f) || (dot*dot < 0.0625f*lenSq)) return 0;
+    }
+    
+    for (size_t fi=0; fi < numFan; fi++) {
+        TKimpl_LodTriangle *tri = lod->tris + fan[fi];
+        if (TKimpl_lodCorner( tri, target ) != 3) {
+            tri->mtlIndex = TKIMPL_NO_INDEX;
+            lod->numAlive--;
+        } else {
+            tri->verts[TKimpl_lodCorner( tri, vert )] = targetAttribs;
+        }
+    }
+    for (int i=0; i < 10; i++) lod->quadrics[target].q[i] += lod->quadrics[vert].q[i];
+    
+    uint32_t next = lod->chainNext[target];
+    lod->chainNext[target] = lod->chainNext[vert];
+    lod->chainNext[vert] = next;
+    
+    lod->touched[vert] = lod->pass;
+    lod->touched[target] = lod->pass;
+    for (size_t ni=0; ni < numNeighbours; ni++) lod->touched[neighbours[ni]] = lod->pass;
+    return 1;
+}
+
+// LSD radix sort of 32-bit keys and their values, the result ends up back in keys and vals
+void TKimpl_radixSort32( uint32_t *keys, uint32_t *vals, uint32_t *tempKeys, uint32_t *tempVals, size_t count )
+{
+    for (int shift=0; shift < 32; shift += 8) {
+        size_t offsets[256];
+        for (int d=0; d < 256; d++) offsets[d] = 0;
+        for (size_t i=0; i < count; i++) offsets[(keys[i] >> shift) & 0xff]++;
+        size_t offset = 0;
+        for (int d=0; d < 256; d++) {
+            size_t digitCount = offsets[d];
+            offsets[d] = offset;
+            offset += digitCount;
+        }
+        for (size_t i=0; i < count; i++) {
+            size_t dest = offsets[(keys[i] >> shift) & 0xff]++;
+            tempKeys[dest] = keys[i];
+            tempVals[dest] = vals[i];
+        }
+        uint32_t *swap = keys; keys = tempKeys; tempKeys = swap;
+        swap = vals; vals = tempVals; tempVals = swap;
+    }
+}
+
+void TKimpl_emitLod( TKimpl_Lod *lod, size_t lodIndex, const size_t *mtlStart, TK_ObjDelegate *objDelegate )
+{
+    TK_ObjGeometry *geom = lod->geom;
+    if (objDelegate->lod) {
+        objDelegate->lod( lodIndex, lod->numAlive, objDelegate->userData );
+    }
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        size_t numTriangles = 0;
+        for (size_t ti = mtlStart[mi]; ti < mtlStart[mi+1]; ti++) {
+            if (lod->tris[ti].mtlIndex != TKIMPL_NO_INDEX) numTriangles++;
+        }
+        if (!numTriangles) continue;
+        
+        if (objDelegate->material) {
+            char mtlName[TKIMPL_MAX_MATERIAL_NAME];
+            TKimpl_stringDelimMtlName( mtlName, geom->materials[mi].mtlName, TKIMPL_MAX_MATERIAL_NAME );
+            objDelegate->material( mtlName, numTriangles, objDelegate->userData );
+        }
+        for (size_t ti = mtlStart[mi]; (objDelegate->triangle) && (ti < mtlStart[mi+1]); ti++) {
+            TKimpl_LodTriangle *tri = lod->tris + ti;
+            if (tri->mtlIndex == TKIMPL_NO_INDEX) continue;
+            
+            TK_TriangleVert verts[3];
+            for (int ci=0; ci < 3; ci++) {
+                const float *pos = geom->vertPos + (size_t)tri->verts[ci].posIndex*3;
+                const float *st = geom->vertSt + (size_t)tri->verts[ci].stIndex*2;
+                const float *nrm = geom->vertNrm + (size_t)tri->verts[ci].normIndex*3;
+                verts[ci].pos[0] = pos[0]; verts[ci].pos[1] = pos[1]; verts[ci].pos[2] = pos[2];
+                verts[ci].st[0] = st[0];   verts[ci].st[1] = st[1];
+                verts[ci].nrm[0] = nrm[0]; verts[ci].nrm[1] = nrm[1]; verts[ci].nrm[2] = nrm[2];
+            }
+            objDelegate->triangle( verts[0], verts[1], verts[2], objDelegate->userData );
+        }
+    }
+}
+
+int TK_ObjEmitLods( TK_ObjGeometry *geom, const float *ratios, size_t numLods,
+                    TK_ObjDelegate *objDelegate, TK_ObjArena *scratch )
+{
+    size_t totalTriangles = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        if ((geom->materials[mi].numTriangles) && (!TKimpl_materialTriangleData( geom, geom->materials + mi ))) {
+            return 0;
+        }
+        totalTriangles += geom->materials[mi].numTriangles;
+    }
+    if ((totalTriangles >= TKIMPL_NO_INDEX / 3) || (geom->numVertPos >= TKIMPL_NO_INDEX)) return 0;
+    
+    TK_ObjArenaMark mark = TK_ObjArenaGetMark( scratch );
+    uint32_t numVerts = (uint32_t)geom->numVertPos;
+    TKimpl_Lod lod;
+    lod.geom = geom;
+    lod.tris = TKImpl_PushStructArray( scratch, TKimpl_LodTriangle, totalTriangles );
+    lod.quadrics = TKImpl_PushStructArray( scratch, TKimpl_Quadric, numVerts );
+    lod.locked = TKImpl_PushStructArray( scratch, uint8_t, numVerts );
+    lod.chainNext = TKImpl_PushStructArray( scratch, uint32_t, numVerts );
+    lod.vertTriStart = TKImpl_PushStructArray( scratch, uint32_t, (size_t)numVerts + 1 );
+    lod.vertTris = TKImpl_PushStructArray( scratch, uint32_t, totalTriangles*3 );
+    lod.touched = TKImpl_PushStructArray( scratch, uint32_t, numVerts );
+    uint32_t *bestTarget = TKImpl_PushStructArray( scratch, uint32_t, numVerts );
+    float *bestCost = TKImpl_PushStructArray( scratch, float, numVerts );
+    uint32_t *candidates[4];
+    for (int i=0; i < 4; i++) candidates[i] = TKImpl_PushStructArray( scratch, uint32_t, numVerts );
+    if ((!lod.tris) || (!lod.quadrics) || (!lod.locked) || (!lod.chainNext) || (!lod.vertTriStart) ||
+        (!lod.vertTris) || (!lod.touched) || (!bestTarget) || (!bestCost) || (!candidates[0]) ||
+        (!candidates[1]) || (!candidates[2]) || (!candidates[3])) {
+        TK_ObjArenaRewind( scratch, mark );
+        return 0;
+    }
+    
+    // Copy the triangles, by material, leaving out degenerate ones. An index past its list
+    // (a bad face in the file) would run off the per-position tables.
+    size_t numSts = geom->numVertSt ? geom->numVertSt : 1;
+    size_t numNrms = geom->numVertNrm ? geom->numVertNrm : 1;
+    size_t mtlStart[TKIMPL_MAX_UNIQUE_MTLS+1];
+    lod.numTriangles = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        TKimpl_Material *mtl = geom->materials + mi;
+        mtlStart[mi] = lod.numTriangles;
+        for (size_t ti=0; ti < mtl->numTriangles; ti++) {
+            TKimpl_IndexedTriangle ndxTri;
+            TKimpl_LoadIndexedTriangle( geom, mtl, ti, &ndxTri );
+            TKimpl_IndexedVert *src = &(ndxTri.vertA);
+            for (int ci=0; ci < 3; ci++) {
+                if (((size_t)src[ci].posIndex >= numVerts) || ((size_t)src[ci].stIndex >= numSts) ||
+                    ((size_t)src[ci].normIndex >= numNrms)) {
+                    TK_ObjArenaRewind( scratch, mark );
+                    return 0;
+                }
+            }
+            if ((ndxTri.vertA.posIndex == ndxTri.vertB.posIndex) || (ndxTri.vertB.posIndex == ndxTri.vertC.posIndex) ||
+                (ndxTri.vertA.posIndex == ndxTri.vertC.posIndex)) {
+                continue;
+            }
+            
+            TKimpl_LodTriangle *tri = lod.tris + lod.numTriangles++;
+            for (int ci=0; ci < 3; ci++) {
+                tri->verts[ci].posIndex = (uint32_t)src[ci].posIndex;
+                tri->verts[ci].stIndex = (uint32_t)src[ci].stIndex;
+                tri->verts[ci].normIndex = (uint32_t)src[ci].normIndex;
+            }
+            tri->mtlIndex = (uint32_t)mi;
+        }
+    }
+    mtlStart[geom->numMaterials] = lod.numTriangles;
+    lod.numAlive = lod.numTriangles;
+    
+    // Quadrics, and the triangles around each position
+    for (uint32_t vi=0; vi < numVerts; vi++) {
+        for (int i=0; i < 10; i++) lod.quadrics[vi].q[i] = 0.0;
+        lod.locked[vi] = 0;
+        lod.chainNext[vi] = vi;
+        lod.touched[vi] = 0;
+        lod.vertTriStart[vi] = 0;
+    }
+    lod.vertTriStart[numVerts] = 0;
+    for (uint32_t ti=0; ti < lod.numTriangles; ti++) {
+        TKimpl_CompactVert *verts = lod.tris[ti].verts;
+        const float *corners[3];
+        for (int ci=0; ci < 3; ci++) {
+            corners[ci] = geom->vertPos + (size_t)verts[ci].posIndex*3;
+            lod.vertTriStart[verts[ci].posIndex + 1]++;
+        }
+        for (int ci=0; ci < 3; ci++) {
+            TKimpl_quadricAddPlane( lod.quadrics + verts[ci].posIndex, corners[0], corners[1], corners[2] );
+        }
+    }
+    for (uint32_t vi=0; vi < numVerts; vi++) lod.vertTriStart[vi+1] += lod.vertTriStart[vi];
+    for (uint32_t ti=0; ti < lod.numTriangles; ti++) {
+        for (int ci=0; ci < 3; ci++) {
+            lod.vertTris[lod.vertTriStart[lod.tris[ti].verts[ci].posIndex]++] = ti;
+        }
+    }
+    for (uint32_t vi=numVerts; vi > 0; vi--) lod.vertTriStart[vi] = lod.vertTriStart[vi-1];
+    lod.vertTriStart[0] = 0;
+    
+    // Lock positions used with more than one uv, normal or material (bestTarget holds the
+    // first triangle seen at each one for now)
+    for (uint32_t vi=0; vi < numVerts; vi++) bestTarget[vi] = TKIMPL_NO_INDEX;
+    for (uint32_t ti=0; ti < lod.numTriangles; ti++) {
+        TKimpl_LodTriangle *tri = lod.tris + ti;
+        for (int ci=0; ci < 3; ci++) {
+            uint32_t vert = tri->verts[ci].posIndex;
+            if (bestTarget[vert] == TKIMPL_NO_INDEX) {
+                bestTarget[vert] = ti*3 + ci;
+                continue;
+            }
+            TKimpl_LodTriangle *first = lod.tris + bestTarget[vert]/3;
+            TKimpl_CompactVert *firstVert = first->verts + bestTarget[vert]%3;
+            if ((first->mtlIndex != tri->mtlIndex) || (firstVert->stIndex != tri->verts[ci].stIndex) ||
+                (firstVert->normIndex != tri->verts[ci].normIndex)) {
+                lod.locked[vert] = 1;
+            }
+        }
+    }
+    
+    // And the ends of any edge that doesn't have exactly two triangles
+    {
+        TK_ObjArenaMark edgeMark = TK_ObjArenaGetMark( scratch );
+        size_t numCorners = (size_t)lod.numTriangles * 3;
+        size_t tableSize = 16;
+        while (tableSize < 2*numCorners) tableSize <<= 1;
+        uint32_t *table = TKImpl_PushStructArray( scratch, uint32_t, tableSize );
+        uint32_t *edgeCount = TKImpl_PushStructArray( scratch, uint32_t, numCorners );
+        if ((!table) || (!edgeCount)) {
+            TK_ObjArenaRewind( scratch, mark );
+            return 0;
+        }
+        for (size_t si=0; si < tableSize; si++) table[si] = TKIMPL_NO_INDEX;
+        for (uint32_t h=0; h < numCorners; h++) {
+            uint32_t a = lod.tris[h/3].verts[h%3].posIndex;
+            uint32_t b = lod.tris[h/3].verts[(h%3 + 1)%3].posIndex;
+            if (a > b) { uint32_t swap = a; a = b; b = swap; }
+            
+            size_t slot = TKimpl_hashIndices( a, b, 0 ) & (tableSize - 1);
+            for (;; slot = (slot + 1) & (tableSize - 1)) {
+                uint32_t other = table[slot];
+                if (other == TKIMPL_NO_INDEX) {
+                    table[slot] = h;
+                    edgeCount[h] = 1;
+                    break;
+                }
+                uint32_t oa = lod.tris[other/3].verts[other%3].posIndex;
+                uint32_t ob = lod.tris[other/3].verts[(other%3 + 1)%3].posIndex;
+                if (((oa == a) && (ob == b)) || ((oa == b) && (ob == a))) {
+                    edgeCount[other]++;
+                    break;
+                }
+            }
+        }
+        for (size_t si=0; si < tableSize; si++) {
+            uint32_t h = table[si];
+            if ((h != TKIMPL_NO_INDEX) && (edgeCount[h] != 2)) {
+                lod.locked[lod.tris[h/3].verts[h%3].posIndex] = 1;
+                lod.locked[lod.tris[h/3].verts[(h%3 + 1)%3].posIndex] = 1;
+            }
+        }
+        TK_ObjArenaRewind( scratch, edgeMark );
+    }
+    
+    lod.pass = 0;
+    for (size_t li=0; li < numLods; li++) {
+        float ratio = (ratios[li] < 0.0f) ? 0.0f : ratios[li];
+        uint32_t target = (ratio >= 1.0f) ? lod.numTriangles : (uint32_t)(ratio * (float)lod.numTriangles);
+        
+        // Each pass collapses the cheapest half of the candidates, as long as they're
+        // not next to something that's already changed this pass (their costs would be
+        // stale), until it gets down to the target or gets stuck
+        while (lod.numAlive > target) {
+            lod.pass++;
+            for (uint32_t vi=0; vi < numVerts; vi++) bestTarget[vi] = TKIMPL_NO_INDEX;
+            for (uint32_t ti=0; ti < lod.numTriangles; ti++) {
+                TKimpl_LodTriangle *tri = lod.tris + ti;
+                if (tri->mtlIndex == TKIMPL_NO_INDEX) continue;
+                for (int ci=0; ci < 3; ci++) {
+                    uint32_t vert = tri->verts[ci].posIndex;
+                    if (lod.locked[vert]) continue;
+                    for (int oi=1; oi < 3; oi++) {
+                        uint32_t other = tri->verts[(ci+oi)%3].posIndex;
+                        const float *otherPos = geom->vertPos + (size_t)other*3;
+                        double error = TKimpl_quadricError( lod.quadrics + vert, otherPos ) +
+                                       TKimpl_quadricError( lod.quadrics + other, otherPos );
+                        float cost = (error > 0.0) ? (float)error : 0.0f;
+                        if ((bestTarget[vert] == TKIMPL_NO_INDEX) || (cost < bestCost[vert])) {
+                            bestTarget[vert] = other;
+                            bestCost[vert] = cost;
+                        }
+                    }
+                }
+            }
+            
+            // Non-negative floats sort the same as their bits
+            size_t numCandidates = 0;
+            for (uint32_t vi=0; vi < numVerts; vi++) {
+                if (bestTarget[vi] == TKIMPL_NO_INDEX) continue;
+                union { float f; uint32_t u; } bits;
+                bits.f = bestCost[vi];
+                candidates[0][numCandidates] = bits.u;
+                candidates[1][numCandidates++] = vi;
+            }
+            TKimpl_radixSort32( candidates[0], candidates[1], candidates[2], candidates[3], numCandidates );
+            
+            size_t numCollapsed = 0;
+            for (size_t ci=0; (ci < (numCandidates + 1)/2) && (lod.numAlive > target); ci++) {
+                uint32_t vert = candidates[1][ci];
+                if ((lod.touched[vert] == lod.pass) || (lod.touched[bestTarget[vert]] == lod.pass)) continue;
+                numCollapsed += TKimpl_lodCollapse( &lod, vert, bestTarget[vert] );
+            }
+            if (!numCollapsed) break;
+        }
+        
+        TKimpl_emitLod( &lod, li, mtlStart, objDelegate );
+    }
+    
+    TK_ObjArenaRewind( scratch, mark );
+    return 1;
+}
+
+
+// =========================================================
+//  Half-edges
+// =========================================================
+
+// Half-edges per job, a whole number of triangles. Each slice keeps a 256 entry histogram.
+#define TKIMPL_HALFEDGE_SLICE (3*16384)
+
+typedef struct {
+    TK_ObjGeometry *geom;
+    TK_ObjHalfEdges *halfEdges;
+    size_t numSlices;
+    
+    // Keys and half-edges, ping-ponged between each radix pass like the Morton sort
+    uint64_t *keys[2];
+    uint32_t *vals[2];
+    int src;
+    int shift;
+    int vertBits; // bits in a posIndex, an edge key is two of them
+    
+    size_t *histograms; // 256 per slice
+} TKimpl_HalfEdgeJob;
+
+static inline void TKimpl_halfEdgeSliceRange( TKimpl_HalfEdgeJob *job, size_t sliceIndex,
+                                              size_t *out_first, size_t *out_end )
+{
+    *out_first = sliceIndex * TKIMPL_HALFEDGE_SLICE;
+    *out_end = *out_first + TKIMPL_HALFEDGE_SLICE;
+    if (*out_end > job->halfEdges->numHalfEdges) *out_end = job->halfEdges->numHalfEdges;
+}
+
+// Fills in vertex, and keys each half-edge by its edge with the lower posIndex first
+void TKimpl_halfEdgeKeyJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_HalfEdgeJob *job = (TKimpl_HalfEdgeJob*)jobData;
+    TK_ObjHalfEdges *halfEdges = job->halfEdges;
+    size_t first, end;
+    TKimpl_halfEdgeSliceRange( job, jobIndex, &first, &end );
+    
+    size_t mi = 0;
+    for (size_t h=first; h < end; h += 3) {
+        size_t ti = h/3;
+        while (halfEdges->mtlStart[mi+1] <= ti) mi++;
+        TKimpl_IndexedTriangle ndxTri;
+        TKimpl_LoadIndexedTriangle( job->geom, job->geom->materials + mi, ti - halfEdges->mtlStart[mi], &ndxTri );
+        halfEdges->vertex[h] = (uint32_t)ndxTri.vertA.posIndex;
+        halfEdges->vertex[h+1] = (uint32_t)ndxTri.vertB.posIndex;
+        halfEdges->vertex[h+2] = (uint32_t)ndxTri.vertC.posIndex;
+    }
+    for (size_t h=first; h < end; h++) {
+        uint64_t a = halfEdges->vertex[h];
+        uint64_t b = halfEdges->vertex[TK_ObjHalfEdgeNext( h )];
+        job->keys[0][h] = (a < b) ? ((a << job->vertBits) | b) : ((b << job->vertBits) | a);
+        job->vals[0][h] = (uint32_t)h;
+    }
+}
+
+// For the sort by the position each half-edge leaves
+void TKimpl_halfEdgeVertKeyJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_HalfEdgeJob *job = (TKimpl_HalfEdgeJob*)jobData;
+    size_t first, end;
+    TKimpl_halfEdgeSliceRange( job, jobIndex, &first, &end );
+    for (size_t h=first; h < end; h++) {
+        job->keys[0][h] = job->halfEdges->vertex[h];
+        job->vals[0][h] = (uint32_t)h;
+    }
+}
+
+void TKimpl_halfEdgeHistogramJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_HalfEdgeJob *job = (TKimpl_HalfEdgeJob*)jobData;
+    size_t first, end;
+    TKimpl_halfEdgeSliceRange( job, jobIndex, &first, &end );
+    
+    size_t *histogram = job->histograms + jobIndex*256;
+    for (int d=0; d < 256; d++) histogram[d] = 0;
+    const uint64_t *keys = job->keys[job->src];
+    for (size_t i=first; i < end; i++) {
+        histogram[(keys[i] >> job->shift) & 0xff]++;
+    }
+}
+
+void TKimpl_halfEdgeScatterJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_HalfEdgeJob *job = (TKimpl_HalfEdgeJob*)jobData;
+    size_t first, end;
+    TKimpl_halfEdgeSliceRange( job, jobIndex, &first, &end );
+    
+    size_t *offsets = job->histograms + jobIndex*256;
+    const uint64_t *srcKeys = job->keys[job->src];
+    const uint32_t *srcVals = job->vals[job->src];
+    uint64_t *destKeys = job->keys[!job->src];
+    uint32_t *destVals = job->vals[!job->src];
+    for (size_t i=first; i < end; i++) {
+        size_t dest = offsets[(srcKeys[i] >> job->shift) & 0xff]++;
+        destKeys[dest] = srcKeys[i];
+        destVals[dest] = srcVals[i];
+    }
+}
+
+// LSD radix sort of the keys (and half-edges) in keys[0]/vals[0], a byte at a time up to
+// keyBits, the result ends up in keys[job->src]
+void TKimpl_halfEdgeSort( TKimpl_HalfEdgeJob *job, int keyBits, const TK_ObjJobSystem *jobs )
+{
+    size_t count = job->halfEdges->numHalfEdges;
+    job->src = 0;
+    for (job->shift = 0; job->shift < keyBits; job->shift += 8) {
+        TKimpl_ParallelFor( jobs, TKimpl_halfEdgeHistogramJob, job, job->numSlices );
+        
+        // Digit major offsets keep it stable, and a pass where every key has the same
+        // digit wouldn't move anything
+        size_t offset = 0;
+        int skipPass = 0;
+        for (int d=0; d < 256; d++) {
+            size_t digitStart = offset;
+            for (size_t si=0; si < job->numSlices; si++) {
+                size_t digitCount = job->histograms[si*256 + d];
+                job->histograms[si*256 + d] = offset;
+                offset += digitCount;
+            }
+            if (offset - digitStart == count) skipPass = 1;
+        }
+        if (skipPass) continue;
+        
+        TKimpl_ParallelFor( jobs, TKimpl_halfEdgeScatterJob, job, job->numSlices );
+        job->src = !job->src;
+    }
+}
+
+// Pairs up the half-edges of each edge that starts in the slice (it may run past the end)
+void TKimpl_halfEdgeTwinJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_HalfEdgeJob *job = (TKimpl_HalfEdgeJob*)jobData;
+    TK_ObjHalfEdges *halfEdges = job->halfEdges;
+    size_t first, end;
+    TKimpl_halfEdgeSliceRange( job, jobIndex, &first, &end );
+    
+    const uint64_t *keys = job->keys[job->src];
+    const uint32_t *vals = job->vals[job->src];
+    size_t i = first;
+    while ((i > 0) && (i < end) && (keys[i] == keys[i-1])) i++;
+    while (i < end) {
+        size_t groupEnd = i + 1;
+        while ((groupEnd < halfEdges->numHalfEdges) && (keys[groupEnd] == keys[i])) groupEnd++;
+        
+        uint32_t a = vals[i];
+        uint32_t b = vals[i+1 < groupEnd ? i+1 : i];
+        if ((groupEnd - i == 2) && (halfEdges->vertex[a] != halfEdges->vertex[b])) {
+            halfEdges->twin[a] = b;
+            halfEdges->twin[b] = a;
+        } else {
+            for (size_t gi=i; gi < groupEnd; gi++) halfEdges->twin[vals[gi]] = TK_OBJ_NO_HALF_EDGE;
+        }
+        i = groupEnd;
+    }
+}
+
+// Copies out the half-edges sorted by position, and finds where each position's start
+void TKimpl_halfEdgeStarJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    (void)workerIndex;
+    TKimpl_HalfEdgeJob *job = (TKimpl_HalfEdgeJob*)jobData;
+    TK_ObjHalfEdges *halfEdges = job->halfEdges;
+    size_t first, end;
+    TKimpl_halfEdgeSliceRange( job, jobIndex, &first, &end );
+    
+    const uint64_t *keys = job->keys[job->src];
+    const uint32_t *vals = job->vals[job->src];
+    for (size_t i=first; i < end; i++) {
+        halfEdges->vertEdges[i] = vals[i];
+        
+        // The positions after the one before, up to this one, start here
+        size_t vert = (i > 0) ? (size_t)keys[i-1] + 1 : 0;
+        for (; vert <= keys[i]; vert++) halfEdges->vertStart[vert] = (uint32_t)i;
+    }
+    if (end == halfEdges->numHalfEdges) {
+        size_t vert = end ? (size_t)keys[end-1] + 1 : 0;
+        for (; vert <= halfEdges->numVerts; vert++) halfEdges->vertStart[vert] = (uint32_t)end;
+    }
+}
+
+TK_ObjHalfEdges *TK_ObjBuildHalfEdges( TK_ObjGeometry *geom, TK_ObjArena *arena, TK_ObjArena *scratch,
+                                       const TK_ObjJobSystem *jobs )
+{
+    size_t numTriangles = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        if ((geom->materials[mi].numTriangles) && (!TKimpl_materialTriangleData( geom, geom->materials + mi ))) {
+            return NULL;
+        }
+        numTriangles += geom->materials[mi].numTriangles;
+    }
+    if ((numTriangles >= TK_OBJ_NO_HALF_EDGE / 3) || (geom->numVertPos >= TK_OBJ_NO_HALF_EDGE)) return NULL;
+    
+    TK_ObjArenaMark arenaMark = TK_ObjArenaGetMark( arena );
+    TK_ObjHalfEdges *halfEdges = TKImpl_PushStruct( arena, TK_ObjHalfEdges );
+    if (!halfEdges) return NULL;
+    halfEdges->numTriangles = numTriangles;
+    halfEdges->numHalfEdges = numTriangles * 3;
+    halfEdges->numMaterials = geom->numMaterials;
+    halfEdges->numVerts = geom->numVertPos;
+    halfEdges->mtlStart = TKImpl_PushStructArray( arena, size_t, geom->numMaterials + 1 );
+    halfEdges->vertex = TKImpl_PushStructArray( arena, uint32_t, halfEdges->numHalfEdges );
+    halfEdges->twin = TKImpl_PushStructArray( arena, uint32_t, halfEdges->numHalfEdges );
+    halfEdges->vertStart = TKImpl_PushStructArray( arena, uint32_t, halfEdges->numVerts + 1 );
+    halfEdges->vertEdges = TKImpl_PushStructArray( arena, uint32_t, halfEdges->numHalfEdges );
+    if ((!halfEdges->mtlStart) || (!halfEdges->vertex) || (!halfEdges->twin) ||
+        (!halfEdges->vertStart) || (!halfEdges->vertEdges)) {
+        TK_ObjArenaRewind( arena, arenaMark );
+        return NULL;
+    }
+    
+    size_t triStart = 0;
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        halfEdges->mtlStart[mi] = triStart;
+        triStart += geom->materials[mi].numTriangles;
+    }
+    halfEdges->mtlStart[geom->numMaterials] = triStart;
+    
+    TK_ObjArenaMark mark = TK_ObjArenaGetMark( scratch );
+    TKimpl_HalfEdgeJob job;
+    job.geom = geom;
+    job.halfEdges = halfEdges;
+    job.numSlices = (halfEdges->numHalfEdges + TKIMPL_HALFEDGE_SLICE-1) / TKIMPL_HALFEDGE_SLICE;
+    job.keys[0] = TKImpl_PushStructArray( scratch, uint64_t, halfEdges->numHalfEdges );
+    job.keys[1] = TKImpl_PushStructArray( scratch, uint64_t, halfEdges->numHalfEdges );
+    job.vals[0] = TKImpl_PushStructArray( scratch, uint32_t, halfEdges->numHalfEdges );
+    job.vals[1] = TKImpl_PushStructArray( scratch, uint32_t, halfEdges->numHalfEdges );
+    job.histograms = TKImpl_PushStructArray( scratch, size_t, job.numSlices * 256 );
+    if ((!job.keys[0]) || (!job.keys[1]) || (!job.vals[0]) || (!job.vals[1]) || (!job.histograms)) {
+        TK_ObjArenaRewind( scratch, mark );
+        TK_ObjArenaRewind( arena, arenaMark );
+        return NULL;
+    }
+    job.vertBits = 1;
+    while ((job.vertBits < 32) && (((size_t)1 << job.vertBits) < halfEdges->numVerts)) job.vertBits++;
+    
+    // Edges first, sorted so each one's half-edges are next to each other
+    TKimpl_ParallelFor( jobs, TKimpl_halfEdgeKeyJob, &job, job.numSlices );
+    
+    // An index past the positions would run off vertStart
+    for (size_t h=0; h < halfEdges->numHalfEdges; h++) {
+        if (halfEdges->vertex[h] >= halfEdges->numVerts) {
+            TK_ObjArenaRewind( scratch, mark );
+            TK_ObjArenaRewind( arena, arenaMark );
+            return NULL;
+        }
+    }
+    TKimpl_halfEdgeSort( &job, 2*job.vertBits, jobs );
+    TKimpl_ParallelFor( jobs, TKimpl_halfEdgeTwinJob, &job, job.numSlices );
+    
+    // Then by the position they leave, for the stars
+    TKimpl_ParallelFor( jobs, TKimpl_halfEdgeVertKeyJob, &job, job.numSlices );
+    TKimpl_halfEdgeSort( &job, job.vertBits, jobs );
+    TKimpl_ParallelFor( jobs, TKimpl_halfEdgeStarJob, &job, job.numSlices );
+    if (!halfEdges->numHalfEdges) {
+        for (size_t vi=0; vi <= halfEdges->numVerts; vi++) halfEdges->vertStart[vi] = 0;
+    }
+    
+    TK_ObjArenaRewind( scratch, mark );
+    return halfEdges;
+}
+
+size_t TK_ObjHalfEdgeNext( size_t halfEdge )
+{
+    return ((halfEdge % 3) == 2) ? halfEdge - 2 : halfEdge + 1;
+}
+
+size_t TK_ObjHalfEdgePrev( size_t halfEdge )
+{
+    return ((halfEdge % 3) == 0) ? halfEdge + 2 : halfEdge - 1;
+}
+
+size_t TK_ObjHalfEdgeTwin( const TK_ObjHalfEdges *halfEdges, size_t halfEdge )
+{
+    return halfEdges->twin[halfEdge];
+}
+
+size_t TK_ObjVertexStar( const TK_ObjHalfEdges *halfEdges, size_t posIndex, const uint32_t **out_halfEdges )
+{
+    if (posIndex >= halfEdges->numVerts) {
+        *out_halfEdges = NULL;
+        return 0;
+    }
+    *out_halfEdges = halfEdges->vertEdges + halfEdges->vertStart[posIndex];
+    return halfEdges->vertStart[posIndex+1] - halfEdges->vertStart[posIndex];
+}
+
+// =========================================================
+//  OPTIONAL STDLIB LAYER
+// =========================================================
+#ifdef TK_OBJFILE_STDLIB
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define TKIMPL_HAS_MMAP (1)
+
+// Some older BSDs and macOS only spell it MAP_ANON
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+void *TKimpl_mallocChunk( size_t size, void *allocUserData )
+{
+    (void)allocUserData;
+    return malloc( size );
+}
+
+void TKimpl_freeChunk( void *ptr, size_t size, void *allocUserData )
+{
+    (void)size;
+    (void)allocUserData;
+    free( ptr );
+}
+
+void TK_ObjArenaInitMalloc( TK_ObjArena *arena, size_t chunkSize )
+{
+    TK_ObjArenaInit( arena, NULL, 0 );
+    arena->alloc = TKimpl_mallocChunk;
+    arena->free = TKimpl_freeChunk;
+    arena->chunkSize = chunkSize;
+}
+
+#define TKIMPL_HUGE_PAGE_SIZE ((size_t)2*1024*1024)
+#define TKimpl_HugePageRound(size) (((size) + TKIMPL_HUGE_PAGE_SIZE-1) & ~(TKIMPL_HUGE_PAGE_SIZE-1))
+
+void *TKimpl_hugePageChunk( size_t size, void *allocUserData )
+{
+    (void)allocUserData;
+#ifdef TKIMPL_HAS_MMAP
+    size = TKimpl_HugePageRound( size );
+    void *ptr = MAP_FAILED;
+    // MAP_HUGETLB and MADV_HUGEPAGE are Linux extensions, the _DEFAULT_SOURCE at the
+    // top of the file keeps them visible under -std=c99
+#ifdef MAP_HUGETLB
+    // Explicit huge pages, only works if the admin has reserved some
+    ptr = mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0 );
+#endif
+    if (ptr == MAP_FAILED) {
+        ptr = mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+        if (ptr == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise( ptr, size, MADV_HUGEPAGE );
+#endif
+    }
+    return ptr;
+#else
+    return malloc( size );
+#endif
+}
+
+void TKimpl_freeHugePageChunk( void *ptr, size_t size, void *allocUserData )
+{
+    (void)size;
+    (void)allocUserData;
+#ifdef TKIMPL_HAS_MMAP
+    munmap( ptr, TKimpl_HugePageRound( size ) );
+#else
+    free( ptr );
+#endif
+}
+
+void TK_ObjArenaInitHugePages( TK_ObjArena *arena, size_t chunkSize )
+{
+    TK_ObjArenaInit( arena, NULL, 0 );
+    arena->alloc = TKimpl_hugePageChunk;
+    arena->free = TKimpl_freeHugePageChunk;
+    
+    // Don't waste the rest of the last huge page (minus the chunk header)
+    if (chunkSize < TKIMPL_HUGE_PAGE_SIZE) chunkSize = TKIMPL_HUGE_PAGE_SIZE;
+    arena->chunkSize = TKimpl_HugePageRound( chunkSize ) - sizeof(TK_ObjArenaChunk);
+}
+
+// Starting chunk size for the batch workers' arenas
+#define TKIMPL_BATCH_CHUNK_SIZE ((size_t)1024*1024)
+
+typedef struct {
+    TK_ObjArena arena;
+    char *fileData;
+    size_t fileDataSize;
+    size_t numSucceeded;
+} TKimpl_BatchWorker;
+
+typedef struct {
+    TK_ObjBatchItem *items;
+    TK_ObjDelegate *objDelegate;
+    TK_ObjBatchDoneFunc fileDone;
+    TKimpl_BatchWorker *workers;
+} TKimpl_BatchJob;
+
+// Grow a worker buffer, with some slack so a run of slightly bigger files doesn't realloc every time
+int TKimpl_growBuffer( void **buffer, size_t *bufferSize, size_t requiredSize )
+{
+    if (requiredSize <= *bufferSize) return 1;
+    
+    size_t newSize = *bufferSize + (*bufferSize / 2);
+    if (newSize < requiredSize) newSize = requiredSize;
+    
+    void *newBuffer = realloc( *buffer, newSize );
+    if (!newBuffer) return 0;
+    
+    *buffer = newBuffer;
+    *bufferSize = newSize;
+    return 1;
+}
+
+// Reads a whole file into the worker's file buffer
+char *TKimpl_batchReadFile( TKimpl_BatchWorker *worker, const char *path, size_t *out_fileSize )
+{
+    FILE *fp = fopen( path, "rb" );
+    if (!fp) return NULL;
+    
+    fseek( fp, 0L, SEEK_END );
+    long fileSize = ftell( fp );
+    fseek( fp, 0L, SEEK_SET );
+    
+    // One extra for a 0 terminator, the parser peeks at the byte after a line
+    char *result = NULL;
+    if ((fileSize >= 0) &&
+        TKimpl_growBuffer( (void**)&(worker->fileData), &(worker->fileDataSize), (size_t)fileSize + 1 )) {
+        if (fread( worker->fileData, 1, (size_t)fileSize, fp ) == (size_t)fileSize) {
+            worker->fileData[fileSize] = '\0';
+            *out_fileSize = (size_t)fileSize;
+            result = worker->fileData;
+        }
+    }
+    fclose( fp );
+    
+    return result;
+}
+
+void TKimpl_batchParseJob( void *jobData, size_t jobIndex, size_t workerIndex )
+{
+    TKimpl_BatchJob *batch = (TKimpl_BatchJob*)jobData;
+    TKimpl_BatchWorker *worker = batch->workers + workerIndex;
+    TK_ObjBatchItem *item = batch->items + jobIndex;
+    
+    // Each file gets its own copy of the delegate
+    TK_ObjDelegate objDelegate = *(batch->objDelegate);
+    TK_ObjGeometry *geom = NULL;
+    
+    void *objFileData = item->objFileData;
+    size_t objFileSize = item->objFileSize;
+    if (item->path) {
+        objFileData = TKimpl_batchReadFile( worker, item->path, &objFileSize );
+        if ((!objFileData) && (objDelegate.error)) {
+            objDelegate.error( 0, "Could not read file.", objDelegate.userData );
+        }
+    }
+    
+    if (objFileData) {
+        // Reuse the worker's arena from the last file
+        TK_ObjArenaReset( &(worker->arena) );
+        objDelegate.scratchMem = NULL;
+        objDelegate.scratchMemSize = 0;
+        objDelegate.arena = &(worker->arena);
+        geom = TK_ParseObjGeometry( objFileData, objFileSize, &objDelegate );
+    }
+    
+    // Counted per worker, so there's nothing to share between threads
+    if (geom) worker->numSucceeded++;
+    
+    if (batch->fileDone) {
+        batch->fileDone( jobIndex, geom, &objDelegate, objDelegate.userData );
+    }
+}
+
+size_t TK_ParseObjBatch( TK_ObjBatchItem *items, size_t numItems, TK_ObjDelegate *objDelegate,
+                         TK_ObjBatchDoneFunc fileDone, const TK_ObjJobSystem *jobs )
+{
+    size_t numWorkers = ((jobs) && (jobs->parallelFor) && (jobs->numWorkers)) ? jobs->numWorkers : 1;
+    
+    TKimpl_BatchJob batch;
+    batch.items = items;
+    batch.objDelegate = objDelegate;
+    batch.fileDone = fileDone;
+    batch.workers = (TKimpl_BatchWorker*)calloc( numWorkers, sizeof(TKimpl_BatchWorker) );
+    if (!batch.workers) {
+        TKimpl_memoryError( objDelegate );
+        return 0;
+    }
+    for (size_t i=0; i < numWorkers; i++) {
+        TK_ObjArenaInitMalloc( &(batch.workers[i].arena), TKIMPL_BATCH_CHUNK_SIZE );
+    }
+    
+    TKimpl_ParallelFor( jobs, TKimpl_batchParseJob, &batch, numItems );
+    
+    size_t numSucceeded = 0;
+    for (size_t i=0; i < numWorkers; i++) {
+        numSucceeded += batch.workers[i].numSucceeded;
+        TK_ObjArenaRelease( &(batch.workers[i].arena) );
+        free( batch.workers[i].fileData );
+    }
+    free( batch.workers );
+    
+    return numSucceeded;
+}
+
+// Smallest spill buffer, so a tight budget with lots of materials doesn't
+// turn into a write() per triangle
+#define TKIMPL_SPILL_MIN_TRIANGLES (1024)
+
+#ifdef TKIMPL_HAS_MMAP
+
+// One material's triangles. bufMtl points at the in-memory buffer, so the
+// usual store and expand code works on it.
+typedef struct {
+    int fd;                 // spill file, -1 until the buffer first fills up
+    size_t numSpilled;
+    size_t numBuffered;
+    TKimpl_Material bufMtl;
+} TKimpl_SpillFile;
+
+typedef struct {
+    TKimpl_Geometry *geom;
+    TK_ObjDelegate *objDelegate;
+    const char *tempDir;
+    size_t triangleSize;
+    size_t bufTriangles[TKIMPL_MAX_UNIQUE_MTLS];
+    TKimpl_SpillFile spills[TKIMPL_MAX_UNIQUE_MTLS];
+    int failed;
+} TKimpl_OutOfCore;
+
+// Makes an anonymous temp file, it's unlinked right away so the
+// OS cleans it up when it's closed
+int TKimpl_openTempFile( const char *tempDir )
+{
+    char path[1024];
+    snprintf( path, sizeof(path), "%s/tk_objfile_XXXXXX", tempDir );
+    int fd = mkstemp( path );
+    if (fd >= 0) {
+        unlink( path );
+    }
+    return fd;
+}
+
+int TKimpl_writeAll( int fd, const void *data, size_t size )
+{
+    const char *curr = (const char*)data;
+    while (size) {
+        ssize_t written = write( fd, curr, size );
+        if (written <= 0) return 0;
+        curr += written;
+        size -= (size_t)written;
+    }
+    return 1;
+}
+
+int TKimpl_readAll( int fd, void *data, size_t size, size_t offset )
+{
+    char *curr = (char*)data;
+    while (size) {
+        ssize_t amount = pread( fd, curr, size, (off_t)offset );
+        if (amount <= 0) return 0;
+        curr += amount;
+        offset += (size_t)amount;
+        size -= (size_t)amount;
+    }
+    return 1;
+}
+
+void TKimpl_spillFlush( TKimpl_OutOfCore *ooc, TKimpl_SpillFile *spill )
+{
+    if ((!spill->numBuffered) || (ooc->failed)) return;
+    
+    if (spill->fd < 0) {
+        spill->fd = TKimpl_openTempFile( ooc->tempDir );
+    }
+    void *buffer = ooc->geom->compactIndices ? (void*)spill->bufMtl.compactTriangles : (void*)spill->bufMtl.triangles;
+    if ((spill->fd < 0) ||
+        (!TKimpl_writeAll( spill->fd, buffer, spill->numBuffered * ooc->triangleSize ))) {
+        ooc->failed = 1;
+        return;
+    }
+    spill->numSpilled += spill->numBuffered;
+    spill->numBuffered = 0;
+}
+
+void TKimpl_spillTriangle( void *sinkData, size_t mtlIndex, TKimpl_IndexedTriangle *ndxTri )
+{
+    TKimpl_OutOfCore *ooc = (TKimpl_OutOfCore*)sinkData;
+    TKimpl_SpillFile *spill = ooc->spills + mtlIndex;
+    
+    TKimpl_StoreIndexedTriangle( ooc->geom, &(spill->bufMtl), spill->numBuffered++, ndxTri );
+    if (spill->numBuffered == ooc->bufTriangles[mtlIndex]) {
+        TKimpl_spillFlush( ooc, spill );
+    }
+}
+
+// Expands a buffer full of triangles and hands them to the delegate
+void TKimpl_emitSpillBuffer( TKimpl_OutOfCore *ooc, TKimpl_SpillFile *spill, size_t emitIndex,
+                             size_t firstTriangle, size_t numTriangles )
+{
+    TK_ObjDelegate *objDelegate = ooc->objDelegate;
+    TK_Triangle batch[TKIMPL_EXPAND_BATCH];
+    for (size_t ti=0; ti < numTriangles; ti += TKIMPL_EXPAND_BATCH) {
+        size_t count = numTriangles - ti;
+        if (count > TKIMPL_EXPAND_BATCH) count = TKIMPL_EXPAND_BATCH;
+        TKimpl_ExpandTriangles( ooc->geom, &(spill->bufMtl), ti, count, batch );
+        
+        if (objDelegate->triangleBatch) {
+            objDelegate->triangleBatch( emitIndex, firstTriangle + ti, batch, count, objDelegate->userData );
+        } else if (objDelegate->triangle) {
+            for (size_t bi=0; bi < count; bi++) {
+                objDelegate->triangle( batch[bi].vertA, batch[bi].vertB, batch[bi].vertC,
+                                       objDelegate->userData );
+            }
+        }
+    }
+}
+
+// Maps the file read-only, with an extra zeroed page after it (the parser peeks at the
+// byte after the last line, which would fault if the file ends on a page boundary)
+void *TKimpl_mapInputFile( const char *path, size_t *out_fileSize, size_t *out_mapSize )
+{
+    int fd = open( path, O_RDONLY );
+    if (fd < 0) return NULL;
+    
+    struct stat st;
+    if (fstat( fd, &st ) != 0) {
+        close( fd );
+        return NULL;
+    }
+    
+    size_t fileSize = (size_t)st.st_size;
+    size_t pageSize = (size_t)sysconf( _SC_PAGESIZE );
+    size_t mapSize = ((fileSize + pageSize - 1) / pageSize) * pageSize + pageSize;
+    
+    void *data = mmap( NULL, mapSize, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+    if ((data != MAP_FAILED) && (fileSize)) {
+        if (mmap( data, fileSize, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0 ) == MAP_FAILED) {
+            munmap( data, mapSize );
+            data = MAP_FAILED;
+        } else {
+            posix_madvise( data, fileSize, POSIX_MADV_SEQUENTIAL );
+        }
+    }
+    close( fd );
+    
+    if (data == MAP_FAILED) return NULL;
+    
+    *out_fileSize = fileSize;
+    *out_mapSize = mapSize;
+    return data;
+}
+
+// Sets up the spill buffers, runs the full pass and emits everything
+int TKimpl_outOfCoreParse( TKimpl_OutOfCore *ooc, void *objFileData, size_t objFileSize,
+                           TKimpl_Material *uniqueMtls, size_t numUniqueMtls, size_t ramBudget )
+{
+    TKimpl_Geometry *geom = ooc->geom;
+    TK_ObjDelegate *objDelegate = ooc->objDelegate;
+    TKimpl_Material materials[TKIMPL_MAX_UNIQUE_MTLS];
+    geom->materials = materials;
+    geom->numMaterials = numUniqueMtls;
+    ooc->triangleSize = geom->compactIndices ? sizeof(TKimpl_CompactTriangle) : sizeof(TKimpl_IndexedTriangle);
+    
+    // Split the budget between the materials that have triangles, but
+    // don't give any of them a bigger buffer than they'll need
+    size_t numUsedMtls = 0;
+    for (size_t i=0; i < numUniqueMtls; i++) {
+        if (uniqueMtls[i].numTriangles) numUsedMtls++;
+    }
+    size_t spillBufferSize = 0;
+    for (size_t i=0; i < numUniqueMtls; i++) {
+        size_t bufTriangles = 0;
+        if ((uniqueMtls[i].numTriangles) && (!objDelegate->immediateMode)) {
+            bufTriangles = ramBudget / (numUsedMtls * ooc->triangleSize);
+            if (bufTriangles < TKIMPL_SPILL_MIN_TRIANGLES) bufTriangles = TKIMPL_SPILL_MIN_TRIANGLES;
+            if (bufTriangles > uniqueMtls[i].numTriangles) bufTriangles = uniqueMtls[i].numTriangles;
+        }
+        ooc->bufTriangles[i] = bufTriangles;
+        spillBufferSize += TKimpl_ArenaSize( bufTriangles * ooc->triangleSize );
+    }
+    
+    char *spillBuffers = (char*)malloc( spillBufferSize ? spillBufferSize : 1 );
+    if (!spillBuffers) {
+        TKimpl_memoryError( objDelegate );
+        return 0;
+    }
+    
+    char *currBuffer = spillBuffers;
+    for (size_t i=0; i < numUniqueMtls; i++) {
+        TKimpl_SpillFile *spill = ooc->spills + i;
+        spill->fd = -1;
+        spill->numSpilled = 0;
+        spill->numBuffered = 0;
+        spill->bufMtl.mtlName = uniqueMtls[i].mtlName;
+        spill->bufMtl.numTriangles = 0;
+        spill->bufMtl.triangles = geom->compactIndices ? NULL : (TKimpl_IndexedTriangle*)currBuffer;
+        spill->bufMtl.compactTriangles = geom->compactIndices ? (TKimpl_CompactTriangle*)currBuffer : NULL;
+        spill->bufMtl.remap = NULL;
+        currBuffer += TKimpl_ArenaSize( ooc->bufTriangles[i] * ooc->triangleSize );
+        
+        materials[i].mtlName = uniqueMtls[i].mtlName;
+        materials[i].triangles = NULL;
+        materials[i].compactTriangles = NULL;
+        materials[i].remap = NULL;
+        materials[i].numTriangles = objDelegate->immediateMode ? uniqueMtls[i].numTriangles : 0;
+    }
+    
+    // Parse again, spilling triangles as the buffers fill up
+    TKimpl_ParseObjPass( objFileData, objFileSize, geom,
+                         geom->materials, &(geom->numMaterials),
+                         objDelegate, TKimpl_ParseTypeFull, NULL, NULL, NULL );
+    
+    if (!objDelegate->immediateMode) {
+        size_t emitIndex = 0;
+        for (size_t mi=0; (mi < geom->numMaterials) && (!ooc->failed); mi++) {
+            TKimpl_SpillFile *spill = ooc->spills + mi;
+            size_t numTriangles = materials[mi].numTriangles;
+            if (!numTriangles) continue;
+            
+            if (objDelegate->material) {
+                char mtlName[TKIMPL_MAX_MATERIAL_NAME];
+                TKimpl_stringDelimMtlName( mtlName, materials[mi].mtlName, TKIMPL_MAX_MATERIAL_NAME );
+                objDelegate->material( mtlName, numTriangles, objDelegate->userData );
+            }
+            
+            if (spill->fd < 0) {
+                // Never spilled, everything is still in the buffer
+                TKimpl_emitSpillBuffer( ooc, spill, emitIndex, 0, numTriangles );
+            } else {
+                // Stream it back in, a buffer at a time
+                TKimpl_spillFlush( ooc, spill );
+                void *buffer = geom->compactIndices ? (void*)spill->bufMtl.compactTriangles : (void*)spill->bufMtl.triangles;
+                size_t firstTriangle = 0;
+                while ((firstTriangle < numTriangles) && (!ooc->failed)) {
+                    size_t count = numTriangles - firstTriangle;
+                    if (count > ooc->bufTriangles[mi]) count = ooc->bufTriangles[mi];
+                    
+                    if (!TKimpl_readAll( spill->fd, buffer, count * ooc->triangleSize,
+                                         firstTriangle * ooc->triangleSize )) {
+                        ooc->failed = 1;
+                        break;
+                    }
+                    TKimpl_emitSpillBuffer( ooc, spill, emitIndex, firstTriangle, count );
+                    firstTriangle += count;
+                }
+            }
+            emitIndex++;
+        }
+    }
+    
+    for (size_t i=0; i < numUniqueMtls; i++) {
+        if (ooc->spills[i].fd >= 0) close( ooc->spills[i].fd );
+    }
+    free( spillBuffers );
+    
+    if ((ooc->failed) && (objDelegate->error)) {
+        objDelegate->error( 0, "Could not write or read back a spill file.", objDelegate->userData );
+    }
+    return !ooc->failed;
+}
+
+int TK_ParseObjOutOfCore( const char *path, TK_ObjDelegate *objDelegate,
+                          const char *tempDir, size_t ramBudget )
+{
+    if (!tempDir) tempDir = getenv( "TMPDIR" );
+    if (!tempDir) tempDir = "/tmp";
+    
+    size_t objFileSize = 0, inputMapSize = 0;
+    void *objFileData = TKimpl_mapInputFile( path, &objFileSize, &inputMapSize );
+    if (!objFileData) {
+        if (objDelegate->error) {
+            objDelegate->error( 0, "Could not read file.", objDelegate->userData );
+        }
+        return 0;
+    }
+    
+    TKimpl_Material uniqueMtls[TKIMPL_MAX_UNIQUE_MTLS];
+    size_t numUniqueMtls = 0;
+    TKimpl_CountObjPass( objFileData, objFileSize, uniqueMtls, &numUniqueMtls, objDelegate, NULL );
+    
+    size_t numStsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_St) ? 1 : objDelegate->numSts;
+    size_t numNormsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_Nrm) ? 1 : objDelegate->numNorms;
+    
+    // The vertex lists all go in one mapped temp file
+    size_t posSize = TKimpl_ArenaSize( sizeof(float)*(3*objDelegate->numVerts + TKIMPL_VERT_PADDING) );
+    size_t nrmSize = TKimpl_ArenaSize( sizeof(float)*(3*numNormsAlloc + TKIMPL_VERT_PADDING) );
+    size_t stSize = TKimpl_ArenaSize( sizeof(float)*2*numStsAlloc );
+    size_t vertMapSize = posSize + nrmSize + stSize;
+    
+    char *vertMap = (char*)MAP_FAILED;
+    int vertFd = TKimpl_openTempFile( tempDir );
+    if ((vertFd >= 0) && (ftruncate( vertFd, (off_t)vertMapSize ) == 0)) {
+        vertMap = (char*)mmap( NULL, vertMapSize, PROT_READ|PROT_WRITE, MAP_SHARED, vertFd, 0 );
+    }
+    if (vertFd >= 0) close( vertFd );
+    
+    TKimpl_OutOfCore *ooc = (TKimpl_OutOfCore*)calloc( 1, sizeof(TKimpl_OutOfCore) );
+    int result = 0;
+    if ((ooc) && (vertMap != (char*)MAP_FAILED)) {
+        TKimpl_Geometry geom;
+        geom.numVertPos = 0;
+        geom.numVertNrm = 0;
+        geom.numVertSt = 0;
+        geom.vertPos = (float*)vertMap;
+        geom.vertNrm = (float*)(vertMap + posSize);
+        geom.vertSt = (float*)(vertMap + posSize + nrmSize);
+        geom.skipAttribs = objDelegate->skipAttribs;
+        geom.compactIndices = TKimpl_useCompactIndices( objDelegate );
+        geom.triangleSink = objDelegate->immediateMode ? NULL : TKimpl_spillTriangle;
+        geom.sinkData = ooc;
+        geom.hasBounds = 0;
+        geom.relativeBias = 0;
+        geom.inSitu = 0;
+        TKimpl_setDefaultAttribs( &geom, objDelegate );
+        
+        ooc->geom = &geom;
+        ooc->objDelegate = objDelegate;
+        ooc->tempDir = tempDir;
+        result = TKimpl_outOfCoreParse( ooc, objFileData, objFileSize, uniqueMtls, numUniqueMtls, ramBudget );
+    } else {
+        TKimpl_memoryError( objDelegate );
+    }
+    
+    if (vertMap != (char*)MAP_FAILED) munmap( vertMap, vertMapSize );
+    munmap( objFileData, inputMapSize );
+    free( ooc );
+    return result;
+}
+
+// How much more to read at a time looking for the end of a shard's last line
+#define TKIMPL_SHARD_READ_SIZE (64*1024)
+
+TK_ObjShard *TK_ParseObjShardFile( const char *path, size_t begin, size_t end, TK_ObjDelegate *objDelegate )
+{
+    int fd = open( path, O_RDONLY );
+    struct stat fileStat;
+    if ((fd < 0) || (fstat( fd, &fileStat ) != 0)) {
+        if (fd >= 0) close( fd );
+        if (objDelegate->error) {
+            objDelegate->error( 0, "Could not read file.", objDelegate->userData );
+        }
+        return NULL;
+    }
+    size_t fileSize = (size_t)fileStat.st_size;
+    if (end > fileSize) end = fileSize;
+    if (begin > end) begin = end;
+    
+    // Start a byte early, the shard needs to see if begin is at the start of a line
+    size_t start = (begin > 0) ? begin - 1 : 0;
+    char *buffer = NULL;
+    size_t bufferSize = 0, readSize = end - start;
+    int failed = (!TKimpl_growBuffer( (void**)&buffer, &bufferSize, readSize ? readSize : 1 )) ||
+                 (!TKimpl_readAll( fd, buffer, readSize, start ));
+    
+    // Then keep going until the last line ends
+    while ((!failed) && (start + readSize < fileSize) && ((readSize == 0) || (buffer[readSize-1] != '\n'))) {
+        size_t amount = fileSize - (start + readSize);
+        if (amount > TKIMPL_SHARD_READ_SIZE) amount = TKIMPL_SHARD_READ_SIZE;
+        failed = (!TKimpl_growBuffer( (void**)&buffer, &bufferSize, readSize + amount )) ||
+                 (!TKimpl_readAll( fd, buffer + readSize, amount, start + readSize ));
+        
+        // Only up to the newline, if there is one
+        size_t used = 0;
+        while ((!failed) && (used < amount) && (buffer[readSize + used++] != '\n')) {}
+        readSize += used;
+    }
+    close( fd );
+    
+    TK_ObjShard *shard = NULL;
+    if (failed) {
+        if (objDelegate->error) {
+            objDelegate->error( 0, "Could not read file.", objDelegate->userData );
+        }
+    } else {
+        shard = TK_ParseObjShard( buffer, readSize, begin - start, end - start, objDelegate );
+    }
+    free( buffer );
+    return shard;
+}
+
+#else
+
+int TK_ParseObjOutOfCore( const char *path, TK_ObjDelegate *objDelegate,
+                          const char *tempDir, size_t ramBudget )
+{
+    if (objDelegate->error) {
+        objDelegate->error( 0, "Out-of-core parsing needs mmap.", objDelegate->userData );
+    }
+    return 0;
+}
+
+TK_ObjShard *TK_ParseObjShardFile( const char *path, size_t begin, size_t end, TK_ObjDelegate *objDelegate )
+{
+    if (objDelegate->error) {
+        objDelegate->error( 0, "Reading a shard of a file needs pread.", objDelegate->userData );
+    }
+    return NULL;
+}
+
+#endif // TKIMPL_HAS_MMAP
+
+int TK_WriteObjFile( const char *path, TK_ObjGeometry *geom, const TK_ObjJobSystem *jobs )
+{
+    size_t maxSize = 0;
+    TK_WriteObj( geom, NULL, &maxSize, jobs );
+    char *text = (char*)malloc( maxSize ? maxSize : 1 );
+    if (!text) return 0;
+    
+    size_t size = TK_WriteObj( geom, text, &maxSize, jobs );
+    FILE *file = fopen( path, "wb" );
+    int result = (file != NULL) && (fwrite( text, 1, size, file ) == size);
+    if ((file) && (fclose( file ) != 0)) result = 0;
+    free( text );
+    return result;
+}
+
+// =========================================================
+//  Streaming parse
+// =========================================================
+
+struct TK_ObjStream {
+    TK_ObjDelegate *objDelegate;
+    TKimpl_Geometry geom;
+    TKimpl_Material materials[TKIMPL_MAX_UNIQUE_MTLS];
+    
+    // Each piece gets a count pass, to grow the lists, then the full pass
+    TKimpl_Material countMtls[TKIMPL_MAX_UNIQUE_MTLS];
+    size_t numCountMtls;
+    TKimpl_ParseState countState;
+    TKimpl_ParseState fullState;
+    
+    // Allocated bytes of each list
+    size_t posBytes, nrmBytes, stBytes;
+    size_t triangleBytes[TKIMPL_MAX_UNIQUE_MTLS];
+    char *mtlNames[TKIMPL_MAX_UNIQUE_MTLS];
+    
+    // The unfinished line at the end of the last piece
+    char *carry;
+    size_t carrySize, carryBytes;
+    
+    int failed;
+};
+
+// Switches the stored triangles to full size indices, once a list gets too big for 32 bits
+int TKimpl_streamWidenIndices( TK_ObjStream *stream )
+{
+    TKimpl_Geometry *geom = &(stream->geom);
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        TKimpl_Material *mtl = geom->materials + mi;
+        size_t bytes = sizeof(TKimpl_IndexedTriangle) * (stream->triangleBytes[mi] / sizeof(TKimpl_CompactTriangle));
+        TKimpl_IndexedTriangle *triangles = (TKimpl_IndexedTriangle*)malloc( bytes ? bytes : 1 );
+        if (!triangles) return 0;
+        
+        for (size_t ti=0; ti < mtl->numTriangles; ti++) {
+            TKimpl_LoadIndexedTriangle( geom, mtl, ti, triangles + ti );
+        }
+        free( mtl->compactTriangles );
+        mtl->compactTriangles = NULL;
+        mtl->triangles = triangles;
+        stream->triangleBytes[mi] = bytes;
+    }
+    geom->compactIndices = 0;
+    return 1;
+}
+
+// Copies a material name so the fed data doesn't have to stay around
+char *TKimpl_streamCopyMtlName( const char *mtlName )
+{
+    size_t len = 0;
+    while (TKimpl_isIdentifier( mtlName[len] )) len++;
+    char *copy = (char*)malloc( len + 1 );
+    if (copy) {
+        for (size_t i=0; i < len; i++) copy[i] = mtlName[i];
+        copy[len] = '\n';
+    }
+    return copy;
+}
+
+// Parses a run of whole lines
+void TKimpl_streamParseLines( TK_ObjStream *stream, char *lines, size_t size )
+{
+    TK_ObjDelegate *objDelegate = stream->objDelegate;
+    TKimpl_Geometry *geom = &(stream->geom);
+    
+    // The pass expects to start on a line, not a blank one
+    while ((size) && (*lines == '\n')) {
+        lines++;
+        size--;
+        stream->countState.lineNumber++;
+        stream->fullState.lineNumber++;
+    }
+    if ((!size) || (stream->failed)) return;
+    
+    if (!TKimpl_ParseObjPass( lines, size, NULL, stream->countMtls, &(stream->numCountMtls),
+                              objDelegate, TKimpl_ParseTypeCountOnly, &(stream->countState), NULL, NULL )) {
+        stream->failed = 1;
+        return;
+    }
+    
+    // New materials
+    for (size_t mi=geom->numMaterials; mi < stream->numCountMtls; mi++) {
+        TKimpl_Material *mtl = geom->materials + mi;
+        mtl->mtlName = stream->countMtls[mi].mtlName;
+        if (mi > 0) {
+            stream->mtlNames[mi] = TKimpl_streamCopyMtlName( mtl->mtlName );
+            if (!stream->mtlNames[mi]) stream->failed = 1;
+            mtl->mtlName = stream->mtlNames[mi];
+            stream->countMtls[mi].mtlName = stream->mtlNames[mi];
+        }
+        mtl->triangles = NULL;
+        mtl->compactTriangles = NULL;
+        mtl->remap = NULL;
+        mtl->numTriangles = 0;
+    }
+    geom->numMaterials = stream->numCountMtls;
+    
+    // Grow the lists to fit
+    size_t numStsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_St) ? 1 : objDelegate->numSts;
+    size_t numNormsAlloc = (objDelegate->skipAttribs & TK_ObjAttrib_Nrm) ? 1 : objDelegate->numNorms;
+    if (!numStsAlloc) numStsAlloc = 1;
+    if (!numNormsAlloc) numNormsAlloc = 1;
+    if ((!TKimpl_growBuffer( (void**)&(geom->vertPos), &(stream->posBytes),
+                             sizeof(float)*(3*objDelegate->numVerts + TKIMPL_VERT_PADDING) )) ||
+        (!TKimpl_growBuffer( (void**)&(geom->vertNrm), &(stream->nrmBytes),
+                             sizeof(float)*(3*numNormsAlloc + TKIMPL_VERT_PADDING) )) ||
+        (!TKimpl_growBuffer( (void**)&(geom->vertSt), &(stream->stBytes), sizeof(float)*2*numStsAlloc ))) {
+        stream->failed = 1;
+    }
+    
+    if ((geom->compactIndices) && (!TKimpl_useCompactIndices( objDelegate ))) {
+        if (!TKimpl_streamWidenIndices( stream )) stream->failed = 1;
+    }
+    
+    for (size_t mi=0; mi < geom->numMaterials; mi++) {
+        TKimpl_Material *mtl = geom->materials + mi;
+        if (objDelegate->immediateMode) {
+            // Nothing is stored, material() gets the count so far
+            mtl->numTriangles = stream->countMtls[mi].numTriangles;
+            continue;
+        }
+        
+        size_t triangleSize = geom->compactIndices ? sizeof(TKimpl_CompactTriangle) : sizeof(TKimpl_IndexedTriangle);
+        void **triangles = geom->compactIndices ? (void**)&(mtl->compactTriangles) : (void**)&(mtl->triangles);
+        if (!TKimpl_growBuffer( triangles, &(stream->triangleBytes[mi]),
+                                triangleSize * stream->countMtls[mi].numTriangles )) {
+            stream->failed = 1;
+        }
+    }
+    if (stream->failed) {
+        TKimpl_memoryError( objDelegate );
+        return;
+    }
+    
+    if (!TKimpl_ParseObjPass( lines, size, geom, geom->materials, &(geom->numMaterials),
+                              objDelegate, TKimpl_ParseTypeFull, &(stream->fullState), NULL, NULL )) {
+        stream->failed = 1;
+    }
+}
+
+void TKimpl_streamFree( TK_ObjStream *stream )
+{
+    for (size_t mi=0; mi < stream->geom.numMaterials; mi++) {
+        free( stream->materials[mi].triangles );
+        free( stream->materials[mi].compactTriangles );
+        free( stream->materials[mi].remap );
+        free( stream->mtlNames[mi] );
+    }
+    free( stream->geom.vertPos );
+    free( stream->geom.vertNrm );
+    free( stream->geom.vertSt );
+    free( stream->carry );
+    free( stream );
+}
+
+TK_ObjStream *TK_ObjStreamBegin( TK_ObjDelegate *objDelegate )
+{
+    TK_ObjStream *stream = (TK_ObjStream*)calloc( 1, sizeof(TK_ObjStream) );
+    if (!stream) {
+        TKimpl_memoryError( objDelegate );
+        return NULL;
+    }
+    
+    objDelegate->numVerts = 0;
+    objDelegate->numSts = 0;
+    objDelegate->numNorms = 0;
+    objDelegate->numFaces = 0;
+    objDelegate->numTriangles = 0;
+    
+    stream->objDelegate = objDelegate;
+    stream->countState.emitMtl = TKIMPL_NO_MATERIAL;
+    stream->countState.lineNumber = 1;
+    stream->fullState = stream->countState;
+    
+    // Start with the single default st and normal
+    TKimpl_Geometry *geom = &(stream->geom);
+    geom->materials = stream->materials;
+    geom->skipAttribs = objDelegate->skipAttribs;
+    geom->compactIndices = 1;
+    if ((!TKimpl_growBuffer( (void**)&(geom->vertPos), &(stream->posBytes), sizeof(float)*(3 + TKIMPL_VERT_PADDING) )) ||
+        (!TKimpl_growBuffer( (void**)&(geom->vertNrm), &(stream->nrmBytes), sizeof(float)*(3 + TKIMPL_VERT_PADDING) )) ||
+        (!TKimpl_growBuffer( (void**)&(geom->vertSt), &(stream->stBytes), sizeof(float)*2 ))) {
+        TKimpl_memoryError( objDelegate );
+        TKimpl_streamFree( stream );
+        return NULL;
+    }
+    TKimpl_setDefaultAttribs( geom, objDelegate );
+    return stream;
+}
+
+int TK_ObjStreamFeed( TK_ObjStream *stream, const void *data, size_t size )
+{
+    char *curr = (char*)data;
+    char *end = curr + size;
+    
+    // Finish off the line that was split between the pieces
+    if (stream->carrySize) {
+        char *newline = curr;
+        while ((newline < end) && (*newline != '\n')) newline++;
+        size_t take = (newline < end) ? (size_t)(newline + 1 - curr) : size;
+        if (!TKimpl_growBuffer( (void**)&(stream->carry), &(stream->carryBytes), stream->carrySize + take )) {
+            stream->failed = 1;
+            TKimpl_memoryError( stream->objDelegate );
+            return 0;
+        }
+        for (size_t i=0; i < take; i++) stream->carry[stream->carrySize++] = curr[i];
+        curr += take;
+        if (newline == end) return !stream->failed;
+        
+        TKimpl_streamParseLines( stream, stream->carry, stream->carrySize );
+        stream->carrySize = 0;
+    }
+    
+    // Whole lines get parsed right out of the piece
+    char *lastNewline = end;
+    while ((lastNewline > curr) && (lastNewline[-1] != '\n')) lastNewline--;
+    if (lastNewline > curr) {
+        TKimpl_streamParseLines( stream, curr, lastNewline - curr );
+        curr = lastNewline;
+    }
+    
+    // And the rest waits for the next piece
+    if (curr < end) {
+        if (!TKimpl_growBuffer( (void**)&(stream->carry), &(stream->carryBytes), end - curr )) {
+            stream->failed = 1;
+            TKimpl_memoryError( stream->objDelegate );
+            return 0;
+        }
+        for (stream->carrySize = 0; curr < end; curr++) {
+            stream->carry[stream->carrySize++] = *curr;
+        }
+    }
+    return !stream->failed;
+}
+
+int TK_ObjStreamEnd( TK_ObjStream *stream )
+{
+    TK_ObjDelegate *objDelegate = stream->objDelegate;
+    TKimpl_Geometry *geom = &(stream->geom);
+    
+    // The file didn't end with a newline, so give the last line one
+    if (stream->carrySize) {
+        if (TKimpl_growBuffer( (void**)&(stream->carry), &(stream->carryBytes), stream->carrySize + 1 )) {
+            stream->carry[stream->carrySize++] = '\n';
+            TKimpl_streamParseLines( stream, stream->carry, stream->carrySize );
+        } else {
+            stream->failed = 1;
+            TKimpl_memoryError( objDelegate );
+        }
+    }
+    
+    // Same as the prepass, there's always the default st and normal
+    if (!objDelegate->numSts) objDelegate->numSts = 1;
+    if (!objDelegate->numNorms) objDelegate->numNorms = 1;
+    
+    if ((!stream->failed) && (!objDelegate->immediateMode)) {
+        // The weld, sort and bounds get their temporary space from a malloc arena
+        int mortonOrder = objDelegate->mortonOrder;
+        for (size_t mi=0; (mortonOrder) && (mi < geom->numMaterials); mi++) {
+            geom->materials[mi].remap = (size_t*)malloc( sizeof(size_t) * (geom->materials[mi].numTriangles + 1) );
+            if (!geom->materials[mi].remap) stream->failed = 1;
+        }
+        
+        TK_ObjArena arena;
+        TK_ObjArenaInitMalloc( &arena, TKIMPL_BATCH_CHUNK_SIZE );
+        if ((!stream->failed) &&
+            (!TKimpl_WeldPositions( geom, objDelegate->weldTolerance, &arena, objDelegate->jobs ))) {
+            stream->failed = 1;
+        }
+        if ((!stream->failed) && (mortonOrder) && (!TKimpl_SortMorton( geom, &arena, objDelegate->jobs ))) {
+            stream->failed = 1;
+        }
+        if ((!stream->failed) && (objDelegate->computeBounds) &&
+            (!TKimpl_ComputeBounds( geom, &arena, objDelegate->jobs ))) {
+            stream->failed = 1;
+        }
+        TK_ObjArenaRelease( &arena );
+        
+        if (stream->failed) {
+            TKimpl_memoryError( objDelegate );
+        } else {
+            TKimpl_EmitGeometry( geom, objDelegate );
+        }
+    }
+    
+    int result = !stream->failed;
+    TKimpl_streamFree( stream );
+    return result;
+}
+
+#endif // TK_OBJFILE_STDLIB
+
+#ifdef TK_OBJFILE_THREADS
+
+#include <pthread.h>
+#include <unistd.h>
+
+struct TK_ObjThreadPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    
+    pthread_t *threads;
+    size_t numThreads; // including the calling thread
+    
+    // The current parallelFor
+    TK_ObjJobFunc job;
+    void *jobData;
+    size_t numJobs;
+    size_t nextJob;
+    size_t numBusy;
+    size_t generation;
+    int shutdown;
+};
+
+typedef struct {
+    TK_ObjThreadPool *pool;
+    size_t workerIndex;
+} TKimpl_PoolThreadInfo;
+
+// Pull job indices until there are none left
+void TKimpl_poolRunJobs( TK_ObjThreadPool *pool, TK_ObjJobFunc job, void *jobData,
+                         size_t numJobs, size_t workerIndex )
+{
+    for (;;) {
+        size_t jobIndex = __sync_fetch_and_add( &(pool->nextJob), 1 );
+        if (jobIndex >= numJobs) break;
+        job( jobData, jobIndex, workerIndex );
+    }
+}
+
+void *TKimpl_poolThreadMain( void *arg )
+{
+    TKimpl_PoolThreadInfo info = *(TKimpl_PoolThreadInfo*)arg;
+    free( arg );
+    
+    TK_ObjThreadPool *pool = info.pool;
+    size_t seenGeneration = 0;
+    
+    pthread_mutex_lock( &(pool->mutex) );
+    for (;;) {
+        while ((!pool->shutdown) && (pool->generation == seenGeneration)) {
+            pthread_cond_wait( &(pool->workReady), &(pool->mutex) );
+        }
+        if (pool->shutdown) break;
+        
+        seenGeneration = pool->generation;
+        TK_ObjJobFunc job = pool->job;
+        void *jobData = pool->jobData;
+        size_t numJobs = pool->numJobs;
+        pthread_mutex_unlock( &(pool->mutex) );
+        
+        TKimpl_poolRunJobs( pool, job, jobData, numJobs, info.workerIndex );
+        
+        pthread_mutex_lock( &(pool->mutex) );
+        if (--pool->numBusy == 0) {
+            pthread_cond_signal( &(pool->workDone) );
+        }
+    }
+    pthread_mutex_unlock( &(pool->mutex) );
+    
+    return NULL;
+}
+
+void TKimpl_poolParallelFor( TK_ObjJobFunc job, void *jobData, size_t numJobs, void *jobContext )
+{
+    TK_ObjThreadPool *pool = (TK_ObjThreadPool*)jobContext;
+    
+    pthread_mutex_lock( &(pool->mutex) );
+    pool->job = job;
+    pool->jobData = jobData;
+    pool->numJobs = numJobs;
+    pool->nextJob = 0;
+    pool->numBusy = pool->numThreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast( &(pool->workReady) );
+    pthread_mutex_unlock( &(pool->mutex) );
+    
+    // The calling thread pitches in as worker 0
+    TKimpl_poolRunJobs( pool, job, jobData, numJobs, 0 );
+    
+    pthread_mutex_lock( &(pool->mutex) );
+    while (pool->numBusy > 0) {
+        pthread_cond_wait( &(pool->workDone), &(pool->mutex) );
+    }
+    pthread_mutex_unlock( &(pool->mutex) );
+}
+
+TK_ObjThreadPool *TK_ObjThreadPoolCreate( size_t numThreads )
+{
+    if (numThreads == 0) {
+        long numCores = sysconf( _SC_NPROCESSORS_ONLN );
+        numThreads = (numCores > 0) ? (size_t)numCores : 1;
+    }
+    
+    TK_ObjThreadPool *pool = (TK_ObjThreadPool*)calloc( 1, sizeof(TK_ObjThreadPool) );
+    if (!pool) return NULL;
+    
+    pthread_mutex_init( &(pool->mutex), NULL );
+    pthread_cond_init( &(pool->workReady), NULL );
+    pthread_cond_init( &(pool->workDone), NULL );
+    
+    pool->threads = (pthread_t*)calloc( numThreads, sizeof(pthread_t) );
+    pool->numThreads = 1;
+    for (size_t i=1; (pool->threads) && (i < numThreads); i++) {
+        TKimpl_PoolThreadInfo *info = (TKimpl_PoolThreadInfo*)malloc( sizeof(TKimpl_PoolThreadInfo) );
+        if (!info) break;
+        info->pool = pool;
+        info->workerIndex = i;
+        if (pthread_create( pool->threads + i, NULL, TKimpl_poolThreadMain, info ) != 0) {
+            free( info );
+            break;
+        }
+        pool->numThreads++;
+    }
+    
+    return pool;
+}
+
+void TK_ObjThreadPoolDestroy( TK_ObjThreadPool *pool )
+{
+    if (!pool) return;
+    
+    pthread_mutex_lock( &(pool->mutex) );
+    pool->shutdown = 1;
+    pthread_cond_broadcast( &(pool->workReady) );
+    pthread_mutex_unlock( &(pool->mutex) );
+    
+    for (size_t i=1; i < pool->numThreads; i++) {
+        pthread_join( pool->threads[i], NULL );
+    }
+    
+    pthread_cond_destroy( &(pool->workDone) );
+    pthread_cond_destroy( &(pool->workReady) );
+    pthread_mutex_destroy( &(pool->mutex) );
+    free( pool->threads );
+    free( pool );
+}
+
+void TK_ObjThreadPoolJobSystem( TK_ObjThreadPool *pool, TK_ObjJobSystem *jobs )
+{
+    jobs->parallelFor = TKimpl_poolParallelFor;
+    jobs->jobContext = pool;
+    jobs->numWorkers = pool->numThreads;
+}
+
+// =========================================================
+//  Compressed files
+// =========================================================
+
+#ifdef TK_OBJFILE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef TK_OBJFILE_ZSTD
+#include <zstd.h>
+#endif
+
+#define TKIMPL_RING_SLOTS (4)
+#define TKIMPL_RING_DEFAULT_SIZE (4*1024*1024)
+#define TKIMPL_RING_MIN_SIZE (64*1024)
+#define TKIMPL_RING_READ_SIZE (256*1024)
+
+typedef enum {
+    TKimpl_FileFormatPlain,
+    TKimpl_FileFormatGzip,
+    TKimpl_FileFormatZstd,
+} TKimpl_FileFormat;
+
+// TKimpl_Ring -- Slots of decompressed text, handed from the decompressor thread
+// to the parsing thread. Slots are filled and parsed in order, so (filled - parsed)
+// of them are waiting to be parsed.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t slotFilled;
+    pthread_cond_t slotFreed;
+    
+    char *slots[TKIMPL_RING_SLOTS];
+    size_t slotUsed[TKIMPL_RING_SLOTS];
+    size_t slotSize;
+    size_t filled, parsed;
+    
+    FILE *file;
+    TKimpl_FileFormat format;
+    const char *errorMessage; // set by the decompressor, reported by the parsing thread
+    int finished;
+    int cancelled;
+} TKimpl_Ring;
+
+// Waits for an empty slot, returns NULL if the parse gave up
+char *TKimpl_ringAcquire( TKimpl_Ring *ring )
+{
+    pthread_mutex_lock( &(ring->mutex) );
+    while ((!ring->cancelled) && (ring->filled - ring->parsed == TKIMPL_RING_SLOTS)) {
+        pthread_cond_wait( &(ring->slotFreed), &(ring->mutex) );
+    }
+    char *slot = ring->cancelled ? NULL : ring->slots[ring->filled % TKIMPL_RING_SLOTS];
+    pthread_mutex_unlock( &(ring->mutex) );
+    return slot;
+}
+
+void TKimpl_ringCommit( TKimpl_Ring *ring, size_t used )
+{
+    pthread_mutex_lock( &(ring->mutex) );
+    ring->slotUsed[ring->filled % TKIMPL_RING_SLOTS] = used;
+    ring->filled++;
+    pthread_cond_signal( &(ring->slotFilled) );
+    pthread_mutex_unlock( &(ring->mutex) );
+}
+
+void TKimpl_ringPlain( TKimpl_Ring *ring )
+{
+    char *slot;
+    while ((slot = TKimpl_ringAcquire( ring )) != NULL) {
+        size_t used = fread( slot, 1, ring->slotSize, ring->file );
+        if (!used) break;
+        TKimpl_ringCommit( ring, used );
+    }
+    if (ferror( ring->file )) ring->errorMessage = "Could not read file.";
+}
+
+#ifdef TK_OBJFILE_ZLIB
+void TKimpl_ringInflateGzip( TKimpl_Ring *ring, unsigned char *input )
+{
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    zs.next_in = Z_NULL;
+    zs.avail_in = 0;
+    if (inflateInit2( &zs, 15 + 32 ) != Z_OK) {
+        ring->errorMessage = "Could not start zlib.";
+        return;
+    }
+    
+    char *slot = NULL;
+    size_t used = 0;
+    int eof = 0, streamEnd = 0;
+    for (;;) {
+        if ((!zs.avail_in) && (!eof)) {
+            zs.next_in = input;
+            zs.avail_in = (uInt)fread( input, 1, TKIMPL_RING_READ_SIZE, ring->file );
+            eof = (zs.avail_in == 0);
+        }
+        if (streamEnd) {
+            // gzip files can be several members back to back (e.g. from cat)
+            if (!zs.avail_in) break;
+            inflateReset( &zs );
+            streamEnd = 0;
+        }
+        if (!slot) {
+            slot = TKimpl_ringAcquire( ring );
+            if (!slot) break;
+            used = 0;
+        }
+        
+        zs.next_out = (Bytef*)(slot + used);
+        zs.avail_out = (uInt)(ring->slotSize - used);
+        int ret = inflate( &zs, Z_NO_FLUSH );
+        used = ring->slotSize - zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            streamEnd = 1;
+        } else if ((ret == Z_BUF_ERROR) && (eof)) {
+            ring->errorMessage = ferror( ring->file ) ? "Could not read file." : "Compressed file is truncated.";
+            break;
+        } else if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+            ring->errorMessage = "Compressed file is corrupt.";
+            break;
+        }
+        
+        if (used == ring->slotSize) {
+            TKimpl_ringCommit( ring, used );
+            slot = NULL;
+        }
+    }
+    if ((slot) && (used) && (!ring->errorMessage)) {
+        TKimpl_ringCommit( ring, used );
+    }
+    inflateEnd( &zs );
+}
+#endif // TK_OBJFILE_ZLIB
+
+#ifdef TK_OBJFILE_ZSTD
+void TKimpl_ringDecompressZstd( TKimpl_Ring *ring, unsigned char *input )
+{
+    ZSTD_DStream *dstream = ZSTD_createDStream();
+    if ((!dstream) || (ZSTD_isError( ZSTD_initDStream( dstream ) ))) {
+        ring->errorMessage = "Could not start zstd.";
+        ZSTD_freeDStream( dstream );
+        return;
+    }
+    
+    // Back to back frames are handled by zstd, a result of 0 means the last one ended
+    ZSTD_inBuffer in = { input, 0, 0 };
+    char *slot = NULL;
+    size_t used = 0, lastResult = 0;
+    int eof = 0;
+    for (;;) {
+        if ((in.pos == in.size) && (!eof)) {
+            in.size = fread( input, 1, TKIMPL_RING_READ_SIZE, ring->file );
+            in.pos = 0;
+            eof = (in.size == 0);
+        }
+        if ((eof) && (lastResult == 0)) break;
+        if (!slot) {
+            slot = TKimpl_ringAcquire( ring );
+            if (!slot) break;
+            used = 0;
+        }
+        
+        ZSTD_outBuffer out = { slot, ring->slotSize, used };
+        size_t result = ZSTD_decompressStream( dstream, &out, &in );
+        if (ZSTD_isError( result )) {
+            ring->errorMessage = "Compressed file is corrupt.";
+            break;
+        }
+        if ((eof) && (result != 0) && (out.pos == used)) {
+            ring->errorMessage = ferror( ring->file ) ? "Could not read file." : "Compressed file is truncated.";
+            break;
+        }
+        lastResult = result;
+        used = out.pos;
+        
+        if (used == ring->slotSize) {
+            TKimpl_ringCommit( ring, used );
+            slot = NULL;
+        }
+    }
+    if ((slot) && (used) && (!ring->errorMessage)) {
+        TKimpl_ringCommit( ring, used );
+    }
+    ZSTD_freeDStream( dstream );
+}
+#endif // TK_OBJFILE_ZSTD
+
+void *TKimpl_ringThreadMain( void *arg )
+{
+    TKimpl_Ring *ring = (TKimpl_Ring*)arg;
+    
+    unsigned char *input = NULL;
+    if (ring->format == TKimpl_FileFormatPlain) {
+        TKimpl_ringPlain( ring );
+    } else if ((input = (unsigned char*)malloc( TKIMPL_RING_READ_SIZE )) == NULL) {
+        ring->errorMessage = "Out of memory.";
+    }
+#ifdef TK_OBJFILE_ZLIB
+    else if (ring->format == TKimpl_FileFormatGzip) {
+        TKimpl_ringInflateGzip( ring, input );
+    }
+#endif
+#ifdef TK_OBJFILE_ZSTD
+    else if (ring->format == TKimpl_FileFormatZstd) {
+        TKimpl_ringDecompressZstd( ring, input );
+    }
+#endif
+    free( input );
+    
+    pthread_mutex_lock( &(ring->mutex) );
+    ring->finished = 1;
+    pthread_cond_signal( &(ring->slotFilled) );
+    pthread_mutex_unlock( &(ring->mutex) );
+    return NULL;
+}
+
+int TK_ParseObjCompressed( const char *path, TK_ObjDelegate *objDelegate, size_t ringSize )
+{
+    TKimpl_Ring ring;
+    ring.file = fopen( path, "rb" );
+    if (!ring.file) {
+        if (objDelegate->error) {
+            objDelegate->error( 0, "Could not read file.", objDelegate->userData );
+        }
+        return 0;
+    }
+    
+    // Go by the magic numbers, not the extension
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    size_t magicSize = fread( magic, 1, 4, ring.file );
+    fseek( ring.file, 0, SEEK_SET );
+    
+    const char *formatError = NULL;
+    ring.format = TKimpl_FileFormatPlain;
+    if ((magicSize >= 2) && (magic[0] == 0x1f) && (magic[1] == 0x8b)) {
+        ring.format = TKimpl_FileFormatGzip;
+#ifndef TK_OBJFILE_ZLIB
+        formatError = "File is gzip compressed, that needs TK_OBJFILE_ZLIB.";
+#endif
+    } else if ((magicSize == 4) && (magic[0] == 0x28) && (magic[1] == 0xb5) &&
+               (magic[2] == 0x2f) && (magic[3] == 0xfd)) {
+        ring.format = TKimpl_FileFormatZstd;
+#ifndef TK_OBJFILE_ZSTD
+        formatError = "File is zstd compressed, that needs TK_OBJFILE_ZSTD.";
+#endif
+    }
+    if (formatError) {
+        if (objDelegate->error) {
+            objDelegate->error( 0, formatError, objDelegate->userData );
+        }
+        fclose( ring.file );
+        return 0;
+    }
+    
+    if (!ringSize) ringSize = TKIMPL_RING_DEFAULT_SIZE;
+    if (ringSize < TKIMPL_RING_MIN_SIZE) ringSize = TKIMPL_RING_MIN_SIZE;
+    ring.slotSize = ringSize / TKIMPL_RING_SLOTS;
+    ring.filled = 0;
+    ring.parsed = 0;
+    ring.errorMessage = NULL;
+    ring.finished = 0;
+    ring.cancelled = 0;
+    
+    char *ringMem = (char*)malloc( ring.slotSize * TKIMPL_RING_SLOTS );
+    TK_ObjStream *stream = ringMem ? TK_ObjStreamBegin( objDelegate ) : NULL;
+    if (!stream) {
+        if (!ringMem) TKimpl_memoryError( objDelegate );
+        free( ringMem );
+        fclose( ring.file );
+        return 0;
+    }
+    for (size_t i=0; i < TKIMPL_RING_SLOTS; i++) {
+        ring.slots[i] = ringMem + i * ring.slotSize;
+    }
+    
+    pthread_mutex_init( &(ring.mutex), NULL );
+    pthread_cond_init( &(ring.slotFilled), NULL );
+    pthread_cond_init( &(ring.slotFreed), NULL );
+    
+    pthread_t thread;
+    int threadStarted = (pthread_create( &thread, NULL, TKimpl_ringThreadMain, &ring ) == 0);
+    if (!threadStarted) {
+        ring.errorMessage = "Could not start the decompression thread.";
+    }
+    
+    // Parse each slot as it's filled, and hand it back
+    int ok = threadStarted;
+    while (ok) {
+        pthread_mutex_lock( &(ring.mutex) );
+        while ((!ring.finished) && (ring.filled == ring.parsed)) {
+            pthread_cond_wait( &(ring.slotFilled), &(ring.mutex) );
+        }
+        int haveSlot = (ring.filled != ring.parsed);
+        pthread_mutex_unlock( &(ring.mutex) );
+        if (!haveSlot) break;
+        
+        size_t slotIndex = ring.parsed % TKIMPL_RING_SLOTS;
+        ok = TK_ObjStreamFeed( stream, ring.slots[slotIndex], ring.slotUsed[slotIndex] );
+        
+        pthread_mutex_lock( &(ring.mutex) );
+        ring.parsed++;
+        if (!ok) ring.cancelled = 1;
+        pthread_cond_signal( &(ring.slotFreed) );
+        pthread_mutex_unlock( &(ring.mutex) );
+    }
+    if (threadStarted) pthread_join( thread, NULL );
+    
+    if (ring.errorMessage) {
+        if (objDelegate->error) {
+            objDelegate->error( 0, ring.errorMessage, objDelegate->userData );
+        }
+        // Don't emit a partial file
+        stream->failed = 1;
+    }
+    int result = TK_ObjStreamEnd( stream );
+    
+    pthread_cond_destroy( &(ring.slotFreed) );
+    pthread_cond_destroy( &(ring.slotFilled) );
+    pthread_mutex_destroy( &(ring.mutex) );
+    free( ringMem );
+    fclose( ring.file );
+    return result;
 }
 
+#endif // TK_OBJFILE_THREADS
 
 #endif // TK_OBJFILE_IMPLEMENTATION
 